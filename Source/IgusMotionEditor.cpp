@@ -22,6 +22,7 @@
 #include <QModelIndex>
 #include <QFileDialog>
 #include <QTextStream>
+#include <QSettings>
 
 #include "globals.h"
 #include "IgusMotionEditor.h"
@@ -48,11 +49,6 @@ IgusMotionEditor::IgusMotionEditor(QWidget *parent)
 
 	message("Connecting to robot...");
 
-	// The joint angles are always kept in a QHash<QString, double> associative data structure.
-	// To be used in the signature of a signal, QHash<QString, double> needs to be registered as a meta type.
-	// Read more about this here: http://doc.trolltech.com/4.2/qt.html#ConnectionType-enum
-	qRegisterMetaType< QHash<QString, double> >("QHash<QString, double>");
-
 	robolinkIconGrey.load("images/robolinkicon_grey.png");
 	robolinkIconOrange.load("images/robolinkicon_orange.png");
 	joystickIconGrey.load("images/joystick_grey.png");
@@ -110,6 +106,7 @@ IgusMotionEditor::IgusMotionEditor(QWidget *parent)
     connect(&jointConfiguration, SIGNAL(changed(JointInfo::ListPtr)), keyframeEditor, SLOT(setJointConfig(JointInfo::ListPtr)));
     connect(&jointConfiguration, SIGNAL(changed(JointInfo::ListPtr)), &robotInterface, SLOT(setJointConfig(JointInfo::ListPtr)));
     connect(&jointConfiguration, SIGNAL(changed(JointInfo::ListPtr)), &joystickControl, SLOT(setJointConfig(JointInfo::ListPtr)));
+    connect(&jointConfiguration, SIGNAL(changed(JointInfo::ListPtr)), &keyframePlayer, SLOT(setJointConfig(JointInfo::ListPtr)));
 
     if(!jointConfiguration.loadFromFile("calibs/robot.ini"))
     {
@@ -126,14 +123,19 @@ IgusMotionEditor::IgusMotionEditor(QWidget *parent)
 	connect(&robotInterface, SIGNAL(robotConnected()), this, SLOT(robotConnected()));
 	connect(&robotInterface, SIGNAL(robotDisconnected()), this, SLOT(robotDisconnected()));
 	connect(&robotInterface, SIGNAL(robotInitialized()), this, SLOT(robotInitialized()));
-	connect(&robotInterface, SIGNAL(motionOut(QHash<QString, double>, QHash<QString, double>)), &joystickControl, SLOT(jointAnglesIn(QHash<QString, double>)));
-	connect(&robotInterface, SIGNAL(motionOut(QHash<QString, double>, QHash<QString, double>)), &keyframePlayer, SLOT(jointAnglesIn(QHash<QString, double>)));
+	connect(&robotInterface, SIGNAL(motionOut(JointVector, JointVector)), &joystickControl, SLOT(jointAnglesIn(JointVector)));
+	connect(&robotInterface, SIGNAL(motionOut(JointVector, JointVector)), &keyframePlayer, SLOT(jointAnglesIn(JointVector)));
     connect(&robotInterface, SIGNAL(playbackFinished()), SLOT(playerFinished()));
 	connect(ui.alignSpeedSlider, SIGNAL(valueChanged(int)), &robotInterface, SLOT(setSpeedLimit(int)));
-    connect(this, SIGNAL(keyframeTransferRequested(const KeyframePlayerItem*,int)), &robotInterface, SLOT(transferKeyframes(const KeyframePlayerItem*,int)));
+    connect(this, SIGNAL(keyframeTransferRequested(Timeline,int)), &robotInterface, SLOT(transferKeyframes(Timeline,int)));
     connect(&robotInterface, SIGNAL(keyframeTransferFinished(bool)), SLOT(keyframeTransferFinished(bool)));
     connect(&robotInterface, SIGNAL(playbackStarted()), SLOT(handleConnections()));
+    connect(&robotInterface, SIGNAL(commStatsChanged(RobotInterface::CommStats)), SLOT(commStatsChanged(RobotInterface::CommStats)));
 	robotInterface.setSpeedLimit(ui.alignSpeedSlider->value());
+
+    // Target rate of the robot communication, 0 = as fast as possible
+    QSettings settings("igus", "MotionEditor");
+    robotInterface.setCommRate(settings.value("robot/comm_rate", SERIALCOMRATE).toDouble());
 	robotInterface.start();
 
 	// Sometimes the robot interface manages to connect to the robot before the above qt connection have been made.
@@ -192,12 +194,12 @@ IgusMotionEditor::IgusMotionEditor(QWidget *parent)
 void IgusMotionEditor::handleConnections()
 {
 	// First Disconnect everything.
-    disconnect(keyframeEditor, SIGNAL(motionOut(QHash<QString, double>, QHash<QString, double>, int)), &robotInterface, SLOT(motionIn(QHash<QString, double>, QHash<QString, double>, int)));
-	disconnect(&robotInterface, SIGNAL(motionOut(QHash<QString, double>, QHash<QString, double>)), keyframeEditor, SLOT(setJointAngles(QHash<QString, double>)));
-	disconnect(&joystickControl, SIGNAL(joystickOut(QHash<QString, double>)), keyframeEditor, SLOT(joystickIn(QHash<QString, double>)));
-    disconnect(&keyframePlayer, SIGNAL(motionOut(QHash<QString, double>, QHash<QString, double>)), &robotInterface, SLOT(motionIn(QHash<QString, double>, QHash<QString, double>)));
-	disconnect(&keyframePlayer, SIGNAL(motionOut(QHash<QString, double>, QHash<QString, double>)), keyframeEditor, SLOT(motionIn(QHash<QString, double>, QHash<QString, double>)));
-    disconnect(&keyframePlayer, SIGNAL(motionOut(QHash<QString, double>, QHash<QString, double>)), keyframeEditor, SLOT(setJointAngles(QHash<QString, double>)));
+    disconnect(keyframeEditor, SIGNAL(motionOut(JointVector, JointVector, int)), &robotInterface, SLOT(motionIn(JointVector, JointVector, int)));
+	disconnect(&robotInterface, SIGNAL(motionOut(JointVector, JointVector)), keyframeEditor, SLOT(setJointAngles(JointVector)));
+	disconnect(&joystickControl, SIGNAL(joystickOut(JointVector)), keyframeEditor, SLOT(joystickIn(JointVector)));
+    disconnect(&keyframePlayer, SIGNAL(motionOut(JointVector, JointVector)), &robotInterface, SLOT(motionIn(JointVector, JointVector)));
+	disconnect(&keyframePlayer, SIGNAL(motionOut(JointVector, JointVector)), keyframeEditor, SLOT(motionIn(JointVector, JointVector)));
+    disconnect(&keyframePlayer, SIGNAL(motionOut(JointVector, JointVector)), keyframeEditor, SLOT(setJointAngles(JointVector)));
 
 	// default:
 	// the robot is off (not connected or manually set into the off state.)
@@ -212,11 +214,11 @@ void IgusMotionEditor::handleConnections()
 		{
 			keyframePlayer.interpolating = true;
 			keyframePlayer.velocityAdaption = false;
-			connect(&keyframePlayer, SIGNAL(motionOut(QHash<QString, double>, QHash<QString, double>)), keyframeEditor, SLOT(setJointAngles(QHash<QString, double>)), Qt::UniqueConnection);
+			connect(&keyframePlayer, SIGNAL(motionOut(JointVector, JointVector)), keyframeEditor, SLOT(setJointAngles(JointVector)), Qt::UniqueConnection);
 		}
 		else
 		{
-			connect(&joystickControl, SIGNAL(joystickOut(QHash<QString, double>)), keyframeEditor, SLOT(joystickIn(QHash<QString, double>)), Qt::UniqueConnection);
+			connect(&joystickControl, SIGNAL(joystickOut(JointVector)), keyframeEditor, SLOT(joystickIn(JointVector)), Qt::UniqueConnection);
 		}
 	}
 
@@ -231,12 +233,13 @@ void IgusMotionEditor::handleConnections()
 	{
         if (robotInterface.isPlaying())
         {
-			connect(&robotInterface, SIGNAL(motionOut(QHash<QString, double>, QHash<QString, double>)), keyframeEditor, SLOT(setJointAngles(QHash<QString, double>)), Qt::UniqueConnection);
+			connect(&robotInterface, SIGNAL(motionOut(JointVector, JointVector)), keyframeEditor, SLOT(setJointAngles(JointVector)), Qt::UniqueConnection);
 		}
 		else
 		{
-            connect(keyframeEditor, SIGNAL(motionOut(QHash<QString, double>, QHash<QString, double>, int)), &robotInterface, SLOT(motionIn(QHash<QString, double>, QHash<QString, double>, int)), Qt::UniqueConnection);
-			connect(&joystickControl, SIGNAL(joystickOut(QHash<QString, double>)), keyframeEditor, SLOT(joystickIn(QHash<QString, double>)), Qt::UniqueConnection);
+            // Direct connection, the robot interface keeps only the latest command (see RobotInterface::motionIn())
+            connect(keyframeEditor, SIGNAL(motionOut(JointVector, JointVector, int)), &robotInterface, SLOT(motionIn(JointVector, JointVector, int)), Qt::ConnectionType(Qt::UniqueConnection | Qt::DirectConnection));
+			connect(&joystickControl, SIGNAL(joystickOut(JointVector)), keyframeEditor, SLOT(joystickIn(JointVector)), Qt::UniqueConnection);
 		}
 	}
 
@@ -252,11 +255,11 @@ void IgusMotionEditor::handleConnections()
 		{
 			keyframePlayer.interpolating = true;
 			keyframePlayer.velocityAdaption = false;
-			connect(&keyframePlayer, SIGNAL(motionOut(QHash<QString, double>, QHash<QString, double>)), keyframeEditor, SLOT(setJointAngles(QHash<QString, double>)), Qt::UniqueConnection);
+			connect(&keyframePlayer, SIGNAL(motionOut(JointVector, JointVector)), keyframeEditor, SLOT(setJointAngles(JointVector)), Qt::UniqueConnection);
 		}
 		else
 		{
-			connect(&robotInterface, SIGNAL(motionOut(QHash<QString, double>, QHash<QString, double>)), keyframeEditor, SLOT(setJointAngles(QHash<QString, double>)), Qt::UniqueConnection);
+			connect(&robotInterface, SIGNAL(motionOut(JointVector, JointVector)), keyframeEditor, SLOT(setJointAngles(JointVector)), Qt::UniqueConnection);
 		}
 	}
 }
@@ -296,11 +299,36 @@ void IgusMotionEditor::robotDisconnected()
 	handleConnections();
 
 	ui.connectionStatusIndicator->setPixmap(robolinkIconGrey);
+    ui.connectionStatusIndicator->setToolTip(QString());
+    ui.commStatsLabel->clear();
 	//ui.offButton->click();
     ui.stiffButton->setEnabled(false);
 	ui.initButton->setEnabled(false);
 }
 
+/*
+ * Shows the achieved robot communication rate below the connection indicator,
+ * the details are in its tool tip.
+ */
+void IgusMotionEditor::commStatsChanged(const RobotInterface::CommStats& stats)
+{
+    ui.commStatsLabel->setText(QString("%1 Hz").arg(qRound(stats.rate)));
+
+    QString target = (stats.targetRate > 0) ? QString("%1 Hz").arg(stats.targetRate) : QString("link limited");
+    QString tip = QString("Exchanges: %1/s (target %2)").arg(stats.rate, 0, 'f', 1).arg(target);
+
+    if (stats.pushed)
+        tip += "\nFeedback pushed by the robot";
+    else
+        tip += QString("\nRound trip: median %1 ms, 95%: %2 ms, 99%: %3 ms, max %4 ms\nMissed deadlines: %5")
+            .arg(stats.rttMedian, 0, 'f', 1).arg(stats.rttP95, 0, 'f', 1)
+            .arg(stats.rttP99, 0, 'f', 1).arg(stats.rttMax, 0, 'f', 1)
+            .arg(stats.missed);
+
+    ui.connectionStatusIndicator->setToolTip(tip);
+    ui.commStatsLabel->setToolTip(tip);
+}
+
 /*
  * These are the things that need to be done when the robot was successfully initialized.
  */
@@ -499,6 +527,7 @@ void IgusMotionEditor::on_flashButton_clicked()
     // from last to first
     keyframePlayer.looped = true;
     keyframePlayer.playTheseFrames(motionSequence->getKeyframes());
+    message(QString("Predicted cycle time: %1 s").arg(keyframePlayer.cycleTime(), 0, 'f', 2));
 
     emit keyframeTransferRequested(keyframePlayer.playingList(), RobotInterface::KC_COMMIT);
 
@@ -566,6 +595,7 @@ void IgusMotionEditor::on_loopButton_clicked()
 	// Start playing.
 	keyframePlayer.looped = true;
 	keyframePlayer.playTheseFrames(motionSequence->getKeyframes());
+	message(QString("Predicted cycle time: %1 s").arg(keyframePlayer.cycleTime(), 0, 'f', 2));
 
     // Sequence playback is handled by C if connected, otherwise KeyframePlayer is started.
     if(robotInterface.isRobotConnected())
@@ -629,7 +659,7 @@ void IgusMotionEditor::on_startGrabButton_clicked()
 		ui.grabProgressBar->setValue(0);
 
 		// Pipe the joint angle stream from the robot interface into the frame grabber.
-		connect(&robotInterface, SIGNAL(motionOut(QHash<QString, double>, QHash<QString, double>)), this, SLOT(grabFrame(QHash<QString, double>, QHash<QString, double>)));
+		connect(&robotInterface, SIGNAL(motionOut(JointVector, JointVector)), this, SLOT(grabFrame(JointVector, JointVector)));
 
 		isGrabbing = true;
 	}
@@ -638,7 +668,7 @@ void IgusMotionEditor::on_startGrabButton_clicked()
 /*
  * Handles a frame grabber tick triggered by an incoming motion signal from the robot interface.
  */
-void IgusMotionEditor::grabFrame(QHash<QString, double> ja, QHash<QString, double> jv)
+void IgusMotionEditor::grabFrame(const JointVector& ja, const JointVector& jv)
 {
 	if (lastFrameGrabbedTime.msecsTo(QTime::currentTime()) > 1000.0/framesPerSecond)
 	{
@@ -648,8 +678,11 @@ void IgusMotionEditor::grabFrame(QHash<QString, double> ja, QHash<QString, doubl
         kf->setJointConfig(jointConfiguration.config());
 		kf->setJointAngles(ja);
 		double maxSpeed = 0;
-		foreach (QString key, jv.keys())
-			maxSpeed = qMax(jv[key], maxSpeed);
+		for (int i = 0; i < JointVector::MAX_JOINTS; ++i)
+		{
+			if (jv.contains(i))
+				maxSpeed = qMax(jv[i], maxSpeed);
+		}
 		kf->setSpeed(qBound(10, int(100.0 * maxSpeed / (0.01*(double)ui.motionSpeedSlider->value()*SERVOSPEEDMAX)), 100));
 		sandbox->addKeyframe(kf);
 
@@ -678,7 +711,7 @@ void IgusMotionEditor::grabFrame(QHash<QString, double> ja, QHash<QString, doubl
  */
 void IgusMotionEditor::frameGrabberFinished()
 {
-	disconnect(&robotInterface, SIGNAL(motionOut(QHash<QString, double>, QHash<QString, double>)), this, SLOT(grabFrame(QHash<QString, double>, QHash<QString, double>)));
+	disconnect(&robotInterface, SIGNAL(motionOut(JointVector, JointVector)), this, SLOT(grabFrame(JointVector, JointVector)));
 	ui.grabProgressBar->setValue(100);
 	ui.startGrabButton->setChecked(false);
 	ui.startGrabButton->setText("Record");
@@ -20,6 +20,7 @@
 #include "RobotInterface.h"
 #include "JoystickControl.h"
 #include "JointConfiguration.h"
+#include "JointVector.h"
 
 class IgusMotionEditor : public QWidget
 {
@@ -67,7 +68,7 @@ public:
 
 signals:
     void complianceChangeRequested(int mode);
-    void keyframeTransferRequested(const KeyframePlayerItem* head, int cmd);
+    void keyframeTransferRequested(const Timeline& timeline, int cmd);
 
 protected:
 	void keyPressEvent(QKeyEvent* event);
@@ -88,7 +89,7 @@ private slots:
     void on_initButton_clicked();
 
 	void on_startGrabButton_clicked();
-	void grabFrame(QHash<QString, double>, QHash<QString, double>);
+	void grabFrame(const JointVector&, const JointVector&);
 	void frameGrabberFinished();
 
 	void on_playButton_clicked();
@@ -112,6 +113,7 @@ private slots:
 
     void keyframeTransferFinished(bool success);
 	void handleConnections();
+    void commStatsChanged(const RobotInterface::CommStats& stats);
 };
 
 #endif // MOTIONEDITOR_H
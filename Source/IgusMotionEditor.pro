@@ -14,11 +14,17 @@ HEADERS += ResettableSlider.h \
     Keyframe.h \
     KeyframeArea.h \
     KeyframePlayer.h \
-    KeyframePlayerItem.h \
     RobotInterface.h \
+    PacketFramer.h \
+    PortDiscovery.h \
+    ProtocolTrace.h \
+    Timeline.h \
+    SpeedProfile.h \
     RobotView3D.h \
-    Serial.h \
     JointConfiguration.h \
+    JointStateEstimator.h \
+    JointVector.h \
+    TripleBuffer.h \
     ViewJoint.h
 SOURCES += ResettableSlider.cpp \
     KeyframeEditor.cpp \
@@ -27,19 +33,35 @@ SOURCES += ResettableSlider.cpp \
     Keyframe.cpp \
     KeyframeArea.cpp \
     KeyframePlayer.cpp \
-    KeyframePlayerItem.cpp \
     RobotInterface.cpp \
+    PacketFramer.cpp \
+    PortDiscovery.cpp \
+    ProtocolTrace.cpp \
+    Timeline.cpp \
+    SpeedProfile.cpp \
     RobotView3D.cpp \
     JoystickControl.cpp \
-    JoystickWin.cpp \
-    Serial.cpp \
     main.cpp \
     JointConfiguration.cpp \
+    JointStateEstimator.cpp \
+    JointVector.cpp \
     ViewJoint.cpp
+win32:HEADERS += Serial.h
+win32:SOURCES += Serial.cpp \
+    JoystickWin.cpp
+unix:HEADERS += SerialLinux.h
+unix:SOURCES += SerialLinux.cpp \
+    JoystickLinux.cpp
 win32:INCLUDEPATH += c:\\workspace\\libQGLViewer
 win32:LIBS += -Lc:\\workspace\\libQGLViewer\\QGLViewer\\release \
     -lQGLViewer2 \
     -lWINMM
+unix:LIBS += -lQGLViewer
+unix:packagesExist(libudev) {
+    CONFIG += link_pkgconfig
+    PKGCONFIG += libudev
+    DEFINES += HAVE_UDEV
+}
 FORMS += KeyframeEditor.ui \
     igusmotioneditor.ui
 RESOURCES += 
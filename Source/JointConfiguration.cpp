@@ -1,4 +1,7 @@
 #include "JointConfiguration.h"
+#include "JointVector.h"
+#include "microcontroller/protocol.h"
+#include "globals.h"
 
 #include <QRegExp>
 #include <QStringList>
@@ -39,6 +42,27 @@ bool JointConfiguration::loadFromSettings(QSettings* settings)
     // Init global options
     list->lookahead = settings->value("global/lookahead", 200).toUInt();
 
+    QString interpolation = settings->value("global/interpolation", "linear").toString();
+    if(interpolation == "linear")
+        list->interpolation = proto::IP_LINEAR;
+    else if(interpolation == "cubic")
+        list->interpolation = proto::IP_CUBIC;
+    else if(interpolation == "minjerk")
+        list->interpolation = proto::IP_MIN_JERK;
+    else
+    {
+        setError(QString("Invalid interpolation '%1' (linear, cubic or minjerk)").arg(interpolation));
+        return false;
+    }
+
+    // Without lookahead the microcontroller only sends the keyframes to the
+    // motor controllers, which always move linearly
+    if(list->lookahead == 0 && list->interpolation != proto::IP_LINEAR)
+    {
+        setError(QString("Interpolation '%1' needs a lookahead > 0").arg(interpolation));
+        return false;
+    }
+
     QStringList groups = settings->childGroups();
     foreach(const QString& group, groups)
     {
@@ -81,6 +105,12 @@ bool JointConfiguration::loadFromSettings(QSettings* settings)
             return false;
         }
 
+        if(info.address < 1 || info.address > JointVector::MAX_JOINTS)
+        {
+            setError(QString("Address '%1' is out of range (1-%2)").arg(info.address).arg((int)JointVector::MAX_JOINTS));
+            return false;
+        }
+
         if(addresses.size() >= info.address && addresses[info.address-1])
         {
             setError(QString("Address '%1' is used more than once").arg(info.address));
@@ -110,6 +140,14 @@ bool JointConfiguration::loadFromSettings(QSettings* settings)
         info.invert = settings->value("invert", 0).toInt();
         info.max_current = settings->value("max_current", 50).toInt();
         info.hold_current = settings->value("hold_current", 20).toInt();
+        info.max_velocity = settings->value("max_velocity", SERVOSPEEDMAX).toDouble();
+        info.max_acceleration = settings->value("max_acceleration", 0.0).toDouble();
+
+        if(info.max_velocity <= 0 || info.max_acceleration < 0)
+        {
+            setError(QString("Invalid motion limits in group '%1'").arg(group));
+            return false;
+        }
 
         settings->endGroup();
 
@@ -143,6 +181,7 @@ bool JointConfiguration::loadFromSettings(QSettings* settings)
 
     qDebug() << "Joint configuration loaded.";
     m_config = JointInfo::ListPtr(list);
+    JointVector::setJointConfig(*m_config);
     emit changed(m_config);
 
     return true;
@@ -28,6 +28,10 @@ struct JointInfo
     double max_current;
     double hold_current;
 
+    // motion limits in rad/s and rad/s^2 (acceleration 0: unlimited)
+    double max_velocity;
+    double max_acceleration;
+
     // axis length (distance to next joint) in m
     // may be negative if omitted.
     double length;
@@ -44,6 +48,7 @@ struct JointInfo
     public:
         // Global options
         int lookahead;
+        int interpolation; // proto::Interpolation
     };
     typedef QSharedPointer<List> ListPtr;
 };
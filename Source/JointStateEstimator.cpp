@@ -0,0 +1,123 @@
+// Joint state estimation from timestamped feedback
+
+#include "JointStateEstimator.h"
+
+#include "microcontroller/protocol.h"
+
+// Filter gains. BETA follows the Benedict-Bordner relation
+// beta = alpha^2 / (2 - alpha), which balances noise reduction and the lag
+// on velocity changes. The response is slightly underdamped (poles at
+// radius sqrt(1 - alpha)) and settles within a few samples.
+static const double ALPHA = 0.5;
+static const double BETA = ALPHA * ALPHA / (2.0 - ALPHA);
+
+static const double MAX_SAMPLE_GAP = 0.5;      // s, restart the filter after longer gaps
+static const double MAX_EXTRAPOLATION = 0.1;   // s
+static const double MAX_CLOCK_STEP = 60.0;     // s, larger steps mean the µC was reset
+static const double OFFSET_CREEP = 1e-4;       // s/s, more than the clock drift
+
+JointStateEstimator::JointStateEstimator()
+ : m_synchronized(false)
+ , m_lastMcuTime(0)
+ , m_mcuTime(0)
+ , m_offset(0)
+ , m_offsetTime(0)
+{
+}
+
+void JointStateEstimator::reset(int numJoints)
+{
+    Joint empty;
+    empty.valid = false;
+    empty.position = 0;
+    empty.velocity = 0;
+    empty.time = 0;
+
+    m_joints.fill(empty, numJoints);
+    m_synchronized = false;
+}
+
+void JointStateEstimator::synchronize(quint32 mcuTime, double rxTime, double linkDelay)
+{
+    if(m_synchronized)
+    {
+        // Unsigned difference, so the wrap around of the µC clock does
+        // not matter
+        double step = (quint32)(mcuTime - m_lastMcuTime) / 1e6;
+        if(step > MAX_CLOCK_STEP)
+            reset(m_joints.size());
+        else
+        {
+            m_mcuTime += step;
+            m_offset += OFFSET_CREEP * (rxTime - m_offsetTime);
+        }
+    }
+
+    double candidate = rxTime - linkDelay - m_mcuTime;
+
+    if(!m_synchronized)
+    {
+        m_mcuTime = 0;
+        m_offset = rxTime - linkDelay;
+        m_synchronized = true;
+    }
+    else if(candidate < m_offset)
+        m_offset = candidate;
+
+    m_lastMcuTime = mcuTime;
+    m_offsetTime = rxTime;
+}
+
+void JointStateEstimator::addSample(int joint, double angle, int age)
+{
+    if(joint < 0 || joint >= m_joints.size() || !m_synchronized || age == 0xFF)
+        return;
+
+    Joint& j = m_joints[joint];
+    double t = m_mcuTime - age * proto::SAMPLE_AGE_UNIT / 1e6;
+    double dt = t - j.time;
+
+    if(!j.valid || dt > MAX_SAMPLE_GAP || dt < -MAX_SAMPLE_GAP)
+    {
+        j.valid = true;
+        j.position = angle;
+        j.velocity = 0;
+        j.time = t;
+        return;
+    }
+
+    // Same sample as last time (the age unit rounds down)
+    if(dt <= proto::SAMPLE_AGE_UNIT / 1e6)
+        return;
+
+    double predicted = j.position + j.velocity * dt;
+    double residual = angle - predicted;
+
+    j.position = predicted + ALPHA * residual;
+    j.velocity += BETA / dt * residual;
+    j.time = t;
+}
+
+bool JointStateEstimator::isValid(int joint) const
+{
+    return joint >= 0 && joint < m_joints.size() && m_joints[joint].valid;
+}
+
+double JointStateEstimator::position(int joint, double time) const
+{
+    if(!isValid(joint))
+        return 0;
+
+    const Joint& j = m_joints[joint];
+    double dt = qBound(0.0, time - m_offset - j.time, MAX_EXTRAPOLATION);
+
+    return j.position + j.velocity * dt;
+}
+
+double JointStateEstimator::velocity(int joint) const
+{
+    if(!isValid(joint))
+        return 0;
+
+    return m_joints[joint].velocity;
+}
@@ -0,0 +1,78 @@
+// Joint state estimation from timestamped feedback
+
+#ifndef JOINTSTATEESTIMATOR_H
+#define JOINTSTATEESTIMATOR_H
+
+#include <QVector>
+#include <QtGlobal>
+
+/**
+ * Filters the joint positions reported by the µC and predicts where the
+ * joints are right now.
+ *
+ * Every joint has an alpha-beta filter (constant velocity model) which is
+ * updated with the time the µC sampled the position (proto::Feedback),
+ * not the time the PC received it. So the velocity is not disturbed by
+ * jitter on the serial link and the PC side scheduling, and a position
+ * which was not sampled again (e.g. during playback) is not counted twice.
+ *
+ * To compensate the link latency, the µC clock is related to the PC clock:
+ * the smallest observed difference between receive time and µC time is the
+ * clock offset plus the minimal link delay, which is taken into account
+ * separately. The offset is allowed to creep up slowly to follow clock
+ * drift. position() then extrapolates the filtered state to the present.
+ **/
+class JointStateEstimator
+{
+public:
+    JointStateEstimator();
+
+    //! Forget everything, e.g. after the positions were set externally
+    void reset(int numJoints);
+
+    /**
+     * Relate the µC clock to the PC clock. Call for every feedback packet
+     * before addSample().
+     *
+     * @param mcuTime proto::Feedback::time (µs)
+     * @param rxTime PC time (s) at which the packet was received
+     * @param linkDelay Minimal time (s) from filling the packet on the µC
+     *        until it is received, i.e. its transmission time
+     **/
+    void synchronize(quint32 mcuTime, double rxTime, double linkDelay);
+
+    /**
+     * New position measurement of @a joint
+     *
+     * @param age proto::Feedback::sample_age
+     **/
+    void addSample(int joint, double angle, int age);
+
+    //! A position was measured since the last reset()
+    bool isValid(int joint) const;
+
+    //! Position of @a joint extrapolated to the PC time @a time (s)
+    double position(int joint, double time) const;
+
+    //! Filtered velocity of @a joint (rad/s)
+    double velocity(int joint) const;
+
+private:
+    struct Joint
+    {
+        bool valid;
+        double position;
+        double velocity;
+        double time; // µC time (s) of the last sample
+    };
+
+    QVector<Joint> m_joints;
+
+    bool m_synchronized;
+    quint32 m_lastMcuTime;
+    double m_mcuTime;    // Unwrapped µC time (s) of the last packet
+    double m_offset;     // PC time - µC time (s), lower envelope
+    double m_offsetTime; // PC time (s) of the last synchronize()
+};
+
+#endif
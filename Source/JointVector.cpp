@@ -0,0 +1,118 @@
+// Dense joint value vector
+
+#include "JointVector.h"
+
+#include <QtGlobal>
+
+// Name table. It is only changed while loading the joint configuration,
+// before any of the motion objects is running.
+static QString g_names[JointVector::MAX_JOINTS];
+static int g_numJoints = 0;
+
+JointVector::JointVector()
+ : m_valid(0)
+{
+    for(int i = 0; i < MAX_JOINTS; ++i)
+        m_values[i] = 0.0;
+}
+
+JointVector::JointVector(double value)
+ : m_valid(0)
+{
+    for(int i = 0; i < MAX_JOINTS; ++i)
+        m_values[i] = 0.0;
+
+    for(int i = 0; i < g_numJoints; ++i)
+        (*this)[i] = value;
+}
+
+void JointVector::fill(double value)
+{
+    for(int i = 0; i < MAX_JOINTS; ++i)
+    {
+        if(contains(i))
+            m_values[i] = value;
+    }
+}
+
+double JointVector::distance(const JointVector& other) const
+{
+    double distance = 0;
+
+    for(int i = 0; i < MAX_JOINTS; ++i)
+    {
+        if(!contains(i))
+            continue;
+
+        distance = qMax(distance, qAbs(m_values[i] - other.value(i)));
+    }
+
+    return distance;
+}
+
+bool JointVector::contains(const QString& name) const
+{
+    int index = indexOf(name);
+    return index >= 0 && contains(index);
+}
+
+double JointVector::value(const QString& name, double defaultValue) const
+{
+    int index = indexOf(name);
+    if(index < 0)
+        return defaultValue;
+
+    return value(index, defaultValue);
+}
+
+bool JointVector::insert(const QString& name, double value)
+{
+    int index = indexOf(name);
+    if(index < 0)
+        return false;
+
+    (*this)[index] = value;
+    return true;
+}
+
+void JointVector::setJointConfig(const JointInfo::List& config)
+{
+    for(int i = 0; i < MAX_JOINTS; ++i)
+        g_names[i].clear();
+
+    g_numJoints = 0;
+
+    foreach(const JointInfo& joint, config)
+    {
+        int index = joint.address - 1;
+        if(index < 0 || index >= MAX_JOINTS)
+            continue;
+
+        g_names[index] = joint.name;
+        g_numJoints = qMax(g_numJoints, index + 1);
+    }
+}
+
+int JointVector::numJoints()
+{
+    return g_numJoints;
+}
+
+int JointVector::indexOf(const QString& name)
+{
+    for(int i = 0; i < g_numJoints; ++i)
+    {
+        if(g_names[i] == name)
+            return i;
+    }
+
+    return -1;
+}
+
+QString JointVector::name(int index)
+{
+    if(index < 0 || index >= MAX_JOINTS)
+        return QString();
+
+    return g_names[index];
+}
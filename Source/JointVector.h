@@ -0,0 +1,97 @@
+// Dense joint value vector
+
+#ifndef JOINTVECTOR_H
+#define JOINTVECTOR_H
+
+#include <QString>
+#include <QMetaType>
+
+#include "JointConfiguration.h"
+#include "microcontroller/protocol.h"
+
+/**
+ * Joint angles (or velocities) of all joints.
+ *
+ * Joint i is the joint with bus address i+1. The values are stored in a
+ * fixed array, so a JointVector can be copied, passed through queued
+ * signal/slot connections and modified without any memory allocation.
+ *
+ * Like keys in a hash, joints which were never set are not contained in
+ * the vector. Writing through operator[] adds the joint.
+ *
+ * The names of the joints are only needed for the motion files and are
+ * looked up in a global table, see setJointConfig().
+ **/
+class JointVector
+{
+public:
+    enum
+    {
+        MAX_JOINTS = proto::NUM_AXES
+    };
+
+    //! Empty vector
+    JointVector();
+
+    //! All joints of the current configuration set to @a value
+    explicit JointVector(double value);
+
+    inline bool contains(int index) const
+    { return m_valid & (1 << index); }
+
+    inline double operator[](int index) const
+    { return m_values[index]; }
+
+    //! Adds the joint if it is not contained yet
+    inline double& operator[](int index)
+    {
+        m_valid |= (1 << index);
+        return m_values[index];
+    }
+
+    inline double value(int index, double defaultValue = 0.0) const
+    { return contains(index) ? m_values[index] : defaultValue; }
+
+    inline bool isEmpty() const
+    { return m_valid == 0; }
+
+    inline void clear()
+    { m_valid = 0; }
+
+    //! Set all contained joints to @a value
+    void fill(double value);
+
+    /**
+     * Maximum absolute difference over the joints contained in this
+     * vector. Joints missing in @a other count as zero.
+     **/
+    double distance(const JointVector& other) const;
+
+    // Access by name, slow
+    bool contains(const QString& name) const;
+    double value(const QString& name, double defaultValue = 0.0) const;
+
+    //! @return false if there is no joint called @a name
+    bool insert(const QString& name, double value);
+
+    /**
+     * Build the name table. Needs to be called before the joint
+     * configuration is distributed to the other objects.
+     **/
+    static void setJointConfig(const JointInfo::List& config);
+
+    //! Number of joints in the current configuration
+    static int numJoints();
+
+    //! @return -1 if there is no joint called @a name
+    static int indexOf(const QString& name);
+
+    static QString name(int index);
+private:
+    double m_values[MAX_JOINTS];
+    quint32 m_valid;
+};
+
+Q_DECLARE_METATYPE(JointVector)
+
+#endif
@@ -48,9 +48,9 @@ void JoystickControl::update()
 	// Do the usual joystick business when connected.
 	if (connected)
 	{
-		QHash<QString, double> txJointVelocity;
-		QHash<QString, double> txJointAngles;
-		QHash<QString, double> txJoystick;
+		JointVector txJointVelocity;
+		JointVector txJointAngles;
+		JointVector txJoystick;
 
 		// The motion signal is generated using the "minimal carrot" algorithm.
 		// You know how you hold a carrot in front of a donkey so that it starts
@@ -79,9 +79,10 @@ void JoystickControl::update()
 
             if(qAbs(js_value) > joystickThreshold)
             {
-                txJointAngles[joint.name] = rxJointAngles[joint.name] + js_value * carrot;
-                txJointVelocity[joint.name] = qAbs(js_value) * speedLimit;
-                txJoystick[joint.name] = js_value;
+                int index = joint.address - 1;
+                txJointAngles[index] = rxJointAngles.value(index) + js_value * carrot;
+                txJointVelocity[index] = qAbs(js_value) * speedLimit;
+                txJoystick[index] = js_value;
 
                 somethingIsNonZero = true;
             }
@@ -111,7 +112,7 @@ void JoystickControl::update()
  * Updates the internal copy of joint angles.
  * The joystick control receives a constant stream of joint angles from the robot interface.
  */
-void JoystickControl::jointAnglesIn(QHash<QString, double> ja)
+void JoystickControl::jointAnglesIn(const JointVector& ja)
 {
 	rxJointAngles = ja;
 }
@@ -6,10 +6,10 @@
  */
 
 #include <QObject>
-#include <QHash>
 #include <QTimer>
 #include "Joystick.h"
 #include "JointConfiguration.h"
+#include "JointVector.h"
 
 class JoystickControl : public QObject
 {
@@ -18,10 +18,9 @@ class JoystickControl : public QObject
 	Joystick joystick;
 	bool connected;
 	double speedLimit;
-	QHash<QString, double> rxJointAngles;
+	JointVector rxJointAngles;
 	QTimer timer;
 
-	QHash<QString, double> txxJointAngles;
     JointInfo::ListPtr m_jointConfig;
 
 public:
@@ -30,7 +29,7 @@ public:
 
 public slots:
 	void update();
-	void jointAnglesIn(QHash<QString, double>);
+	void jointAnglesIn(const JointVector&);
 	void setSpeedLimit(int sl);
     void setJointConfig(const JointInfo::ListPtr& config);
 
@@ -39,8 +38,8 @@ signals:
 	void joystickDisconnected();
 	void message(QString);
 	void buttonPressed(QList<bool> button);
-	void motionOut(QHash<QString, double>, QHash<QString, double>);
-	void joystickOut(QHash<QString, double>);
+	void motionOut(const JointVector&, const JointVector&);
+	void joystickOut(const JointVector&);
 
 };
 
@@ -0,0 +1,75 @@
+#include "Joystick.h"
+#include <QDebug>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/joystick.h>
+
+Joystick::Joystick()
+{
+	connected = false;
+	jd = -1;
+
+	for (int i = 0; i < numOfButtons; i++)
+		button << false;
+
+	axis << 0 << 0 << 0 << 0;
+}
+
+Joystick::~Joystick()
+{
+	if (jd >= 0)
+		close(jd);
+}
+
+// Initializes the joystick with the first joystick found.
+// Returns true on success and false if no joystick was found.
+bool Joystick::init()
+{
+	if (jd < 0)
+		jd = open("/dev/input/js0", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+	connected = (jd >= 0);
+	return connected;
+}
+
+// Polls the joystick state. Returns true on success and false on error (e.g. the joystick was disconnected).
+bool Joystick::update()
+{
+	if (jd < 0)
+		return false;
+
+	for (int i = 0; i < numOfButtons; i++)
+		buttonBefore[i] = button[i];
+
+	// The driver sends the initial state as events too, so the state is
+	// simply what the last event for each button or axis said.
+	struct js_event ev;
+	ssize_t ret;
+	while ((ret = read(jd, &ev, sizeof(ev))) == sizeof(ev))
+	{
+		int number = ev.number;
+
+		if ((ev.type & ~JS_EVENT_INIT) == JS_EVENT_BUTTON && number < numOfButtons)
+			button[number] = ev.value;
+		else if ((ev.type & ~JS_EVENT_INIT) == JS_EVENT_AXIS && number < numOfAxes)
+			axis[number] = (double)ev.value / 32767.0;
+	}
+
+	if (ret < 0 && errno != EAGAIN)
+	{
+		close(jd);
+		jd = -1;
+		connected = false;
+		return false;
+	}
+
+	for (int i = 0; i < numOfButtons; i++)
+	{
+		buttonPressed[i] = !buttonBefore[i] && button[i];
+		buttonReleased[i] = buttonBefore[i] && !button[i];
+	}
+
+	return true;
+}
@@ -4,11 +4,8 @@
  * This class is a combination of a pose of the robot described by joint angles
  * and its graphical representation.
  *
- * The joint angles are doubles in rad packed in a QHash with associated names as hash keys.
- * The associative representation was chosen as a base for more explicit algorithms, that assign
- * joint angles very clearly by names instead of just iterating through a list. I hope this will
- * yield robustness, as in inserting or removing a joint from the list would destroy the algorithms
- * everywhere in the program, where the joint angles are visited.
+ * The joint angles are doubles in rad packed in a JointVector, which is indexed by the joint
+ * address. The joint names are only used in the string representation.
  *
  * The graphical representation is a subclass of QFrame and a 3D display of the robot in
  * the given pose. The 3D model is converted the a pixmap that can be drawn much faster.
@@ -27,7 +24,6 @@
 #include <QSizePolicy>
 #include <QSize>
 #include <QFont>
-#include <QHashIterator>
 #include <QRegExp>
 #include <QPaintEvent>
 #include <QPainter>
@@ -60,6 +56,7 @@ Keyframe::Keyframe(QWidget *parent) :
 	index = 0;
 	pause = 0.0;
 	speed = 50;
+	blend = 0;
 	selected = false;
 	loaded = false;
     ignoreMouse = true;
@@ -97,6 +94,10 @@ Keyframe::Keyframe(QWidget *parent) :
 	pauseLabel->setText("pause:");
     pauseLabel->setMaximumHeight(13);
 
+	QLabel* blendLabel = new QLabel;
+	blendLabel->setText("blend:");
+	blendLabel->setMaximumHeight(13);
+
     QLabel* digitalLabel = new QLabel("out:");
     digitalLabel->setMaximumHeight(13);
 
@@ -104,6 +105,7 @@ Keyframe::Keyframe(QWidget *parent) :
     for(int i = 0; i < DO_COUNT; ++i)
         digBox->insertItem(i, DIGITAL_OUTPUT_LABELS[i]);
     connect(digBox, SIGNAL(currentIndexChanged(int)), SIGNAL(outputCommandChanged(int)));
+    connect(digBox, SIGNAL(currentIndexChanged(int)), SIGNAL(changed()));
 
 	speedBox = new QSpinBox;
 	speedBox->setProperty("keyframeSpinBox", true);
@@ -129,6 +131,17 @@ Keyframe::Keyframe(QWidget *parent) :
     pauseBox->setSuffix("s");
 	connect(pauseBox, SIGNAL(valueChanged(double)), this, SLOT(pauseChangedBySpinbox()));
 
+	blendBox = new QSpinBox;
+	blendBox->setProperty("keyframeSpinBox", true);
+	blendBox->setAccelerated(true);
+	blendBox->setAlignment(Qt::AlignRight);
+	blendBox->setRange(0, 100);
+	blendBox->setValue(blend);
+	blendBox->setMaximumWidth(50);
+	blendBox->setMaximumHeight(15);
+	blendBox->setSuffix("%");
+	connect(blendBox, SIGNAL(valueChanged(int)), this, SLOT(blendChangedBySpinbox()));
+
 
 	QHBoxLayout *headerLayout = new QHBoxLayout;
 	headerLayout->setContentsMargins(2, 4, 2, 3);
@@ -149,8 +162,11 @@ Keyframe::Keyframe(QWidget *parent) :
 	footerLayout->addWidget(pauseLabel, 1, 0, Qt::AlignRight);
     footerLayout->addWidget(pauseBox, 1, 1);
 
-    footerLayout->addWidget(digitalLabel, 2, 0, Qt::AlignRight);
-    footerLayout->addWidget(digBox, 2, 1);
+	footerLayout->addWidget(blendLabel, 2, 0, Qt::AlignRight);
+    footerLayout->addWidget(blendBox, 2, 1);
+
+    footerLayout->addWidget(digitalLabel, 3, 0, Qt::AlignRight);
+    footerLayout->addWidget(digBox, 3, 1);
 
 	QVBoxLayout *layout = new QVBoxLayout;
     layout->setContentsMargins(3, 0, 3, 0);
@@ -191,6 +207,7 @@ void Keyframe::setPause(double pause)
 	pauseBox->blockSignals(true);
 	pauseBox->setValue(pause);
 	pauseBox->blockSignals(false);
+	emit changed();
 }
 
 /*
@@ -203,6 +220,28 @@ double Keyframe::getPause()
 }
 
 
+/*
+ * Sets the fly-by blend of the keyframe in percent (0 - 100).
+ * With a blend, the robot does not stop in this keyframe, but rounds off the
+ * corner to the next one. The blend is ignored if the keyframe has a pause.
+ */
+void Keyframe::setBlend(int blend)
+{
+	this->blend = blend;
+	blendBox->blockSignals(true);
+	blendBox->setValue(blend);
+	blendBox->blockSignals(false);
+	emit changed();
+}
+
+/*
+ * Returns the fly-by blend of the keyframe in percent.
+ */
+int Keyframe::getBlend()
+{
+	return this->blend;
+}
+
 /*
  * Sets the speed of the keyframe.
  * The speed parameter is a percental value (1 - 100) that describes how fast this keyframe
@@ -216,6 +255,7 @@ void Keyframe::setSpeed(int speed)
 	speedBox->blockSignals(true);
 	speedBox->setValue(speed);
 	speedBox->blockSignals(false);
+	emit changed();
 }
 
 void Keyframe::setOutputCommand(int cmd)
@@ -223,6 +263,7 @@ void Keyframe::setOutputCommand(int cmd)
     digBox->blockSignals(true);
     digBox->setCurrentIndex((int)cmd);
     digBox->blockSignals(false);
+    emit changed();
 }
 
 Keyframe::DigitalOutput Keyframe::getOutputCommand() const
@@ -249,6 +290,15 @@ void Keyframe::pauseChangedBySpinbox()
 	emit pauseChanged(pauseBox->value());
 }
 
+/*
+ * A slot for handling the internal blend spin box.
+ */
+void Keyframe::blendChangedBySpinbox()
+{
+	setBlend(blendBox->value());
+	emit blendChanged(blendBox->value());
+}
+
 /*
  * Returns the speed of the keyframe.
  * The speed parameter is a percental value (1 - 100) that describes how fast this keyframe
@@ -290,10 +340,11 @@ void Keyframe::updateView()
  * Sets the joint angles if this keyframe.
  * It also renders the pixmap, so it's expensive.
  */
-void Keyframe::setJointAngles(const QHash<QString, double> ja)
+void Keyframe::setJointAngles(const JointVector& ja)
 {
 	jointAngles = ja;
     updateView();
+    emit changed();
 }
 
 /*
@@ -301,7 +352,7 @@ void Keyframe::setJointAngles(const QHash<QString, double> ja)
  * not render the pixmap, because during streaming only the 3D model is
  * shown. The pixmap is rendered once when the keyframes is unloaded.
  */
-void Keyframe::motionIn(QHash<QString, double> angles)
+void Keyframe::motionIn(const JointVector& angles)
 {
 	jointAngles = angles;
 
@@ -309,6 +360,7 @@ void Keyframe::motionIn(QHash<QString, double> angles)
         robotView->updateView();
 
 	update();
+	emit changed();
 }
 
 // Replaces the current pixmap with a new one generated from the 3D model
@@ -326,38 +378,16 @@ void Keyframe::updatePixmap()
  */
 double Keyframe::distance(Keyframe* kf)
 {
-	// Find the maximum joint distance.
-	double distance = 0;
-	QHashIterator<QString, double> jointIterator(jointAngles);
-	while (jointIterator.hasNext())
-	{
-		jointIterator.next();
-
-		if (qAbs(this->jointAngles[jointIterator.key()] - kf->jointAngles[jointIterator.key()]) > distance)
-			distance = qAbs(this->jointAngles[jointIterator.key()] - kf->jointAngles[jointIterator.key()]);
-	}
-
-	return distance;
+	return jointAngles.distance(kf->jointAngles);
 }
 
 /*
  * Returns the distance between this and the "other" keyframe.
  * The distance is calculated as the maximum norm on the joint angles.
  */
-double Keyframe::distance(QHash<QString, double> ja)
+double Keyframe::distance(const JointVector& ja)
 {
-	// Find the maximum joint distance.
-	double distance = 0;
-	QHashIterator<QString, double> jointIterator(jointAngles);
-	while (jointIterator.hasNext())
-	{
-		jointIterator.next();
-
-		if (qAbs(this->jointAngles[jointIterator.key()] - ja[jointIterator.key()]) > distance)
-			distance = qAbs(this->jointAngles[jointIterator.key()] - ja[jointIterator.key()]);
-	}
-
-	return distance;
+	return jointAngles.distance(ja);
 }
 
 /*
@@ -367,6 +397,7 @@ double Keyframe::distance(QHash<QString, double> ja)
 void Keyframe::jointAnglesChangedByInternalView()
 {
 	emit jointAnglesChanged(jointAngles);
+	emit changed();
 }
 
 /*
@@ -376,6 +407,10 @@ void Keyframe::jointAnglesChangedByInternalView()
  * layout or in a sequence. When the frame is converted to a string,
  * it means that it's being dragged away or exported somehow, so
  * it's taken away from its sequence and the index becomes invalid.
+ *
+ * The blend is only written if it is set. Editors older than the fly-by
+ * blends read "blend" as the name of a joint, so motion files with blends
+ * cannot be loaded by them.
  */
 const QString Keyframe::toString()
 {
@@ -383,13 +418,14 @@ const QString Keyframe::toString()
 
 	string.append("speed:" + QString::number(this->speed));
 	string.append(" pause:" + QString::number(this->pause));
+	if (this->blend != 0)
+		string.append(" blend:" + QString::number(this->blend));
     string.append(" output:" + QString::number(digBox->currentIndex()));
 
-	QHashIterator<QString, double> i(jointAngles);
-	while (i.hasNext())
+	for (int i = 0; i < JointVector::MAX_JOINTS; ++i)
 	{
-		i.next();
-		string.append(" " + i.key() + ":" + QString::number(i.value()));
+		if (jointAngles.contains(i))
+			string.append(" " + JointVector::name(i) + ":" + QString::number(jointAngles[i]));
 	}
 
 	string.append("\n");
@@ -429,26 +465,30 @@ void Keyframe::fromString(QString keyframeString)
 		else if (partBits.at(0) == "pause")
 			setPause(partBits.at(1).toDouble(&ok));
 
+		else if (partBits.at(0) == "blend")
+			setBlend(qBound(0, partBits.at(1).toInt(&ok), 100));
+
         else if (partBits.at(0) == "output")
             setOutputCommand((DigitalOutput)partBits.at(1).toInt(&ok));
 
-		else
-			this->jointAngles[partBits.at(0)] = partBits.at(1).toDouble(&ok);
+		else if (!this->jointAngles.insert(partBits.at(0), partBits.at(1).toDouble(&ok)))
+			qDebug() << "Ignoring unknown joint" << partBits.at(0);
 
 		if (!ok)
 			qDebug() << "When creating a keyframe from string, could not extract value from " << part;
 	}
 
     updateView();
+    emit changed();
 }
 
 
 /*
  * Converts the string representation to a joint angle hash.
  */
-QHash<QString, double> Keyframe::jointAnglesFromString(QString keyframeString)
+JointVector Keyframe::jointAnglesFromString(QString keyframeString)
 {
-	QHash<QString, double> ja;
+	JointVector ja;
 
 	// Chop off everything starting from the first newline character.
 	if (keyframeString.contains("\n"))
@@ -470,8 +510,8 @@ QHash<QString, double> Keyframe::jointAnglesFromString(QString keyframeString)
 
 		partBits = part.split(":");
 
-        if (partBits.at(0) != "speed" && partBits.at(0) != "pause" && partBits.at(0) != "output")
-			ja[partBits.at(0)] = partBits.at(1).toDouble(&ok);
+        if (partBits.at(0) != "speed" && partBits.at(0) != "pause" && partBits.at(0) != "blend" && partBits.at(0) != "output")
+			ja.insert(partBits.at(0), partBits.at(1).toDouble(&ok));
 
 		if (!ok)
 			qDebug() << "When creating a keyframe from string, could not extract value from " << part;
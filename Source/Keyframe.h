@@ -13,6 +13,7 @@
 #include <QLabel>
 
 #include "RobotView3D.h"
+#include "JointVector.h"
 
 extern const char* DIGITAL_OUTPUT_LABELS[];
 
@@ -25,6 +26,7 @@ class Keyframe : public QWidget
 	QLabel* indexLabel;
 	QSpinBox* speedBox;
 	QDoubleSpinBox* pauseBox;
+	QSpinBox* blendBox;
     QComboBox* digBox;
     QLabel* robotViewContainer;
 
@@ -40,13 +42,18 @@ class Keyframe : public QWidget
 	// the robot will not move at all and the program will freeze while playing the keyframes.
 	int speed;
 
+	// Fly-by blend in percent (0 - 100). With a blend, the robot does not stop in this keyframe,
+	// but rounds off the corner to the next one. The blend takes this percentage of the shorter
+	// adjacent motion. 0 means that the keyframe is reached exactly.
+	int blend;
+
 	bool selected;
 	bool loaded;
 
 	bool ignoreMouse;
 
 public:
-	QHash<QString, double> jointAngles;
+	JointVector jointAngles;
 	QPixmap modelPixmap;
 
     //! See labels in Keyframe.cpp
@@ -66,6 +73,7 @@ public:
 	int getSpeed();
     DigitalOutput getOutputCommand() const;
 	double getPause();
+	int getBlend();
 	void setIndex(int);
 	void toggleSelected();
 	void setSelected(bool);
@@ -78,16 +86,17 @@ public:
 	void zoomOut();
 	void setZoom(int zoomFactor);
 	double distance(Keyframe*);
-	double distance(QHash<QString, double>);
+	double distance(const JointVector&);
 
 	static bool validateString(QString);
-	static QHash<QString, double> jointAnglesFromString(QString);
+	static JointVector jointAnglesFromString(QString);
 
 public slots:
-	void motionIn(QHash<QString, double>);
-	void setJointAngles(QHash<QString, double>);
+	void motionIn(const JointVector&);
+	void setJointAngles(const JointVector&);
 	void setPause(double);
 	void setSpeed(int);
+	void setBlend(int);
     void setOutputCommand(int cmd);
 	void updatePixmap();
     void setJointConfig(const JointInfo::ListPtr& config);
@@ -95,17 +104,22 @@ public slots:
     void updateView();
 
 signals:
-	void jointAnglesChanged(QHash<QString, double>);
+	void jointAnglesChanged(const JointVector&);
 	void speedChanged(int);
 	void pauseChanged(double);
+	void blendChanged(int);
 
     //! cmd is a DigitalOutput member
     void outputCommandChanged(int cmd);
 
+    //! Any of the played values changed, also when set programmatically
+    void changed();
+
 private slots:
 	void jointAnglesChangedByInternalView();
 	void speedChangedBySpinbox();
 	void pauseChangedBySpinbox();
+	void blendChangedBySpinbox();
 
 protected:
 	void paintEvent(QPaintEvent*);
@@ -337,12 +337,11 @@ void KeyframeArea::interpolateSelected(double alpha)
 		// Interpolate between the first and second.
 		// new = (1-alpha) * first + alpha*second
 
-		QHash<QString, double> interpolatedJointAngles;
-		QHashIterator<QString, double> i(firstFrame->jointAngles);
-		while (i.hasNext())
+		JointVector interpolatedJointAngles;
+		for (int i = 0; i < JointVector::MAX_JOINTS; ++i)
 		{
-			i.next();
-			interpolatedJointAngles[i.key()] = (1-alpha) * firstFrame->jointAngles.value(i.key()) + alpha * secondFrame->jointAngles.value(i.key());
+			if (firstFrame->jointAngles.contains(i))
+				interpolatedJointAngles[i] = (1-alpha) * firstFrame->jointAngles[i] + alpha * secondFrame->jointAngles.value(i);
 		}
 
 		Keyframe* interpolatedKeyframe = new Keyframe(this);
@@ -469,6 +468,7 @@ void KeyframeArea::dropEvent(QDropEvent *event)
                 keyframe->setJointConfig(m_jointConfig);
 				keyframe->setPause(kf->getPause());
 				keyframe->setSpeed(kf->getSpeed());
+				keyframe->setBlend(kf->getBlend());
 				keyframe->motionIn(kf->jointAngles);
 				keyframe->modelPixmap = kf->modelPixmap;
 				insertKeyframeAt(dropIndex++, keyframe);
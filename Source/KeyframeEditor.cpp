@@ -100,7 +100,7 @@ void KeyframeEditor::loadKeyframe(Keyframe *keyframe)
     setPause(keyframe->getPause());
     setOutputCommand(keyframe->getOutputCommand());
 
-    connect(this, SIGNAL(motionOut(QHash<QString,double>,QHash<QString,double>,int)), keyframe, SLOT(motionIn(QHash<QString,double>)), Qt::UniqueConnection);
+    connect(this, SIGNAL(motionOut(JointVector,JointVector,int)), keyframe, SLOT(motionIn(JointVector)), Qt::UniqueConnection);
     connect(this, SIGNAL(speedChanged(int)), keyframe, SLOT(setSpeed(int)), Qt::UniqueConnection);
     connect(this, SIGNAL(pauseChanged(double)), keyframe, SLOT(setPause(double)), Qt::UniqueConnection);
     connect(this, SIGNAL(outputCommandChanged(int)), keyframe, SLOT(setOutputCommand(int)), Qt::UniqueConnection);
@@ -137,12 +137,9 @@ void KeyframeEditor::transferJointAnglesToGuiElements()
 	disconnect(this, SIGNAL(spinboxValueChanged()), this, SLOT(jointAnglesChangedBySpinbox()));
 	disconnect(this, SIGNAL(sliderValueChanged()), this, SLOT(jointAnglesChangedBySlider()));
 
-    QHash<QString, GUIElements>::iterator it;
-    for(it = m_guiElements.begin(); it != m_guiElements.end(); ++it)
+    foreach(const GUIElements& gui, m_guiElements)
     {
-        const GUIElements& gui = it.value();
-
-        gui.spinBox->setValue(txJointAngles[it.key()] * radToDeg);
+        gui.spinBox->setValue(txJointAngles.value(gui.index) * radToDeg);
         gui.slider->setValue(gui.slider->minimum() + ((gui.spinBox->value() - gui.spinBox->minimum()) / (gui.spinBox->maximum() - gui.spinBox->minimum())) * (gui.slider->maximum() - gui.slider->minimum()));
     }
 
@@ -155,14 +152,13 @@ void KeyframeEditor::transferJointAnglesToGuiElements()
  * This is triggered when a keyframe is double clicked or dropped on the keyframe editor.
  * It's also used to stream received joint angles from the robot interface to the kf editor.
  */
-void KeyframeEditor::setJointAngles(QHash<QString, double> ja)
+void KeyframeEditor::setJointAngles(const JointVector& ja)
 {
 	txJointAngles = ja;
 	robotView->updateView();
 
 	// Reset the velocities because the joystick might have messed them up.
-    foreach (QString key, txJointVelocities.keys())
-		txJointVelocities[key] = speedLimit;
+	txJointVelocities.fill(speedLimit);
 
     emit motionOut(txJointAngles, txJointVelocities, ui.outputComboBox->currentIndex());
 
@@ -186,13 +182,11 @@ void KeyframeEditor::setJointAngles(QHash<QString, double> ja)
 void KeyframeEditor::zeroKeyframe()
 {
 	// Set all joint angles to zero.
-    foreach (QString key, txJointAngles.keys())
-		txJointAngles[key] = 0.0;
+	txJointAngles.fill(0.0);
 	robotView->updateView();
 
 	// Reset the velocities because the joystick might have messed them up.
-    foreach (QString key, txJointVelocities.keys())
-		txJointVelocities[key] = speedLimit;
+	txJointVelocities.fill(speedLimit);
 
 	transferJointAnglesToGuiElements();
 
@@ -202,7 +196,7 @@ void KeyframeEditor::zeroKeyframe()
 /*
  * The default motion data transfer slot.
  */
-void KeyframeEditor::motionIn(QHash<QString, double> pos, QHash<QString, double> vel)
+void KeyframeEditor::motionIn(const JointVector& pos, const JointVector& vel)
 {
 	txJointAngles = pos;
 	robotView->updateView();
@@ -222,7 +216,7 @@ void KeyframeEditor::motionIn(QHash<QString, double> pos, QHash<QString, double>
  * This is triggered when a keyframe is double clicked or dropped on the keyframe editor.
  * It's also used to stream received joint angles from the robot interface to the kf editor.
  */
-void KeyframeEditor::joystickIn(QHash<QString, double> joy)
+void KeyframeEditor::joystickIn(const JointVector& joy)
 {
 	// Minimal carrot algorithm.
 	// Like this I can control the arm fairly smooth with minimal carrot distance.
@@ -230,14 +224,15 @@ void KeyframeEditor::joystickIn(QHash<QString, double> joy)
 	double carrot = speedLimit * 1.0/JOYSTICKRATE + 0.006;
     foreach(const JointInfo& joint, *m_jointConfig)
     {
-        if(!joy.contains(joint.name))
+        int index = joint.address - 1;
+        if(!joy.contains(index))
             continue;
 
-        txJointAngles[joint.name] = qBound(
-            joint.lower_limit, txJointAngles[joint.name] + joy[joint.name] * carrot, joint.upper_limit
+        txJointAngles[index] = qBound(
+            joint.lower_limit, txJointAngles.value(index) + joy[index] * carrot, joint.upper_limit
         );
-        if(qAbs(joy[joint.name]) > 0)
-            txJointVelocities[joint.name] = qBound(0.0, qAbs(joy[joint.name]) * speedLimit, speedLimit);
+        if(qAbs(joy[index]) > 0)
+            txJointVelocities[index] = qBound(0.0, qAbs(joy[index]) * speedLimit, speedLimit);
     }
 
 //	qDebug() << txJointVelocities;
@@ -261,14 +256,13 @@ void KeyframeEditor::joystickIn(QHash<QString, double> joy)
 void KeyframeEditor::setSpeedLimit(int sl)
 {
 	speedLimit = qBound(0.0, 0.01 * (double)sl * SERVOSPEEDMAX, SERVOSPEEDMAX);
-    foreach (QString key, txJointVelocities.keys())
-		txJointVelocities[key] = speedLimit;
+	txJointVelocities.fill(speedLimit);
 }
 
 /*
  * Returns the currently set joint angles.
  */
-QHash<QString, double> KeyframeEditor::getJointAngles()
+JointVector KeyframeEditor::getJointAngles()
 {
 	return txJointAngles;
 }
@@ -340,16 +334,13 @@ void KeyframeEditor::jointAnglesChangedBySpinbox()
 	disconnect(this, SIGNAL(spinboxValueChanged()), this, SLOT(jointAnglesChangedBySpinbox()));
 	disconnect(this, SIGNAL(sliderValueChanged()), this, SLOT(jointAnglesChangedBySlider()));
 
-    QHash<QString, GUIElements>::iterator it;
-    for(it = m_guiElements.begin(); it != m_guiElements.end(); ++it)
+    foreach(const GUIElements& gui, m_guiElements)
     {
-         const GUIElements& gui = it.value();
-
          gui.slider->setValue(gui.slider->minimum()
                               + (gui.spinBox->value() - gui.spinBox->minimum())
                               * (gui.slider->maximum() - gui.slider->minimum())
                               / (gui.spinBox->maximum() - gui.spinBox->minimum()));
-         txJointAngles[it.key()] = gui.spinBox->value() * degToRad;
+         txJointAngles[gui.index] = gui.spinBox->value() * degToRad;
     }
 
 	connect(this, SIGNAL(spinboxValueChanged()), this, SLOT(jointAnglesChangedBySpinbox()));
@@ -376,17 +367,14 @@ void KeyframeEditor::jointAnglesChangedBySlider()
 	disconnect(this, SIGNAL(spinboxValueChanged()), this, SLOT(jointAnglesChangedBySpinbox()));
 	disconnect(this, SIGNAL(sliderValueChanged()), this, SLOT(jointAnglesChangedBySlider()));
 
-    QHash<QString, GUIElements>::iterator it;
-    for(it = m_guiElements.begin(); it != m_guiElements.end(); ++it)
+    foreach(const GUIElements& gui, m_guiElements)
     {
-        const GUIElements& gui = it.value();
-
         gui.spinBox->setValue(gui.spinBox->minimum()
             + (((double)gui.slider->value() - gui.slider->minimum())
                        / (gui.slider->maximum() - gui.slider->minimum()))
                               * (gui.spinBox->maximum() - gui.spinBox->minimum()));
 
-        txJointAngles[it.key()] = gui.spinBox->value () * degToRad;
+        txJointAngles[gui.index] = gui.spinBox->value () * degToRad;
     }
 
 	connect(this, SIGNAL(spinboxValueChanged()), this, SLOT(jointAnglesChangedBySpinbox()));
@@ -461,6 +449,7 @@ void KeyframeEditor::setJointConfig(const JointInfo::ListPtr &config)
     {
         const JointInfo& joint = config->at(i);
         GUIElements elem;
+        elem.index = joint.address - 1;
         QLabel* label = new QLabel(joint.name, ui.sliderWidget);
         elem.slider = new QSlider(Qt::Horizontal, ui.sliderWidget);
         elem.spinBox = new QDoubleSpinBox(ui.sliderWidget);
@@ -482,9 +471,9 @@ void KeyframeEditor::setJointConfig(const JointInfo::ListPtr &config)
         layout->addWidget(elem.spinBox, i, 2);
         layout->addWidget(degLabel, i, 3);
 
-        m_guiElements[joint.name] = elem;
+        m_guiElements.append(elem);
 
-        txJointVelocities[joint.name] = speedLimit;
+        txJointVelocities[elem.index] = speedLimit;
     }
 
     robotView->setJointConfig(config);
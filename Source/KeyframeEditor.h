@@ -6,6 +6,7 @@
 
 #include "Keyframe.h"
 #include "RobotView3D.h"
+#include "JointVector.h"
 
 class KeyframeEditor : public QGroupBox
 {
@@ -13,10 +14,11 @@ class KeyframeEditor : public QGroupBox
 
     struct GUIElements
     {
+        int index; // in JointVector
         QSlider* slider;
         QDoubleSpinBox* spinBox;
     };
-    QHash<QString, GUIElements> m_guiElements;
+    QList<GUIElements> m_guiElements;
 
     Ui::KeyframeEditorClass ui;
 
@@ -28,8 +30,8 @@ class KeyframeEditor : public QGroupBox
 	RobotView3D *robotView;
 
 	double speedLimit;
-	QHash<QString, double> txJointAngles;
-	QHash<QString, double> txJointVelocities;
+	JointVector txJointAngles;
+	JointVector txJointVelocities;
 
     JointInfo::ListPtr m_jointConfig;
     QPointer<Keyframe> m_keyframe;
@@ -37,7 +39,7 @@ public:
     KeyframeEditor(QWidget *parent = 0);
     int getSpeed();
     double getPause();
-    QHash<QString, double> getJointAngles();
+    JointVector getJointAngles();
     int getOutputCommand();
 
     inline bool isLoaded() const
@@ -47,9 +49,9 @@ public:
     { return m_keyframe; }
 
 public slots:
-	void motionIn(QHash<QString, double>, QHash<QString, double>);
-	void joystickIn(QHash<QString, double>);
-	void setJointAngles(QHash<QString, double>);
+	void motionIn(const JointVector&, const JointVector&);
+	void joystickIn(const JointVector&);
+	void setJointAngles(const JointVector&);
 	void setSpeedLimit(int sl);
 	void setSpeed(int);
 	void setPause(double);
@@ -72,7 +74,7 @@ signals:
 	void speedChanged(int);
 	void pauseChanged(double);
     void outputCommandChanged(int);
-    void motionOut(QHash<QString, double>, QHash<QString, double>, int outputCommand);
+    void motionOut(const JointVector&, const JointVector&, int outputCommand);
 
     void saveRequested();
 
@@ -3,8 +3,8 @@
  *
  * This class is playing the current keyframes in the motion sequence.
  * When the play (or loop) button is pressed, the keyframe sequence is
- * converted to a linked list data structure. For each item in the list,
- * a point in time is calculated where the keyframe should be reached.
+ * converted to a Timeline. For each frame in the timeline, a point in
+ * time is calculated where the keyframe should be reached.
  * The actual playing is happening by advancing the "sliderPositon" in
  * real time. It's always the "next" keyframe that we are moving into
  * what is sent as a target position. Additionally, appropriate joint
@@ -16,13 +16,10 @@
  */
 
 #include <QString>
-#include <QHash>
 #include <QList>
 #include <QPointer>
 #include <QtDebug>
-#include <QHashIterator>
 #include "KeyframePlayer.h"
-#include "KeyframePlayerItem.h"
 #include "Keyframe.h"
 #include "globals.h"
 
@@ -32,24 +29,23 @@ KeyframePlayer::KeyframePlayer()
 	velocityAdaptionStrength = 0.15;
 
 	sliderPosition = 0.0;
-	head = new KeyframePlayerItem();
-	current = head;
+	current = 0;
+	compiledLooped = false;
+	compiledSpeedLimit = 0;
 	speedLimit = SERVOSPEEDMAX;
 	looped = false;
 	interpolating = false;
+	blending = true;
 	velocityAdaption = true;
 
-	// High precision tick counters.
-	QueryPerformanceFrequency(&ticksPerSecond);
-	QueryPerformanceCounter(&startTime);
-	QueryPerformanceCounter(&lastTime);
+	// High precision timer.
+	stepTimer.start();
 
 	connect(&timer, SIGNAL(timeout()), this, SLOT(step()));
 }
 
 KeyframePlayer::~KeyframePlayer()
 {
-	delete head;
 }
 
 // Sets the maximum possible joint velocity.
@@ -89,30 +85,30 @@ bool KeyframePlayer::isPlaying()
  * Using this feedback, factors are calculated that adapt the motion speed of the
  * joints during playing to correct errors.
  */
-void KeyframePlayer::jointAnglesIn(QHash<QString, double> ja)
+void KeyframePlayer::jointAnglesIn(const JointVector& ja)
 {
 	rxJointAngles = ja;
 
-	if (current->next && velocityAdaption)
+	for (int i = 0; i < JointVector::MAX_JOINTS; ++i)
 	{
-        foreach (QString key, head->joints.keys())
+		if (!timeline.contains(i))
+			continue;
+
+		if (current+1 < timeline.size() && velocityAdaption)
 		{
-			double deltaS = qAbs(txJointAngles[key] - rxJointAngles[key]);
-			double deltaT = current->next->absoluteTime - sliderPosition + timeCorrection;
-			txJointVelocityCorrectionFactors[key] = qBound(1.0 - velocityAdaptionStrength, deltaS / (deltaT * txJointVelocities[key]), 1.0 + velocityAdaptionStrength);
+			double deltaS = qAbs(txJointAngles.value(i) - rxJointAngles.value(i));
+			double deltaT = timeline.time(current+1) - sliderPosition + timeCorrection;
+			txJointVelocityCorrectionFactors[i] = qBound(1.0 - velocityAdaptionStrength, deltaS / (deltaT * txJointVelocities.value(i)), 1.0 + velocityAdaptionStrength);
 		}
-	}
-	else
-	{
-        foreach (QString key, head->joints.keys())
-			txJointVelocityCorrectionFactors[key] = 1.0;
+		else
+			txJointVelocityCorrectionFactors[i] = 1.0;
 	}
 }
 
 
 /*
  * Loads a list of keyframes into the keyframe player.
- * It prepares a linked list of keyframe player items that is iterated when playing.
+ * It prepares the timeline that is played.
  */
 void KeyframePlayer::playTheseFrames(QList< QPointer<Keyframe> > keyframes)
 {
@@ -124,107 +120,231 @@ void KeyframePlayer::playTheseFrames(QList< QPointer<Keyframe> > keyframes)
 	// Initialize the joint angles with the first frame.
 	txJointAngles = keyframes[0]->jointAngles;
 
-	// Initialize the velocities.
-    foreach (QString key, head->joints.keys())
-		txJointVelocities[key] = speedLimit;
+	// Initialize the velocities and reset the correction factors.
+	txJointVelocities.clear();
+	txJointVelocityCorrectionFactors.clear();
+	for (int i = 0; i < JointVector::MAX_JOINTS; ++i)
+	{
+		if (!txJointAngles.contains(i))
+			continue;
+
+		txJointVelocities[i] = speedLimit;
+		txJointVelocityCorrectionFactors[i] = 1.0;
+	}
+
+	// Patch the timeline if only some keyframes changed since the last call,
+	// otherwise build it up from scratch.
+	if (!patch(keyframes))
+		compile(keyframes);
+
+	compiledLooped = looped;
+	compiledSpeedLimit = speedLimit;
+	changedKeyframes.clear();
+
+	// Reset the current frame for playing.
+	current = 0;
+}
+
+/*
+ * The fly-by blend of a keyframe in the timeline. A keyframe with a pause
+ * is always reached exactly, and so is every keyframe without lookahead,
+ * since the microcontroller then only sends the keyframes to the servos.
+ */
+int KeyframePlayer::frameBlend(Keyframe* kf) const
+{
+	if (!blending || kf->getPause() > 0)
+		return 0;
 
-	// Reset the correction factors.
-    foreach (QString key, head->joints.keys())
-		txJointVelocityCorrectionFactors[key] = 1.0;
+	return kf->getBlend();
+}
 
-	// Delete the old motion data structure.
-	delete head->next;
+/*
+ * Returns true if the robot moves through keyframe i without stopping.
+ * Like the microcontroller, it stops in the first keyframe and in the last
+ * one unless the motion is looped.
+ */
+bool KeyframePlayer::flyBy(const QList< QPointer<Keyframe> >& keyframes, int i) const
+{
+	if (i == 0 || (i == keyframes.size()-1 && !looped))
+		return false;
 
-	// Initialize the head.
-	head->next = 0;
-    head->setJointAngles(keyframes[0]->jointAngles);
-	head->relativeTime = 0;
-	head->absoluteTime = 0;
-    head->outputCommand = keyframes[0]->getOutputCommand();
-	current = head;
+	return frameBlend(keyframes[i]) > 0;
+}
 
-	// Build up the keyframe timeline.
-	KeyframePlayerItem* item;
-    for (int i = 0; i < keyframes.size(); i++)
+/*
+ * Returns the time it takes to move from one keyframe to the other.
+ * The speed of the target keyframe and the speed limit scale the maximum
+ * velocities of the joints, the slowest joint sets the time.
+ */
+double KeyframePlayer::segmentTime(const QList< QPointer<Keyframe> >& keyframes, int from, int to) const
+{
+	double speed = 0.01 * (double)keyframes[to]->getSpeed() * speedLimit / SERVOSPEEDMAX;
+	return profile.segmentTime(keyframes[from]->jointAngles, keyframes[to]->jointAngles, speed,
+		!flyBy(keyframes, from), !flyBy(keyframes, to));
+}
+
+/*
+ * Builds up the keyframe timeline from scratch.
+ */
+void KeyframePlayer::compile(const QList< QPointer<Keyframe> >& keyframes)
+{
+	compiledKeyframes.clear();
+	keyframeFrames.clear();
+
+	// Start with the first frame.
+	timeline.clear();
+	timeline.append(0, keyframes[0]->jointAngles, keyframes[0]->getOutputCommand());
+	keyframeFrames.append(0);
+
+	for (int i = 0; i < keyframes.size(); i++)
 	{
 		double pause = (double)keyframes[i]->getPause();
 
 		if (pause > 0)
-		{
-			item = new KeyframePlayerItem();
-            item->setJointAngles(keyframes[i]->jointAngles);
-			item->relativeTime = pause;
-            item->absoluteTime = current->absoluteTime + item->relativeTime;
-			current->next = item;
-			current = item;
-		}
+			timeline.append(pause, keyframes[i]->jointAngles, Keyframe::DO_IGNORE);
 
-        if(i == keyframes.size()-1)
-            break; // No next keyframe to move to
+		if (i == keyframes.size()-1)
+			break; // No next keyframe to move to
 
 		// Calculate the time it takes to reach the next keyframe.
-		double keyframeDistance = qAbs(keyframes[i]->distance(keyframes[i+1]));
-		double time = keyframeDistance / (0.01 * (double)keyframes[i+1]->getSpeed() * speedLimit);
-		//qDebug() << "kfd:" << keyframeDistance << "sp:" << (0.01 * (double)keyframes[i+1]->getSpeed() * speedLimit) << "time:" << time;
-
-		// Instantiate a new item and add it to the playlist.
-		item = new KeyframePlayerItem();
-        item->setJointAngles(keyframes[i+1]->jointAngles);
-		item->relativeTime = time;
-		item->absoluteTime = current->absoluteTime + item->relativeTime;
-        item->outputCommand = keyframes[i+1]->getOutputCommand();
-		current->next = item;
-		current = item;
+		keyframeFrames.append(timeline.size());
+		timeline.append(segmentTime(keyframes, i, i+1), keyframes[i+1]->jointAngles, keyframes[i+1]->getOutputCommand(), frameBlend(keyframes[i+1]));
 	}
 
+	keyframeFrames.append(timeline.size());
+
 	// If the motion is looped, the last keyframe has to be connected with the first one.
 	if (looped)
+		timeline.append(segmentTime(keyframes, keyframes.size()-1, 0), keyframes[0]->jointAngles, keyframes[0]->getOutputCommand());
+
+	// Calculate needed velocities
+	timeline.computeVelocities(speedLimit);
+
+	// Get notified about changes to patch the timeline next time.
+	foreach (Keyframe* kf, keyframes)
 	{
-		// Calculate the time it takes to reach the next keyframe.
-		double keyframeDistance = qAbs(keyframes.last()->distance(keyframes[0]));
-		double time = keyframeDistance / (0.01 * (double)keyframes[0]->getSpeed() * speedLimit);
-
-		// Instantiate a new item and add it to the playlist.
-		item = new KeyframePlayerItem();
-        item->setJointAngles(keyframes[0]->jointAngles);
-		item->relativeTime = time;
-		item->absoluteTime = current->absoluteTime + item->relativeTime;
-        item->outputCommand = keyframes[0]->getOutputCommand();
-		current->next = item;
-		current = item;
+		compiledKeyframes << kf;
+		connect(kf, SIGNAL(changed()), this, SLOT(keyframeChanged()), Qt::UniqueConnection);
+		connect(kf, SIGNAL(destroyed(QObject*)), this, SLOT(keyframeDestroyed(QObject*)), Qt::UniqueConnection);
+	}
+}
+
+/*
+ * Updates the timeline for the keyframes which changed since it was compiled.
+ * Only the segments to and from a changed keyframe are recalculated.
+ * Returns false if the timeline has to be compiled from scratch, e.g. because
+ * keyframes were added, removed or reordered.
+ */
+bool KeyframePlayer::patch(const QList< QPointer<Keyframe> >& keyframes)
+{
+	int n = keyframes.size();
+
+	if (timeline.isEmpty() || speedLimit != compiledSpeedLimit || n != compiledKeyframes.size())
+		return false;
+
+	for (int i = 0; i < n; i++)
+	{
+		Keyframe* kf = keyframes[i];
+
+		if (kf != compiledKeyframes[i])
+			return false;
+
+		if (!changedKeyframes.contains(kf))
+			continue;
+
+		// Adding or removing a pause inserts or removes a frame.
+		bool hasPause = (keyframeFrames[i+1] - keyframeFrames[i] == 2);
+		if ((kf->getPause() > 0) != hasPause)
+			return false;
+
+		// The first keyframe defines the joints of the timeline.
+		if (i == 0)
+		{
+			for (int j = 0; j < JointVector::MAX_JOINTS; ++j)
+			{
+				if (kf->jointAngles.contains(j) != timeline.contains(j))
+					return false;
+			}
+		}
+	}
+
+	// Add or remove the segment from the last keyframe back to the first one.
+	// Whether the robot stops in the last keyframe changes as well.
+	int loopFrame = keyframeFrames[n];
+	if (looped != compiledLooped)
+		changedKeyframes.insert(keyframes.last());
+
+	if (looped && !compiledLooped)
+	{
+		timeline.append(segmentTime(keyframes, n-1, 0), keyframes[0]->jointAngles, keyframes[0]->getOutputCommand());
+		timeline.computeVelocities(speedLimit, loopFrame-1, loopFrame);
 	}
+	else if (!looped && compiledLooped)
+	{
+		timeline.truncate(loopFrame);
+		timeline.computeVelocities(speedLimit, loopFrame-1, loopFrame-1);
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		Keyframe* kf = keyframes[i];
+
+		if (!changedKeyframes.contains(kf))
+			continue;
+
+		int frame = keyframeFrames[i];
+		int nextFrame = keyframeFrames[i+1];
 
-    // Calculate needed velocities
-    current = head;
-    while(current)
-    {
-        KeyframePlayerItem* next = current->next;
+		timeline.setFrame(frame, kf->jointAngles, kf->getOutputCommand(), i > 0 ? frameBlend(kf) : 0);
+
+		if (nextFrame - frame == 2)
+		{
+			timeline.setFrame(frame+1, kf->jointAngles, Keyframe::DO_IGNORE);
+			timeline.setRelativeTime(frame+1, kf->getPause());
+		}
 
-        if(!next)
-            break;
+		if (i > 0)
+			timeline.setRelativeTime(frame, segmentTime(keyframes, i-1, i));
 
-        QHash<QString, KeyframePlayerItem::AxisInfo>::iterator it;
-        for(it = current->joints.begin(); it != current->joints.end(); ++it)
-        {
-            double jointDistance = next->joints[it.key()].angle - it.value().angle;
-            it.value().velocity = (jointDistance == 0 || next->relativeTime == 0) ?
-                speedLimit : qAbs(jointDistance / next->relativeTime);
-        }
+		if (i < n-1)
+			timeline.setRelativeTime(nextFrame, segmentTime(keyframes, i, i+1));
+		else if (looped)
+			timeline.setRelativeTime(loopFrame, segmentTime(keyframes, i, 0));
 
-        current = next;
+		timeline.computeVelocities(speedLimit, frame-1, nextFrame-1);
 
-        if(current == head)
-            break;
-    }
+		if (i == 0 && looped)
+		{
+			timeline.setFrame(loopFrame, kf->jointAngles, kf->getOutputCommand());
+			timeline.setRelativeTime(loopFrame, segmentTime(keyframes, n-1, 0));
+			timeline.computeVelocities(speedLimit, loopFrame-1, loopFrame);
+		}
+	}
 
-	// Reset the current pointer for playing.
-	current = head;
+	return true;
+}
+
+/*
+ * Marks the keyframe that sent the signal for the next playTheseFrames() call.
+ */
+void KeyframePlayer::keyframeChanged()
+{
+	changedKeyframes.insert(sender());
+}
+
+/*
+ * A new keyframe might be allocated at the same address, so it has to be
+ * treated as changed.
+ */
+void KeyframePlayer::keyframeDestroyed(QObject* keyframe)
+{
+	changedKeyframes.insert(keyframe);
 }
 
 void KeyframePlayer::start()
 {
     // Start the timer.
-    QueryPerformanceCounter(&lastTime);
+    stepTimer.restart();
     timer.start((int)(1000.0 / MOTIONSAMPLERATE));
 }
 
@@ -236,29 +356,31 @@ void KeyframePlayer::start()
 void KeyframePlayer::step()
 {
 	// Advance the slider position by the time passed since the last iteration.
-	QueryPerformanceCounter(&tick);
-	double timePassed = ((double)tick.QuadPart - (double)lastTime.QuadPart) / (double)ticksPerSecond.QuadPart;
-	lastTime = tick;
+	double timePassed = stepTimer.nsecsElapsed() / 1e9;
+	stepTimer.restart();
 	//sliderPosition += 1.0/MOTIONSAMPLERATE;
 	sliderPosition += timePassed;
 
-	// Check if the next keyframe has been overshot and advance the "current" pointer if needed.
-	// The while loop covers the case when multiple keyframes have been stepped over in the last tick.
-	while (current->next && current->next->absoluteTime < sliderPosition)
-		current = current->next;
+	// Find the keyframe segment we are in. This also covers the case when
+	// multiple keyframes have been stepped over in the last tick.
+	current = timeline.seek(sliderPosition);
+	int next = current + 1;
 
 	// Check if the end of the motion sequence has been reached.
-	if (!current->next)
+	if (next == timeline.size())
 	{
-        txJointAngles = current->jointAngles();
+		txJointAngles = timeline.angles(current);
 
-        foreach (QString key, head->joints.keys())
-			txJointVelocities[key] = speedLimit;
+		for (int i = 0; i < JointVector::MAX_JOINTS; ++i)
+		{
+			if (timeline.contains(i))
+				txJointVelocities[i] = speedLimit;
+		}
 
 		if (looped)
 		{
-			sliderPosition = sliderPosition - current->absoluteTime;
-			current = head;
+			sliderPosition = sliderPosition - timeline.time(current);
+			current = 0;
 		}
 		else
 		{
@@ -270,27 +392,62 @@ void KeyframePlayer::step()
 	}
 	else
 	{
+		double relativeTime = timeline.relativeTime(next);
+
+		// The interpolation follows the one of the microcontroller.
+		JointVector interpolated;
+		if (interpolating)
+			interpolated = timeline.sample(sliderPosition);
+
 		// Calculate new target positions.
-		foreach (QString key, txJointAngles.keys())
+		for (int i = 0; i < JointVector::MAX_JOINTS; ++i)
 		{
-            double jointDistance = current->next->joints[key].angle - current->joints[key].angle;
+			if (!txJointAngles.contains(i))
+				continue;
+
+			double jointDistance = timeline.angle(next, i) - timeline.angle(current, i);
 			if (interpolating)
-                txJointAngles[key] = current->joints[key].angle + jointDistance * qMin(1.0, (sliderPosition - current->absoluteTime) / current->next->relativeTime);
+				txJointAngles[i] = interpolated.value(i);
 			else
-                txJointAngles[key] = current->next->joints[key].angle;
-            txJointVelocities[key] = (jointDistance == 0 || current->next->relativeTime == 0) ?
-                        speedLimit : txJointVelocityCorrectionFactors[key] * qAbs(jointDistance / (current->next->relativeTime + timeCorrection));
+				txJointAngles[i] = timeline.angle(next, i);
+			txJointVelocities[i] = (jointDistance == 0 || relativeTime == 0) ?
+				speedLimit : txJointVelocityCorrectionFactors.value(i) * qAbs(jointDistance / (relativeTime + timeCorrection));
 		}
 	}
 
 	emit motionOut(txJointAngles, txJointVelocities);
 }
 
+/*
+ * Takes over the interpolation and the joint limits of the robot
+ * configuration.
+ */
+void KeyframePlayer::setJointConfig(const JointInfo::ListPtr& config)
+{
+	timeline.setInterpolation(config->interpolation);
+	blending = (config->lookahead > 0);
+	profile.setJointConfig(*config);
+
+	// All segment times change, compile the timeline from scratch next time.
+	compiledKeyframes.clear();
+}
+
+/**
+ * The timeline of the last playTheseFrames() call. Copy it to keep it
+ * (copies are cheap, the data is shared).
+ */
+const Timeline& KeyframePlayer::playingList() const
+{
+    return timeline;
+}
+
 /**
- * @warning Returned pointer is only valid until next playTheseFrames() call!
+ * Predicted duration of the last playTheseFrames() call in seconds. If the
+ * motion is looped, this is one cycle including the way back to the first
+ * keyframe.
  */
-const KeyframePlayerItem* KeyframePlayer::playingList()
+double KeyframePlayer::cycleTime() const
 {
-    return head;
+    return timeline.duration();
 }
 
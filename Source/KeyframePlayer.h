@@ -11,40 +11,57 @@
 #define KEYFRAMEPLAYER_H_
 #include <QObject>
 #include <QList>
-#include <QHash>
+#include <QSet>
 #include <QString>
 #include <QPointer>
 #include <QTimer>
+#include <QElapsedTimer>
 
 #include "microcontroller/protocol.h"
 
-#include "KeyframePlayerItem.h"
+#include "Keyframe.h"
+#include "JointVector.h"
+#include "Timeline.h"
+#include "SpeedProfile.h"
 
 class KeyframePlayer : public QObject
 {
 	Q_OBJECT
 
-	KeyframePlayerItem* head;
-	KeyframePlayerItem* current;
+	Timeline timeline;
+	int current;
+	SpeedProfile profile;
+
+	// State of the last compiled timeline. Keyframes which changed since
+	// are patched into the timeline instead of rebuilding all of it.
+	QList<Keyframe*> compiledKeyframes;
+	QVector<int> keyframeFrames; // Timeline frame of each keyframe, plus the end
+	bool compiledLooped;
+	double compiledSpeedLimit;
+	QSet<QObject*> changedKeyframes;
 	double sliderPosition;
 	double speedLimit;
 	double timeCorrection;
 	double velocityAdaptionStrength;
+	bool blending; // Fly-by blends need the lookahead of the microcontroller
 
 	QTimer timer;
 
 	// Precise timer.
-	LARGE_INTEGER startTime;
-	LARGE_INTEGER lastTime;
-	LARGE_INTEGER ticksPerSecond;
-	LARGE_INTEGER tick;
+	QElapsedTimer stepTimer;
+
+	void compile(const QList< QPointer<Keyframe> >& keyframes);
+	bool patch(const QList< QPointer<Keyframe> >& keyframes);
+	double segmentTime(const QList< QPointer<Keyframe> >& keyframes, int from, int to) const;
+	int frameBlend(Keyframe* kf) const;
+	bool flyBy(const QList< QPointer<Keyframe> >& keyframes, int i) const;
 
 public:
 
-	QHash<QString, double> rxJointAngles;
-	QHash<QString, double> txJointAngles;
-	QHash<QString, double> txJointVelocities;
-	QHash<QString, double> txJointVelocityCorrectionFactors;
+	JointVector rxJointAngles;
+	JointVector txJointAngles;
+	JointVector txJointVelocities;
+	JointVector txJointVelocityCorrectionFactors;
 
 	bool looped;
 	bool interpolating;
@@ -57,19 +74,23 @@ public:
 	void stop();
 	bool isPlaying();
 
-    const KeyframePlayerItem* playingList();
+    const Timeline& playingList() const;
+    double cycleTime() const;
 
 public slots:
 	void setSpeedLimit(int sl);
-	void jointAnglesIn(QHash<QString, double>);
+	void jointAnglesIn(const JointVector&);
 	void setTimeCorrection(int cor);
+	void setJointConfig(const JointInfo::ListPtr& config);
 
 signals:
-	void motionOut(QHash<QString, double>, QHash<QString, double>);
+	void motionOut(const JointVector&, const JointVector&);
 	void finished();
 
 private slots:
 	void step();
+	void keyframeChanged();
+	void keyframeDestroyed(QObject* keyframe);
 };
 
 #endif /* KEYFRAMEPLAYER_H_ */
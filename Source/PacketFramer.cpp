@@ -0,0 +1,146 @@
+// Incremental packet framer for the extended C protocol
+
+#include "PacketFramer.h"
+
+PacketFramer::PacketFramer()
+{
+    reset();
+    resetCounters();
+}
+
+void PacketFramer::reset()
+{
+    m_start = m_read = m_write = 0;
+    m_state = PS_START;
+    m_size = 0;
+}
+
+void PacketFramer::resetCounters()
+{
+    memset(&m_counters, 0, sizeof(m_counters));
+}
+
+uint8_t* PacketFramer::writeBuffer(int* space)
+{
+    if(m_write - m_start == RING_SIZE)
+    {
+        // Cannot happen with valid packets, since RING_SIZE > MAX_PACKET_SIZE.
+        // Throw away the packet in progress.
+        m_counters.overflows += m_write - m_start;
+        m_start = m_read = m_write;
+        m_state = PS_START;
+    }
+
+    unsigned int idx = m_write & (RING_SIZE-1);
+    unsigned int free = RING_SIZE - (m_write - m_start);
+    unsigned int contiguous = RING_SIZE - idx;
+
+    *space = (free < contiguous) ? free : contiguous;
+    return m_ring + idx;
+}
+
+void PacketFramer::written(int length)
+{
+    if(length > 0)
+        m_write += length;
+}
+
+/*
+ * The current packet is invalid. Continue parsing after its start byte.
+ */
+void PacketFramer::resync()
+{
+    m_counters.resyncs++;
+    m_counters.droppedBytes++;
+
+    m_read = m_start + 1;
+    m_start = m_read;
+    m_state = PS_START;
+}
+
+void PacketFramer::idle()
+{
+    if(m_state != PS_START)
+        resync();
+}
+
+bool PacketFramer::poll()
+{
+    while(m_read != m_write)
+    {
+        uint8_t c = m_ring[m_read & (RING_SIZE-1)];
+        m_read++;
+
+        switch(m_state)
+        {
+            case PS_START:
+                if(c == 0xFF)
+                {
+                    m_start = m_read - 1;
+                    m_size = 0;
+                    m_packet[m_size++] = c;
+                    m_state = PS_VERSION;
+                }
+                else
+                {
+                    m_start = m_read;
+                    m_counters.droppedBytes++;
+                }
+                break;
+            case PS_VERSION:
+                if(c != proto::VERSION)
+                {
+                    resync();
+                    break;
+                }
+                m_packet[m_size++] = c;
+                m_state = PS_COMMAND;
+                break;
+            case PS_COMMAND:
+                if(c >= proto::CMD_COUNT)
+                {
+                    resync();
+                    break;
+                }
+                m_packet[m_size++] = c;
+                m_state = PS_LENGTH;
+                break;
+            case PS_LENGTH:
+                m_packet[m_size++] = c;
+                m_state = PS_SEQUENCE;
+                break;
+            case PS_SEQUENCE:
+                m_packet[m_size++] = c;
+                m_state = header().length ? PS_PAYLOAD : PS_CHECKSUM;
+                break;
+            case PS_PAYLOAD:
+                m_packet[m_size++] = c;
+                if(m_size == (int)sizeof(proto::PacketHeader) + header().length)
+                    m_state = PS_CHECKSUM;
+                break;
+            case PS_CHECKSUM:
+                if(c != proto::packetChecksum(header(), m_packet + sizeof(proto::PacketHeader)))
+                {
+                    m_counters.checksumErrors++;
+                    resync();
+                    break;
+                }
+                m_packet[m_size++] = c;
+                m_state = PS_END;
+                break;
+            case PS_END:
+                if(c != 0x0D)
+                {
+                    resync();
+                    break;
+                }
+                m_packet[m_size++] = c;
+                m_start = m_read;
+                m_state = PS_START;
+                m_counters.packets++;
+                return true;
+        }
+    }
+
+    return false;
+}
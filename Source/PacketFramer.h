@@ -0,0 +1,133 @@
+// Incremental packet framer for the extended C protocol
+
+#ifndef PACKETFRAMER_H
+#define PACKETFRAMER_H
+
+#include <string.h>
+
+#include "microcontroller/protocol.h"
+
+/**
+ * Splits the byte stream received from the C into packets.
+ *
+ * Bytes are read directly into a fixed receive ring (see writeBuffer()),
+ * so no memory is allocated after construction. The parser is the same
+ * state machine as on the C side (commands.cpp). If a packet turns out to
+ * be invalid, parsing restarts at the byte after its start byte, so a
+ * spurious 0xFF inside a payload cannot swallow the following packet.
+ *
+ * Usage:
+ *  int space;
+ *  uint8_t* buf = framer.writeBuffer(&space);
+ *  framer.written(serial.read(buf, space));
+ *  while(framer.poll())
+ *      handle(framer.packet(), framer.packetSize());
+ */
+class PacketFramer
+{
+public:
+    enum
+    {
+        RING_SIZE = 1024, //!< Must be a power of two
+        MAX_PACKET_SIZE = sizeof(proto::PacketHeader) + 255 + 2
+    };
+
+    struct Counters
+    {
+        uint32_t packets;        //!< Valid packets
+        uint32_t checksumErrors; //!< Packets with wrong checksum
+        uint32_t resyncs;        //!< Packet starts which turned out invalid
+        uint32_t droppedBytes;   //!< Bytes not belonging to a valid packet
+        uint32_t overflows;      //!< Bytes discarded because the ring was full
+    };
+
+    PacketFramer();
+
+    //! Discard all buffered data (e.g. after reconnecting)
+    void reset();
+
+    /**
+     * Get the contiguous free space in the receive ring.
+     *
+     * If the ring is full, the oldest bytes are discarded.
+     * @param space Receives the number of bytes which may be written
+     */
+    uint8_t* writeBuffer(int* space);
+
+    //! Mark @a length bytes returned by writeBuffer() as written
+    void written(int length);
+
+    /**
+     * Parse the received bytes.
+     *
+     * @return true if a complete packet is available. It stays valid until
+     *         the next call of poll().
+     */
+    bool poll();
+
+    /**
+     * Call if no data arrived for a while. The C sends packets in one go,
+     * so a packet in progress is considered invalid and parsing restarts
+     * after its start byte. Call poll() afterwards.
+     */
+    void idle();
+
+    inline const uint8_t* packet() const
+    { return m_packet; }
+
+    inline int packetSize() const
+    { return m_size; }
+
+    inline const proto::PacketHeader& header() const
+    { return *((const proto::PacketHeader*)m_packet); }
+
+    /**
+     * Copy the current packet into @a dest.
+     *
+     * @return false if command code or size do not match
+     */
+    template<class T>
+    bool packetAs(T* dest) const
+    {
+        if(m_size != (int)sizeof(T) || header().command != ((const proto::PacketHeader*)dest)->command)
+            return false;
+
+        memcpy(dest, m_packet, sizeof(T));
+        return true;
+    }
+
+    inline const Counters& counters() const
+    { return m_counters; }
+
+    void resetCounters();
+
+private:
+    enum State
+    {
+        PS_START,
+        PS_VERSION,
+        PS_COMMAND,
+        PS_LENGTH,
+        PS_SEQUENCE,
+        PS_PAYLOAD,
+        PS_CHECKSUM,
+        PS_END
+    };
+
+    void resync();
+
+    uint8_t m_ring[RING_SIZE];
+
+    // Free-running ring indices
+    unsigned int m_start; // First byte of the packet being parsed
+    unsigned int m_read;  // Next byte to parse
+    unsigned int m_write; // Next byte to write
+
+    State m_state;
+    uint8_t m_packet[MAX_PACKET_SIZE];
+    int m_size;
+
+    Counters m_counters;
+};
+
+#endif
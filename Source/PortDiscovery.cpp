@@ -0,0 +1,293 @@
+// Serial port discovery
+
+#include "PortDiscovery.h"
+
+#ifdef Q_OS_WIN
+#include "Serial.h"
+#else
+#include "SerialLinux.h"
+#endif
+
+#include "microcontroller/protocol.h"
+
+#include <QDir>
+#include <QRegExp>
+#include <QSettings>
+#include <QSocketNotifier>
+#include <QTimer>
+#include <QtDebug>
+
+#ifdef HAVE_UDEV
+#include <libudev.h>
+#endif
+
+PortDiscovery::PortDiscovery(QObject* parent)
+ : QObject(parent)
+ , m_goodPortTried(false)
+ , m_scanned(false)
+ , m_pollTimer(0)
+#ifdef HAVE_UDEV
+ , m_udev(0)
+ , m_monitor(0)
+ , m_notifier(0)
+#endif
+{
+    QSettings settings("igus", "MotionEditor");
+    m_goodPort = settings.value("robot/port").toString();
+}
+
+PortDiscovery::~PortDiscovery()
+{
+#ifdef HAVE_UDEV
+    delete m_notifier;
+
+    if(m_monitor)
+        udev_monitor_unref(m_monitor);
+    if(m_udev)
+        udev_unref(m_udev);
+#endif
+}
+
+void PortDiscovery::start()
+{
+    m_ports = availablePorts();
+
+#ifdef HAVE_UDEV
+    m_udev = udev_new();
+    if(m_udev)
+        m_monitor = udev_monitor_new_from_netlink(m_udev, "udev");
+
+    if(m_monitor
+        && udev_monitor_filter_add_match_subsystem_devtype(m_monitor, "tty", 0) == 0
+        && udev_monitor_enable_receiving(m_monitor) == 0)
+    {
+        m_notifier = new QSocketNotifier(udev_monitor_get_fd(m_monitor), QSocketNotifier::Read, this);
+        connect(m_notifier, SIGNAL(activated(int)), SLOT(handleUdevEvent()));
+        return;
+    }
+
+    qDebug() << "PortDiscovery: udev monitor not available, polling the port list";
+#endif
+
+    m_pollTimer = new QTimer(this);
+    connect(m_pollTimer, SIGNAL(timeout()), SLOT(updatePortList()));
+    m_pollTimer->start(POLL_INTERVAL);
+}
+
+QString PortDiscovery::find()
+{
+    // Newly plugged in
+    if(!m_added.isEmpty())
+    {
+        QStringList ports = m_added;
+        m_added.clear();
+
+        if(ports.size() == 1)
+            return ports.first();
+
+        QString port = probe(ports);
+        if(!port.isEmpty())
+            return port;
+    }
+
+    // Where the robot was the last time
+    if(!m_goodPort.isEmpty() && !m_goodPortTried)
+    {
+        m_goodPortTried = true;
+        return m_goodPort;
+    }
+
+    // Everything else
+    if(!m_scanned || m_scanTime.elapsed() > RESCAN_INTERVAL)
+    {
+        m_scanned = true;
+        m_scanTime.start();
+        return probe(availablePorts());
+    }
+
+    return QString();
+}
+
+void PortDiscovery::setGoodPort(const QString& port)
+{
+    if(port == m_goodPort)
+        return;
+
+    m_goodPort = port;
+    m_goodPortTried = true;
+
+    QSettings settings("igus", "MotionEditor");
+    settings.setValue("robot/port", port);
+}
+
+/**
+ * Send the status query of RobotInterface::handle_confirmConnection() to all
+ * @a ports at once and return the first one which answers.
+ **/
+QString PortDiscovery::probe(const QStringList& ports)
+{
+    // CMD_EXIT in case the µC is still in extended mode
+    proto::SimplePacket<proto::CMD_EXIT> exitPacket;
+    QByteArray request((const char*)&exitPacket, sizeof(exitPacket));
+    request += "#1ZP\r";
+
+    int count = qMin(ports.size(), (int)MAX_PORTS);
+    CSerial serial[MAX_PORTS];
+    QByteArray answer[MAX_PORTS];
+
+    for(int i = 0; i < count; ++i)
+    {
+        if(!serial[i].Open(ports[i]))
+            continue;
+
+        serial[i].Setup(CSerial::EBaud115200, CSerial::EData8, CSerial::EParNone, CSerial::EStop1);
+        serial[i].SetupHandshaking(CSerial::EHandshakeOff);
+        serial[i].SetMask(CSerial::EEventRecv);
+        serial[i].SetEventChar(0x0D);
+
+        if(serial[i].write(request.constData(), request.size()) != 0)
+            serial[i].close();
+    }
+
+    QRegExp rx("1ZP\\+\\d\\r");
+    QTime time;
+    time.start();
+
+    while(time.elapsed() < PROBE_TIMEOUT)
+    {
+        CSerial* waitPort = 0;
+
+        for(int i = 0; i < count; ++i)
+        {
+            if(!serial[i].isOpen())
+                continue;
+
+            char buf[64];
+            int ret = serial[i].read(buf, sizeof(buf));
+            if(ret < 0)
+            {
+                serial[i].close();
+                continue;
+            }
+
+            answer[i].append(buf, ret);
+            if(rx.indexIn(QString::fromAscii(answer[i].constData(), answer[i].size())) >= 0)
+                return ports[i];
+
+            if(!waitPort)
+                waitPort = &serial[i];
+        }
+
+        if(!waitPort)
+            break;
+
+        // Answers on the other ports are buffered in the meantime
+        waitPort->WaitEvent(PROBE_WAIT);
+    }
+
+    return QString();
+}
+
+void PortDiscovery::portAdded(const QString& port)
+{
+    if(!m_added.contains(port))
+        m_added << port;
+
+    if(port == m_goodPort)
+        m_goodPortTried = false;
+}
+
+/**
+ * Compare the port list with the one from the last call. Only used without
+ * udev.
+ **/
+void PortDiscovery::updatePortList()
+{
+    QStringList ports = availablePorts();
+    bool changed = false;
+
+    foreach(const QString& port, ports)
+    {
+        if(!m_ports.contains(port))
+        {
+            portAdded(port);
+            changed = true;
+        }
+    }
+
+    foreach(const QString& port, m_ports)
+    {
+        if(!ports.contains(port))
+        {
+            m_added.removeAll(port);
+            emit portRemoved(port);
+            changed = true;
+        }
+    }
+
+    m_ports = ports;
+
+    if(changed)
+        emit portsChanged();
+}
+
+void PortDiscovery::handleUdevEvent()
+{
+#ifdef HAVE_UDEV
+    struct udev_device* dev = udev_monitor_receive_device(m_monitor);
+    if(!dev)
+        return;
+
+    const char* action = udev_device_get_action(dev);
+    const char* node = udev_device_get_devnode(dev);
+
+    if(action && node)
+    {
+        QString port = QString::fromLocal8Bit(node);
+
+        // udev reports the device once its rules (e.g. permissions) are
+        // applied, so it can be opened right away.
+        if(qstrcmp(action, "add") == 0)
+        {
+            m_ports << port;
+            portAdded(port);
+            emit portsChanged();
+        }
+        else if(qstrcmp(action, "remove") == 0)
+        {
+            m_ports.removeAll(port);
+            m_added.removeAll(port);
+            emit portRemoved(port);
+            emit portsChanged();
+        }
+    }
+
+    udev_device_unref(dev);
+#endif
+}
+
+QStringList PortDiscovery::availablePorts()
+{
+    QStringList ports;
+
+#ifdef Q_OS_WIN
+    // All serial ports the drivers have registered, without opening them
+    QSettings registry("HKEY_LOCAL_MACHINE\\HARDWARE\\DEVICEMAP\\SERIALCOMM", QSettings::NativeFormat);
+    foreach(const QString& key, registry.allKeys())
+        ports << "\\\\.\\" + registry.value(key).toString();
+#else
+    // USB serial adapters (CP210x, FTDI) and CDC ACM devices
+    QDir dev("/dev");
+    QStringList filters;
+    filters << "ttyUSB*" << "ttyACM*";
+    foreach(const QString& name, dev.entryList(filters, QDir::System, QDir::Name))
+        ports << dev.absoluteFilePath(name);
+#endif
+
+    return ports;
+}
+
+QString PortDiscovery::displayName(const QString& port)
+{
+    return port.mid(port.lastIndexOf(QRegExp("[\\\\/]")) + 1);
+}
@@ -0,0 +1,101 @@
+// Serial port discovery
+
+#ifndef PORTDISCOVERY_H
+#define PORTDISCOVERY_H
+
+#include <QObject>
+#include <QStringList>
+#include <QTime>
+
+class QSocketNotifier;
+class QTimer;
+
+#ifdef HAVE_UDEV
+struct udev;
+struct udev_monitor;
+#endif
+
+/**
+ * Finds the serial port the robot is connected to.
+ *
+ * Instead of probing one port after the other, find() tries
+ *  1. ports which appeared since the last call (hotplug),
+ *  2. the last port a robot was found on (kept in the user settings),
+ *  3. all ports at once: the probe is written to every port and the
+ *     answers are collected together, so a full scan takes a single
+ *     round trip (at most PROBE_TIMEOUT).
+ *
+ * A single candidate is returned without probing, as the caller confirms
+ * the connection anyway. So after plugging in the robot, only one round
+ * trip is needed.
+ *
+ * Device add/remove events come from udev on Linux. Elsewhere (or without
+ * libudev) the port list is polled, which is cheap since the ports are
+ * only listed, not opened.
+ *
+ * The object must only be used from one thread, start() has to be called
+ * in this thread.
+ **/
+class PortDiscovery : public QObject
+{
+    Q_OBJECT
+public:
+    explicit PortDiscovery(QObject* parent = 0);
+    virtual ~PortDiscovery();
+
+    //! Start watching for added and removed ports
+    void start();
+
+    /**
+     * Next port to connect to.
+     *
+     * @return empty string if there is nothing to try right now
+     **/
+    QString find();
+
+    //! The robot was confirmed on @a port, try it first next time
+    void setGoodPort(const QString& port);
+
+    //! Serial ports present in the system. They are listed, not opened.
+    static QStringList availablePorts();
+
+    //! Short name for display, e.g. COM3 or ttyUSB0
+    static QString displayName(const QString& port);
+
+signals:
+    void portsChanged();
+    void portRemoved(const QString& port);
+
+private slots:
+    void updatePortList();
+    void handleUdevEvent();
+
+private:
+    enum
+    {
+        PROBE_TIMEOUT = 200,    // ms, like the answer timeout in RobotInterface::txrx()
+        PROBE_WAIT = 5,         // ms, sleep between checking the ports
+        POLL_INTERVAL = 500,    // ms, port list polling without udev
+        RESCAN_INTERVAL = 2000, // ms, full scan if nothing changed
+        MAX_PORTS = 64
+    };
+
+    QString probe(const QStringList& ports);
+    void portAdded(const QString& port);
+
+    QStringList m_ports;  // Ports present at the last check
+    QStringList m_added;  // Ports added since the last find()
+    QString m_goodPort;
+    bool m_goodPortTried;
+    bool m_scanned;
+    QTime m_scanTime;
+    QTimer* m_pollTimer;
+
+#ifdef HAVE_UDEV
+    struct udev* m_udev;
+    struct udev_monitor* m_monitor;
+    QSocketNotifier* m_notifier;
+#endif
+};
+
+#endif
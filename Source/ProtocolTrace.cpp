@@ -0,0 +1,166 @@
+// Binary trace of the serial protocol
+
+#include "ProtocolTrace.h"
+
+#include "microcontroller/protocol.h"
+
+#include <QtDebug>
+
+#include <string.h>
+
+// Positions in the ring are free running counters, their difference is
+// the fill level even after wrapping around.
+static inline quint32 position(QAtomicInt& counter)
+{
+    return (quint32)counter.fetchAndAddAcquire(0);
+}
+
+ProtocolTrace::ProtocolTrace()
+ : m_ring(0)
+ , m_open(false)
+ , m_head(0)
+ , m_tail(0)
+ , m_quit(0)
+ , m_dropped(0)
+{
+}
+
+ProtocolTrace::~ProtocolTrace()
+{
+    close();
+    delete[] m_ring;
+}
+
+bool ProtocolTrace::open(const QString& fileName)
+{
+    close();
+
+    m_file.setFileName(fileName);
+    if(!m_file.open(QFile::WriteOnly | QFile::Truncate))
+    {
+        qDebug() << "ProtocolTrace: could not open" << fileName;
+        return false;
+    }
+
+    trace::FileHeader header;
+    memcpy(header.magic, "IGTRACE", sizeof(header.magic));
+    header.version = trace::VERSION;
+    header.proto_version = proto::VERSION;
+    m_file.write((const char*)&header, sizeof(header));
+
+    if(!m_ring)
+        m_ring = new uint8_t[RING_SIZE];
+
+    m_head = 0;
+    m_tail = 0;
+    m_quit = 0;
+    m_dropped = 0;
+    m_timer.start();
+    m_open = true;
+
+    start(QThread::LowPriority);
+
+    return true;
+}
+
+void ProtocolTrace::close()
+{
+    if(!m_open)
+        return;
+
+    m_open = false;
+    m_quit.fetchAndStoreRelease(1);
+    wait();
+
+    m_file.close();
+}
+
+void ProtocolTrace::record(trace::RecordType type, const void* data, int length)
+{
+    if(!m_open)
+        return;
+
+    trace::RecordHeader header;
+    header.time = m_timer.nsecsElapsed();
+    header.reserved = 0;
+
+    if(m_dropped)
+    {
+        header.type = trace::REC_DROPPED;
+        header.length = sizeof(m_dropped);
+
+        if(!push(header, &m_dropped))
+        {
+            m_dropped++;
+            return;
+        }
+
+        m_dropped = 0;
+    }
+
+    header.type = type;
+    header.length = qMin(length, 0xFFFF);
+
+    if(!push(header, data))
+        m_dropped++;
+}
+
+bool ProtocolTrace::push(const trace::RecordHeader& header, const void* data)
+{
+    quint32 head = position(m_head);
+    quint32 size = sizeof(header) + header.length;
+
+    if(RING_SIZE - (head - position(m_tail)) < size)
+        return false;
+
+    copyIn(head, &header, sizeof(header));
+    copyIn(head + sizeof(header), data, header.length);
+
+    m_head.fetchAndStoreRelease(head + size);
+    return true;
+}
+
+void ProtocolTrace::copyIn(quint32 pos, const void* data, int length)
+{
+    quint32 idx = pos & (RING_SIZE-1);
+    int first = qMin<int>(length, RING_SIZE - idx);
+
+    if(first > 0)
+        memcpy(m_ring + idx, data, first);
+    if(length > first)
+        memcpy(m_ring, (const uint8_t*)data + first, length - first);
+}
+
+void ProtocolTrace::run()
+{
+    while(!m_quit.fetchAndAddAcquire(0))
+    {
+        drain();
+        msleep(FLUSH_INTERVAL);
+    }
+
+    drain();
+}
+
+/**
+ * Write everything recorded so far to the file.
+ */
+void ProtocolTrace::drain()
+{
+    quint32 head = position(m_head);
+    quint32 tail = position(m_tail);
+
+    if(head == tail)
+        return;
+
+    quint32 idx = tail & (RING_SIZE-1);
+    quint32 length = head - tail;
+    quint32 first = qMin<quint32>(length, RING_SIZE - idx);
+
+    m_file.write((const char*)m_ring + idx, first);
+    if(first < length)
+        m_file.write((const char*)m_ring, length - first);
+    m_file.flush();
+
+    m_tail.fetchAndStoreRelease(head);
+}
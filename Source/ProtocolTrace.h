@@ -0,0 +1,101 @@
+// Binary trace of the serial protocol
+
+#ifndef PROTOCOLTRACE_H
+#define PROTOCOLTRACE_H
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QThread>
+
+#include <stdint.h>
+
+namespace trace
+{
+
+//! File format version, stored in FileHeader
+const uint32_t VERSION = 1;
+
+enum RecordType
+{
+    REC_OPEN     = 0, //!< Port opened, payload: port name
+    REC_TX_EXT   = 1, //!< Extended packet sent
+    REC_RX_EXT   = 2, //!< Extended packet received (when parsed)
+    REC_TX_PLAIN = 3, //!< Plain text command sent
+    REC_RX_PLAIN = 4, //!< Plain text answer received
+    REC_DROPPED  = 5  //!< Records lost since the ring was full, payload: uint32_t count
+};
+
+/**
+ * Start of the trace file, followed by the records. Each record is a
+ * RecordHeader followed by @a length payload bytes, without padding.
+ * Multi-byte values are little endian (the byte order of the PC).
+ **/
+struct FileHeader
+{
+    char magic[8];          //!< "IGTRACE\0"
+    uint32_t version;       //!< trace::VERSION
+    uint32_t proto_version; //!< proto::VERSION
+} __attribute__((packed));
+
+struct RecordHeader
+{
+    uint64_t time;   //!< ns since the trace was opened
+    uint8_t type;    //!< RecordType
+    uint8_t reserved;
+    uint16_t length; //!< Payload bytes following the header
+} __attribute__((packed));
+
+}
+
+/**
+ * Records the frames sent to and received from the µC with a timestamp.
+ *
+ * record() copies the frame into a ring allocated by open() and never
+ * blocks, so the trace can stay enabled during time-critical exchanges.
+ * A background thread writes the ring to the trace file every
+ * FLUSH_INTERVAL ms. If it cannot keep up, records are dropped and a
+ * REC_DROPPED record tells how many.
+ *
+ * record() has to be called from a single thread. The file is decoded
+ * offline with the tracedecoder tool.
+ **/
+class ProtocolTrace : public QThread
+{
+public:
+    ProtocolTrace();
+    virtual ~ProtocolTrace();
+
+    //! Create @a fileName and start the writer thread
+    bool open(const QString& fileName);
+
+    //! Write the remaining records and close the file
+    void close();
+
+    void record(trace::RecordType type, const void* data, int length);
+
+protected:
+    virtual void run();
+
+private:
+    enum
+    {
+        RING_SIZE = 1 << 20, //!< Must be a power of two
+        FLUSH_INTERVAL = 100 //!< ms
+    };
+
+    bool push(const trace::RecordHeader& header, const void* data);
+    void copyIn(quint32 pos, const void* data, int length);
+    void drain();
+
+    uint8_t* m_ring;
+    bool m_open;
+    QAtomicInt m_head; //!< Written by record()
+    QAtomicInt m_tail; //!< Written by the writer thread
+    QAtomicInt m_quit;
+    quint32 m_dropped;
+    QElapsedTimer m_timer;
+    QFile m_file;
+};
+
+#endif
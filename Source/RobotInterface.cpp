@@ -24,18 +24,17 @@
  *  Author: Marcell Missura, missura@ais.uni-bonn.de
  */
 
-#include <QHash>
-#include <QHashIterator>
 #include <QString>
 #include <QFile>
 #include <QTextStream>
 #include <QtDebug>
 #include <QByteArray>
+#include <QtAlgorithms>
 #include "RobotInterface.h"
 #include "Keyframe.h"
 #include "globals.h"
 #include "microcontroller/protocol.h"
-#include "KeyframePlayerItem.h"
+#include "Timeline.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -53,16 +52,46 @@
  * To accelerate motion commands and feedback, they are combined
  * into a single C packet for all joints in handle_extendedMode().
  *
+ * Motion commands and feedback do not travel through the event queue.
+ * motionIn() runs in the GUI thread and stores the command in a
+ * TripleBuffer, handle_extendedMode() picks up the newest one at the
+ * start of each cycle. Feedback goes the other way through a second
+ * TripleBuffer; the RobotFeedbackRelay emits motionOut() in the GUI
+ * thread and at most one delivery is queued at any time. So bursts of
+ * slider or joystick events and a slow GUI only skip intermediate
+ * values instead of piling them up.
+ *
  * TODO: Use proper QThread model. This means communication happens
  * only via signals/slots and the thread has its own event loop.
  * We can do away with mutexes and stuff like that.
  */
 
+// Transmission time of one byte at 115200 baud, 8N1 (s)
+static const double LINK_BYTE_TIME = 10.0 / 115200;
+
+RobotFeedbackRelay::RobotFeedbackRelay(RobotInterface* robot)
+ : m_robot(robot)
+{
+}
+
+void RobotFeedbackRelay::deliver()
+{
+    // Clear the flag before fetching. Feedback published after this
+    // point queues another deliver() call.
+    m_robot->m_feedbackPending.fetchAndStoreOrdered(0);
+
+    if(!m_robot->m_feedbackMailbox.fetch())
+        return;
+
+    const RobotInterface::MotionFeedback& fb = m_robot->m_feedbackMailbox.readBuffer();
+    emit motionOut(fb.angles, fb.velocities);
+}
+
 RobotInterface::RobotInterface()
  : m_isExtendedMode(false)
  , txOutputCommand(proto::OC_NOP)
+ , m_feedbackRelay(this)
 {
-	portNumber = 2; // The default port.
 	timeoutTicksLeft = TIMEOUT;
 
     robotIsConnected = false;
@@ -74,25 +103,57 @@ RobotInterface::RobotInterface()
     requestedComplianceMode = complianceMode = noCompliance;
     m_isExtendedMode = false;
     m_isPlaying = false;
-
-	// Log and high precision tick counters for debugging.
-	QueryPerformanceFrequency(&ticksPerSecond);
-	QueryPerformanceCounter(&startTime);
-	QueryPerformanceCounter(&lastTime);
+    m_isStreaming = false;
+    m_streamPos = 0;
+    m_streamLoop = false;
+
+    m_numPending = 0;
+    m_numFeedback = 0;
+    m_sequence = 0;
+
+    m_sessionKnown = false;
+    m_resumeSession = false;
+    m_resumeCompliance = noCompliance;
+
+    m_subscribedPeriod = 0;
+    m_pushValid = false;
+    m_pushSequence = -1;
+    m_pushCount = 0;
+    m_pushLost = 0;
+
+    setCommRate(SERIALCOMRATE);
+    m_commDeadline = 0;
+    m_commExchanges = 0;
+    m_commMissed = 0;
+    m_commPushed = false;
+    m_commTimer.start();
+    m_commStatsTimer.start();
+
+	// Log for debugging.
 	logfile.setFileName("data.log");
 	logfile.open(QFile::WriteOnly | QFile::Truncate);
 	log.setDevice(&logfile);
+    m_trace.open("data.trace");
 
 	encoderPosition = 0;
     motorPosition = 0;
 
     m_noFeedbackCounter = 0;
 
+    // Moves to this thread together with us
+    m_discovery = new PortDiscovery(this);
+    connect(m_discovery, SIGNAL(portRemoved(QString)), SLOT(portRemoved(QString)));
+
     // Execute step() function as often as possible
     QTimer* timer = new QTimer(this);
     connect(timer, SIGNAL(timeout()), SLOT(step()));
     timer->start(0);
 
+    // The relay is no child of ours, so it stays in the GUI thread
+    connect(this, SIGNAL(feedbackAvailable()), &m_feedbackRelay, SLOT(deliver()));
+    connect(&m_feedbackRelay, SIGNAL(motionOut(JointVector, JointVector)),
+        this, SIGNAL(motionOut(JointVector, JointVector)), Qt::DirectConnection);
+
     // Slots should be executed in this thread
     moveToThread(this);
 
@@ -106,6 +167,7 @@ RobotInterface::~RobotInterface()
 	wait();
 	serial.close();
 	logfile.close();
+    m_trace.close();
 }
 
 // Sets the speed limit for the joints.
@@ -116,19 +178,28 @@ void RobotInterface::setSpeedLimit(int sl)
 }
 
 /*
- * Sets the serial port identifier to something.
- * It closes the current port and it will try to
- * automatically reconnect to the new port.
+ * Closes the current port. The next step() asks the port discovery
+ * where to look for the robot.
  */
-void RobotInterface::setPortNumber(int pn)
+void RobotInterface::closePort()
 {
-	portNumber = pn;
 	serial.close();
 
 	if (robotIsConnected)
 		disconnectRobot();
+}
+
+/*
+ * A serial port was unplugged. Close it right away if it is ours instead
+ * of waiting for a write to fail.
+ */
+void RobotInterface::portRemoved(const QString& port)
+{
+    if (!serial.isOpen() || port != m_portName)
+        return;
 
-	//emit message("Searching for a robot on " + port->portName() + ".");
+    emit message("Port " + PortDiscovery::displayName(m_portName) + " disconnected.");
+    closePort();
 }
 
 /*
@@ -148,35 +219,27 @@ void RobotInterface::setComplianceMode(int cm)
     if(cm == requestedComplianceMode)
         return;
 
+    if(isPlaying())
+        emit message("The compliance mode changes when the playback has stopped.");
+
     requestedComplianceMode = (ComplianceMode)cm;
 }
 
 /*
  * Sets the joint angles and velocities that are sent to the robot from now on.
- * This function is guarding the joint angle and velocity limits by truncating values that are too high or too low.
+ * This runs in the caller's thread and only stores the command, a newer command
+ * replaces it if the communication loop did not pick it up yet. See applyMotionCommand().
  */
-void RobotInterface::motionIn(QHash<QString, double> angles, QHash<QString, double> velocities, int outputCommand)
+void RobotInterface::motionIn(const JointVector& angles, const JointVector& velocities, int outputCommand)
 {
-	QHashIterator<QString, double> i(rxJointAngles);
-	while (i.hasNext())
-	{
-		i.next();
-        const MotorData& m = m_motors[i.key()];
-		if (angles.contains(i.key()))
-            txJointAngles[i.key()] = qBound(
-                m.joint.lower_limit,
-                angles[i.key()],
-                m.joint.upper_limit
-            );
-		if (velocities.contains(i.key()))
-            txJointVelocities[i.key()] = qBound(
-                0.0, qAbs(velocities[i.key()]), SERVOSPEEDMAX
-            );
-	}
-    txOutputCommand = outputCommand;
+    MotionCommand& cmd = m_commandMailbox.writeBuffer();
+    cmd.angles = angles;
+    cmd.velocities = velocities;
+    cmd.outputCommand = outputCommand;
+    m_commandMailbox.publish();
 }
 
-void RobotInterface::motionIn(QHash<QString, double> angles, QHash<QString, double> velocities)
+void RobotInterface::motionIn(const JointVector& angles, const JointVector& velocities)
 {
     motionIn(angles, velocities, proto::OC_NOP);
 }
@@ -186,13 +249,9 @@ void RobotInterface::motionIn(QHash<QString, double> angles, QHash<QString, doub
  */
 void RobotInterface::stopRobot()
 {
-	QHashIterator<QString, double> i(rxJointAngles);
-	while (i.hasNext())
-	{
-		i.next();
-		txJointAngles[i.key()] = rxJointAngles[i.key()];
-		txJointVelocities[i.key()] = 0.0;
-    }
+	txJointAngles = rxJointAngles;
+	txJointVelocities = rxJointAngles;
+	txJointVelocities.fill(0.0);
 }
 
 /*
@@ -208,15 +267,19 @@ bool RobotInterface::isRobotConnected()
  */
 void RobotInterface::disconnectRobot()
 {
+    // Pick up where we left off if the same C session shows up again
+    m_resumeSession = robotIsInitialized && m_sessionKnown;
+    m_resumeCompliance = complianceMode;
+
 	if (complianceMode == hardwareCompliance)
 	{
         complianceMode = noCompliance;
 	}
 
-    QHash<QString, MotorData>::iterator it;
+    QVector<MotorData>::iterator it;
     for(it = m_motors.begin(); it != m_motors.end(); ++it)
     {
-        MotorData* m = &it.value();
+        MotorData* m = it;
         m->isReset = false;
         m->isInitialized = false;
         m->isHWCompliant = false;
@@ -254,10 +317,10 @@ void RobotInterface::initializeRobot()
 
     complianceMode = noCompliance; // TODO: Check if this is true
 
-    QHash<QString, MotorData>::iterator it;
+    QVector<MotorData>::iterator it;
     for(it = m_motors.begin(); it != m_motors.end(); ++it)
     {
-        MotorData* m = &it.value();
+        MotorData* m = it;
         m->isReset = false;
         m->isInitialized = false;
     }
@@ -298,7 +361,7 @@ inline int kf_output_cmd_to_proto(int cmd)
  * different actions are taken (e.g. playback of the sequence, or save to
  * EEPROM)
  */
-void RobotInterface::transferKeyframes(const KeyframePlayerItem *head, int cmd)
+void RobotInterface::transferKeyframes(const Timeline& timeline, int cmd)
 {
     QList<proto::Keyframe> frames;
     m_stopPlaying = false;
@@ -307,52 +370,25 @@ void RobotInterface::transferKeyframes(const KeyframePlayerItem *head, int cmd)
 
     // Build the keyframe list
     // Push initial state (first keyframe)
-    if(head)
-    {
-        proto::Keyframe init;
-        init.duration = 0;
-        init.output_command = kf_output_cmd_to_proto(head->outputCommand);
-
-        QHash<QString, KeyframePlayerItem::AxisInfo>::const_iterator it;
-        for(it = head->joints.begin(); it != head->joints.end(); ++it)
-        {
-            if(!m_motors.contains(it.key()))
-                continue;
-
-            const MotorData& m = m_motors[it.key()];
-
-            int idx = m.joint.address - 1;
-            double sgn = m.joint.invert ? -1 : 1;
-            init.ticks[idx] = qRound((sgn * it.value().angle + m.joint.offset) / m.joint.enc_to_rad) + proto::NT_POSITION_BIAS;
-        }
-
-        frames.push_back(init);
-    }
-
-    for(; head; head = head->next)
+    // The first frame is the initial state, its duration is zero.
+    for(int frame = 0; frame < timeline.size(); ++frame)
     {
-        QHash<QString, KeyframePlayerItem::AxisInfo>::const_iterator it;
-
-        const KeyframePlayerItem* next = head->next;
-
-        if(!next || next == head)
-            break;
-
         proto::Keyframe cmd;
+        memset(&cmd, 0, sizeof(cmd));
 
-        cmd.duration = next->relativeTime * 1000;
-        cmd.output_command = kf_output_cmd_to_proto(next->outputCommand);
+        cmd.duration = timeline.relativeTime(frame) * 1000;
+        cmd.output_command = kf_output_cmd_to_proto(timeline.outputCommand(frame));
+        cmd.blend = timeline.blend(frame);
 
-        for(it = next->joints.begin(); it != next->joints.end(); ++it)
+        for(int idx = 0; idx < m_motors.size(); ++idx)
         {
-            if(!m_motors.contains(it.key()))
+            if(!timeline.contains(idx))
                 continue;
 
-            const MotorData& m = m_motors[it.key()];
+            const MotorData& m = m_motors.at(idx);
 
-            int idx = m.joint.address - 1;
             double sgn = m.joint.invert ? -1 : 1;
-            cmd.ticks[idx] = qRound((sgn * it.value().angle + m.joint.offset) / m.joint.enc_to_rad) + proto::NT_POSITION_BIAS;
+            cmd.ticks[idx] = qRound((sgn * timeline.angle(frame, idx) + m.joint.offset) / m.joint.enc_to_rad) + proto::NT_POSITION_BIAS;
         }
 
         frames.append(cmd);
@@ -362,45 +398,76 @@ void RobotInterface::transferKeyframes(const KeyframePlayerItem *head, int cmd)
     foreach(const proto::Keyframe& kf, frames)
     {
         log << "KEYFRAME\n";
-        log << "  duration: " << kf.duration << "output: " << kf.output_command << '\n';
+        log << "  duration: " << kf.duration << "output: " << kf.output_command << " blend: " << (int)kf.blend << '\n';
         for(int i = 0; i < 4; ++i)
             log << i << " " << kf.ticks[i] << '\n';
     }
 
     // Everything prepared, begin flash process
 
-    if(!extSendConfig(frames.length()))
+    // Sequences which do not fit into the keyframe buffer are streamed
+    // while playing.
+    bool stream = frames.length() > proto::MAX_KEYFRAMES;
+    if(stream && cmd == KC_COMMIT)
     {
+        emit message(tr("The motion has %1 keyframes, only %2 can be stored on the microcontroller")
+            .arg(frames.length()).arg(proto::MAX_KEYFRAMES)
+        );
         emit keyframeTransferFinished(false);
         return;
     }
 
-    for(int i = 0; i < frames.length(); ++i)
+    if(stream)
     {
-        const proto::Keyframe keyframe = frames[i];
-        proto::Packet<proto::CMD_SAVE_KEYFRAME, proto::SaveKeyframe> packet;
+        if(!extSendConfig(0))
+        {
+            emit keyframeTransferFinished(false);
+            return;
+        }
 
-        packet.payload.index = i;
-        packet.payload.keyframe = keyframe;
+        m_streamFrames = frames;
+        m_streamPos = 0;
+        m_streamLoop = (cmd == KC_LOOP);
 
-        packet.updateChecksum();
-        if(!extChat(packet, proto::SimplePacket<proto::CMD_SAVE_KEYFRAME>()))
+        if(!extStreamFill(proto::MAX_KEYFRAMES))
         {
-            emit message(tr("Could not save keyframe %1").arg(i));
+            emit message(tr("Could not stream keyframes"));
             emit keyframeTransferFinished(false);
             return;
         }
     }
+    else if(!extUploadSequence(frames))
+    {
+        emit keyframeTransferFinished(false);
+        return;
+    }
 
     switch(cmd)
     {
         case KC_COMMIT:
-            if(!extChat(proto::SimplePacket<proto::CMD_COMMIT>(), proto::SimplePacket<proto::CMD_COMMIT>()))
+        {
+            proto::Packet<proto::CMD_COMMIT, proto::ConfigStatus> answer;
+            if(!extCommand(proto::SimplePacket<proto::CMD_COMMIT>(), &answer))
+            {
+                emit message(tr("Could not write to EEPROM"));
+                emit keyframeTransferFinished(false);
+                return;
+            }
+
+            if(answer.payload.result == proto::CR_BUSY)
+            {
+                emit message(tr("Could not write to EEPROM: the microcontroller is playing"));
+                emit keyframeTransferFinished(false);
+                return;
+            }
+
+            if(!extWaitCommit())
             {
                 emit message(tr("Could not write to EEPROM"));
                 emit keyframeTransferFinished(false);
                 return;
             }
+        }
             break;
        case KC_PLAY:
        case KC_LOOP:
@@ -408,6 +475,8 @@ void RobotInterface::transferKeyframes(const KeyframePlayerItem *head, int cmd)
             play.payload.flags = 0;
             if(cmd == KC_LOOP)
                 play.payload.flags |= proto::PF_LOOP;
+            if(stream)
+                play.payload.flags |= proto::PF_STREAM;
 
             play.updateChecksum();
 
@@ -420,17 +489,83 @@ void RobotInterface::transferKeyframes(const KeyframePlayerItem *head, int cmd)
 
             emit playbackStarted();
             m_isPlaying = true;
+            m_isStreaming = stream;
             break;
     }
 
+    // The checksums changed
+    extReadSession();
+
     emit keyframeTransferFinished(true);
 }
 
-bool RobotInterface::extSendConfig(int num_frames)
+/*
+ * Send up to max_frames keyframes of m_streamFrames with CMD_STREAM.
+ *
+ * Stream index 0 is the start keyframe. Without looping, the stream ends
+ * with the second-to-last frame, since the last frame only returns to the
+ * start position. When looping, frames 1..n-1 are repeated forever.
+ * Returns false on communication errors.
+ */
+bool RobotInterface::extStreamFill(int max_frames)
+{
+    int num_frames = m_streamFrames.length();
+    int last = num_frames - 2;
+
+    while(max_frames > 0)
+    {
+        // Send a batch of keyframes without waiting for the answers
+        uint8_t sequence[KEYFRAME_PIPELINE];
+        int count = 0;
+        int pos = m_streamPos;
+
+        for(; count < KEYFRAME_PIPELINE && count < max_frames; ++count, ++pos)
+        {
+            if(!m_streamLoop && pos > last)
+                break;
+
+            int frame = pos;
+            if(m_streamLoop && pos != 0)
+                frame = 1 + (pos - 1) % (num_frames - 1);
+
+            proto::Packet<proto::CMD_STREAM, proto::StreamKeyframe> packet;
+            packet.payload.index = pos & 0xFFFF;
+            packet.payload.flags = 0;
+            if(!m_streamLoop && pos == last)
+                packet.payload.flags |= proto::SKF_LAST;
+            packet.payload.keyframe = m_streamFrames[frame];
+            packet.updateChecksum();
+
+            if(!extSend(packet, &sequence[count]))
+                return false;
+        }
+
+        if(count == 0)
+            return true;
+
+        proto::Packet<proto::CMD_STREAM, proto::StreamStatus> status;
+        for(int i = 0; i < count; ++i)
+        {
+            if(!extReceive(sequence[i], &status))
+                return false;
+        }
+
+        // Continue where the C wants us to (e.g. if keyframes were rejected)
+        m_streamPos += (qint16)(status.payload.next_index - (quint16)m_streamPos);
+        max_frames -= count;
+
+        if(m_streamPos != pos || status.payload.free == 0)
+            break;
+    }
+
+    return true;
+}
+
+bool RobotInterface::extBuildConfig(int num_frames, proto::Config* config)
 {
     // Find the number of axes
     int num_axes = 0;
-    foreach(const MotorData& m, m_motors.values())
+    foreach(const MotorData& m, m_motors)
     {
         if(m.joint.address > num_axes)
             num_axes = m.joint.address;
@@ -442,31 +577,246 @@ bool RobotInterface::extSendConfig(int num_frames)
         return false;
     }
 
-    proto::Packet<proto::CMD_CONFIG, proto::Config> configPacket;
-    configPacket.payload.active_axes = num_axes;
-    configPacket.payload.num_keyframes = num_frames; // TODO: error message if too large
-    configPacket.payload.lookahead = m_lookahead;
+    // Unused entries need to be defined for the CRC comparison
+    memset(config, 0, sizeof(proto::Config));
+
+    config->active_axes = num_axes;
+    config->num_keyframes = num_frames; // TODO: error message if too large
+    config->lookahead = m_lookahead;
+    config->interpolation = m_interpolation;
+    config->layout = proto::CONFIG_LAYOUT;
 
-    foreach(const MotorData& m, m_motors.values())
+    foreach(const MotorData& m, m_motors)
     {
-        configPacket.payload.enc_to_mot[m.joint.address-1] = 256.0 * m.joint.enc_to_rad / m.joint.mot_to_rad;
-        log << "enc_to_mot for " << m.joint.name << ": " << configPacket.payload.enc_to_mot[m.joint.address-1];
+        config->enc_to_mot[m.joint.address-1] = 256.0 * m.joint.enc_to_rad / m.joint.mot_to_rad;
+        config->hold_current[m.joint.address-1] = qBound(0, qRound(m.joint.hold_current), 100);
+        config->max_current[m.joint.address-1] = qBound(0, qRound(m.joint.max_current), 100);
+        log << "enc_to_mot for " << m.joint.name << ": " << config->enc_to_mot[m.joint.address-1];
     }
 
+    return true;
+}
+
+/*
+ * The C refuses a new configuration while it is playing or writing to the
+ * EEPROM. In the latter case, wait for the write and try once more.
+ */
+bool RobotInterface::extSendConfig(int num_frames)
+{
+    proto::Packet<proto::CMD_CONFIG, proto::Config> configPacket;
+
+    if(!extBuildConfig(num_frames, &configPacket.payload))
+        return false;
+
     configPacket.updateChecksum();
 
-    if(!extChat(configPacket, proto::SimplePacket<proto::CMD_CONFIG>()))
+    proto::Packet<proto::CMD_CONFIG, proto::ConfigStatus> answer;
+    for(int attempt = 0; attempt < 2; ++attempt)
+    {
+        if(!extCommand(configPacket, &answer))
+        {
+            emit message("Could not write configuration");
+            return false;
+        }
+
+        if(answer.payload.result != proto::CR_BUSY)
+            break;
+
+        if(!extWaitCommit())
+            return false;
+    }
+
+    switch(answer.payload.result)
+    {
+        case proto::CR_OK:
+            return true;
+        case proto::CR_BUSY:
+            emit message("Could not write configuration: the microcontroller is busy");
+            return false;
+        default:
+            emit message("Could not write configuration: rejected by the microcontroller");
+            return false;
+    }
+}
+
+/*
+ * CMD_COMMIT only starts the EEPROM write, the C continues it in the
+ * background. Poll the progress until it is finished.
+ */
+bool RobotInterface::extWaitCommit()
+{
+    QTime time;
+    time.start();
+
+    int lastRemaining = -1;
+
+    while(time.elapsed() < COMMIT_TIMEOUT)
     {
-        emit message("Could not write configuration");
+        proto::Packet<proto::CMD_COMMIT_STATUS, proto::CommitStatus> status;
+        if(!extCommand(proto::SimplePacket<proto::CMD_COMMIT_STATUS>(), &status))
+            return false;
+
+        if(!status.payload.busy)
+            return true;
+
+        if(status.payload.remaining != lastRemaining)
+        {
+            emit message(tr("Writing to EEPROM: %1 of %2 remaining")
+                .arg((int)status.payload.remaining).arg((int)status.payload.total)
+            );
+            lastRemaining = status.payload.remaining;
+        }
+
+        msleep(COMMIT_POLL);
+    }
+
+    emit message(tr("Timeout while writing to EEPROM"));
+    return false;
+}
+
+/*
+ * Bring configuration and keyframe buffer on the C up to date.
+ *
+ * Compares the checksums reported by CMD_CRC with the local data and
+ * uploads only what differs. Changed keyframe blocks are sent with
+ * CMD_SAVE_KEYFRAMES, KEYFRAME_PIPELINE/2 packets in flight (they are
+ * larger than the other packets).
+ */
+bool RobotInterface::extUploadSequence(const QList<proto::Keyframe>& frames)
+{
+    proto::Config config;
+    if(!extBuildConfig(frames.length(), &config))
+        return false;
+
+    proto::Packet<proto::CMD_CRC, proto::SequenceCrc> crc;
+    if(!extCommand(proto::SimplePacket<proto::CMD_CRC>(), &crc))
+    {
+        emit message(tr("Could not read sequence checksum"));
         return false;
     }
 
+    if(crc.payload.config != proto::crcUpdate(0xFFFF, &config, sizeof(config)))
+    {
+        if(!extSendConfig(frames.length()))
+            return false;
+
+        // The keyframe checksums depend on num_keyframes
+        if(!extCommand(proto::SimplePacket<proto::CMD_CRC>(), &crc))
+        {
+            emit message(tr("Could not read sequence checksum"));
+            return false;
+        }
+    }
+
+    const int BULK_PIPELINE = KEYFRAME_PIPELINE / 2;
+    uint8_t sequence[BULK_PIPELINE];
+    int uploaded = 0;
+
+    // The C refuses keyframes while it is writing to the EEPROM. In that
+    // case, wait for the write and upload the remaining blocks once more.
+    for(int attempt = 0; attempt < 2; ++attempt)
+    {
+        int inFlight = 0;
+        bool busy = false;
+        bool rejected = false;
+
+        for(int block = 0; block < proto::CRC_BLOCKS; ++block)
+        {
+            int start = block * proto::KEYFRAMES_PER_PACKET;
+            int count = qBound(0, frames.length() - start, (int)proto::KEYFRAMES_PER_PACKET);
+
+            if(count == 0)
+                break;
+
+            proto::Packet<proto::CMD_SAVE_KEYFRAMES, proto::SaveKeyframes> packet;
+            memset(&packet.payload, 0, sizeof(packet.payload));
+            packet.payload.index = start;
+            packet.payload.count = count;
+            for(int i = 0; i < count; ++i)
+                packet.payload.keyframes[i] = frames[start + i];
+
+            uint16_t local = proto::crcUpdate(0xFFFF, packet.payload.keyframes, count * sizeof(proto::Keyframe));
+            if(local == crc.payload.blocks[block])
+                continue;
+
+            if(inFlight == BULK_PIPELINE)
+            {
+                proto::Packet<proto::CMD_SAVE_KEYFRAMES, proto::ConfigStatus> answer;
+                if(!extReceive(sequence[0], &answer))
+                {
+                    emit message(tr("Could not save keyframes"));
+                    return false;
+                }
+
+                if(answer.payload.result == proto::CR_BUSY)
+                    busy = true;
+                else if(answer.payload.result != proto::CR_OK)
+                    rejected = true;
+
+                memmove(sequence, sequence + 1, --inFlight);
+            }
+
+            packet.updateChecksum();
+            if(!extSend(packet, &sequence[inFlight++]))
+            {
+                emit message(tr("Could not save keyframes"));
+                return false;
+            }
+
+            uploaded += count;
+        }
+
+        for(int i = 0; i < inFlight; ++i)
+        {
+            proto::Packet<proto::CMD_SAVE_KEYFRAMES, proto::ConfigStatus> answer;
+            if(!extReceive(sequence[i], &answer))
+            {
+                emit message(tr("Could not save keyframes"));
+                return false;
+            }
+
+            if(answer.payload.result == proto::CR_BUSY)
+                busy = true;
+            else if(answer.payload.result != proto::CR_OK)
+                rejected = true;
+        }
+
+        if(rejected)
+        {
+            emit message(tr("Could not save keyframes: rejected by the microcontroller"));
+            return false;
+        }
+
+        if(!busy)
+            break;
+
+        if(attempt == 1)
+        {
+            emit message(tr("Could not save keyframes: the microcontroller is busy"));
+            return false;
+        }
+
+        if(!extWaitCommit())
+            return false;
+
+        // Only the refused blocks differ now
+        if(!extCommand(proto::SimplePacket<proto::CMD_CRC>(), &crc))
+        {
+            emit message(tr("Could not read sequence checksum"));
+            return false;
+        }
+    }
+
+    log << "Uploaded " << uploaded << " of " << frames.length() << " keyframes\n";
+
     return true;
 }
 
 void RobotInterface::setJointConfig(const JointInfo::ListPtr &config)
 {
+    // JointConfiguration ensures the addresses are 1..n
     m_motors.clear();
+    m_motors.resize(config->size());
     rxJointAngles.clear();
 
     foreach(const JointInfo& joint, *config)
@@ -477,14 +827,16 @@ void RobotInterface::setJointConfig(const JointInfo::ListPtr &config)
         m.isInitialized = false;
         m.isHWCompliant = false;
 
-        m_motors[joint.name] = m;
+        m_motors[joint.address-1] = m;
 
         // Initialize joint angles
-        rxJointAngles[joint.name] = 0.0;
+        rxJointAngles[joint.address-1] = 0.0;
     }
 
-    txJointAngles = txJointVelocities = rxJointAngles;
+    txJointAngles = txJointVelocities = rxJointVelocities = rxJointAngles;
+    m_estimator.reset(m_motors.size());
     m_lookahead = config->lookahead;
+    m_interpolation = config->interpolation;
 }
 
 bool RobotInterface::isPlaying()
@@ -509,6 +861,8 @@ void RobotInterface::stopPlaying()
  */
 QString RobotInterface::txrx(QString command)
 {
+    m_trace.record(trace::REC_TX_PLAIN, command.toAscii().constData(), command.length());
+
     int bytesWritten = serial.write((void*)command.toAscii().constData(), command.length());
     command.replace("\r", "\\r");
     //qDebug() << "Command:" << command.left(command.length()) << bytesWritten << " bytes sent";
@@ -519,7 +873,7 @@ QString RobotInterface::txrx(QString command)
         // Close the broken port.
         if (serial.isOpen())
         {
-            emit message("Port COM" + QString::number(portNumber) + " disconnected.");
+            emit message("Port " + PortDiscovery::displayName(m_portName) + " disconnected.");
             serial.close();
         }
 
@@ -533,12 +887,13 @@ QString RobotInterface::txrx(QString command)
     memset(receiveBuffer, 0, BUFFER_SIZE);
     serial.WaitEvent(200);
     int bytesRead = serial.read(receiveBuffer, BUFFER_SIZE);
+    if (bytesRead > 0)
+        m_trace.record(trace::REC_RX_PLAIN, receiveBuffer, bytesRead);
+
     QString response = QString::fromAscii(receiveBuffer, bytesRead);
     response.replace("\r", "\\r");
     //qDebug() << "Response:" << bytesRead << response;
 
-    log << "Plain cmd: '" << command << "' -> '" << response << '\n';
-
 //    if(bytesRead >= 1)
 //        qDebug() << "Dec:" << (int)response[response.length()-1].toAscii();
 
@@ -567,21 +922,6 @@ QString RobotInterface::txrx(QString command)
     return response;
 }
 
-bool RobotInterface::pollRegister(QString reg)
-{
-    bool ok = false;
-    QString response = txrx("#" + reg + "\r");
-    QRegExp rx = QRegExp(reg + "([+-]?\\d+)");
-    if (rx.indexIn(response) != -1)
-    {
-        int ticks = rx.cap(1).toInt(&ok);
-        if (ok)
-            registerValue = ticks;
-    }
-
-    return ok;
-}
-
 bool RobotInterface::pollPiggyBackRegister(QString reg)
 {
     bool ok = false;
@@ -601,108 +941,360 @@ bool RobotInterface::pollPiggyBackRegister(QString reg)
 }
 
 /**
- * Write an extended command to serial port and save the answer.
+ * Write an extended command to serial port without waiting for the answer.
  *
- * Usage:
- *  proto::SimplePacket<proto::CMD_EXIT> cmd, response;
- *  extCommand(serial, cmd, &response);
+ * The command gets the next sequence number, which is needed to retrieve
+ * the answer with extReceive(). Answers can be retrieved in any order.
  *
- * @return false if there was an error (e.g. checksum mismatch)
+ * @return false if too many commands are in flight
  */
-template<class Cmd, class Answer>
-bool RobotInterface::extCommand(const Cmd& cmd, Answer* answer)
+template<class Cmd>
+bool RobotInterface::extSend(const Cmd& cmd, uint8_t* sequence)
 {
-    log << "Extended cmd:";
-    for(size_t i = 0; i < sizeof(cmd); ++i)
-        log << ' ' << QString::number(((uint8_t*)&cmd)[i], 16).rightJustified(2, '0');
-    log << " -> ";
-
-    unsigned char* buf = (unsigned char*)malloc(sizeof(Answer));
-    unsigned char* readptr = buf;
-    int remsize = sizeof(Answer);
-
-    serial.write((void*)&cmd, sizeof(cmd));
-
-    int counter = 0;
-
-    while(remsize > 0)
+    if(m_numPending == MAX_PENDING)
     {
-        if(++counter > 10)
-        {
-            log << "timeout\n";
-            return false;
-        }
-
-        int ret = serial.read(readptr, remsize);
-        if(ret == 0)
-        {
-            serial.WaitEvent(50);
-            continue;
-        }
-        if(ret <= 0)
-        {
-            log << "read error " << ret << '\n';
-            return false;
-        }
-
-        for(size_t i = 0; i < ret; ++i)
-            log << ' ' << QString::number(((uint8_t*)readptr)[i], 16).rightJustified(2, '0');
+        log << "Extended cmd " << (int)cmd.header.command << ": too many commands in flight\n";
+        return false;
+    }
 
-        remsize -= ret;
-        readptr += ret;
+    Cmd packet = cmd;
+    packet.header.sequence = m_sequence++;
+    packet.checksum = packet.currentChecksum();
 
-        // Adjust beginning
-        if(readptr - buf < 4)
-            continue;
+    PendingRequest& req = m_pending[m_numPending++];
+    req.sequence = packet.header.sequence;
+    req.command = packet.header.command;
+    req.answered = false;
+    req.sentAt = m_commTimer.nsecsElapsed();
+    req.size = 0;
 
-        // We know the answer begins with the command header, so
-        // look for it (in a stupid way, I know)
-        int i = 0;
-        while(memcmp(&cmd, buf, 3) != 0)
-        {
-            ++i;
-            if(i == readptr - buf)
-                break;
-        }
+    if(sequence)
+        *sequence = req.sequence;
 
-        if(i != 0)
+    m_trace.record(trace::REC_TX_EXT, &packet, sizeof(packet));
+    if(serial.write((void*)&packet, sizeof(packet)) != 0)
+    {
+        // Broken port, like in txrx()
+        m_numPending--;
+        if(serial.isOpen())
         {
-            memmove(buf, buf + i, sizeof(Answer) - i);
-            remsize += i;
-            readptr -= i;
+            emit message("Port " + PortDiscovery::displayName(m_portName) + " disconnected.");
+            closePort();
         }
-    }
-
-    memcpy(answer, buf, sizeof(Answer));
-    log << "corrected:";
-    for(size_t i = 0; i < sizeof(Answer); ++i)
-        log << ' ' << QString::number(((uint8_t*)answer)[i], 16).rightJustified(2, '0');
-
-    if(answer->currentChecksum() != answer->checksum)
-    {
-        log << "checksum mismatch, should be 0x" << QString::number(answer->currentChecksum(), 16) << '\n';
         return false;
     }
 
-    log << '\n';
-
     return true;
 }
 
 /**
- * Write an extended command to serial port and expect a fixed answer.
+ * Wait for the answer to the command with the given sequence number.
  *
- * @return false if the answer did not match or another error occured.
+ * @return false on timeout, lost answer or size mismatch
  */
-template<class Cmd, class Answer>
-bool RobotInterface::extChat(const Cmd& cmd, const Answer& expectedReply)
+template<class Answer>
+bool RobotInterface::extReceive(uint8_t sequence, Answer* answer)
+{
+    return extWaitAnswer(sequence, answer, sizeof(Answer));
+}
+
+/**
+ * Write an extended command to serial port and save the answer.
+ *
+ * Usage:
+ *  proto::SimplePacket<proto::CMD_EXIT> cmd, response;
+ *  extCommand(serial, cmd, &response);
+ *
+ * Other commands may be in flight, their answers are kept for extReceive().
+ *
+ * @return false if there was an error (e.g. timeout)
+ */
+template<class Cmd, class Answer>
+bool RobotInterface::extCommand(const Cmd& cmd, Answer* answer)
+{
+    uint8_t sequence;
+    if(!extSend(cmd, &sequence))
+        return false;
+
+    return extReceive(sequence, answer);
+}
+
+/**
+ * Send a command and return the answer of the command sent
+ * FEEDBACK_PIPELINE-1 calls earlier. This keeps the link busy while the C
+ * executes the commands, at the price of a slightly older answer.
+ *
+ * @param received Set to false while the pipeline is filling up
+ * @return false if there was an error
+ */
+template<class Cmd, class Answer>
+bool RobotInterface::extPipelined(const Cmd& cmd, Answer* answer, bool* received)
+{
+    *received = false;
+
+    if(!extSend(cmd, &m_feedbackSequence[m_numFeedback]))
+        return false;
+
+    if(++m_numFeedback < FEEDBACK_PIPELINE)
+        return true;
+
+    uint8_t sequence = m_feedbackSequence[0];
+    m_numFeedback--;
+    memmove(m_feedbackSequence, m_feedbackSequence + 1, m_numFeedback);
+
+    if(!extReceive(sequence, answer))
+        return false;
+
+    *received = true;
+    return true;
+}
+
+/**
+ * Handle a packet received by the framer.
+ */
+void RobotInterface::extDispatch()
+{
+    const proto::PacketHeader& header = m_framer.header();
+
+    m_trace.record(trace::REC_RX_EXT, m_framer.packet(), m_framer.packetSize());
+
+    // Pushed feedback, keep only the latest packet
+    if(header.command == proto::CMD_SUBSCRIBE && m_framer.packetAs(&m_pushed))
+    {
+        if(m_pushSequence >= 0)
+            m_pushLost += (uint8_t)(header.sequence - m_pushSequence - 1);
+
+        m_pushSequence = header.sequence;
+        m_pushCount++;
+        m_pushValid = true;
+        return;
+    }
+
+    int idx = -1;
+    for(int i = 0; i < m_numPending; ++i)
+    {
+        if(m_pending[i].sequence == header.sequence && !m_pending[i].answered)
+        {
+            idx = i;
+            break;
+        }
+    }
+
+    if(idx < 0 || m_pending[idx].command != header.command)
+    {
+        // Probably the late answer to a command which timed out
+        log << "Unexpected answer " << (int)header.command << " seq " << (int)header.sequence
+            << " (" << m_framer.packetSize() << " bytes)\n";
+        return;
+    }
+
+    PendingRequest& req = m_pending[idx];
+    req.answered = true;
+    req.size = m_framer.packetSize();
+    memcpy(req.answer, m_framer.packet(), req.size);
+
+    if(req.command == proto::CMD_MOTION)
+        m_commRtt.append((m_commTimer.nsecsElapsed() - req.sentAt) / 1000);
+
+    // The C answers in order, so all unanswered commands sent before
+    // this one are lost.
+    for(int i = 0; i < m_numPending; )
+    {
+        if(!m_pending[i].answered && (int8_t)(m_pending[i].sequence - header.sequence) < 0)
+        {
+            log << "Answer to cmd " << (int)m_pending[i].command << " seq " << (int)m_pending[i].sequence << " lost\n";
+            m_pending[i] = m_pending[--m_numPending];
+        }
+        else
+            ++i;
+    }
+}
+
+/**
+ * Wait until the answer with the given sequence number has arrived and
+ * copy it to @a answer.
+ */
+bool RobotInterface::extWaitAnswer(uint8_t sequence, void* answer, int size)
+{
+    int counter = 0;
+
+    while(true)
+    {
+        while(m_framer.poll())
+            extDispatch();
+
+        int idx = -1;
+        for(int i = 0; i < m_numPending; ++i)
+        {
+            if(m_pending[i].sequence == sequence)
+            {
+                idx = i;
+                break;
+            }
+        }
+
+        if(idx < 0)
+            return false;
+
+        if(m_pending[idx].answered || counter == 10)
+        {
+            PendingRequest& req = m_pending[idx];
+            bool ok = req.answered && req.size == size;
+
+            if(ok)
+                memcpy(answer, req.answer, size);
+            else if(req.answered)
+                log << "Extended cmd " << (int)req.command << ": answer has " << req.size << " bytes, expected " << size << '\n';
+            else
+            {
+                const PacketFramer::Counters& c = m_framer.counters();
+                log << "Extended cmd " << (int)req.command << ": timeout (checksum errors: "
+                    << c.checksumErrors << ", resyncs: " << c.resyncs << ", dropped bytes: " << c.droppedBytes << ")\n";
+            }
+
+            m_pending[idx] = m_pending[--m_numPending];
+            return ok;
+        }
+
+        if(!extRead(&counter))
+            return false;
+    }
+}
+
+/**
+ * Read available data from the serial port into the framer. If there is
+ * none, wait up to 50ms and increment @a idleCounter.
+ *
+ * @return false on read errors
+ */
+bool RobotInterface::extRead(int* idleCounter)
+{
+    int space;
+    uint8_t* buf = m_framer.writeBuffer(&space);
+
+    int ret = serial.read(buf, space);
+    if(ret < 0)
+    {
+        log << "read error " << ret << '\n';
+        return false;
+    }
+    if(ret == 0)
+    {
+        // A packet cannot be interrupted by a pause this long
+        if((*idleCounter)++ != 0)
+            m_framer.idle();
+
+        serial.WaitEvent(50);
+        return true;
+    }
+
+    m_framer.written(ret);
+    return true;
+}
+
+/**
+ * Subscribe to feedback packets pushed by the C every @a period ms
+ * (0 = unsubscribe). The subscription is renewed regularly, as the C
+ * drops it after proto::SUBSCRIBE_TIMEOUT.
+ */
+bool RobotInterface::extSubscribe(int period)
+{
+    if(period == m_subscribedPeriod && (period == 0 || m_subscribeTime.elapsed() < SUBSCRIBE_RENEW))
+        return true;
+
+    if(period != 0)
+    {
+        // Collect the answers of pipelined commands, the pushed packets
+        // replace them.
+        proto::Packet<proto::CMD_FEEDBACK, proto::Feedback> answer;
+        while(m_numFeedback != 0)
+        {
+            if(!extReceive(m_feedbackSequence[--m_numFeedback], &answer))
+                return false;
+        }
+    }
+
+    proto::Packet<proto::CMD_SUBSCRIBE, proto::Subscribe> packet;
+    packet.payload.period = period;
+    packet.updateChecksum();
+
+    if(!extChat(packet, proto::SimplePacket<proto::CMD_SUBSCRIBE>()))
+        return false;
+
+    if(period != m_subscribedPeriod)
+    {
+        m_pushValid = false;
+        m_pushSequence = -1;
+    }
+
+    m_subscribedPeriod = period;
+    m_subscribeTime.start();
+
+    return true;
+}
+
+/**
+ * Wait for the next feedback packet pushed by the C.
+ *
+ * @return false on timeout
+ */
+bool RobotInterface::extWaitPush(proto::Feedback* feedback)
+{
+    int counter = 0;
+
+    while(counter < 10)
+    {
+        while(m_framer.poll())
+            extDispatch();
+
+        if(m_pushValid)
+        {
+            *feedback = m_pushed.payload;
+            m_pushValid = false;
+            return true;
+        }
+
+        if(!extRead(&counter))
+            return false;
+    }
+
+    log << "No pushed feedback (" << m_pushCount << " received, " << m_pushLost << " lost)\n";
+    return false;
+}
+
+/**
+ * Forget all commands in flight (e.g. after reconnecting).
+ */
+void RobotInterface::extResetPipeline()
+{
+    m_numPending = 0;
+    m_numFeedback = 0;
+    m_sequence = 0;
+    m_subscribedPeriod = 0;
+    m_pushValid = false;
+    m_framer.reset();
+    m_commRtt.clear();
+}
+
+/**
+ * Write an extended command to serial port and expect a fixed answer.
+ *
+ * @return false if the answer did not match or another error occured.
+ */
+template<class Cmd, class Answer>
+bool RobotInterface::extChat(const Cmd& cmd, const Answer& expectedReply)
 {
     Answer answer;
 
     if(!extCommand(cmd, &answer))
         return false;
 
-    return memcmp(&expectedReply, &answer, sizeof(Answer)) == 0;
+    // The sequence number is not known in advance
+    Answer expected = expectedReply;
+    expected.header.sequence = answer.header.sequence;
+    expected.checksum = expected.currentChecksum();
+
+    return memcmp(&expected, &answer, sizeof(Answer)) == 0;
 }
 
 /**
@@ -710,7 +1302,11 @@ bool RobotInterface::extChat(const Cmd& cmd, const Answer& expectedReply)
  */
 bool RobotInterface::extDisable()
 {
-    return extChat(proto::SimplePacket<proto::CMD_EXIT>(), proto::SimplePacket<proto::CMD_EXIT>());
+    bool ok = extChat(proto::SimplePacket<proto::CMD_EXIT>(), proto::SimplePacket<proto::CMD_EXIT>());
+
+    extResetPipeline();
+
+    return ok;
 }
 
 /**
@@ -718,7 +1314,118 @@ bool RobotInterface::extDisable()
  */
 bool RobotInterface::extEnable()
 {
-    return extChat(proto::SimplePacket<proto::CMD_INIT>(), proto::SimplePacket<proto::CMD_INIT>());
+    // The C recognizes CMD_INIT only with sequence number 0
+    extResetPipeline();
+
+    return extReadSession();
+}
+
+/**
+ * Update the cached session information (see proto::Session). In extended
+ * mode, CMD_INIT does nothing else.
+ */
+bool RobotInterface::extReadSession()
+{
+    proto::Packet<proto::CMD_INIT, proto::Session> answer;
+    if(!extCommand(proto::SimplePacket<proto::CMD_INIT>(), &answer))
+        return false;
+
+    m_session = answer.payload;
+    m_sessionKnown = true;
+    return true;
+}
+
+/**
+ * Query the state and encoder position of all motors with a single
+ * CMD_AXES exchange. If @a setState is not proto::AXIS_KEEP_STATE, the C
+ * first switches the motors which are in state @a ifState to it.
+ *
+ * Enters the extended mode if necessary. Returns false if the C is
+ * playing. The extended mode stays active then, the caller tries again
+ * on the next step().
+ */
+bool RobotInterface::extAxes(uint8_t setState, uint8_t ifState, proto::AxisStatus* status)
+{
+    if(!m_isExtendedMode)
+    {
+        if(!extEnable())
+            return false;
+
+        m_isExtendedMode = true;
+    }
+
+    proto::Packet<proto::CMD_AXES, proto::AxisCommand> cmd;
+    cmd.payload.axes = 0;
+    for(int i = 0; i < m_motors.size(); ++i)
+        cmd.payload.axes |= 1 << (m_motors.at(i).joint.address-1);
+    cmd.payload.set_state = setState;
+    cmd.payload.if_state = ifState;
+    cmd.updateChecksum();
+
+    proto::Packet<proto::CMD_AXES, proto::AxisStatus> answer;
+    if(!extCommand(cmd, &answer))
+    {
+        m_isExtendedMode = false;
+        return false;
+    }
+
+    // The control loop owns the bus during playback
+    for(int i = 0; i < m_motors.size(); ++i)
+    {
+        if(answer.payload.state[m_motors.at(i).joint.address-1] == proto::AXIS_STATE_BUSY)
+            return false;
+    }
+
+    *status = answer.payload;
+    return true;
+}
+
+/**
+ * Read the control loop statistics of the last playback and write them
+ * to the log.
+ */
+void RobotInterface::extLogStats()
+{
+    proto::Packet<proto::CMD_STATS, proto::Stats> stats;
+
+    if(!extCommand(proto::SimplePacket<proto::CMD_STATS>(), &stats))
+    {
+        log << "Could not read playback statistics\n";
+        return;
+    }
+
+    const proto::Stats& s = stats.payload;
+
+    log << "Playback statistics:\n";
+    log << "  control cycle: nominal " << s.cycle_period << "us, min " << s.cycle_min
+        << "us, max " << s.cycle_max << "us (" << s.cycles << " cycles)\n";
+
+    log << "  jitter histogram:";
+    for(int i = 0; i < proto::STATS_HISTOGRAM_BINS; ++i)
+    {
+        if(i < proto::STATS_HISTOGRAM_BINS-1)
+            log << " <" << proto::STATS_HISTOGRAM_LIMITS[i] << "us: " << s.histogram[i];
+        else
+            log << " more: " << s.histogram[i];
+    }
+    log << '\n';
+
+    log << "  missed slots: " << s.missed_slots << ", max slot delay " << s.slot_delay_max
+        << "us, max sample age " << s.sample_age_max << "us\n";
+    log << "  bus: " << s.bus_transactions << " transactions, " << s.bus_timeouts << " timeouts, "
+        << s.bus_errors << " errors, latency min/avg/max " << s.bus_latency_min << '/'
+        << s.bus_latency_avg << '/' << s.bus_latency_max << "us\n";
+
+    const PacketFramer::Counters& c = m_framer.counters();
+    log << "  PC link: " << c.packets << " packets, " << c.checksumErrors << " checksum errors, "
+        << c.resyncs << " resyncs, " << c.droppedBytes << " dropped bytes\n";
+    log << "  pushed feedback: " << m_pushCount << " packets, " << m_pushLost << " lost\n";
+    log << "  GUI handoff: " << m_commandMailbox.overwritten() << " motion commands coalesced, "
+        << m_feedbackMailbox.overwritten() << " feedback updates dropped\n";
+    log.flush();
+
+    emit message(QString("Control cycle %1us (min %2us, max %3us), %4 missed slots")
+        .arg(s.cycle_period).arg(s.cycle_min).arg(s.cycle_max).arg(s.missed_slots));
 }
 
 /**
@@ -733,7 +1440,8 @@ void RobotInterface::handle_confirmConnection()
     QRegExp rx = QRegExp(".*1ZP\\+\\d$");
     if (rx.exactMatch(response))
     {
-        qDebug() << "Found robot";
+        qDebug() << "Found robot on" << m_portName;
+        m_discovery->setGoodPort(m_portName);
         robotIsConnected = true;
         emit robotConnectionChanged(true);
         emit robotConnected();
@@ -743,10 +1451,81 @@ void RobotInterface::handle_confirmConnection()
     {
         if(!response.isEmpty())
             qDebug() << response;
-        setPortNumber((portNumber+1) % PORTCYCLE);
+        closePort();
     }
 }
 
+/**
+ * Continue the session which was interrupted by a link drop (e.g. a USB
+ * glitch), instead of connecting and checking the initialization again.
+ *
+ * CMD_INIT enters the extended mode and reports the C session. If the
+ * C was not reset in the meantime, nobody changed the sequence and all
+ * motors are still initialized, this single exchange restores the state
+ * from before the drop. Otherwise the next step() connects from scratch.
+ */
+void RobotInterface::handle_resume()
+{
+    m_resumeSession = false;
+
+    proto::Session last = m_session;
+    if(!extEnable())
+        return;
+
+    const proto::Session& now = m_session;
+    bool playing = (now.flags & proto::FF_PLAYING);
+
+    bool same = (now.id == last.id && now.config_crc == last.config_crc);
+
+    // Streaming playback changes the keyframe buffer
+    if(!playing && now.sequence_crc != last.sequence_crc)
+        same = false;
+
+    foreach(const MotorData& m, m_motors)
+    {
+        if(!(now.ready & (1 << (m.joint.address-1))))
+            same = false;
+    }
+
+    if(!same)
+    {
+        log << "Session changed, reconnecting\n";
+        return;
+    }
+
+    qDebug() << "Resumed session on" << m_portName;
+    m_discovery->setGoodPort(m_portName);
+
+    QVector<MotorData>::iterator it;
+    for(it = m_motors.begin(); it != m_motors.end(); ++it)
+    {
+        MotorData* m = it;
+        m->isInitialized = true;
+        m->isHWCompliant = (m_resumeCompliance == hardwareCompliance);
+    }
+
+    robotIsConnected = true;
+    robotIsInitialized = true;
+    doCheckInitialization = false;
+    doInitialize = false;
+    m_isExtendedMode = true;
+
+    requestedComplianceMode = complianceMode = m_resumeCompliance;
+
+    m_isPlaying = playing;
+    if(!playing)
+    {
+        m_isStreaming = false;
+        m_streamFrames.clear();
+    }
+
+    emit robotConnectionChanged(true);
+    emit robotConnected();
+    emit robotInitialized();
+    emit complianceChanged(complianceMode);
+    emit message("ROBOT reconnected.");
+}
+
 /**
  * Make sure the robot is in P0 state (non-initialized) before starting the initialization process.
  */
@@ -754,25 +1533,20 @@ void RobotInterface::handle_robotReset()
 {
     // If the software was closed, but the robot was not turned off,
     // then it's still in P2 (initialized). We have to manually reset.
-    // And make sure that the robot received the commands.
+    // The C resets all motors and reports their state in one exchange.
+    proto::AxisStatus status;
+    if(!extAxes(proto::AXIS_STATE_RESET, proto::AXIS_ANY_STATE, &status))
+        return;
 
     bool isReset = true;
 
-    QHash<QString, MotorData>::iterator it;
+    QVector<MotorData>::iterator it;
     for(it = m_motors.begin(); it != m_motors.end(); ++it)
     {
-        MotorData* m = &it.value();
-        int a = m->joint.address;
-
-        if(m->isReset)
-            continue;
+        MotorData* m = it;
 
-        if(txrx(QString("#%1P0\r").arg(a)
-                ).endsWith(QString("%1P0").arg(a)))
-        {
-            m->isReset = true;
-        }
-        else
+        m->isReset = (status.state[m->joint.address-1] == proto::AXIS_STATE_RESET);
+        if(!m->isReset)
             isReset = false;
     }
 
@@ -788,20 +1562,19 @@ void RobotInterface::handle_robotReset()
  */
 void RobotInterface::handle_checkInitialization()
 {
+    proto::AxisStatus status;
+    if(!extAxes(proto::AXIS_KEEP_STATE, proto::AXIS_ANY_STATE, &status))
+        return;
+
     bool isInitialized = true;
 
-    QHash<QString, MotorData>::iterator it;
+    QVector<MotorData>::iterator it;
     for(it = m_motors.begin(); it != m_motors.end(); ++it)
     {
-        MotorData* m = &it.value();
-
-        if(m->isInitialized)
-            continue;
+        MotorData* m = it;
 
-        QString response = txrx(QString("#%1ZP\r").arg(m->joint.address));
-        if(response.endsWith(QString("%1ZP+2").arg(m->joint.address)))
-            m->isInitialized = true;
-        else
+        m->isInitialized = (status.state[m->joint.address-1] == proto::AXIS_STATE_IDLE);
+        if(!m->isInitialized)
             isInitialized = false;
     }
 
@@ -810,19 +1583,8 @@ void RobotInterface::handle_checkInitialization()
         robotIsInitialized = true;
         doInitialize = false;
 
-        // Collect a first set of encoder and motor feedback so that the tensions are initialized with 0.
-        QHash<QString, MotorData>::iterator it;
-        for(it = m_motors.begin(); it != m_motors.end(); ++it)
-        {
-            const MotorData& m = it.value();
-
-            if(pollRegister(QString("%1I").arg(m.joint.address)))
-                rxJointAngles[it.key()] = (registerValue * m.joint.enc_to_rad) - m.joint.offset;
-        }
-
-        lastRxJointAngles = rxJointAngles;
+        takeInitialPositions(status);
 
-        QueryPerformanceCounter(&lastTime);
         emit robotInitialized();
         emit message("ROBOT is already initialized.");
     }
@@ -831,31 +1593,26 @@ void RobotInterface::handle_checkInitialization()
 }
 
 /**
- * Check with a status request if the servos are initialized
- * and send out an initialization request where needed.
+ * Start the center search on all motors which are not initialized yet
+ * and check with a status request whether all of them are done.
  */
 void RobotInterface::handle_initialize()
 {
+    // Motors in P0 are switched to P1 (search), the others keep their state
+    proto::AxisStatus status;
+    if(!extAxes(proto::AXIS_STATE_SEARCH, proto::AXIS_STATE_RESET, &status))
+        return;
+
     bool isInitialized = true;
 
-    QHash<QString, MotorData>::iterator it;
+    QVector<MotorData>::iterator it;
     for(it = m_motors.begin(); it != m_motors.end(); ++it)
     {
-        MotorData* m = &it.value();
-
-        if(m->isInitialized)
-            continue;
+        MotorData* m = it;
 
-        QString response = txrx(QString("#%1ZP\r").arg(m->joint.address));
-        if(response.endsWith(QString("%1ZP+2").arg(m->joint.address)))
-            m->isInitialized = true;
-        else
-        {
-            qDebug() << response;
+        m->isInitialized = (status.state[m->joint.address-1] == proto::AXIS_STATE_IDLE);
+        if(!m->isInitialized)
             isInitialized = false;
-            if(response.endsWith(QString("%1ZP+0").arg(m->joint.address)))
-                txrx(QString("#%1P1\r").arg(m->joint.address));
-        }
     }
 
     if (isInitialized)
@@ -863,43 +1620,191 @@ void RobotInterface::handle_initialize()
         robotIsInitialized = true;
         doInitialize = false;
 
-        // Collect a first set of encoder and motor feedback so that the tensions are initialized with 0.
-        QHash<QString, MotorData>::iterator it;
-        for(it = m_motors.begin(); it != m_motors.end(); ++it)
-        {
-            const MotorData& m = it.value();
+        takeInitialPositions(status);
+
+        emit robotInitialized();
+        emit message("Initialization complete. ROBOT is ready for your command.");
+
+        if(extSendConfig(0) && extReadSession())
+            m_isPlaying = false;
+        else
+            m_isExtendedMode = false;
+    }
+}
+
+/**
+ * Collect a first set of encoder feedback from a CMD_AXES answer, so that
+ * the feedback velocities start at 0.
+ */
+void RobotInterface::takeInitialPositions(const proto::AxisStatus& status)
+{
+    for(int i = 0; i < m_motors.size(); ++i)
+    {
+        const MotorData& m = m_motors.at(i);
+        double sgn = m.joint.invert ? -1 : 1;
+        int ticks = status.positions[m.joint.address-1];
+
+        if(ticks != 0x7FFF)
+            rxJointAngles[i] = sgn * (ticks * m.joint.enc_to_rad - m.joint.offset);
+    }
+
+    m_estimator.reset(m_motors.size());
+}
+
+/*
+ * Takes over the latest command from motionIn(), if there is a new one.
+ * This function is guarding the joint angle and velocity limits by truncating values that are too high or too low.
+ */
+void RobotInterface::applyMotionCommand()
+{
+    if(!m_commandMailbox.fetch())
+        return;
+
+    const MotionCommand& cmd = m_commandMailbox.readBuffer();
+
+	for (int i = 0; i < m_motors.size(); ++i)
+	{
+        const MotorData& m = m_motors.at(i);
+		if (cmd.angles.contains(i))
+            txJointAngles[i] = qBound(
+                m.joint.lower_limit,
+                cmd.angles[i],
+                m.joint.upper_limit
+            );
+		if (cmd.velocities.contains(i))
+            txJointVelocities[i] = qBound(
+                0.0, qAbs(cmd.velocities[i]), SERVOSPEEDMAX
+            );
+	}
+    txOutputCommand = cmd.outputCommand;
+}
+
+/*
+ * Hands the received joint angles and velocities to the GUI thread. Only one
+ * delivery is queued at a time, it always takes the latest feedback.
+ */
+void RobotInterface::publishFeedback()
+{
+    MotionFeedback& fb = m_feedbackMailbox.writeBuffer();
+    fb.angles = rxJointAngles;
+    fb.velocities = rxJointVelocities;
+    m_feedbackMailbox.publish();
+
+    if(m_feedbackPending.testAndSetOrdered(0, 1))
+        emit feedbackAvailable();
+}
 
-            if(pollRegister(QString("%1I").arg(m.joint.address)))
-                rxJointAngles[it.key()] = (registerValue * m.joint.enc_to_rad) - m.joint.offset;
+/**
+ * Run extended mode exchanges back to back until LOOP_SLICE ms have passed,
+ * then return to the event loop for queued slot calls (motion commands do
+ * not need it, see motionIn()).
+ *
+ * Exchanges with motion commands are paced by the link, or by the target
+ * rate if the link is faster (see setCommRate()). An exchange finishing
+ * after its deadline counts as missed and the schedule starts over. With
+ * pushed feedback, the C sets the pace.
+ */
+void RobotInterface::handle_extendedLoop()
+{
+    QElapsedTimer slice;
+    slice.start();
+
+    while(m_isExtendedMode && !complianceChangePending())
+    {
+        bool pushed = m_isPlaying || complianceMode == hardwareCompliance;
+        if(pushed != m_commPushed)
+        {
+            m_commPushed = pushed;
+            m_commDeadline = 0;
         }
 
-        lastRxJointAngles = rxJointAngles;
+        qint64 now = m_commTimer.nsecsElapsed();
+        if(m_commDeadline == 0)
+            m_commDeadline = now;
 
-        QueryPerformanceCounter(&lastTime);
-        emit robotInitialized();
-        emit message("Initialization complete. ROBOT is ready for your command.");
+        handle_extendedMode();
+        m_commExchanges++;
 
-        if(extEnable() && extSendConfig(0))
+        if(!pushed && m_commPeriod != 0)
         {
-            m_isExtendedMode = true;
-            m_isPlaying = false;
+            m_commDeadline += m_commPeriod;
+            now = m_commTimer.nsecsElapsed();
+
+            if(now > m_commDeadline)
+            {
+                m_commMissed++;
+                m_commDeadline = now;
+            }
+            else
+                usleep((m_commDeadline - now) / 1000);
         }
+
+        if(m_commStatsTimer.elapsed() >= STATS_INTERVAL)
+            publishCommStats();
+
+        if(slice.elapsed() >= LOOP_SLICE)
+            break;
     }
+
+    if(!m_isExtendedMode)
+        m_commDeadline = 0;
 }
 
-void RobotInterface::handle_extendedMode()
+/**
+ * Emit the link statistics of the last interval and start a new one.
+ */
+void RobotInterface::publishCommStats()
+{
+    CommStats stats;
+    stats.rate = m_commExchanges * 1000.0 / m_commStatsTimer.restart();
+    stats.targetRate = m_commPeriod ? 1e9 / m_commPeriod : 0;
+    stats.pushed = m_commPushed;
+    stats.missed = m_commMissed;
+
+    qSort(m_commRtt);
+    int n = m_commRtt.size();
+    if(n != 0)
+    {
+        stats.rttMedian = m_commRtt[n / 2] / 1000.0;
+        stats.rttP95 = m_commRtt[qMin(n - 1, (n * 95) / 100)] / 1000.0;
+        stats.rttP99 = m_commRtt[qMin(n - 1, (n * 99) / 100)] / 1000.0;
+        stats.rttMax = m_commRtt.last() / 1000.0;
+    }
+    else
+        stats.rttMedian = stats.rttP95 = stats.rttP99 = stats.rttMax = 0;
+
+    m_commExchanges = 0;
+    m_commMissed = 0;
+    m_commRtt.clear();
+
+    emit commStatsChanged(stats);
+}
+
+/*
+ * Sets the target rate of the extended mode exchanges in Hz.
+ * With 0, the exchanges run as fast as the serial link allows.
+ */
+void RobotInterface::setCommRate(double hz)
 {
-    // Measure how much real time passed since the last iteration.
-    QueryPerformanceCounter(&tick);
-    double timePassed = ((double)tick.QuadPart - (double)lastTime.QuadPart) / (double)ticksPerSecond.QuadPart;
-    lastTime = tick;
+    m_commPeriod = (hz > 0) ? qRound64(1e9 / hz) : 0;
+    m_commDeadline = 0;
+}
 
+void RobotInterface::handle_extendedMode()
+{
     proto::Packet<proto::CMD_FEEDBACK, proto::Feedback> feedback;
+    bool received;
+
+    applyMotionCommand();
+
+    // Motion and feedback commands are pipelined (see extPipelined()), so
+    // the feedback belongs to a command sent FEEDBACK_PIPELINE-1 cycles ago.
 
     if(m_isPlaying || complianceMode == hardwareCompliance)
     {
-        // Request feedback without giving a motion command
-        if(!extCommand(proto::SimplePacket<proto::CMD_FEEDBACK>(), &feedback))
+        // No motion commands needed, the C pushes the feedback
+        received = extSubscribe(FEEDBACK_PERIOD) && extWaitPush(&feedback.payload);
+        if(!received)
         {
             qDebug() << "no playback feedback";
             m_isExtendedMode = false;
@@ -920,26 +1825,31 @@ void RobotInterface::handle_extendedMode()
         // Request feedback with a motion command
         proto::Packet<proto::CMD_MOTION, proto::Motion> motion;
 
+        if(!extSubscribe(0))
+        {
+            m_isExtendedMode = false;
+            return;
+        }
+
         // Limit the joint target angles to protect the joint limits.
-        foreach (QString key, rxJointAngles.keys())
+        for(int i = 0; i < m_motors.size(); ++i)
         {
-            const MotorData& m = m_motors[key];
-            txJointAngles[key] = qBound(
+            const MotorData& m = m_motors.at(i);
+            txJointAngles[i] = qBound(
                 m.joint.lower_limit,
-                txJointAngles[key],
+                txJointAngles[i],
                 m.joint.upper_limit
             );
         }
 
         motion.payload.num_axes = 0;
-        QHash<QString, MotorData>::iterator it;
-        for(it = m_motors.begin(); it != m_motors.end(); ++it)
+        for(int i = 0; i < m_motors.size(); ++i)
         {
-            const MotorData& m = it.value();
+            const MotorData& m = m_motors.at(i);
             int a = m.joint.address;
             double sgn = m.joint.invert ? -1 : 1;
-            motion.payload.ticks[a-1] = qRound((sgn * txJointAngles[it.key()] + m.joint.offset) / m.joint.enc_to_rad) + proto::NT_POSITION_BIAS;
-            motion.payload.velocity[a-1] = qMax(1, qAbs(qRound((txJointVelocities[it.key()]) / m.joint.mot_to_rad)));
+            motion.payload.ticks[a-1] = qRound((sgn * txJointAngles[i] + m.joint.offset) / m.joint.enc_to_rad) + proto::NT_POSITION_BIAS;
+            motion.payload.velocity[a-1] = qMax(1, qAbs(qRound((txJointVelocities[i]) / m.joint.mot_to_rad)));
             if(a > motion.payload.num_axes)
                 motion.payload.num_axes = a;
         }
@@ -947,7 +1857,7 @@ void RobotInterface::handle_extendedMode()
         motion.payload.output_command = txOutputCommand;
         motion.updateChecksum();
 
-        if(!extCommand(motion, &feedback))
+        if(!extPipelined(motion, &feedback, &received))
         {
             //disconnectRobot();
             m_isExtendedMode = false;
@@ -955,22 +1865,31 @@ void RobotInterface::handle_extendedMode()
         }
     }
 
-    foreach(const MotorData& m, m_motors.values())
+    // Pipeline is still filling up
+    if(!received)
+        return;
+
+    // The positions are filtered with the C sample times and extrapolated
+    // to the present, see JointStateEstimator.
+    double now = m_commTimer.nsecsElapsed() / 1e9;
+    m_estimator.synchronize(feedback.payload.time, now, LINK_BYTE_TIME * sizeof(feedback));
+
+    for(int i = 0; i < m_motors.size(); ++i)
     {
-        const QString& key = m.joint.name;
+        const MotorData& m = m_motors.at(i);
         double sgn = m.joint.invert ? -1 : 1;
-        int ticks = feedback.payload.positions[m.joint.address-1];
+        int ticks = feedback.payload.positions[i];
 
-        if(ticks == 0x7FFF)
-            continue;
+        if(ticks != 0x7FFF)
+            m_estimator.addSample(i, sgn * (ticks * m.joint.enc_to_rad - m.joint.offset), feedback.payload.sample_age[i]);
 
-        rxJointAngles[key] = sgn * (ticks * m.joint.enc_to_rad - m.joint.offset);
+        if(!m_estimator.isValid(i))
+            continue;
 
-        rxJointVelocities[key] = qAbs(rxJointAngles[key] - lastRxJointAngles[key]) / timePassed;
+        rxJointAngles[i] = m_estimator.position(i, now);
+        rxJointVelocities[i] = qAbs(m_estimator.velocity(i));
     }
 
-    lastRxJointAngles = rxJointAngles;
-
     if(complianceMode == hardwareCompliance)
         txJointAngles = rxJointAngles;
 
@@ -981,26 +1900,55 @@ void RobotInterface::handle_extendedMode()
 
         // Halt if no other command is present
         txJointAngles = rxJointAngles;
-        foreach(const MotorData& m, m_motors.values())
+        for(int i = 0; i < m_motors.size(); ++i)
         {
             // motors give strange sounds if velocity == 0
-            txJointVelocities[m.joint.name] = 1.0 * M_PI / 180.0 / m.joint.mot_to_rad;
+            txJointVelocities[i] = 1.0 * M_PI / 180.0 / m_motors.at(i).joint.mot_to_rad;
         }
 
+        m_isStreaming = false;
+        m_streamFrames.clear();
+
+        extLogStats();
+
         emit playbackFinished();
         return;
     }
 
+    if(m_isPlaying && m_isStreaming && !m_stopPlaying)
+    {
+        if(feedback.payload.flags & proto::FF_STREAM_UNDERRUN)
+            log << "stream underrun, low water " << feedback.payload.stream_low_water << '\n';
+
+        if(!extStreamFill(qMin<int>(feedback.payload.stream_free, STREAM_REFILL)))
+        {
+            qDebug() << "could not stream keyframes";
+            m_isExtendedMode = false;
+            return;
+        }
+    }
+
     // Broadcast the received joint angles and velocities to any receivers.
-    emit motionOut(rxJointAngles, rxJointVelocities);
+    publishFeedback();
+}
+
+/*
+ * The C does not change the currents during playback, so a requested
+ * compliance mode waits until the playback has stopped.
+ */
+bool RobotInterface::complianceChangePending() const
+{
+    return complianceMode != requestedComplianceMode && !m_isPlaying;
 }
 
 void RobotInterface::handle_checkComplianceMode()
 {
-    if(complianceMode == requestedComplianceMode)
+    if(!complianceChangePending())
         return;
 
-    if(requestedComplianceMode == noCompliance)
+    bool compliant = (requestedComplianceMode == hardwareCompliance);
+
+    if(!compliant)
     {
         // Send out an initial command packet before switching
         txJointAngles = rxJointAngles;
@@ -1010,98 +1958,47 @@ void RobotInterface::handle_checkComplianceMode()
         complianceMode = lastComp;
     }
 
-    // We need to exit extended mode in order to talk to the motor controllers.
-    if(!extDisable())
-        return;
+    // The C sets the currents of all motors (see proto::Compliance), the
+    // extended mode and the feedback subscription stay active.
+    proto::Packet<proto::CMD_COMPLIANCE, proto::Compliance> cmd;
+    cmd.payload.compliant = compliant;
+    cmd.updateChecksum();
 
-    // Timeout on compliance change
-    QTimer timer;
-    timer.setInterval(2000);
-    timer.start();
-
-    if(requestedComplianceMode == hardwareCompliance)
+    proto::Packet<proto::CMD_COMPLIANCE, proto::ComplianceStatus> answer;
+    if(!extCommand(cmd, &answer))
     {
-        while(1)
-        {
-            bool isHardwareCompliant = true;
-
-            if(!timer.isActive())
-            {
-                message("<font color=\"red\">Failed to change to hardware compliance mode.</font>");
-                requestedComplianceMode = complianceMode;
-                break;
-            }
-
-            QHash<QString, MotorData>::iterator it;
-            for(it = m_motors.begin(); it != m_motors.end(); ++it)
-            {
-                MotorData* m = &it.value();
-
-                if(m->isHWCompliant)
-                    continue;
-
-                int a = m->joint.address;
+        m_isExtendedMode = false;
+        return;
+    }
 
-                if(txrx(QString("#%1r0\r").arg(a)).endsWith(QString("%1r0").arg(a))
-                        && txrx(QString("#%1i0\r").arg(a)).endsWith(QString("%1i0").arg(a)))
-                {
-                    m->isHWCompliant = true;
-                }
-                else
-                    isHardwareCompliant = false;
-            }
+    bool ok = true;
 
-            if(isHardwareCompliant)
-            {
-                emit message("<font color=\"green\">The robot is in hardware compliance mode.</font>");
+    QVector<MotorData>::iterator it;
+    for(it = m_motors.begin(); it != m_motors.end(); ++it)
+    {
+        MotorData* m = it;
 
-                break;
-            }
-        }
+        if(answer.payload.failed & (1 << (m->joint.address-1)))
+            ok = false;
+        else
+            m->isHWCompliant = compliant;
     }
 
-    else if(requestedComplianceMode == noCompliance)
+    if(!ok)
     {
-        while(1)
-        {
-            bool stiff = true;
-
-            if(!timer.isActive())
-            {
-                message("<font color=\"red\">Failed to change to hardware compliance mode.</font>");
-                requestedComplianceMode = complianceMode;
-                break;
-            }
-
-            QHash<QString, MotorData>::iterator it;
-            for(it = m_motors.begin(); it != m_motors.end(); ++it)
-            {
-                MotorData* m = &it.value();
-
-                if(!m->isHWCompliant)
-                    continue;
-
-                int a = m->joint.address;
-
-                if(txrx(QString("#%1r%2\r").arg(a).arg(m->joint.hold_current)).endsWith(QString("%1r%2").arg(a).arg(m->joint.hold_current))
-                        && txrx(QString("#%1i%2\r").arg(a).arg(m->joint.max_current)).endsWith(QString("%1i%2").arg(a).arg(m->joint.max_current)))
-                {
-                    m->isHWCompliant = false;
-                }
-                else
-                    stiff = false;
-            }
+        if(compliant)
+            message("<font color=\"red\">Failed to change to hardware compliance mode.</font>");
+        else
+            message("<font color=\"red\">Failed to make the robot stiff.</font>");
 
-            if (stiff)
-            {
-                emit message("<font color=\"green\">The Robot is stiff.</font>");
-                break;
-            }
-        }
+        requestedComplianceMode = complianceMode;
+        return;
     }
 
-    // Enable extended mode again
-    extEnable();
+    if(compliant)
+        emit message("<font color=\"green\">The robot is in hardware compliance mode.</font>");
+    else
+        emit message("<font color=\"green\">The Robot is stiff.</font>");
 
     complianceMode = requestedComplianceMode;
     emit complianceChanged(complianceMode);
@@ -1119,25 +2016,33 @@ void RobotInterface::step()
     // Setup the port if not done yet.
     if (!serial.isOpen())
     {
-        QString portName = "\\\\.\\COM" + QString::number(portNumber);
-        if (serial.Open(portName))
+        QString name = m_discovery->find();
+        if (name.isEmpty())
+        {
+            // Nothing to try, wait for a port to show up or the next scan
+            msleep(IDLE_WAIT);
+        }
+        else if (serial.Open(name))
         {
-            qDebug() << "trying" << portName;
+            qDebug() << "trying" << name;
+            m_portName = name;
+            QByteArray port = name.toLocal8Bit();
+            m_trace.record(trace::REC_OPEN, port.constData(), port.size());
             serial.Setup(CSerial::EBaud115200, CSerial::EData8, CSerial::EParNone, CSerial::EStop1);
             serial.SetupHandshaking(CSerial::EHandshakeOff);
             serial.SetMask(CSerial::EEventRecv);
             serial.SetEventChar(0x0D);
-        }
-        else
-        {
-            setPortNumber((portNumber+1) % PORTCYCLE);
+            extResetPipeline();
         }
     }
 
     // Confirm the connection with a status query and load the calibration.
     else if (!robotIsConnected)
     {
-        handle_confirmConnection();
+        if (m_resumeSession)
+            handle_resume();
+        else
+            handle_confirmConnection();
     }
 
     else if (!robotIsReset)
@@ -1158,12 +2063,15 @@ void RobotInterface::step()
     else if(m_isExtendedMode)
     {
         handle_checkComplianceMode();
-        handle_extendedMode();
+        handle_extendedLoop();
     }
 }
 
 void RobotInterface::run()
 {
+    // Needs to live in this thread, see PortDiscovery
+    m_discovery->start();
+
     // Run Qt event loop
     exec();
 
@@ -8,21 +8,52 @@
 #ifndef ROBOTINTERFACE_H_
 #define ROBOTINTERFACE_H_
 
-#include <QHash>
+#include <QVector>
 #include <QString>
 #include <QObject>
 #include <QTime>
 #include <QTimer>
-#include <QMutex>
 #include <QThread>
 #include <QFile>
 #include <QTextStream>
 #include <QPointer>
+#include <QElapsedTimer>
+#ifdef Q_OS_WIN
 #include "Serial.h"
+#else
+#include "SerialLinux.h"
+#endif
+#include "PacketFramer.h"
+#include "PortDiscovery.h"
+#include "ProtocolTrace.h"
+#include "JointStateEstimator.h"
 #include "Keyframe.h"
+#include "JointVector.h"
+#include "TripleBuffer.h"
 #include "microcontroller/protocol.h"
 
-class KeyframePlayerItem;
+class Timeline;
+class RobotInterface;
+
+/**
+ * Emits RobotInterface::motionOut() in the thread which created the robot
+ * interface (i.e. the GUI thread), with the latest feedback only.
+ **/
+class RobotFeedbackRelay : public QObject
+{
+    Q_OBJECT
+public:
+    explicit RobotFeedbackRelay(RobotInterface* robot);
+
+public slots:
+    void deliver();
+
+signals:
+    void motionOut(const JointVector&, const JointVector&);
+
+private:
+    RobotInterface* m_robot;
+};
 
 class RobotInterface : public QThread
 {
@@ -42,11 +73,24 @@ public:
         KC_LOOP
     };
 
+    // Extended mode link statistics, see commStatsChanged()
+    struct CommStats
+    {
+        double rate;       // Achieved exchanges per second
+        double targetRate; // 0 = as fast as the link allows
+        bool pushed;       // Feedback pushed by the C, no motion commands
+        int missed;        // Exchanges which missed their deadline
+        double rttMedian;  // CMD_MOTION round trip in ms (0 = none)
+        double rttP95;
+        double rttP99;
+        double rttMax;
+    };
+
 private:
 
 	static const int TIMEOUT = 10; // How many times do you try to receive a packet before you give up.
-    static const int PORTCYCLE = 15; // How many ports to cycle when searching for a robot.
     static const qint64 BUFFER_SIZE = 64; // The size of the receive buffer.
+    static const int IDLE_WAIT = 50; // ms to wait when there is no port to try
 
 	ComplianceMode complianceMode;
     ComplianceMode requestedComplianceMode;
@@ -59,8 +103,7 @@ private:
         bool isHWCompliant;
     };
 
-    QHash<QString, MotorData> m_motors;
-    QMutex m_bigMotorMutex; // Locks m_motors structure
+    QVector<MotorData> m_motors; // Indexed like JointVector
 
 	bool robotIsConnected;
     bool robotIsReset;
@@ -74,32 +117,116 @@ private:
 
 	int timeoutTicksLeft;
 	char receiveBuffer[BUFFER_SIZE];
-    int portNumber;
+    QString m_portName;
+    PortDiscovery* m_discovery;
 	CSerial serial;
+    PacketFramer m_framer;
 
 	int encoderPosition;
 	int motorPosition;
-	int registerValue;
 
 	double speedLimit;
     int m_lookahead;
+    int m_interpolation;
 
-	QHash<QString, double> txJointAngles;
-    QHash<QString, double> txJointVelocities;
-	QHash<QString, double> rxJointAngles;
-    QHash<QString, double> rxJointVelocities;
-    QHash<QString, double> lastRxJointAngles;
+	JointVector txJointAngles;
+    JointVector txJointVelocities;
+	JointVector rxJointAngles;
+    JointVector rxJointVelocities;
     int txOutputCommand;
 
-    // Log and precise timer for debugging.
-	LARGE_INTEGER startTime;
-    LARGE_INTEGER lastTime;
-    LARGE_INTEGER ticksPerSecond;
-    LARGE_INTEGER tick;
+    // Filtered and latency compensated feedback
+    JointStateEstimator m_estimator;
+
+    // Log
     QFile logfile;
     QTextStream log;
 
+    // Every frame on the serial link, see ProtocolTrace
+    ProtocolTrace m_trace;
+
     int m_noFeedbackCounter;
+
+    // Keyframe streaming for sequences longer than proto::MAX_KEYFRAMES
+    static const int STREAM_REFILL = 4; // Max. keyframes sent per feedback cycle
+    QList<proto::Keyframe> m_streamFrames;
+    int m_streamPos; // Next stream index to send
+    bool m_streamLoop;
+    bool m_isStreaming;
+
+    // Pipelined extended mode commands. The C receive buffer (256 bytes)
+    // limits how many commands may be in flight.
+    static const int MAX_PENDING = 8;
+    static const int KEYFRAME_PIPELINE = 4; // Keyframe uploads in flight
+    static const int FEEDBACK_PIPELINE = 3; // Motion/feedback commands in flight
+    struct PendingRequest
+    {
+        uint8_t sequence;
+        uint8_t command;
+        bool answered;
+        qint64 sentAt; // ns, see m_commTimer
+        int size;
+        uint8_t answer[PacketFramer::MAX_PACKET_SIZE];
+    };
+    PendingRequest m_pending[MAX_PENDING];
+    int m_numPending;
+    uint8_t m_sequence;
+    uint8_t m_feedbackSequence[FEEDBACK_PIPELINE];
+    int m_numFeedback;
+
+    // Feedback pushed by the C during playback and hardware compliance
+    static const int FEEDBACK_PERIOD = 10; // ms
+    static const int SUBSCRIBE_RENEW = 100; // ms, see proto::SUBSCRIBE_TIMEOUT
+    int m_subscribedPeriod;
+    QTime m_subscribeTime;
+    proto::Packet<proto::CMD_SUBSCRIBE, proto::Feedback> m_pushed;
+    bool m_pushValid;
+    int m_pushSequence; // -1 = unknown
+    quint32 m_pushCount;
+    quint32 m_pushLost;
+
+    // Extended mode exchange loop, see handle_extendedLoop()
+    static const int LOOP_SLICE = 20; // ms until the event loop gets a turn
+    static const int STATS_INTERVAL = 1000; // ms
+    qint64 m_commPeriod; // ns, 0 = as fast as the link allows
+    qint64 m_commDeadline; // ns
+    QElapsedTimer m_commTimer;
+    QElapsedTimer m_commStatsTimer;
+    int m_commExchanges;
+    int m_commMissed;
+    bool m_commPushed;
+    QVector<int> m_commRtt; // s, CMD_MOTION round trips of this interval
+
+    // Last known C session, see handle_resume()
+    proto::Session m_session;
+    bool m_sessionKnown;
+    bool m_resumeSession; // Try to resume after the link dropped
+    ComplianceMode m_resumeCompliance;
+
+    // Background EEPROM write started by CMD_COMMIT
+    static const int COMMIT_POLL = 100; // ms
+    static const int COMMIT_TIMEOUT = 30000; // ms
+
+    // Latest motion command from the GUI thread, see motionIn()
+    struct MotionCommand
+    {
+        JointVector angles;
+        JointVector velocities;
+        int outputCommand;
+    };
+    TripleBuffer<MotionCommand> m_commandMailbox;
+
+    // Latest feedback for the GUI thread, see RobotFeedbackRelay
+    struct MotionFeedback
+    {
+        JointVector angles;
+        JointVector velocities;
+    };
+    TripleBuffer<MotionFeedback> m_feedbackMailbox;
+    QAtomicInt m_feedbackPending; // A deliver() call is queued
+    RobotFeedbackRelay m_feedbackRelay;
+
+    friend class RobotFeedbackRelay;
 public:
 
 	RobotInterface();
@@ -112,15 +239,21 @@ public:
     bool isPlaying();
 
 public slots:
-	void motionIn(QHash<QString, double>, QHash<QString, double>);
-    void motionIn(QHash<QString, double>, QHash<QString, double>, int outputCommand);
+    // Thread-safe, called directly in the GUI thread (Qt::DirectConnection).
+    // All callers have to live in the same thread.
+	void motionIn(const JointVector&, const JointVector&);
+    void motionIn(const JointVector&, const JointVector&, int outputCommand);
 	void setSpeedLimit(int sl);
 	void initializeRobot();
     void step();
     void setJointConfig(const JointInfo::ListPtr& config);
     void setComplianceMode(int mode);
+    void setCommRate(double hz);
     void stopRobot();
-    void transferKeyframes(const KeyframePlayerItem* head, int cmd);
+    void transferKeyframes(const Timeline& timeline, int cmd);
+
+private slots:
+    void portRemoved(const QString& port);
 
 signals:
 	void robotConnected();
@@ -128,46 +261,79 @@ signals:
 	void robotDisconnected();
     void robotConnectionChanged(bool connected);
 	void message(QString);
-	void limitsLoaded(QHash<QString, double>, QHash<QString, double>);
-	void motionOut(QHash<QString, double>, QHash<QString, double>);
+	void motionOut(const JointVector&, const JointVector&);
     void playbackStarted();
     void playbackFinished();
     void complianceChanged(int mode);
     void keyframeTransferFinished(bool success);
+    void feedbackAvailable(); // internal, see RobotFeedbackRelay
+    void commStatsChanged(const RobotInterface::CommStats& stats);
 
 protected:
 	void run();
 
 private:
-	void setPortNumber(int pn);
+    void closePort();
 	void disconnectRobot();
 	QString txrx(QString command);
-	bool pollRegister(QString reg);
 	bool pollPiggyBackRegister(QString reg);
 
     void flashDone(bool success);
 
+    bool complianceChangePending() const;
     void handle_checkComplianceMode();
     void handle_confirmConnection();
+    void handle_resume();
     void handle_robotReset();
     void handle_checkInitialization();
     void handle_initialize();
     void handle_doHardwareComplianceMode();
     void handle_undoHardwareComplianceMode();
+    void handle_extendedLoop();
     void handle_extendedMode();
     void handle_flashRequest();
+    void publishCommStats();
+
+    void applyMotionCommand();
+    void publishFeedback();
 
     // Extended mode communication helpers
+    template<class Cmd>
+    bool extSend(const Cmd& cmd, uint8_t* sequence = 0);
+
+    template<class Answer>
+    bool extReceive(uint8_t sequence, Answer* answer);
+
     template<class Cmd, class Answer>
     bool extCommand(const Cmd& cmd, Answer* answer);
 
+    template<class Cmd, class Answer>
+    bool extPipelined(const Cmd& cmd, Answer* answer, bool* received);
+
+    bool extWaitAnswer(uint8_t sequence, void* answer, int size);
+    bool extRead(int* idleCounter);
+    bool extSubscribe(int period);
+    bool extWaitPush(proto::Feedback* feedback);
+    void extDispatch();
+    void extResetPipeline();
+
     template<class Cmd, class Answer>
     bool extChat(const Cmd& cmd, const Answer& expectedReply);
 
     bool extDisable();
     bool extEnable();
+    bool extReadSession();
+    bool extAxes(uint8_t setState, uint8_t ifState, proto::AxisStatus* status);
+    void takeInitialPositions(const proto::AxisStatus& status);
 
+    bool extBuildConfig(int num_frames, proto::Config* config);
     bool extSendConfig(int num_frames);
+    bool extUploadSequence(const QList<proto::Keyframe>& frames);
+    bool extWaitCommit();
+    bool extStreamFill(int max_frames);
+    void extLogStats();
 };
 
+Q_DECLARE_METATYPE(RobotInterface::CommStats)
+
 #endif /* ROBOTINTERFACE_H_ */
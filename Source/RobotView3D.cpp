@@ -133,10 +133,11 @@ void RobotView3D::updateView()
 
     foreach(ViewJoint* joint, m_viewJoints)
     {
-        if(!jointAngles->contains(joint->info().name))
+        int index = joint->info().address - 1;
+        if(!jointAngles->contains(index))
             continue;
 
-        joint->setJointAngle(jointAngles->value(joint->info().name));
+        joint->setJointAngle((*jointAngles)[index]);
     }
 
 	update();
@@ -183,10 +184,11 @@ void RobotView3D::mouseMoveEvent(QMouseEvent* e)
 
         foreach(ViewJoint* joint, m_viewJoints)
         {
-            if(!jointAngles->contains(joint->info().name))
+            int index = joint->info().address - 1;
+            if(!jointAngles->contains(index))
                 continue;
 
-            (*jointAngles)[joint->info().name] = joint->jointAngle();
+            (*jointAngles)[index] = joint->jointAngle();
         }
 
 		// Emit a signal.
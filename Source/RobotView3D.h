@@ -14,6 +14,7 @@
 #include <QGLViewer/qglviewer.h>
 
 #include "ViewJoint.h"
+#include "JointVector.h"
 
 using namespace qglviewer;
 
@@ -21,7 +22,7 @@ class RobotView3D: public QGLViewer
 {
 	Q_OBJECT
 
-	QHash<QString, double> *jointAngles;
+	JointVector *jointAngles;
 	unsigned short selected;
 	int slices;
 
@@ -35,8 +36,8 @@ public:
 
 	bool ignoreMouse;
 
-	void setJointAngles(QHash<QString, double> *ja) { jointAngles = ja; }
-	QHash<QString, double>* getJointAngles() { return jointAngles; }
+	void setJointAngles(JointVector *ja) { jointAngles = ja; }
+	JointVector* getJointAngles() { return jointAngles; }
 	QPixmap getPixmap(int width=0, int height=0);
 
 public slots:
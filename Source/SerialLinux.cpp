@@ -0,0 +1,321 @@
+// Serial port backend for Linux
+
+#include "SerialLinux.h"
+
+#include <QtDebug>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+static speed_t baudToSpeed(CSerial::EBaudrate baud)
+{
+    switch(baud)
+    {
+        case CSerial::EBaud9600:   return B9600;
+        case CSerial::EBaud19200:  return B19200;
+        case CSerial::EBaud38400:  return B38400;
+        case CSerial::EBaud57600:  return B57600;
+        case CSerial::EBaud115200: return B115200;
+        case CSerial::EBaud230400: return B230400;
+        default:                   return B0;
+    }
+}
+
+static qint64 monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (qint64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+CSerial::CSerial()
+ : m_fd(-1)
+ , m_epoll(-1)
+ , m_lastError(ERROR_SUCCESS)
+ , m_threshold(1)
+{
+}
+
+CSerial::~CSerial()
+{
+    close();
+}
+
+bool CSerial::Open(QString portName)
+{
+    close();
+
+    m_fd = ::open(portName.toLocal8Bit().constData(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if(m_fd < 0)
+    {
+        m_lastError = errno;
+        return false;
+    }
+
+    // Nobody else may talk to the µC while we use it
+    ioctl(m_fd, TIOCEXCL);
+
+    // Ask the driver to hand over received bytes immediately instead of
+    // collecting them. Not supported by all drivers (e.g. ptys).
+    struct serial_struct serial;
+    if(ioctl(m_fd, TIOCGSERIAL, &serial) == 0)
+    {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        if(ioctl(m_fd, TIOCSSERIAL, &serial) != 0)
+            qDebug() << "CSerial::Open - could not enable low latency mode on" << portName;
+    }
+
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if(m_epoll < 0)
+    {
+        m_lastError = errno;
+        close();
+        return false;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = m_fd;
+    if(epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_fd, &ev) != 0)
+    {
+        m_lastError = errno;
+        close();
+        return false;
+    }
+
+    if(Setup() != ERROR_SUCCESS)
+    {
+        close();
+        return false;
+    }
+
+    tcflush(m_fd, TCIOFLUSH);
+
+    m_lastError = ERROR_SUCCESS;
+    return true;
+}
+
+void CSerial::close()
+{
+    if(m_epoll >= 0)
+    {
+        ::close(m_epoll);
+        m_epoll = -1;
+    }
+
+    if(m_fd >= 0)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+long CSerial::Setup(EBaudrate eBaudrate, EDataBits eDataBits, EParity eParity, EStopBits eStopBits)
+{
+    struct termios tio;
+    if(tcgetattr(m_fd, &tio) != 0)
+        return m_lastError = errno;
+
+    // Raw mode: no echo, no line editing, no character translation
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+
+    speed_t speed = baudToSpeed(eBaudrate);
+    if(speed == B0)
+        return m_lastError = EINVAL;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+
+    tio.c_cflag &= ~CSIZE;
+    switch(eDataBits)
+    {
+        case EData5: tio.c_cflag |= CS5; break;
+        case EData6: tio.c_cflag |= CS6; break;
+        case EData7: tio.c_cflag |= CS7; break;
+        default:     tio.c_cflag |= CS8; break;
+    }
+
+    tio.c_cflag &= ~(PARENB | PARODD);
+    if(eParity == EParOdd)
+        tio.c_cflag |= PARENB | PARODD;
+    else if(eParity == EParEven)
+        tio.c_cflag |= PARENB;
+
+    if(eStopBits == EStop2)
+        tio.c_cflag |= CSTOPB;
+    else
+        tio.c_cflag &= ~CSTOPB;
+
+    // VTIME = 0: no inter-byte timer, timeouts are handled by WaitEvent().
+    // VMIN: epoll reports the port readable once this many bytes are there.
+    tio.c_cc[VMIN] = m_threshold;
+    tio.c_cc[VTIME] = 0;
+
+    if(tcsetattr(m_fd, TCSANOW, &tio) != 0)
+        return m_lastError = errno;
+
+    return m_lastError = ERROR_SUCCESS;
+}
+
+long CSerial::SetupHandshaking(EHandshake eHandshake)
+{
+    struct termios tio;
+    if(tcgetattr(m_fd, &tio) != 0)
+        return m_lastError = errno;
+
+    tio.c_cflag &= ~CRTSCTS;
+    tio.c_iflag &= ~(IXON | IXOFF | IXANY);
+
+    if(eHandshake == EHandshakeHardware)
+        tio.c_cflag |= CRTSCTS;
+    else if(eHandshake == EHandshakeSoftware)
+        tio.c_iflag |= IXON | IXOFF;
+
+    if(tcsetattr(m_fd, TCSANOW, &tio) != 0)
+        return m_lastError = errno;
+
+    return m_lastError = ERROR_SUCCESS;
+}
+
+long CSerial::SetReadThreshold(int bytes)
+{
+    m_threshold = qBound(1, bytes, 255);
+
+    struct termios tio;
+    if(tcgetattr(m_fd, &tio) != 0)
+        return m_lastError = errno;
+
+    tio.c_cc[VMIN] = m_threshold;
+
+    if(tcsetattr(m_fd, TCSANOW, &tio) != 0)
+        return m_lastError = errno;
+
+    return m_lastError = ERROR_SUCCESS;
+}
+
+long CSerial::SetMask(unsigned long)
+{
+    return m_lastError = ERROR_SUCCESS;
+}
+
+long CSerial::SetEventChar(unsigned char, bool)
+{
+    return m_lastError = ERROR_SUCCESS;
+}
+
+long CSerial::WaitEvent(int timeout)
+{
+    if(m_epoll < 0)
+        return m_lastError = EBADF;
+
+    qint64 deadline = monotonicMs() + timeout;
+
+    while(1)
+    {
+        struct epoll_event ev;
+        int ret = epoll_wait(m_epoll, &ev, 1, timeout);
+
+        if(ret > 0)
+        {
+            // The device is gone (e.g. USB adapter unplugged)
+            if(ev.events & (EPOLLHUP | EPOLLERR))
+                return m_lastError = EIO;
+
+            return m_lastError = ERROR_SUCCESS;
+        }
+
+        if(ret == 0)
+            return m_lastError = ERROR_TIMEOUT;
+
+        if(errno != EINTR)
+            return m_lastError = errno;
+
+        if(timeout >= 0)
+            timeout = qMax<qint64>(0, deadline - monotonicMs());
+    }
+}
+
+int CSerial::write(const void* pData, size_t iLen)
+{
+    const char* data = (const char*)pData;
+
+    while(iLen != 0)
+    {
+        ssize_t ret = ::write(m_fd, data, iLen);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            if(errno == EAGAIN)
+            {
+                // Transmit buffer full, wait until there is space again
+                struct pollfd pfd;
+                pfd.fd = m_fd;
+                pfd.events = POLLOUT;
+                if(poll(&pfd, 1, WRITE_TIMEOUT) <= 0)
+                {
+                    m_lastError = ERROR_TIMEOUT;
+                    return -1;
+                }
+                continue;
+            }
+
+            m_lastError = errno;
+            return -1;
+        }
+
+        data += ret;
+        iLen -= ret;
+    }
+
+    m_lastError = ERROR_SUCCESS;
+    return 0;
+}
+
+int CSerial::read(void* pData, size_t iLen)
+{
+    while(1)
+    {
+        ssize_t ret = ::read(m_fd, pData, iLen);
+        if(ret > 0)
+        {
+            m_lastError = ERROR_SUCCESS;
+            return ret;
+        }
+
+        // With VMIN > 0, end of file means hangup
+        if(ret == 0 && iLen != 0)
+        {
+            m_lastError = EIO;
+            return -1;
+        }
+
+        if(ret < 0 && errno == EINTR)
+            continue;
+
+        if(ret < 0 && errno != EAGAIN)
+        {
+            m_lastError = errno;
+            return -1;
+        }
+
+        m_lastError = ERROR_SUCCESS;
+        return 0;
+    }
+}
+
+long CSerial::Purge()
+{
+    if(tcflush(m_fd, TCIOFLUSH) != 0)
+        return m_lastError = errno;
+
+    return m_lastError = ERROR_SUCCESS;
+}
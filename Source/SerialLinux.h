@@ -0,0 +1,156 @@
+// Serial port backend for Linux
+//
+// Drop-in replacement for the Win32 CSerial class (Serial.h) with the
+// subset of its interface used by RobotInterface and the flash tool.
+// Include either Serial.h or this file, depending on the platform.
+
+#ifndef SERIALLINUX_H
+#define SERIALLINUX_H
+
+#include <QString>
+
+#include <stddef.h>
+
+// Return codes of WaitEvent(), named like their Win32 counterparts
+#ifndef ERROR_SUCCESS
+#define ERROR_SUCCESS 0L
+#endif
+#ifndef ERROR_TIMEOUT
+#define ERROR_TIMEOUT 1460L
+#endif
+
+/**
+ * Serial port based on termios and epoll.
+ *
+ * The port is opened non-blocking in raw mode. For low latency, the
+ * driver is asked to push received bytes immediately (ASYNC_LOW_LATENCY,
+ * e.g. sets the FTDI latency timer to 1ms) and WaitEvent() sleeps in
+ * epoll_wait() until the line discipline reports data.
+ *
+ * Return values follow the overlapped CSerial: write() returns 0 when
+ * everything was written, read() returns the number of bytes read
+ * (0 if nothing is available) and both return -1 on errors.
+ **/
+class CSerial
+{
+public:
+    typedef enum
+    {
+        EEventUnknown = -1,
+        EEventNone    = 0,
+        EEventRecv    = 1
+    }
+    EEvent;
+
+    typedef enum
+    {
+        EBaudUnknown = -1,
+        EBaud9600    = 9600,
+        EBaud19200   = 19200,
+        EBaud38400   = 38400,
+        EBaud57600   = 57600,
+        EBaud115200  = 115200,
+        EBaud230400  = 230400
+    }
+    EBaudrate;
+
+    typedef enum
+    {
+        EDataUnknown = -1,
+        EData5       = 5,
+        EData6       = 6,
+        EData7       = 7,
+        EData8       = 8
+    }
+    EDataBits;
+
+    typedef enum
+    {
+        EParUnknown = -1,
+        EParNone    = 0,
+        EParOdd     = 1,
+        EParEven    = 2
+    }
+    EParity;
+
+    typedef enum
+    {
+        EStopUnknown = -1,
+        EStop1       = 0,
+        EStop2       = 2
+    }
+    EStopBits;
+
+    typedef enum
+    {
+        EHandshakeUnknown  = -1,
+        EHandshakeOff      = 0,
+        EHandshakeHardware = 1,
+        EHandshakeSoftware = 2
+    }
+    EHandshake;
+
+    CSerial();
+    virtual ~CSerial();
+
+    //! Open the device (e.g. /dev/ttyUSB0) with 9600 8N1
+    virtual bool Open(QString portName);
+    virtual void close();
+
+    virtual long Setup(EBaudrate eBaudrate = EBaud9600,
+                       EDataBits eDataBits = EData8,
+                       EParity   eParity   = EParNone,
+                       EStopBits eStopBits = EStop1);
+
+    virtual long SetupHandshaking(EHandshake eHandshake);
+
+    /**
+     * Number of buffered bytes which make WaitEvent() return (VMIN).
+     *
+     * The default is 1, i.e. wake on the first byte. If the size of the
+     * next answer is known, waiting for all of it saves the wakeups for
+     * partial packets; if fewer bytes arrive, WaitEvent() times out.
+     **/
+    virtual long SetReadThreshold(int bytes);
+
+    // WaitEvent() always waits for received data, there are no other
+    // events. These only exist for compatibility.
+    virtual long SetMask(unsigned long mask = EEventRecv);
+    virtual long SetEventChar(unsigned char eventChar, bool adjustMask = true);
+
+    /**
+     * Wait until data can be read.
+     *
+     * @param timeout in ms, -1 waits forever
+     * @return ERROR_SUCCESS, ERROR_TIMEOUT or an errno value
+     **/
+    virtual long WaitEvent(int timeout = -1);
+
+    virtual int write(const void* pData, size_t iLen);
+    virtual int read(void* pData, size_t iLen);
+
+    //! Discard all buffered data in both directions
+    long Purge();
+
+    inline int GetCommHandle() const
+    { return m_fd; }
+
+    inline bool isOpen() const
+    { return m_fd >= 0; }
+
+    inline long GetLastError() const
+    { return m_lastError; }
+
+private:
+    enum
+    {
+        WRITE_TIMEOUT = 500 // ms
+    };
+
+    int m_fd;
+    int m_epoll;
+    long m_lastError;
+    int m_threshold;
+};
+
+#endif
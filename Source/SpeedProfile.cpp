@@ -0,0 +1,107 @@
+// Timing of the keyframe segments from the joint limits
+
+#include "SpeedProfile.h"
+#include "globals.h"
+#include "microcontroller/protocol.h"
+
+#include <QtGlobal>
+
+#include <math.h>
+
+// Peak velocity (times distance / T) and peak acceleration
+// (times distance / T^2) of a spline segment from rest to rest
+static const double CUBIC_VELOCITY = 1.5;
+static const double CUBIC_ACCELERATION = 6.0;
+static const double MIN_JERK_VELOCITY = 1.875;
+static const double MIN_JERK_ACCELERATION = 5.7735; // 10 / sqrt(3)
+
+/**
+ * Duration of a segment with fixed shape, so that neither the peak velocity
+ * nor the peak acceleration exceeds the limits.
+ */
+static double shapeTime(double distance, double velocity, double acceleration,
+    double velocityFactor, double accelerationFactor)
+{
+    double time = velocityFactor * distance / velocity;
+
+    if(acceleration > 0)
+        time = qMax(time, sqrt(accelerationFactor * distance / acceleration));
+
+    return time;
+}
+
+SpeedProfile::SpeedProfile()
+ : m_interpolation(proto::IP_LINEAR)
+{
+    for(int i = 0; i < JointVector::MAX_JOINTS; ++i)
+    {
+        m_maxVelocity[i] = SERVOSPEEDMAX;
+        m_maxAcceleration[i] = 0;
+    }
+}
+
+void SpeedProfile::setJointConfig(const JointInfo::List& config)
+{
+    for(int i = 0; i < JointVector::MAX_JOINTS; ++i)
+    {
+        m_maxVelocity[i] = SERVOSPEEDMAX;
+        m_maxAcceleration[i] = 0;
+    }
+
+    foreach(const JointInfo& info, config)
+    {
+        if(info.address < 1 || info.address > JointVector::MAX_JOINTS)
+            continue;
+
+        m_maxVelocity[info.address-1] = info.max_velocity;
+        m_maxAcceleration[info.address-1] = info.max_acceleration;
+    }
+
+    m_interpolation = config.interpolation;
+}
+
+double SpeedProfile::jointTime(int joint, double distance, double speed, int stops) const
+{
+    distance = qAbs(distance);
+    if(distance == 0)
+        return 0;
+
+    double velocity = speed * m_maxVelocity[joint];
+    double acceleration = m_maxAcceleration[joint];
+
+    switch(m_interpolation)
+    {
+        case proto::IP_CUBIC:
+            return shapeTime(distance, velocity, acceleration, CUBIC_VELOCITY, CUBIC_ACCELERATION);
+        case proto::IP_MIN_JERK:
+            return shapeTime(distance, velocity, acceleration, MIN_JERK_VELOCITY, MIN_JERK_ACCELERATION);
+        default:
+            break;
+    }
+
+    if(acceleration <= 0 || stops == 0)
+        return distance / velocity;
+
+    // Trapezoid if the joint reaches the velocity limit. Otherwise it
+    // accelerates all the way (triangle if it also stops).
+    if(distance >= stops * velocity * velocity / (2.0 * acceleration))
+        return distance / velocity + stops * velocity / (2.0 * acceleration);
+    else
+        return stops * sqrt(2.0 * distance / (stops * acceleration));
+}
+
+double SpeedProfile::segmentTime(const JointVector& from, const JointVector& to, double speed,
+    bool stopAtStart, bool stopAtEnd) const
+{
+    double time = 0;
+    int stops = (stopAtStart ? 1 : 0) + (stopAtEnd ? 1 : 0);
+
+    // Joints missing in to count as zero, like in JointVector::distance()
+    for(int i = 0; i < JointVector::MAX_JOINTS; ++i)
+    {
+        if(from.contains(i))
+            time = qMax(time, jointTime(i, to.value(i) - from[i], speed, stops));
+    }
+
+    return time;
+}
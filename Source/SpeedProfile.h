@@ -0,0 +1,57 @@
+// Timing of the keyframe segments from the joint limits
+
+#ifndef SPEEDPROFILE_H
+#define SPEEDPROFILE_H
+
+#include "JointConfiguration.h"
+#include "JointVector.h"
+
+/**
+ * Computes the shortest duration of a keyframe segment which keeps every
+ * joint within its velocity and acceleration limit (JointInfo::max_velocity,
+ * JointInfo::max_acceleration). The joint which needs the longest time sets
+ * the duration of the segment.
+ *
+ * The peak velocity and acceleration of a segment depend on the
+ * interpolation:
+ *
+ *  - linear: the motor controllers ramp between the setpoints, each segment
+ *    is treated as trapezoidal profile. The joints stop at the keyframes,
+ *    except for fly-by keyframes (see Keyframe::setBlend()), where no
+ *    ramp is needed.
+ *  - cubic / minimum jerk: the segment shape is fixed, its peak velocity and
+ *    acceleration are multiples of the average velocity (see
+ *    microcontroller/spline.h). The factors of a segment from rest to rest
+ *    are used. The velocity at a keyframe is at most the larger average
+ *    velocity of the adjacent segments, so the velocity limit holds for
+ *    moving keyframes as well.
+ *
+ * Joints which are not configured use SERVOSPEEDMAX without acceleration
+ * limit. This gives the timing of the old single speed limit.
+ **/
+class SpeedProfile
+{
+public:
+    SpeedProfile();
+
+    //! Take the joint limits and the interpolation from @a config
+    void setJointConfig(const JointInfo::List& config);
+
+    /**
+     * Shortest duration in seconds of the motion from @a from to @a to with
+     * the joint velocities limited to @a speed (0..1) times their maximum.
+     * @a stopAtStart and @a stopAtEnd tell whether the joints are at rest
+     * in @a from and @a to (only used for linear interpolation).
+     **/
+    double segmentTime(const JointVector& from, const JointVector& to, double speed,
+        bool stopAtStart = true, bool stopAtEnd = true) const;
+
+    //! Shortest duration of a move of @a distance for a single joint with @a stops (0-2) ramps
+    double jointTime(int joint, double distance, double speed, int stops = 2) const;
+private:
+    double m_maxVelocity[JointVector::MAX_JOINTS];
+    double m_maxAcceleration[JointVector::MAX_JOINTS];
+    int m_interpolation;
+};
+
+#endif
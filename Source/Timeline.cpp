@@ -0,0 +1,258 @@
+// Seekable timeline of the played keyframes
+
+#include "Timeline.h"
+
+#include "microcontroller/spline.h"
+
+#include <QtGlobal>
+
+#include <algorithm>
+
+Timeline::Timeline()
+ : m_joints(0)
+ , m_interpolation(proto::IP_LINEAR)
+{
+}
+
+void Timeline::clear()
+{
+    m_times.clear();
+    m_outputCommands.clear();
+    m_blends.clear();
+
+    for(int i = 0; i < JointVector::MAX_JOINTS; ++i)
+    {
+        m_angles[i].clear();
+        m_velocities[i].clear();
+    }
+
+    m_joints = 0;
+}
+
+void Timeline::setInterpolation(int interpolation)
+{
+    m_interpolation = interpolation;
+}
+
+void Timeline::append(double relativeTime, const JointVector& angles, int outputCommand, int blend)
+{
+    if(m_times.isEmpty())
+    {
+        m_joints = 0;
+        for(int i = 0; i < JointVector::MAX_JOINTS; ++i)
+        {
+            if(angles.contains(i))
+                m_joints |= (1 << i);
+        }
+
+        m_times.append(0.0);
+    }
+    else
+        m_times.append(m_times.last() + relativeTime);
+
+    m_outputCommands.append(outputCommand);
+    m_blends.append(blend);
+
+    for(int i = 0; i < JointVector::MAX_JOINTS; ++i)
+    {
+        if(contains(i))
+            m_angles[i].append(angles.value(i));
+    }
+}
+
+void Timeline::setFrame(int frame, const JointVector& angles, int outputCommand, int blend)
+{
+    m_outputCommands[frame] = outputCommand;
+    m_blends[frame] = blend;
+
+    for(int i = 0; i < JointVector::MAX_JOINTS; ++i)
+    {
+        if(contains(i))
+            m_angles[i][frame] = angles.value(i);
+    }
+}
+
+void Timeline::setRelativeTime(int frame, double relativeTime)
+{
+    if(frame == 0)
+        return;
+
+    double delta = relativeTime - (m_times[frame] - m_times[frame-1]);
+    if(delta == 0)
+        return;
+
+    double* times = m_times.data();
+    for(int i = frame; i < m_times.size(); ++i)
+        times[i] += delta;
+}
+
+void Timeline::truncate(int size)
+{
+    if(size >= m_times.size())
+        return;
+
+    m_times.resize(size);
+    m_outputCommands.resize(size);
+    m_blends.resize(size);
+
+    for(int i = 0; i < JointVector::MAX_JOINTS; ++i)
+    {
+        if(!contains(i))
+            continue;
+
+        m_angles[i].resize(size);
+        if(m_velocities[i].size() > size)
+            m_velocities[i].resize(size);
+    }
+}
+
+void Timeline::computeVelocities(double defaultVelocity, int first, int last)
+{
+    int n = size();
+
+    if(last < 0 || last > n-1)
+        last = n-1;
+    first = qMax(0, first);
+
+    for(int i = 0; i < JointVector::MAX_JOINTS; ++i)
+    {
+        if(!contains(i))
+            continue;
+
+        const double* angles = m_angles[i].constData();
+        m_velocities[i].resize(n);
+        double* velocities = m_velocities[i].data();
+
+        for(int frame = first; frame <= last; ++frame)
+        {
+            if(frame == n-1)
+            {
+                velocities[frame] = defaultVelocity;
+                break;
+            }
+
+            double jointDistance = angles[frame+1] - angles[frame];
+            double time = m_times[frame+1] - m_times[frame];
+
+            velocities[frame] = (jointDistance == 0 || time == 0) ?
+                defaultVelocity : qAbs(jointDistance / time);
+        }
+    }
+}
+
+double Timeline::duration() const
+{
+    return m_times.isEmpty() ? 0.0 : m_times.last();
+}
+
+JointVector Timeline::angles(int frame) const
+{
+    JointVector ret;
+
+    for(int i = 0; i < JointVector::MAX_JOINTS; ++i)
+    {
+        if(contains(i))
+            ret[i] = m_angles[i][frame];
+    }
+
+    return ret;
+}
+
+int Timeline::seek(double time) const
+{
+    // First frame at or after time, the segment starts one before
+    const double* begin = m_times.constData();
+    const double* it = std::lower_bound(begin, begin + m_times.size(), time);
+
+    return qMax(0, (int)(it - begin) - 1);
+}
+
+/**
+ * Half width in seconds of the blend at @a frame, which needs a previous
+ * and a next frame. Calculated from the segment durations in whole
+ * milliseconds, as they are sent to the microcontroller.
+ */
+double Timeline::blendWidth(int frame) const
+{
+    quint16 before = relativeTime(frame) * 1000;
+    quint16 after = relativeTime(frame+1) * 1000;
+
+    return spline::blendWidth((quint8)qBound(0, m_blends[frame], 100), before, after) / 1000.0;
+}
+
+JointVector Timeline::sample(double time) const
+{
+    if(isEmpty())
+        return JointVector();
+
+    int frame = seek(time);
+    if(frame == size()-1)
+        return angles(frame);
+
+    const double* times = m_times.constData();
+    double segment = times[frame+1] - times[frame];
+    double alpha = segment > 0 ? qBound(0.0, (time - times[frame]) / segment, 1.0) : 1.0;
+
+    spline::Basis<double> b;
+    spline::basis(m_interpolation, alpha, &b);
+
+    // The tangents depend on the neighbouring segments, like on the microcontroller
+    bool hasPrev = frame > 0;
+    bool hasNext = frame+2 < size();
+
+    // Fly-by blends at both ends of the segment (linear interpolation only)
+    double blend0 = 0;
+    double blend1 = 0;
+    if(m_interpolation == proto::IP_LINEAR)
+    {
+        if(hasPrev)
+            blend0 = blendWidth(frame);
+        if(hasNext)
+            blend1 = blendWidth(frame+1);
+    }
+    double w0 = blend0 - (time - times[frame]);
+    double w1 = blend1 - (times[frame+1] - time);
+
+    JointVector ret;
+    for(int i = 0; i < JointVector::MAX_JOINTS; ++i)
+    {
+        if(!contains(i))
+            continue;
+
+        const double* angles = m_angles[i].constData();
+        double diff = angles[frame+1] - angles[frame];
+        double m0 = 0;
+        double m1 = 0;
+
+        if(m_interpolation != proto::IP_LINEAR)
+        {
+            if(hasPrev)
+            {
+                m0 = spline::tangent(m_interpolation, angles[frame] - angles[frame-1],
+                    times[frame] - times[frame-1], diff, segment, segment);
+            }
+            if(hasNext)
+            {
+                m1 = spline::tangent(m_interpolation, diff, segment,
+                    angles[frame+2] - angles[frame+1], times[frame+2] - times[frame+1], segment);
+            }
+        }
+
+        ret[i] = spline::evaluate(b, angles[frame], diff, m0, m1);
+
+        if(w0 > 0)
+        {
+            double offset = spline::cornerOffset(angles[frame] - angles[frame-1],
+                times[frame] - times[frame-1], diff, segment, blend0);
+            ret[i] += spline::corner(offset, blend0, w0);
+        }
+        if(w1 > 0)
+        {
+            double offset = spline::cornerOffset(diff, segment,
+                angles[frame+2] - angles[frame+1], times[frame+2] - times[frame+1], blend1);
+            ret[i] += spline::corner(offset, blend1, w1);
+        }
+    }
+
+    return ret;
+}
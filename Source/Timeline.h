@@ -0,0 +1,129 @@
+// Seekable timeline of the played keyframes
+
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <QMetaType>
+#include <QVector>
+
+#include "JointVector.h"
+
+/**
+ * The frames the KeyframePlayer moves through, built by
+ * KeyframePlayer::playTheseFrames().
+ *
+ * Frame 0 is the start pose at time 0. Every further frame is reached
+ * relativeTime() seconds after the previous one, velocity() is the joint
+ * speed needed to get from a frame to the next one.
+ *
+ * The data is stored as structure of arrays: the frame times, and the
+ * angles and velocities of each joint, are contiguous. seek() is a binary
+ * search over the times. The arrays are implicitly shared, so a Timeline
+ * is cheap to copy and can be passed through queued connections (e.g. to
+ * the robot interface thread for the keyframe transfer).
+ *
+ * All frames contain the joints of the first one.
+ *
+ * sample() interpolates like the microcontroller does (see
+ * microcontroller/spline.h and the fly-by blends of proto::Keyframe), so
+ * the preview matches the playback.
+ **/
+class Timeline
+{
+public:
+    Timeline();
+
+    //! Remove all frames, the interpolation is kept
+    void clear();
+
+    //! Interpolation used by sample() (proto::Interpolation)
+    void setInterpolation(int interpolation);
+
+    inline int interpolation() const
+    { return m_interpolation; }
+
+    /**
+     * Append a frame which is reached @a relativeTime seconds after the
+     * last one. The velocities are not valid until computeVelocities()
+     * is called.
+     **/
+    void append(double relativeTime, const JointVector& angles, int outputCommand, int blend = 0);
+
+    //! Replace the angles, the output command and the blend of @a frame
+    void setFrame(int frame, const JointVector& angles, int outputCommand, int blend = 0);
+
+    //! Change the time between the previous frame and @a frame, the following frames are shifted
+    void setRelativeTime(int frame, double relativeTime);
+
+    //! Remove the frames from @a size on
+    void truncate(int size);
+
+    /**
+     * Velocities to reach the next frame in time for the frames @a first to
+     * @a last (-1: up to the end). Joints which do not move, zero-length
+     * segments and the last frame get @a defaultVelocity.
+     **/
+    void computeVelocities(double defaultVelocity, int first = 0, int last = -1);
+
+    inline int size() const
+    { return m_times.size(); }
+
+    inline bool isEmpty() const
+    { return m_times.isEmpty(); }
+
+    //! Absolute time of the last frame
+    double duration() const;
+
+    inline bool contains(int joint) const
+    { return m_joints & (1 << joint); }
+
+    //! Absolute time of @a frame
+    inline double time(int frame) const
+    { return m_times[frame]; }
+
+    //! Time between the previous frame and @a frame
+    inline double relativeTime(int frame) const
+    { return frame == 0 ? 0.0 : m_times[frame] - m_times[frame-1]; }
+
+    inline int outputCommand(int frame) const
+    { return m_outputCommands[frame]; }
+
+    //! Fly-by blend of @a frame in percent, see proto::Keyframe::blend
+    inline int blend(int frame) const
+    { return m_blends[frame]; }
+
+    inline double angle(int frame, int joint) const
+    { return m_angles[joint][frame]; }
+
+    //! Velocity from @a frame to the next one
+    inline double velocity(int frame, int joint) const
+    { return m_velocities[joint][frame]; }
+
+    JointVector angles(int frame) const;
+
+    /**
+     * The frame whose segment contains @a time, i.e. the last frame
+     * reached before @a time. Times past the end give the last frame.
+     **/
+    int seek(double time) const;
+
+    /**
+     * Interpolated angles at @a time, e.g. for preview. With spline
+     * interpolation, the joints stop at the first and the last frame.
+     **/
+    JointVector sample(double time) const;
+private:
+    double blendWidth(int frame) const;
+
+    QVector<double> m_times;
+    QVector<int> m_outputCommands;
+    QVector<int> m_blends;
+    QVector<double> m_angles[JointVector::MAX_JOINTS];
+    QVector<double> m_velocities[JointVector::MAX_JOINTS];
+    quint32 m_joints;
+    int m_interpolation;
+};
+
+Q_DECLARE_METATYPE(Timeline)
+
+#endif
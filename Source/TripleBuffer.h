@@ -0,0 +1,98 @@
+// Wait-free latest value handoff between two threads
+
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <QAtomicInt>
+#include <QtGlobal>
+
+/**
+ * Passes the latest value of type T from one producer thread to one
+ * consumer thread.
+ *
+ * There are three slots: one owned by the producer, one owned by the
+ * consumer and one in between which is exchanged with an atomic swap.
+ * Neither side ever waits for the other or allocates memory. If the
+ * producer publishes again before the consumer fetched the previous
+ * value, the previous value is replaced; overwritten() counts these.
+ *
+ * Producer:
+ * @code
+ *   buf.writeBuffer() = value;
+ *   buf.publish();
+ * @endcode
+ *
+ * Consumer:
+ * @code
+ *   if(buf.fetch())
+ *       use(buf.readBuffer());
+ * @endcode
+ *
+ * writeBuffer() contains an old value after publish(), so the producer
+ * has to write it completely each time.
+ **/
+template<class T>
+class TripleBuffer
+{
+public:
+    TripleBuffer()
+     : m_state(1)
+     , m_write(0)
+     , m_read(2)
+     , m_overwritten(0)
+    {}
+
+    //! Producer: slot for the next value
+    inline T& writeBuffer()
+    { return m_slots[m_write]; }
+
+    //! Producer: make the contents of writeBuffer() available
+    void publish()
+    {
+        int old = m_state.fetchAndStoreOrdered(m_write | FRESH);
+        m_write = old & INDEX_MASK;
+
+        if(old & FRESH)
+            m_overwritten.fetchAndAddRelaxed(1);
+    }
+
+    /**
+     * Consumer: switch readBuffer() to the latest published value.
+     *
+     * @return false if nothing was published since the last fetch()
+     **/
+    bool fetch()
+    {
+        // Only the consumer clears FRESH, so it cannot vanish after the test
+        if(!((int)m_state & FRESH))
+            return false;
+
+        int old = m_state.fetchAndStoreOrdered(m_read);
+        m_read = old & INDEX_MASK;
+        return true;
+    }
+
+    //! Consumer: value of the last successful fetch()
+    inline const T& readBuffer() const
+    { return m_slots[m_read]; }
+
+    //! Number of values replaced before the consumer fetched them
+    inline int overwritten() const
+    { return m_overwritten; }
+private:
+    Q_DISABLE_COPY(TripleBuffer)
+
+    enum
+    {
+        INDEX_MASK = 3,
+        FRESH = 4
+    };
+
+    T m_slots[3];
+    QAtomicInt m_state; // Index of the middle slot, FRESH if not fetched yet
+    int m_write;
+    int m_read;
+    QAtomicInt m_overwritten;
+};
+
+#endif
@@ -0,0 +1,232 @@
+// Allocation benchmark for the motion data path
+//
+// Runs the per-cycle joint data handling of the robot interface (feedback
+// decoding, motionOut() copy, KeyframePlayer::jointAnglesIn(),
+// RobotInterface::motionIn()) once with QHash<QString, double> as before
+// and once with JointVector, and counts the heap allocations per cycle.
+//
+// Qt containers allocate with qMalloc(), so malloc() itself is counted.
+// This needs glibc (__libc_malloc), i.e. Linux. The queued signal
+// delivery is not part of the measurement.
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QStringList>
+#include <QtGlobal>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "JointVector.h"
+
+static volatile bool g_counting = false;
+static volatile unsigned long g_allocations = 0;
+
+extern "C"
+{
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t num, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size)
+{
+    if(g_counting)
+        g_allocations++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t num, size_t size)
+{
+    if(g_counting)
+        g_allocations++;
+    return __libc_calloc(num, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    if(g_counting)
+        g_allocations++;
+    return __libc_realloc(ptr, size);
+}
+}
+
+static const int NUM_JOINTS = 5;
+static const int CYCLES = 100000;
+static const double DT = 0.01;
+
+// Limits and encoder scale, the same for all joints
+static const double LOWER_LIMIT = -1.5;
+static const double UPPER_LIMIT = 1.5;
+static const double ENC_TO_RAD = 2.0 * 3.14159265 / 14000.0;
+
+static int feedbackTicks(int cycle, int joint)
+{
+    return (cycle * (joint + 1)) % 4000 - 2000;
+}
+
+/**
+ * Joint data path with names as hash keys, as before JointVector.
+ **/
+class HashCycle
+{
+public:
+    HashCycle(const QStringList& names)
+     : m_names(names)
+    {
+        foreach(const QString& name, m_names)
+        {
+            m_rx[name] = 0.0;
+            m_tx[name] = 0.0;
+        }
+        m_rxVel = m_lastRx = m_txVel = m_corr = m_rx;
+    }
+
+    void run(int cycle)
+    {
+        // handle_extendedMode(): decode feedback
+        for(int i = 0; i < m_names.size(); ++i)
+        {
+            const QString& key = m_names[i];
+            m_rx[key] = feedbackTicks(cycle, i) * ENC_TO_RAD;
+            m_rxVel[key] = qAbs(m_rx[key] - m_lastRx[key]) / DT;
+        }
+        m_lastRx = m_rx;
+
+        // emit motionOut(): the queued connection keeps a copy
+        m_received = m_rx;
+        m_receivedVel = m_rxVel;
+
+        // KeyframePlayer::jointAnglesIn()
+        foreach(QString key, m_received.keys())
+            m_corr[key] = qBound(0.85, qAbs(m_tx[key] - m_received[key]) / (DT * (m_txVel[key] + 1.0)), 1.15);
+
+        // RobotInterface::motionIn()
+        QHashIterator<QString, double> it(m_rx);
+        while(it.hasNext())
+        {
+            it.next();
+            if(m_received.contains(it.key()))
+                m_tx[it.key()] = qBound(LOWER_LIMIT, m_received[it.key()], UPPER_LIMIT);
+            if(m_receivedVel.contains(it.key()))
+                m_txVel[it.key()] = qAbs(m_receivedVel[it.key()]);
+        }
+    }
+
+    double checksum() const
+    { return m_tx.value(m_names.first()) + m_corr.value(m_names.last()); }
+private:
+    QStringList m_names;
+    QHash<QString, double> m_rx;
+    QHash<QString, double> m_rxVel;
+    QHash<QString, double> m_lastRx;
+    QHash<QString, double> m_received;
+    QHash<QString, double> m_receivedVel;
+    QHash<QString, double> m_corr;
+    QHash<QString, double> m_tx;
+    QHash<QString, double> m_txVel;
+};
+
+/**
+ * The same with JointVector.
+ **/
+class VectorCycle
+{
+public:
+    VectorCycle()
+     : m_rx(0.0)
+     , m_tx(0.0)
+    {
+        m_rxVel = m_lastRx = m_txVel = m_corr = m_rx;
+    }
+
+    void run(int cycle)
+    {
+        for(int i = 0; i < NUM_JOINTS; ++i)
+        {
+            m_rx[i] = feedbackTicks(cycle, i) * ENC_TO_RAD;
+            m_rxVel[i] = qAbs(m_rx[i] - m_lastRx[i]) / DT;
+        }
+        m_lastRx = m_rx;
+
+        m_received = m_rx;
+        m_receivedVel = m_rxVel;
+
+        for(int i = 0; i < JointVector::MAX_JOINTS; ++i)
+        {
+            if(!m_received.contains(i))
+                continue;
+
+            m_corr[i] = qBound(0.85, qAbs(m_tx[i] - m_received[i]) / (DT * (m_txVel[i] + 1.0)), 1.15);
+        }
+
+        for(int i = 0; i < NUM_JOINTS; ++i)
+        {
+            if(m_received.contains(i))
+                m_tx[i] = qBound(LOWER_LIMIT, m_received[i], UPPER_LIMIT);
+            if(m_receivedVel.contains(i))
+                m_txVel[i] = qAbs(m_receivedVel[i]);
+        }
+    }
+
+    double checksum() const
+    { return m_tx[0] + m_corr[NUM_JOINTS-1]; }
+private:
+    JointVector m_rx;
+    JointVector m_rxVel;
+    JointVector m_lastRx;
+    JointVector m_received;
+    JointVector m_receivedVel;
+    JointVector m_corr;
+    JointVector m_tx;
+    JointVector m_txVel;
+};
+
+template<class Cycle>
+static void measure(const char* label, Cycle* cycle)
+{
+    // Warm up
+    cycle->run(0);
+
+    QElapsedTimer timer;
+    g_allocations = 0;
+    g_counting = true;
+    timer.start();
+
+    for(int i = 1; i <= CYCLES; ++i)
+        cycle->run(i);
+
+    qint64 ns = timer.nsecsElapsed();
+    g_counting = false;
+
+    printf("%-12s %8.2f allocations/cycle %8.1f ns/cycle (checksum %f)\n",
+        label, (double)g_allocations / CYCLES, (double)ns / CYCLES, cycle->checksum()
+    );
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+
+    JointInfo::List config;
+    QStringList names;
+    for(int i = 0; i < NUM_JOINTS; ++i)
+    {
+        JointInfo joint;
+        joint.name = QString("Joint%1").arg(i);
+        joint.address = i + 1;
+        config.append(joint);
+        names << joint.name;
+    }
+    JointVector::setJointConfig(config);
+
+    printf("%d joints, %d cycles\n", NUM_JOINTS, CYCLES);
+
+    HashCycle hash(names);
+    measure("QHash", &hash);
+
+    VectorCycle vector;
+    measure("JointVector", &vector);
+
+    return 0;
+}
@@ -0,0 +1,188 @@
+// Round trip latency benchmark for the serial link
+//
+// Measures the time of single CMD_FEEDBACK exchanges (request written
+// until the complete answer is parsed), i.e. the feedback path of the
+// robot interface without pipelining. Run it against the real board or
+// against the simulated one on a pty:
+//
+//   igus_sim_pty 5 /tmp/igus &    (built in microcontroller/ on the host)
+//   serial_latency_bench /tmp/igus
+//
+// Each run is done twice: waking up on the first received byte (read
+// threshold 1, as RobotInterface does) and only once the whole answer is
+// buffered.
+//
+// Usage: serial_latency_bench <device> [exchanges]
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QString>
+#include <QVector>
+#include <QtAlgorithms>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "SerialLinux.h"
+#include "PacketFramer.h"
+#include "microcontroller/protocol.h"
+
+typedef proto::Packet<proto::CMD_FEEDBACK, proto::Feedback> FeedbackAnswer;
+
+static const int WAIT_TIMEOUT = 100; // ms
+
+struct Result
+{
+    QVector<qint64> latencies; // ns
+    long wakeups;
+    int timeouts;
+};
+
+/**
+ * Send @a request and wait for the answer with the same sequence number.
+ *
+ * @return false on timeout
+ **/
+template<class Cmd>
+static bool exchange(CSerial* serial, PacketFramer* framer, Cmd request, uint8_t sequence, long* wakeups)
+{
+    request.header.sequence = sequence;
+    request.checksum = request.currentChecksum();
+
+    if(serial->write(&request, sizeof(request)) != 0)
+        return false;
+
+    while(1)
+    {
+        int space;
+        uint8_t* buf = framer->writeBuffer(&space);
+
+        int ret = serial->read(buf, space);
+        if(ret < 0)
+            return false;
+
+        if(ret == 0)
+        {
+            if(serial->WaitEvent(WAIT_TIMEOUT) != ERROR_SUCCESS)
+                return false;
+
+            (*wakeups)++;
+            continue;
+        }
+
+        framer->written(ret);
+
+        while(framer->poll())
+        {
+            if(framer->header().sequence == sequence)
+                return true;
+        }
+    }
+}
+
+static void measure(CSerial* serial, PacketFramer* framer, int exchanges, Result* result)
+{
+    proto::SimplePacket<proto::CMD_FEEDBACK> request;
+
+    result->latencies.clear();
+    result->latencies.reserve(exchanges);
+    result->wakeups = 0;
+    result->timeouts = 0;
+
+    QElapsedTimer timer;
+
+    for(int i = 0; i < exchanges; ++i)
+    {
+        // Sequence 0 is reserved for CMD_INIT
+        uint8_t sequence = 1 + i % 255;
+
+        timer.start();
+        if(!exchange(serial, framer, request, sequence, &result->wakeups))
+        {
+            result->timeouts++;
+            framer->reset();
+            continue;
+        }
+
+        result->latencies.append(timer.nsecsElapsed());
+    }
+}
+
+static void print(const char* label, const Result& result)
+{
+    QVector<qint64> sorted = result.latencies;
+    qSort(sorted);
+
+    int n = sorted.size();
+    if(n == 0)
+    {
+        printf("%-22s no answers (%d timeouts)\n", label, result.timeouts);
+        return;
+    }
+
+    qint64 sum = 0;
+    foreach(qint64 t, sorted)
+        sum += t;
+
+    printf("%-22s min %6.1f  avg %6.1f  p50 %6.1f  p99 %6.1f  max %7.1f us, %.2f wakeups/exchange, %d timeouts\n",
+        label,
+        sorted.first() / 1000.0,
+        (double)sum / n / 1000.0,
+        sorted[n / 2] / 1000.0,
+        sorted[qMin(n - 1, (n * 99) / 100)] / 1000.0,
+        sorted.last() / 1000.0,
+        (double)result.wakeups / n,
+        result.timeouts
+    );
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+
+    if(argc < 2)
+    {
+        fprintf(stderr, "Usage: serial_latency_bench <device> [exchanges]\n");
+        return 1;
+    }
+
+    int exchanges = (argc > 2) ? atoi(argv[2]) : 2000;
+
+    CSerial serial;
+    if(!serial.Open(argv[1]))
+    {
+        fprintf(stderr, "Could not open %s: error %ld\n", argv[1], serial.GetLastError());
+        return 1;
+    }
+
+    serial.Setup(CSerial::EBaud115200, CSerial::EData8, CSerial::EParNone, CSerial::EStop1);
+    serial.SetupHandshaking(CSerial::EHandshakeOff);
+
+    PacketFramer framer;
+
+    // Enter extended mode
+    long wakeups = 0;
+    if(!exchange(&serial, &framer, proto::SimplePacket<proto::CMD_INIT>(), 0, &wakeups))
+    {
+        fprintf(stderr, "No answer to CMD_INIT\n");
+        return 1;
+    }
+
+    printf("%s: %d exchanges of CMD_FEEDBACK (%d bytes answer)\n",
+        argv[1], exchanges, (int)sizeof(FeedbackAnswer));
+
+    Result result;
+
+    serial.SetReadThreshold(1);
+    measure(&serial, &framer, exchanges, &result);
+    print("threshold 1 byte:", result);
+
+    serial.SetReadThreshold(sizeof(FeedbackAnswer));
+    measure(&serial, &framer, exchanges, &result);
+    print("threshold full answer:", result);
+
+    serial.SetReadThreshold(1);
+    exchange(&serial, &framer, proto::SimplePacket<proto::CMD_EXIT>(), 1, &wakeups);
+
+    return 0;
+}
@@ -0,0 +1,263 @@
+// Check of the patched keyframe timeline
+//
+// KeyframePlayer::playTheseFrames() only patches the segments around the
+// keyframes which changed since the last call. This program edits random
+// keyframe sequences the way the editor does (through the Keyframe
+// setters, so the changed() signals mark the keyframes), and after each
+// step compares the patched timeline with one compiled from scratch by a
+// second player. Both have to be identical: times, output commands,
+// blends, angles and velocities of all frames.
+//
+// It also reports the time of a patch and of a full compile for the
+// same edits. Keyframe is a widget, so this needs a display, e.g.
+//
+//   xvfb-run timeline_patch_test
+//
+// The exit code is 1 if a patched timeline differs.
+//
+// Usage: timeline_patch_test [sequences]
+
+#include <QApplication>
+#include <QElapsedTimer>
+#include <QList>
+#include <QPointer>
+#include <QtAlgorithms>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Keyframe.h"
+#include "KeyframePlayer.h"
+#include "JointConfiguration.h"
+#include "JointVector.h"
+#include "Timeline.h"
+#include "microcontroller/protocol.h"
+
+static const int NUM_JOINTS = 3;
+static const int JOINT_ADDRESSES[NUM_JOINTS] = {1, 2, 4};
+static const int STEPS = 10;
+
+// The patch computes the same values as a full compile, but the frame
+// times are sums in a different order.
+static const double TIME_TOLERANCE = 1e-9;
+
+static double randomAngle()
+{
+    return 0.01 * (rand() % 301 - 150);
+}
+
+static JointVector randomAngles()
+{
+    JointVector angles;
+    for(int i = 0; i < NUM_JOINTS; ++i)
+        angles[JOINT_ADDRESSES[i]-1] = randomAngle();
+    return angles;
+}
+
+static void randomize(Keyframe* kf)
+{
+    kf->motionIn(randomAngles());
+    kf->setSpeed(10 + rand() % 91);
+    kf->setPause((rand() % 3 == 0) ? 0.5 * (1 + rand() % 4) : 0.0);
+    kf->setBlend((rand() % 2 == 0) ? rand() % 101 : 0);
+    kf->setOutputCommand(rand() % Keyframe::DO_COUNT);
+}
+
+/**
+ * One editor action on a random keyframe, mostly values which only need
+ * a patch, sometimes a pause which needs a full compile.
+ **/
+static void edit(const QList< QPointer<Keyframe> >& keyframes)
+{
+    Keyframe* kf = keyframes[rand() % keyframes.size()];
+
+    switch(rand() % 6)
+    {
+        case 0:
+        {
+            JointVector angles = kf->jointAngles;
+            angles[JOINT_ADDRESSES[rand() % NUM_JOINTS]-1] = randomAngle();
+            kf->motionIn(angles);
+            break;
+        }
+        case 1:
+            kf->setSpeed(10 + rand() % 91);
+            break;
+        case 2:
+            kf->setBlend((rand() % 3 == 0) ? rand() % 101 : 0);
+            break;
+        case 3:
+            kf->setOutputCommand(rand() % Keyframe::DO_COUNT);
+            break;
+        case 4:
+            // Changes the pause, but keeps it on or off. Without a pause,
+            // the keyframe reports a change without a new value.
+            if(kf->getPause() > 0)
+                kf->setPause(0.5 * (1 + rand() % 4));
+            else
+                kf->setSpeed(kf->getSpeed());
+            break;
+        default:
+            kf->setPause(kf->getPause() > 0 ? 0.0 : 1.0);
+            break;
+    }
+}
+
+/**
+ * @return the first frame which differs, or -1
+ **/
+static int compare(const Timeline& a, const Timeline& b)
+{
+    if(a.size() != b.size())
+        return qMin(a.size(), b.size());
+
+    for(int frame = 0; frame < a.size(); ++frame)
+    {
+        if(fabs(a.time(frame) - b.time(frame)) > TIME_TOLERANCE
+            || a.outputCommand(frame) != b.outputCommand(frame)
+            || a.blend(frame) != b.blend(frame))
+            return frame;
+
+        for(int j = 0; j < JointVector::MAX_JOINTS; ++j)
+        {
+            if(a.contains(j) != b.contains(j))
+                return frame;
+            if(!a.contains(j))
+                continue;
+
+            if(a.angle(frame, j) != b.angle(frame, j)
+                || fabs(a.velocity(frame, j) - b.velocity(frame, j)) > TIME_TOLERANCE)
+                return frame;
+        }
+    }
+
+    return -1;
+}
+
+struct Result
+{
+    int checks;
+    int mismatches;
+    qint64 patchTime;   // ns
+    qint64 compileTime; // ns
+};
+
+static void run(const JointInfo::ListPtr& config, int sequences, Result* result)
+{
+    for(int s = 0; s < sequences; ++s)
+    {
+        int n = 2 + rand() % 14;
+
+        QList< QPointer<Keyframe> > keyframes;
+        for(int i = 0; i < n; ++i)
+        {
+            Keyframe* kf = new Keyframe(0);
+            randomize(kf);
+            keyframes << kf;
+        }
+
+        KeyframePlayer player;
+        player.setJointConfig(config);
+        player.looped = (rand() % 2 == 0);
+        player.playTheseFrames(keyframes);
+
+        for(int step = 0; step < STEPS; ++step)
+        {
+            int edits = rand() % 4;
+            for(int e = 0; e < edits; ++e)
+                edit(keyframes);
+
+            if(rand() % 5 == 0)
+                player.looped = !player.looped;
+
+            QElapsedTimer timer;
+            timer.start();
+            player.playTheseFrames(keyframes);
+            result->patchTime += timer.nsecsElapsed();
+
+            KeyframePlayer reference;
+            reference.setJointConfig(config);
+            reference.looped = player.looped;
+
+            timer.restart();
+            reference.playTheseFrames(keyframes);
+            result->compileTime += timer.nsecsElapsed();
+
+            result->checks++;
+
+            int frame = compare(player.playingList(), reference.playingList());
+            if(frame >= 0)
+            {
+                if(result->mismatches == 0)
+                {
+                    printf("  sequence %d, step %d: patched timeline differs at frame %d\n",
+                        s, step, frame
+                    );
+                }
+                result->mismatches++;
+            }
+        }
+
+        qDeleteAll(keyframes);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    QApplication app(argc, argv);
+
+    int sequences = 200;
+    if(argc > 1)
+        sequences = qMax(1, atoi(argv[1]));
+
+    JointInfo::ListPtr config(new JointInfo::List);
+    for(int i = 0; i < NUM_JOINTS; ++i)
+    {
+        JointInfo joint;
+        joint.name = QString("Joint%1").arg(i);
+        joint.address = JOINT_ADDRESSES[i];
+        joint.max_velocity = 0.5 + i;
+        joint.max_acceleration = (i == 0) ? 0.0 : 2.0 * i;
+        config->append(joint);
+    }
+    JointVector::setJointConfig(*config);
+
+    struct Variant
+    {
+        const char* label;
+        int interpolation;
+        int lookahead;
+    };
+    const Variant variants[] = {
+        {"linear", proto::IP_LINEAR, 200},
+        {"cubic", proto::IP_CUBIC, 200},
+        {"minjerk", proto::IP_MIN_JERK, 200},
+        {"lookahead 0", proto::IP_LINEAR, 0}
+    };
+
+    printf("%d sequences with %d edit steps each\n", sequences, STEPS);
+
+    bool ok = true;
+    srand(1);
+    for(unsigned int v = 0; v < sizeof(variants) / sizeof(variants[0]); ++v)
+    {
+        config->interpolation = variants[v].interpolation;
+        config->lookahead = variants[v].lookahead;
+
+        Result result = {0, 0, 0, 0};
+        run(config, sequences, &result);
+
+        printf("%-12s %5d checks, %d mismatches, patch %7.1f us, compile %7.1f us%s\n",
+            variants[v].label, result.checks, result.mismatches,
+            result.patchTime / 1000.0 / result.checks,
+            result.compileTime / 1000.0 / result.checks,
+            result.mismatches ? "" : " ok"
+        );
+
+        if(result.mismatches)
+            ok = false;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,4 @@
+TEMPLATE = subdirs
+SUBDIRS = jointvector_bench.pro \
+    timeline_patch_test.pro
+unix:SUBDIRS += serial_latency_bench.pro
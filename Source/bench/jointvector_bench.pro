@@ -0,0 +1,9 @@
+TEMPLATE = app
+TARGET = jointvector_bench
+QT += core
+QT -= gui
+INCLUDEPATH += ..
+HEADERS += ../JointVector.h
+SOURCES += JointVectorBench.cpp \
+    ../JointVector.cpp
+CONFIG += console
@@ -0,0 +1,11 @@
+TEMPLATE = app
+TARGET = serial_latency_bench
+QT += core
+QT -= gui
+INCLUDEPATH += ..
+HEADERS += ../SerialLinux.h \
+    ../PacketFramer.h
+SOURCES += SerialLatencyBench.cpp \
+    ../SerialLinux.cpp \
+    ../PacketFramer.cpp
+CONFIG += console
@@ -0,0 +1,29 @@
+TEMPLATE = app
+TARGET = timeline_patch_test
+QT += core \
+    gui \
+    xml \
+    opengl
+INCLUDEPATH += ..
+HEADERS += ../Keyframe.h \
+    ../KeyframePlayer.h \
+    ../RobotView3D.h \
+    ../ViewJoint.h \
+    ../Timeline.h \
+    ../SpeedProfile.h \
+    ../JointConfiguration.h \
+    ../JointVector.h
+SOURCES += TimelinePatchTest.cpp \
+    ../Keyframe.cpp \
+    ../KeyframePlayer.cpp \
+    ../RobotView3D.cpp \
+    ../ViewJoint.cpp \
+    ../Timeline.cpp \
+    ../SpeedProfile.cpp \
+    ../JointConfiguration.cpp \
+    ../JointVector.cpp
+win32:INCLUDEPATH += c:\\workspace\\libQGLViewer
+win32:LIBS += -Lc:\\workspace\\libQGLViewer\\QGLViewer\\release \
+    -lQGLViewer2
+unix:LIBS += -lQGLViewer
+CONFIG += console
@@ -1,25 +1,48 @@
 #include "flashtool.h"
 #include "ui_flashtool.h"
 
+#include <QtCore/qglobal.h>
+
+#ifdef Q_OS_WIN
 #define _WIN32_WINDOWS 0x0410
 #define WINVER 0x0500
 
 #include "../Serial.h"
+#else
+#include "../SerialLinux.h"
+#endif
+#include "../PortDiscovery.h"
 #include "../microcontroller/protocol.h"
 
 
-
+#ifdef Q_OS_WIN
 #include <Windows.h>
 #include <winuser.h>
 #include <dbt.h>
 #include <basetyps.h>
 #include <initguid.h>
 #include <ddk/ntddser.h>
+#endif
 
 #include <QtCore/QDebug>
+#include <QtCore/QDir>
 #include <QtCore/QProcess>
 #include <QtGui/QMessageBox>
 
+#include <string.h>
+
+// avrdude is shipped in microcontroller/ on Windows and taken from PATH elsewhere
+static void startAvrdude(const QStringList& avrdudeArgs)
+{
+#ifdef Q_OS_WIN
+    QStringList args;
+    args << "/K" << "microcontroller\\avrdude.exe" << avrdudeArgs;
+    QProcess::startDetached("cmd.exe", args);
+#else
+    QProcess::startDetached("avrdude", avrdudeArgs);
+#endif
+}
+
 
 FlashTool::FlashTool(QWidget *parent)
  : QWidget(parent)
@@ -29,6 +52,7 @@ FlashTool::FlashTool(QWidget *parent)
 
     updatePorts();
 
+#ifdef Q_OS_WIN
     // Listen to device events
     DEV_BROADCAST_DEVICEINTERFACE devInt;
     ZeroMemory(&devInt, sizeof(devInt));
@@ -38,7 +62,11 @@ FlashTool::FlashTool(QWidget *parent)
 
     HANDLE blub;
     blub = RegisterDeviceNotification(winId(), &devInt, DEVICE_NOTIFY_WINDOW_HANDLE);
-
+#else
+    PortDiscovery* discovery = new PortDiscovery(this);
+    connect(discovery, SIGNAL(portsChanged()), SLOT(updatePorts()));
+    discovery->start();
+#endif
 
     connect(ui->bootFlashButton, SIGNAL(clicked()), SLOT(flashBootloader()));
     connect(ui->flashButton, SIGNAL(clicked()), SLOT(flashFirmware()));
@@ -56,13 +84,14 @@ void FlashTool::updatePorts()
     ui->progPortBox->clear();
     ui->ucPortBox->clear();
 
-    for(int i = 1; i < 50; ++i)
+    // Only ports which are present, skip the ones in use
+    foreach(const QString& path, PortDiscovery::availablePorts())
     {
-        QString path = "\\\\.\\COM" + QString::number(i);
         if(serial.Open(path))
         {
-            ui->progPortBox->addItem("COM" + QString::number(i), path);
-            ui->ucPortBox->addItem("COM" + QString::number(i), path);
+            QString name = PortDiscovery::displayName(path);
+            ui->progPortBox->addItem(name, path);
+            ui->ucPortBox->addItem(name, path);
             serial.close();
         }
     }
@@ -70,6 +99,7 @@ void FlashTool::updatePorts()
     ui->progPortBox->addItem("usb (e.g. AVRISP mkII)", "usb");
 }
 
+#ifdef Q_OS_WIN
 bool FlashTool::winEvent(MSG *message, long *)
 {
     //qDebug() << message;
@@ -77,22 +107,21 @@ bool FlashTool::winEvent(MSG *message, long *)
         updatePorts();
     return false;
 }
+#endif
 
 void FlashTool::flashBootloader()
 {
-    QString prog = "cmd.exe";
     QStringList args;
     args
-         << "/K" << "microcontroller\\avrdude.exe"
          << "-c" << ui->progTypeBox->currentText()
          << "-p" << "atmega2560"
          << "-P" << ui->progPortBox->itemData(ui->progPortBox->currentIndex()).toString()
          << "-U" << "lfuse:w:0xCE:m"
          << "-U" << "hfuse:w:0xD4:m"
          << "-U" << "efuse:w:0xFC:m"
-         << "-U" << "flash:w:microcontroller\\bootloader.hex";
+         << "-U" << "flash:w:" + QDir::toNativeSeparators("microcontroller/bootloader.hex");
 
-    QProcess::startDetached(prog, args);
+    startAvrdude(args);
     return;
 }
 
@@ -134,16 +163,14 @@ void FlashTool::flashFirmware()
 {
     enterBootloader();
 
-    QString prog = "cmd.exe";
     QStringList args;
     args
-         << "/K" << "microcontroller\\avrdude.exe"
          << "-c" << "avr109"
          << "-p" << "atmega2560"
          << "-b" << "115200"
          << "-P" << ui->ucPortBox->itemData(ui->ucPortBox->currentIndex()).toString()
-         << "-U" << "flash:w:microcontroller\\microcontroller.hex";
+         << "-U" << "flash:w:" + QDir::toNativeSeparators("microcontroller/microcontroller.hex");
 
-    QProcess::startDetached(prog, args);
+    startAvrdude(args);
     return;
 }
@@ -15,7 +15,9 @@ public:
     explicit FlashTool(QWidget *parent = 0);
     ~FlashTool();
 
+#ifdef Q_OS_WIN
     virtual bool winEvent(MSG *message, long *result);
+#endif
 private slots:
     void updatePorts();
     void flashBootloader();
@@ -11,10 +11,19 @@ TEMPLATE = app
 
 
 SOURCES += main.cpp\
-        flashtool.cpp\
-        ../serial.cpp
+        flashtool.cpp \
+        ../PortDiscovery.cpp
 
-HEADERS  += flashtool.h
+win32:SOURCES += ../Serial.cpp
+unix:SOURCES += ../SerialLinux.cpp
+unix:packagesExist(libudev) {
+    CONFIG += link_pkgconfig
+    PKGCONFIG += libudev
+    DEFINES += HAVE_UDEV
+}
+
+HEADERS  += flashtool.h \
+        ../PortDiscovery.h
 
 FORMS    += \
     flashtool.ui
@@ -10,7 +10,7 @@
 #define EPSILON 0.0001
 
 
-#define SERIALCOMRATE 16.39 // Frequency of the serial communication loop in Hz.
+#define SERIALCOMRATE 100.0 // Default target rate of the extended mode exchanges in Hz (0 = as fast as the link allows).
 #define JOYSTICKRATE 25.0 // Frequency of the joystick stream.
 #define MOTIONSAMPLERATE 50.0 // Frequency of the motion sampling of the keyframe player.
 #define SERVOSPEEDMAX 4.0 // Maximum speed of the servos in rad per second.
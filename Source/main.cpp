@@ -10,6 +10,14 @@ int main(int argc, char *argv[])
     // Register custom types
     qRegisterMetaType<JointInfo::ListPtr>("JointInfo::ListPtr");
 
+    // Joint angles and velocities are passed through queued connections
+    // between the robot interface thread and the GUI.
+    qRegisterMetaType<JointVector>("JointVector");
+    qRegisterMetaType<RobotInterface::CommStats>("RobotInterface::CommStats");
+
+    // The keyframe transfer gets its own copy of the timeline
+    qRegisterMetaType<Timeline>("Timeline");
+
 	// Apply a stylesheet to the application.
 	QFile file("styles.css");
 	file.open(QFile::ReadOnly);
@@ -5,7 +5,7 @@
 #define COMBUF_H
 
 #include <stdint.h>
-#include <util/atomic.h>
+#include "hal.h"
 
 const int BUFSIZE = 256;
 const int BUFSIZE_MASK = BUFSIZE - 1;
@@ -72,7 +72,7 @@ public:
 			if(m_read_idx != m_write_idx)
 				m_read_idx = (m_read_idx + 1) & BUFSIZE_MASK;
 			else
-				PORTJ &= ~(1 << 7);
+				hal_setLed(false);
 		}
 
 		return c;
@@ -5,24 +5,37 @@
 
 #include "protocol.h"
 #include "combuf.h"
-#include "uart.h"
+#include "hal.h"
 #include "mem.h"
 #include "motion.h"
+#include "nanotec.h"
 
 #include <string.h>
-#include <util/delay.h>
 
 const int PAYLOAD_BUFSIZE = 256;
 uint8_t payloadBuffer[PAYLOAD_BUFSIZE];
 
 bool g_extShouldQuit = false;
 
+//! Sequence number of the command being handled, echoed in the answer
+uint8_t g_sequence = 0;
+
+// Feedback subscription, see proto::Subscribe
+uint16_t g_pushPeriod = 0;     //!< ms, 0 = not subscribed
+uint32_t g_pushLast = 0;       //!< hal_micros() of the last packet
+uint32_t g_pushRenewed = 0;    //!< hal_micros() of the last CMD_SUBSCRIBE
+uint8_t g_pushSequence = 0;
+
+//! Identifies this run of the µC, see proto::Session. 0 = not chosen yet
+uint32_t g_sessionId = 0;
+
 enum ParserState
 {
 	PS_START,
 	PS_VERSION,
 	PS_COMMAND,
 	PS_LENGTH,
+	PS_SEQUENCE,
 	PS_PAYLOAD,
 	PS_CHECKSUM,
 	PS_END
@@ -31,35 +44,184 @@ enum ParserState
 template<class T>
 void writeAnswer(const T& data)
 {
-	com_buf_to_pc.putData((const uint8_t*)&data, sizeof(data));
-	uart_pc->startTransmitting();
+	T answer = data;
+	answer.header.sequence = g_sequence;
+	answer.checksum = answer.currentChecksum();
+
+	com_buf_to_pc.putData((const uint8_t*)&answer, sizeof(answer));
+	hal_pcStartTransmitting();
 	while(com_buf_to_pc.available());
 }
 
-template<int CMD_CODE>
-void writeFeedbackPacket()
+void fillFeedback(proto::Feedback* feedback)
 {
-	proto::Packet<CMD_CODE, proto::Feedback> answer;
-	answer.payload.num_axes = mem_config.active_axes;
+	feedback->num_axes = mem_config.active_axes;
 
-	answer.payload.flags = 0;
+	feedback->flags = 0;
 	if(motion_isPlaying())
-		answer.payload.flags |= proto::FF_PLAYING;
+		feedback->flags |= proto::FF_PLAYING;
+
+	uint32_t sampled[proto::NUM_AXES];
+	for(uint8_t i = 0; i < mem_config.active_axes && i < proto::NUM_AXES; ++i)
+		feedback->positions[i] = motion_feedback(i, &sampled[i]);
+
+	feedback->time = hal_micros();
+
+	for(uint8_t i = 0; i < proto::NUM_AXES; ++i)
+	{
+		feedback->sample_age[i] = 0xFF;
 
-	for(uint8_t i = 0; i < mem_config.active_axes; ++i)
-		answer.payload.positions[i] = motion_feedback(i);
+		if(i >= mem_config.active_axes || feedback->positions[i] == 0x7FFF)
+			continue;
+
+		uint32_t age = (feedback->time - sampled[i]) / proto::SAMPLE_AGE_UNIT;
+		if(age < 0xFF)
+			feedback->sample_age[i] = age;
+	}
+
+	motion_streamFeedback(feedback);
+}
+
+template<int CMD_CODE>
+void writeFeedbackPacket()
+{
+	proto::Packet<CMD_CODE, proto::Feedback> answer;
+	fillFeedback(&answer.payload);
 
 	answer.updateChecksum();
 	writeAnswer(answer);
 }
 
+void cmd_poll()
+{
+	if(!g_pushPeriod)
+		return;
+
+	uint32_t now = hal_micros();
+
+	if(now - g_pushRenewed > 1000UL * proto::SUBSCRIBE_TIMEOUT)
+	{
+		// The PC is gone
+		g_pushPeriod = 0;
+		return;
+	}
+
+	if(now - g_pushLast < 1000UL * g_pushPeriod)
+		return;
+
+	// Do not wait for the PC link here, this is called from the control
+	// loop. Skip the packet if the last one is still being sent.
+	if(com_buf_to_pc.available())
+		return;
+
+	g_pushLast = now;
+
+	proto::Packet<proto::CMD_SUBSCRIBE, proto::Feedback> packet;
+	fillFeedback(&packet.payload);
+	packet.header.sequence = g_pushSequence++;
+	packet.updateChecksum();
+
+	com_buf_to_pc.putData((const uint8_t*)&packet, sizeof(packet));
+	hal_pcStartTransmitting();
+}
+
+/**
+ * Change and read the state of several motor controllers,
+ * see proto::AxisCommand.
+ **/
+void axisCommand(const proto::AxisCommand& cmd, proto::AxisStatus* status)
+{
+	for(uint8_t i = 0; i < proto::NUM_AXES; ++i)
+	{
+		status->state[i] = -1;
+		status->positions[i] = 0x7FFF;
+
+		if(!(cmd.axes & (1 << i)))
+			continue;
+
+		uint8_t id = i+1;
+		int8_t state = nt_state(id);
+		if(state < 0)
+			continue;
+
+		if(cmd.set_state != proto::AXIS_KEEP_STATE && state != cmd.set_state
+			&& (cmd.if_state == proto::AXIS_ANY_STATE || state == cmd.if_state))
+		{
+			nt_setState(id, cmd.set_state);
+			state = nt_state(id);
+		}
+
+		status->state[i] = state;
+
+		int16_t position;
+		if(nt_encoderPosition(id, &position))
+			status->positions[i] = position;
+	}
+}
+
+/**
+ * Switch all active axes to hardware compliance or back to the currents
+ * from the configuration.
+ *
+ * @return Bit mask of the axes which did not acknowledge
+ **/
+uint8_t setCompliance(bool compliant)
+{
+	uint8_t failed = 0;
+
+	for(uint8_t i = 0; i < mem_config.active_axes && i < proto::NUM_AXES; ++i)
+	{
+		uint8_t hold = compliant ? 0 : mem_config.hold_current[i];
+		uint8_t max = compliant ? 0 : mem_config.max_current[i];
+
+		if(!nt_setCurrents(i+1, hold, max))
+			failed |= (1 << i);
+	}
+
+	return failed;
+}
+
+void fillSession(proto::Session* session)
+{
+	// The time of the first connection after a reset is as good as random
+	if(!g_sessionId)
+		g_sessionId = hal_micros() | 1;
+
+	session->id = g_sessionId;
+
+	proto::SequenceCrc crc;
+	motion_sequenceCrc(&crc);
+	session->config_crc = crc.config;
+	session->sequence_crc = proto::crcUpdate(0xFFFF, crc.blocks, sizeof(crc.blocks));
+
+	session->flags = 0;
+	session->ready = 0;
+
+	if(motion_isPlaying())
+	{
+		// The control loop owns the bus, and the axes are obviously initialized
+		session->flags |= proto::FF_PLAYING;
+		session->ready = (1 << mem_config.active_axes) - 1;
+		return;
+	}
+
+	for(uint8_t i = 0; i < mem_config.active_axes && i < proto::NUM_AXES; ++i)
+	{
+		int8_t state = nt_state(i+1);
+		if(state == NT_STATE_IDLE || state == NT_STATE_COMPLIANCE)
+			session->ready |= (1 << i);
+	}
+}
+
 void handleCommand(uint8_t command, const uint8_t* payload, uint8_t length)
 {
 	switch(command)
 	{
 		case proto::CMD_INIT:
 		{
-			proto::SimplePacket<proto::CMD_INIT> answer;
+			proto::Packet<proto::CMD_INIT, proto::Session> answer;
+			fillSession(&answer.payload);
+			answer.updateChecksum();
 			writeAnswer(answer);
 		}
 			break;
@@ -74,12 +236,56 @@ void handleCommand(uint8_t command, const uint8_t* payload, uint8_t length)
 		{
 			const proto::SaveKeyframe& packet = *((const proto::SaveKeyframe*)payload);
 
-			if(length != sizeof(packet) || motion_isPlaying())
+			if(length != sizeof(packet))
+				return;
+
+			proto::Packet<proto::CMD_SAVE_KEYFRAME, proto::ConfigStatus> answer;
+			answer.payload.result = proto::CR_OK;
+
+			// The EEPROM writer copies g_buffer byte by byte
+			if(motion_isPlaying() || mem_commitBusy())
+				answer.payload.result = proto::CR_BUSY;
+			else
+				motion_writeToBuffer(packet.index, packet.keyframe);
+
+			answer.updateChecksum();
+			writeAnswer(answer);
+		}
+			break;
+		case proto::CMD_SAVE_KEYFRAMES:
+		{
+			const proto::SaveKeyframes& packet = *((const proto::SaveKeyframes*)payload);
+
+			if(length != sizeof(packet))
 				return;
 
-			motion_writeToBuffer(packet.index, packet.keyframe);
+			proto::Packet<proto::CMD_SAVE_KEYFRAMES, proto::ConfigStatus> answer;
+			answer.payload.result = proto::CR_OK;
+
+			if(packet.count > proto::KEYFRAMES_PER_PACKET
+				|| packet.index + packet.count > proto::MAX_KEYFRAMES)
+			{
+				answer.payload.result = proto::CR_INVALID;
+			}
+			else if(motion_isPlaying() || mem_commitBusy())
+			{
+				answer.payload.result = proto::CR_BUSY;
+			}
+			else
+			{
+				for(uint8_t i = 0; i < packet.count; ++i)
+					motion_writeToBuffer(packet.index + i, packet.keyframes[i]);
+			}
 
-			proto::SimplePacket<proto::CMD_SAVE_KEYFRAME> answer;
+			answer.updateChecksum();
+			writeAnswer(answer);
+		}
+			break;
+		case proto::CMD_CRC:
+		{
+			proto::Packet<proto::CMD_CRC, proto::SequenceCrc> answer;
+			motion_sequenceCrc(&answer.payload);
+			answer.updateChecksum();
 			writeAnswer(answer);
 		}
 			break;
@@ -98,17 +304,35 @@ void handleCommand(uint8_t command, const uint8_t* payload, uint8_t length)
 			break;
 		case proto::CMD_CONFIG:
 		{
-			if(motion_isPlaying())
-				return;
-
 			if(length == sizeof(proto::Config))
 			{
-				mem_config = *((const proto::Config*)payload);
+				const proto::Config& config = *((const proto::Config*)payload);
+
+				proto::Packet<proto::CMD_CONFIG, proto::ConfigStatus> answer;
+				answer.payload.result = proto::CR_OK;
+
+				// The control slots index the per-axis arrays with
+				// active_axes, and mem_init() would drop a different
+				// layout after the next reset.
+				if(config.active_axes == 0 || config.active_axes > proto::NUM_AXES
+					|| config.layout != proto::CONFIG_LAYOUT)
+				{
+					answer.payload.result = proto::CR_INVALID;
+				}
+				else if(motion_isPlaying() || mem_commitBusy())
+				{
+					// The EEPROM writer copies mem_config byte by byte
+					answer.payload.result = proto::CR_BUSY;
+				}
+				else
+				{
+					mem_config = config;
 
-				// Trigger first output command if we are in the starting position
-				motion_isInStartPosition();
+					// Trigger first output command if we are in the starting position
+					motion_isInStartPosition();
+				}
 
-				proto::SimplePacket<proto::CMD_CONFIG> answer;
+				answer.updateChecksum();
 				writeAnswer(answer);
 			}
 			else if(length == 0)
@@ -123,13 +347,31 @@ void handleCommand(uint8_t command, const uint8_t* payload, uint8_t length)
 		case proto::CMD_RESET:
 			if(memcmp(payload, proto::RESET_KEY, sizeof(proto::RESET_KEY)) == 0)
 			{
-				cli();
-				asm volatile ("jmp 0x3F800");
+				hal_enterBootloader();
 			}
 			break;
 		case proto::CMD_COMMIT:
-			motion_commit();
-			writeAnswer(proto::SimplePacket<proto::CMD_COMMIT>());
+		{
+			proto::Packet<proto::CMD_COMMIT, proto::ConfigStatus> answer;
+			answer.payload.result = proto::CR_OK;
+
+			// The stream may have overwritten the keyframe buffer
+			if(motion_isPlaying())
+				answer.payload.result = proto::CR_BUSY;
+			else
+				motion_commit();
+
+			answer.updateChecksum();
+			writeAnswer(answer);
+		}
+			break;
+		case proto::CMD_COMMIT_STATUS:
+		{
+			proto::Packet<proto::CMD_COMMIT_STATUS, proto::CommitStatus> answer;
+			mem_commitStatus(&answer.payload);
+			answer.updateChecksum();
+			writeAnswer(answer);
+		}
 			break;
 		case proto::CMD_PLAY:
 		{
@@ -137,7 +379,23 @@ void handleCommand(uint8_t command, const uint8_t* payload, uint8_t length)
 			writeAnswer(proto::SimplePacket<proto::CMD_PLAY>());
 
 			if(!motion_isPlaying())
-				motion_runSequence(play.flags & proto::PF_LOOP);
+				motion_runSequence(play.flags & proto::PF_LOOP, play.flags & proto::PF_STREAM);
+		}
+			break;
+		case proto::CMD_STREAM:
+		{
+			const proto::StreamKeyframe& packet = *((const proto::StreamKeyframe*)payload);
+			if(length != sizeof(packet))
+				return;
+
+			// The answer tells the PC where to continue if the
+			// keyframe was rejected.
+			motion_streamKeyframe(packet);
+
+			proto::Packet<proto::CMD_STREAM, proto::StreamStatus> answer;
+			motion_streamStatus(&answer.payload);
+			answer.updateChecksum();
+			writeAnswer(answer);
 		}
 			break;
 		case proto::CMD_STOP:
@@ -151,11 +409,87 @@ void handleCommand(uint8_t command, const uint8_t* payload, uint8_t length)
 		case proto::CMD_FEEDBACK:
 			writeFeedbackPacket<proto::CMD_FEEDBACK>();
 			break;
+		case proto::CMD_SUBSCRIBE:
+		{
+			const proto::Subscribe& packet = *((const proto::Subscribe*)payload);
+			if(length != sizeof(packet))
+				return;
+
+			if(packet.period && !g_pushPeriod)
+				g_pushLast = hal_micros() - 1000UL * packet.period;
+
+			g_pushPeriod = packet.period;
+			g_pushRenewed = hal_micros();
+
+			writeAnswer(proto::SimplePacket<proto::CMD_SUBSCRIBE>());
+		}
+			break;
+		case proto::CMD_STATS:
+		{
+			proto::Packet<proto::CMD_STATS, proto::Stats> answer;
+			motion_getStats(&answer.payload);
+			answer.updateChecksum();
+			writeAnswer(answer);
+
+			if(length == sizeof(proto::StatsRequest))
+			{
+				const proto::StatsRequest& req = *((const proto::StatsRequest*)payload);
+				if(req.flags & proto::SF_RESET)
+					motion_resetStats();
+			}
+		}
+			break;
+		case proto::CMD_AXES:
+		{
+			const proto::AxisCommand& packet = *((const proto::AxisCommand*)payload);
+
+			proto::Packet<proto::CMD_AXES, proto::AxisStatus> answer;
+
+			if(length != sizeof(packet) || motion_isPlaying())
+			{
+				// The control loop owns the bus during playback, the PC
+				// tries again later
+				int8_t state = (length == sizeof(packet)) ? proto::AXIS_STATE_BUSY : -1;
+				for(uint8_t i = 0; i < proto::NUM_AXES; ++i)
+				{
+					answer.payload.state[i] = state;
+					answer.payload.positions[i] = 0x7FFF;
+				}
+			}
+			else
+				axisCommand(packet, &answer.payload);
+
+			answer.updateChecksum();
+			writeAnswer(answer);
+		}
+			break;
+		case proto::CMD_COMPLIANCE:
+		{
+			const proto::Compliance& packet = *((const proto::Compliance*)payload);
+
+			if(length != sizeof(packet))
+				return;
+
+			proto::Packet<proto::CMD_COMPLIANCE, proto::ComplianceStatus> answer;
+			answer.payload.compliant = packet.compliant;
+
+			// The control loop owns the bus during playback, report
+			// all axes as failed
+			if(motion_isPlaying())
+				answer.payload.failed = 0xFF;
+			else
+				answer.payload.failed = setCompliance(packet.compliant);
+
+			answer.updateChecksum();
+			writeAnswer(answer);
+		}
+			break;
 	}
 }
 
 uint8_t parser_state = PS_START;
 uint8_t command = 0;
+uint8_t sequence = 0;
 uint8_t payloadLength = 0;
 uint8_t payloadIdx = 0;
 
@@ -183,7 +517,11 @@ bool cmd_input(uint8_t c)
 			break;
 		case PS_LENGTH:
 			payloadLength = c;
-			if(c)
+			parser_state = PS_SEQUENCE;
+			break;
+		case PS_SEQUENCE:
+			sequence = c;
+			if(payloadLength)
 				parser_state = PS_PAYLOAD;
 			else
 				parser_state = PS_CHECKSUM;
@@ -195,7 +533,7 @@ bool cmd_input(uint8_t c)
 			break;
 		case PS_CHECKSUM:
 		{
-			uint8_t checksum = proto::VERSION + command + payloadLength;
+			uint8_t checksum = proto::VERSION + command + payloadLength + sequence;
 			for(uint8_t i = 0; i < payloadLength; ++i)
 				checksum += payloadBuffer[i];
 			checksum = ~checksum;
@@ -212,6 +550,7 @@ bool cmd_input(uint8_t c)
 
 			if(c == 0x0D)
 			{
+				g_sequence = sequence;
 				handleCommand(command, payloadBuffer, payloadLength);
 				return true;
 			}
@@ -237,10 +576,17 @@ void handleCommands()
 				ticks_since_last_msg = 0;
 		}
 
-		_delay_ms(1);
+		cmd_poll();
+
+		hal_delayMs(1);
 		if(++ticks_since_last_msg == 255)
 			break;
 	}
 
 	g_extShouldQuit = false;
+
+	// The next session starts with CMD_INIT, which has sequence number 0
+	g_sequence = 0;
+	g_pushPeriod = 0;
+	parser_state = PS_START;
 }
@@ -18,4 +18,10 @@ bool cmd_input(uint8_t c);
 
 bool cmd_extEnabled();
 
+/**
+ * Send subscribed feedback packets if due. Needs to be called regularly
+ * while in extended mode.
+ **/
+void cmd_poll();
+
 #endif
@@ -0,0 +1,237 @@
+// Hardware abstraction layer
+//
+// The motion, command and Nanotec driver code only talks to the hardware
+// through the functions in this file. On the AVR they are thin inline
+// wrappers around the registers, so there is no overhead compared to direct
+// register access. If HAL_HOST is defined, they are implemented by the
+// simulator in sim/, which allows building the firmware logic as a native
+// library (see CMakeLists.txt, HOST_BUILD option).
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+
+enum RS485Direction
+{
+	RS485_IN,
+	RS485_OUT
+};
+
+#if HAL_HOST
+
+// There is only one thread of execution in the simulator. "Interrupts" are
+// delivered from inside hal_delay*(), hal_idle() and the PC/EEPROM
+// functions. Inside an atomic block they are held back like on the real
+// hardware (one pending timer interrupt, two bytes of UART receive FIFO).
+void hal_irqDisable();
+void hal_irqRestore();
+
+class HalAtomicGuard
+{
+public:
+	HalAtomicGuard() : m_once(true) { hal_irqDisable(); }
+	~HalAtomicGuard() { hal_irqRestore(); }
+
+	inline bool once()
+	{
+		bool ret = m_once;
+		m_once = false;
+		return ret;
+	}
+private:
+	bool m_once;
+};
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type) for(HalAtomicGuard hal_atomic_guard; hal_atomic_guard.once(); )
+
+//! Place variable in EEPROM
+#define HAL_EEPROM
+
+//! Timer1 compare interrupt (1kHz), see hal_timerStart()
+#define HAL_TIMER_ISR() void hal_timerISR()
+void hal_timerISR();
+
+void hal_init();
+
+void hal_delayUs(uint16_t us);
+void hal_delayMs(uint16_t ms);
+
+uint32_t hal_micros();
+void hal_idle();
+
+void hal_timerStart();
+void hal_timerStop();
+
+void hal_setLed(bool on);
+void hal_toggleLed();
+
+void hal_pcStartTransmitting();
+bool hal_pcDataSent();
+
+void rs485_setDir(RS485Direction dir);
+void hal_busStartTx();
+void hal_busArmTimer(uint16_t us);
+void hal_busCancelTimer();
+
+void hal_eepromRead(void* dest, const void* src, uint16_t size);
+
+bool hal_eepromReady();
+uint8_t hal_eepromReadByte(const uint8_t* addr);
+void hal_eepromStartWrite(uint8_t* addr, uint8_t value);
+void hal_eepromSetReadyIRQ(bool enabled);
+
+void hal_enterBootloader();
+
+#else
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+
+#include "uart.h"
+
+#define HAL_EEPROM __attribute__((section(".eeprom")))
+
+#define HAL_TIMER_ISR() ISR(TIMER1_COMPA_vect)
+
+// _delay_us() and _delay_ms() need compile-time constant arguments, so these
+// have to be inlined in any case.
+#define HAL_INLINE static inline __attribute__((always_inline))
+
+HAL_INLINE void hal_delayUs(double us)
+{
+	_delay_us(us);
+}
+
+HAL_INLINE void hal_delayMs(double ms)
+{
+	_delay_ms(ms);
+}
+
+//! Start the free-running Timer3 used for hal_micros() and the bus timer
+void hal_init();
+
+//! Microseconds since hal_init() (4us resolution, wraps after 71 minutes)
+uint32_t hal_micros();
+
+//! Called in busy-wait loops. Nothing to do on the real hardware.
+HAL_INLINE void hal_idle()
+{
+}
+
+//! Start Timer1 with a 1ms period (prescaler 64, CTC mode)
+HAL_INLINE void hal_timerStart()
+{
+	OCR1A = 250-1;
+	TCCR1A = 0;
+	TIMSK1 = (1 << OCIE1A);
+	TCCR1B = (1 << WGM12) | (1 << CS11) | (1 << CS10);
+	OCR1A = 250-1;
+	TCNT1 = 0;
+}
+
+HAL_INLINE void hal_timerStop()
+{
+	TCCR1B = 0;
+}
+
+HAL_INLINE void hal_setLed(bool on)
+{
+	if(on)
+		PORTJ |= (1 << 7);
+	else
+		PORTJ &= ~(1 << 7);
+}
+
+HAL_INLINE void hal_toggleLed()
+{
+	PORTJ ^= (1 << 7);
+}
+
+HAL_INLINE void hal_pcStartTransmitting()
+{
+	uart_pc->startTransmitting();
+}
+
+HAL_INLINE bool hal_pcDataSent()
+{
+	return uart_pc->dataSent();
+}
+
+HAL_INLINE void rs485_setDir(RS485Direction dir)
+{
+	if(dir == RS485_IN)
+		PORTJ &= ~(1 << 2);
+	else
+		PORTJ |= (1 << 2);
+}
+
+//! Enable the USART3 UDRE interrupt, which calls nt_busTxISR() (see uart.cpp)
+HAL_INLINE void hal_busStartTx()
+{
+	UCSR3B |= (1 << UDRIE3);
+}
+
+/**
+ * Arm the one-shot bus timer (Timer3 compare B), which calls
+ * nt_busTimerISR() after @a us microseconds (4us resolution).
+ **/
+HAL_INLINE void hal_busArmTimer(uint16_t us)
+{
+	OCR3B = TCNT3 + us / 4;
+	TIFR3 = (1 << OCF3B);
+	TIMSK3 |= (1 << OCIE3B);
+}
+
+HAL_INLINE void hal_busCancelTimer()
+{
+	TIMSK3 &= ~(1 << OCIE3B);
+}
+
+HAL_INLINE void hal_eepromRead(void* dest, const void* src, uint16_t size)
+{
+	eeprom_read_block(dest, src, size);
+}
+
+HAL_INLINE bool hal_eepromReady()
+{
+	return eeprom_is_ready();
+}
+
+HAL_INLINE uint8_t hal_eepromReadByte(const uint8_t* addr)
+{
+	return eeprom_read_byte(addr);
+}
+
+//! Start an erase+write cycle. Interrupts need to be disabled (EEMPE timing).
+HAL_INLINE void hal_eepromStartWrite(uint8_t* addr, uint8_t value)
+{
+	EEAR = (uint16_t)addr;
+	EEDR = value;
+	EECR |= (1 << EEMPE);
+	EECR |= (1 << EEPE);
+}
+
+HAL_INLINE void hal_eepromSetReadyIRQ(bool enabled)
+{
+	if(enabled)
+		EECR |= (1 << EERIE);
+	else
+		EECR &= ~(1 << EERIE);
+}
+
+HAL_INLINE void hal_enterBootloader()
+{
+	cli();
+	asm volatile ("jmp 0x3F800");
+}
+
+#undef HAL_INLINE
+
+#endif
+
+#endif
@@ -0,0 +1,57 @@
+// Hardware abstraction layer, AVR part
+//
+// Timer3 runs freely with prescaler 64 (4us per tick) and serves as time
+// base for hal_micros(). Its compare B unit is the one-shot bus timer used
+// by the Nanotec transaction queue.
+//
+// The EEPROM ready interrupt drives the background writer in mem.cpp.
+
+#include "hal.h"
+
+#include "mem.h"
+#include "nanotec.h"
+
+static volatile uint16_t g_timer3High;
+
+ISR(TIMER3_OVF_vect)
+{
+	g_timer3High++;
+}
+
+ISR(TIMER3_COMPB_vect)
+{
+	TIMSK3 &= ~(1 << OCIE3B);
+	nt_busTimerISR();
+}
+
+ISR(EE_READY_vect)
+{
+	mem_eepromReadyISR();
+}
+
+void hal_init()
+{
+	TCCR3A = 0;
+	TCCR3B = (1 << CS31) | (1 << CS30);
+	TCNT3 = 0;
+	TIFR3 = (1 << TOV3) | (1 << OCF3B);
+	TIMSK3 = (1 << TOIE3);
+}
+
+uint32_t hal_micros()
+{
+	uint16_t low;
+	uint16_t high;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		low = TCNT3;
+		high = g_timer3High;
+
+		// Overflow happened, but the interrupt did not run yet
+		if((TIFR3 & (1 << TOV3)) && low < 0x8000)
+			high++;
+	}
+
+	return ((((uint32_t)high) << 16) | low) * 4;
+}
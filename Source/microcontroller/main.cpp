@@ -12,6 +12,7 @@
 #include <string.h>
 
 #include "uart.h"
+#include "hal.h"
 #include "combuf.h"
 #include "nanotec.h"
 #include "protocol.h"
@@ -117,6 +118,7 @@ int main()
 	uart_pc->init(BAUD_SETTING<115200>());
 	uart_rob->init(16);
 
+	hal_init();
 	io_init();
 	nt_init();
 
@@ -3,14 +3,14 @@
 
 #include "mem.h"
 
-#include <avr/eeprom.h>
-#include <avr/interrupt.h>
-#include <util/atomic.h>
+#include "hal.h"
+
 #include <stdio.h>
+#include <string.h>
 
-proto::Keyframe __attribute__((section(".eeprom"))) g_keyframe_memory[proto::MAX_KEYFRAMES]
+proto::Keyframe HAL_EEPROM g_keyframe_memory[proto::MAX_KEYFRAMES]
  = {{0, {0x00}}};
-proto::Config __attribute__((section(".eeprom"))) g_config_memory
+proto::Config HAL_EEPROM g_config_memory
  = {0xF, 0};
 
 proto::Config mem_config;
@@ -19,21 +19,60 @@ bool g_readRequest = true;
 uint8_t g_readIdx = 0;
 uint8_t g_readOffset = 0;
 
+// Background writer state. g_commitIndex == g_commitEnd means the
+// configuration is written, g_commitIndex > g_commitEnd means done.
+static uint8_t g_dirty[proto::MAX_KEYFRAMES / 8];
+static const proto::Keyframe* g_commitSource;
+static volatile uint8_t g_commitIndex;
+static volatile uint8_t g_commitOffset;
+static volatile uint8_t g_commitEnd;
+static volatile uint8_t g_commitTotal;
+static volatile bool g_commitBusy;
+static volatile bool g_commitRepeat;
+
 void mem_init()
 {
 	bool invalid = false;
 
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		eeprom_read_block(&mem_config, &g_config_memory, sizeof(proto::Config));
+		hal_eepromRead(&mem_config, &g_config_memory, sizeof(proto::Config));
 
-		// Validity check (empty EEPROM is 0xFFFF)
-		if(mem_config.active_axes > 100 || mem_config.num_keyframes >= proto::MAX_KEYFRAMES)
+		// Validity check (empty EEPROM is 0xFFFF). The control slots
+		// index the per-axis arrays with active_axes. A different layout
+		// was written by a firmware with other keyframe or configuration
+		// sizes, the stored sequence is not readable.
+		if(mem_config.layout != proto::CONFIG_LAYOUT
+			|| mem_config.active_axes == 0 || mem_config.active_axes > proto::NUM_AXES
+			|| mem_config.num_keyframes >= proto::MAX_KEYFRAMES)
 		{
 			invalid = true;
 
+			// The other fields hold whatever the old layout stored at
+			// their offsets. Use the defaults of the PC configuration.
+			memset(&mem_config, 0, sizeof(mem_config));
 			mem_config.active_axes = 4;
 			mem_config.num_keyframes = 0;
+			mem_config.lookahead = 200;
+			mem_config.interpolation = proto::IP_LINEAR;
+			mem_config.layout = proto::CONFIG_LAYOUT;
+
+			for(uint8_t i = 0; i < proto::NUM_AXES; ++i)
+			{
+				mem_config.enc_to_mot[i] = 256; // 1:1
+				mem_config.hold_current[i] = 20;
+				mem_config.max_current[i] = 50;
+			}
+		}
+
+		// Written by older firmware versions, use the PC defaults
+		for(uint8_t i = 0; i < proto::NUM_AXES; ++i)
+		{
+			if(mem_config.hold_current[i] > 100 || mem_config.max_current[i] > 100)
+			{
+				mem_config.hold_current[i] = 20;
+				mem_config.max_current[i] = 50;
+			}
 		}
 	}
 
@@ -43,24 +82,184 @@ void mem_init()
 
 void mem_readKeyframe(uint8_t index, proto::Keyframe* dest)
 {
+	// Do not wait for a background write with interrupts disabled
+	while(1)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			if(hal_eepromReady())
+			{
+				hal_eepromRead(dest, g_keyframe_memory + index, sizeof(proto::Keyframe));
+				return;
+			}
+		}
+
+		hal_idle();
+	}
+}
+
+static inline bool isDirty(uint8_t index)
+{
+	return g_dirty[index / 8] & (1 << (index % 8));
+}
+
+void mem_markDirty(uint8_t index)
+{
+	if(index >= proto::MAX_KEYFRAMES)
+		return;
+
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		eeprom_read_block(dest, g_keyframe_memory + index, sizeof(proto::Keyframe));
+		g_dirty[index / 8] |= (1 << (index % 8));
 	}
 }
 
-void mem_saveKeyframe(uint8_t index, const proto::Keyframe& src)
+void mem_clearDirty()
 {
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		eeprom_update_block(&src, g_keyframe_memory + index, sizeof(proto::Keyframe));
+		memset(g_dirty, 0, sizeof(g_dirty));
 	}
 }
 
-void mem_saveConfig()
+static uint8_t countDirty(uint8_t from, uint8_t to)
+{
+	uint8_t count = 0;
+	for(uint8_t i = from; i < to; ++i)
+	{
+		if(isDirty(i))
+			count++;
+	}
+
+	return count;
+}
+
+static void startCommit()
+{
+	g_commitEnd = mem_config.num_keyframes;
+	if(g_commitEnd > proto::MAX_KEYFRAMES)
+		g_commitEnd = proto::MAX_KEYFRAMES;
+
+	g_commitIndex = 0;
+	g_commitOffset = 0;
+	g_commitTotal = countDirty(0, g_commitEnd) + 1;
+	g_commitRepeat = false;
+}
+
+void mem_commit(const proto::Keyframe* buffer)
 {
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		eeprom_update_block(&mem_config, &g_config_memory, sizeof(proto::Config));
+		g_commitSource = buffer;
+
+		if(g_commitBusy)
+			g_commitRepeat = true;
+		else
+		{
+			startCommit();
+			g_commitBusy = true;
+			hal_eepromSetReadyIRQ(true);
+		}
 	}
 }
+
+bool mem_commitBusy()
+{
+	return g_commitBusy;
+}
+
+void mem_commitStatus(proto::CommitStatus* status)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		status->busy = g_commitBusy;
+		status->total = g_commitTotal;
+		status->remaining = 0;
+
+		if(g_commitBusy && g_commitIndex <= g_commitEnd)
+		{
+			// Dirty keyframes after the current one, the current one
+			// and the configuration.
+			status->remaining = 1;
+			if(g_commitIndex < g_commitEnd)
+			{
+				status->remaining += countDirty(g_commitIndex+1, g_commitEnd);
+				if(g_commitOffset != 0 || isDirty(g_commitIndex))
+					status->remaining++;
+			}
+		}
+	}
+}
+
+/**
+ * Write the next differing byte of @a src to @a dest, starting at
+ * g_commitOffset.
+ *
+ * @return true if a write was started
+ **/
+static bool writeNextByte(const uint8_t* src, uint8_t* dest, uint8_t size)
+{
+	while(g_commitOffset < size)
+	{
+		uint8_t offset = g_commitOffset++;
+
+		if(hal_eepromReadByte(dest + offset) != src[offset])
+		{
+			hal_eepromStartWrite(dest + offset, src[offset]);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Every invocation either starts one byte write or handles at most one
+ * keyframe, so the interrupt never runs for long.
+ */
+void mem_eepromReadyISR()
+{
+	if(g_commitIndex < g_commitEnd)
+	{
+		uint8_t index = g_commitIndex;
+
+		if(g_commitOffset == 0)
+		{
+			if(!isDirty(index))
+			{
+				g_commitIndex++;
+				return;
+			}
+
+			// If the keyframe is changed while we write it, it will be
+			// marked dirty again.
+			g_dirty[index / 8] &= ~(1 << (index % 8));
+		}
+
+		if(writeNextByte((const uint8_t*)(g_commitSource + index), (uint8_t*)(g_keyframe_memory + index), sizeof(proto::Keyframe)))
+			return;
+
+		g_commitIndex++;
+		g_commitOffset = 0;
+		return;
+	}
+
+	if(g_commitIndex == g_commitEnd)
+	{
+		// Configuration last, so it only references written keyframes
+		if(writeNextByte((const uint8_t*)&mem_config, (uint8_t*)&g_config_memory, sizeof(proto::Config)))
+			return;
+
+		g_commitIndex++;
+		return;
+	}
+
+	if(g_commitRepeat)
+	{
+		startCommit();
+		return;
+	}
+
+	g_commitBusy = false;
+	hal_eepromSetReadyIRQ(false);
+}
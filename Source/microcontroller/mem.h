@@ -9,11 +9,35 @@
 #include "protocol.h"
 
 void mem_readKeyframe(uint8_t index, proto::Keyframe* dest);
-void mem_saveKeyframe(uint8_t index, const proto::Keyframe& src);
 
 extern proto::Config mem_config;
 
 void mem_init();
-void mem_saveConfig();
+
+/**
+ * Background EEPROM writer
+ *
+ * Keyframes changed in RAM are marked dirty. mem_commit() writes the dirty
+ * keyframes (< num_keyframes) and the configuration byte by byte from the
+ * EEPROM ready interrupt, so interrupts stay enabled and the caller does
+ * not have to wait. Only bytes which actually differ are written.
+ **/
+void mem_markDirty(uint8_t index);
+void mem_clearDirty();
+
+/**
+ * Start writing dirty keyframes from @a buffer and mem_config.
+ * If a commit is already running, it is repeated afterwards.
+ *
+ * @a buffer must not be changed except through mem_markDirty()-tracked
+ * writes until the commit is finished.
+ **/
+void mem_commit(const proto::Keyframe* buffer);
+
+bool mem_commitBusy();
+void mem_commitStatus(proto::CommitStatus* status);
+
+//! Called by the HAL from the EEPROM ready interrupt
+void mem_eepromReadyISR();
 
 #endif
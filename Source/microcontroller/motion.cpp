@@ -4,20 +4,17 @@
 #include "motion.h"
 
 #include "protocol.h"
-#include "uart.h"
+#include "hal.h"
 #include "mem.h"
 #include "nanotec.h"
 #include "io.h"
 #include "combuf.h"
 #include "commands.h"
-
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <util/atomic.h>
-#include <util/delay.h>
+#include "spline.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 const bool MOTION_PLOT = false;
 const bool PLOT_STOP = false;
@@ -29,12 +26,38 @@ volatile static uint32_t g_delta; //!< Reset to zero on resetTimer()
 volatile static uint32_t g_dest;
 volatile static bool g_reached;
 
+/**
+ * Control slots
+ *
+ * During playback the axes are updated in fixed time slots of
+ * g_slotPeriod us, axis after axis. A slot consists of reading the encoder
+ * position and sending destination and velocity (three bus transactions,
+ * ~5.3ms including the RS485 guard and hold times). The slots are timed
+ * on hal_micros() and sized from the measured transaction time plus
+ * SLOT_MARGIN, so the bus is not left idle until the next millisecond.
+ * The remainder of a long slot overlaps with the next one, its encoder
+ * read is queued behind the setpoints. So every axis is sampled once per
+ * cycle of active_axes * g_slotPeriod us, independent of the load on the
+ * main loop. The period is adapted at the start of each cycle.
+ **/
+const uint16_t SLOT_MARGIN = 20;           //!< us
+const uint16_t SLOT_PERIOD_DEFAULT = 6000; //!< us, first cycle
+const uint16_t SLOT_PERIOD_MAX = 8000;     //!< us, cycle_period is 16 bit
+
+static uint16_t g_slotPeriod = SLOT_PERIOD_DEFAULT;
+static uint32_t g_nextSlot;  //!< hal_micros() at start of the next slot
+
+static proto::Stats g_stats;
+static uint32_t g_lastSample[proto::NUM_AXES]; //!< For cycle time measurement
+static bool g_lastSampleValid[proto::NUM_AXES];
+
 proto::Keyframe g_buffer[proto::MAX_KEYFRAMES];
 bool g_shouldStop;
 bool g_isPlaying;
 int16_t g_encPos[proto::NUM_AXES];
+uint32_t g_encTime[proto::NUM_AXES]; //!< hal_micros() when g_encPos was read
 
-ISR(TIMER1_COMPA_vect)
+HAL_TIMER_ISR()
 {
 	g_delta++;
 	g_ticks++;
@@ -43,7 +66,7 @@ ISR(TIMER1_COMPA_vect)
 		g_reached = true;
 
 	if(g_ticks % 128 == 0)
-		PORTJ ^= (1 << 7);
+		hal_toggleLed();
 }
 
 static void resetTimer(uint32_t dest)
@@ -59,19 +82,30 @@ static void resetTimer(uint32_t dest)
 static void startTimer()
 {
 	g_ticks = 0;
+	g_nextSlot = hal_micros();
+	hal_timerStart();
+}
+
+//! Size the control slots from the measured bus transaction time
+static void updateSlotPeriod()
+{
+	uint16_t transaction = nt_transactionTime();
+	if(!transaction)
+		return;
 
-	OCR1A = 250-1;
-	TCCR1A = 0;
-	TIMSK1 = (1 << OCIE1A);
-	// Prescaler: 64, CTC mode
-	TCCR1B = (1 << WGM12) | (1 << CS11) | (1 << CS10);
-	OCR1A = 250-1;
-	TCNT1 = 0;
+	// Encoder read (with lookahead), destination and velocity
+	uint8_t count = mem_config.lookahead ? 3 : 2;
+
+	uint32_t period = (uint32_t)count * transaction + SLOT_MARGIN;
+	if(period > SLOT_PERIOD_MAX)
+		period = SLOT_PERIOD_MAX;
+
+	g_slotPeriod = period;
 }
 
 static void stopTimer()
 {
-	TCCR1B = 0;
+	hal_timerStop();
 }
 
 static uint32_t getTicks()
@@ -98,11 +132,581 @@ static uint32_t getDelta()
 	return copy;
 }
 
-void motion_loadSequence()
+/**
+ * Segment table
+ *
+ * Segment i (1 <= i < num_keyframes) is the motion from keyframe i-1 to
+ * keyframe i. compileSequence() precomputes the start times (prefix sum of
+ * the durations) and reciprocal durations, so that the playback loop can
+ * evaluate the trajectory with multiplications and shifts only. The entry
+ * of the start keyframe (SEG_ORIGIN) has no motion, the segment after it
+ * starts at time 0.
+ *
+ * Per-axis slopes for all segments would need 4KB of RAM. Instead they are
+ * calculated once for the segment under the lookahead cursor, whenever the
+ * cursor enters a new segment (see Cursor).
+ **/
+struct Segment
+{
+	uint32_t start;         //!< Start time relative to keyframe 0 (ms)
+	uint32_t inv_duration;  //!< 2^24 / duration
+	uint8_t flags;          //!< SegmentFlags
+};
+
+enum SegmentFlags
+{
+	SEG_DECIDED = 1,        //!< SEG_SMOOTH_END is valid
+	SEG_SMOOTH_END = 2,     //!< Spline continues into the next segment without stopping
+	SEG_ORIGIN = 4          //!< Start keyframe of the sequence or stream
+};
+
+static Segment g_segments[proto::MAX_KEYFRAMES];
+
+//! Precomputed per-axis factors for the velocity control
+struct AxisScale
+{
+	uint32_t vel_factor;    //!< 1000 * enc_to_mot / (256 * lookahead), Q16
+	uint32_t err_limit;     //!< Position errors above this saturate at max_speed
+	int32_t max_speed;
+};
+
+static AxisScale g_scales[proto::NUM_AXES];
+
+/**
+ * Streaming playback
+ *
+ * In streaming mode g_buffer and g_segments are ring buffers, indexed with
+ * the stream index modulo MAX_KEYFRAMES. The PC appends keyframes with
+ * CMD_STREAM while playing. A slot can be reused as soon as the segment
+ * starting at the keyframe in it has been played.
+ *
+ * The stream index wraps around after 65536 keyframes. Only the first
+ * keyframe of a new stream is the start keyframe (g_streamOrigin), a later
+ * index 0 is an ordinary segment.
+ **/
+static bool g_streaming;
+static bool g_streamOrigin = true;  //!< Next keyframe is the start keyframe
+static uint16_t g_streamWrite;      //!< Next stream index expected
+static uint16_t g_streamBase;       //!< Oldest keyframe still needed
+static bool g_streamEnd;            //!< Last keyframe was received
+static bool g_streamUnderrun;       //!< Stream ran empty since last feedback
+static uint8_t g_streamLowWater;    //!< Minimum buffered keyframes since last feedback
+
+static inline proto::Keyframe& keyframe(uint16_t index)
+{
+	return g_buffer[index % proto::MAX_KEYFRAMES];
+}
+
+static inline Segment& segment(uint16_t index)
+{
+	return g_segments[index % proto::MAX_KEYFRAMES];
+}
+
+static inline uint16_t segmentDuration(uint16_t index)
+{
+	uint16_t duration = keyframe(index).duration;
+	return duration ? duration : 1;
+}
+
+//! Mark @a index as the start keyframe, the next segment starts at time 0
+static void compileOrigin(uint16_t index)
+{
+	Segment& seg = segment(index);
+
+	seg.start = 0;
+	seg.inv_duration = 0;
+	seg.flags = SEG_ORIGIN;
+}
+
+//! Compile segment @a index. The segment before needs to be compiled already.
+static void compileSegment(uint16_t index)
+{
+	Segment& seg = segment(index);
+	const Segment& prev = segment(index-1);
+
+	if(prev.flags & SEG_ORIGIN)
+		seg.start = 0;
+	else
+		seg.start = prev.start + segmentDuration(index-1);
+
+	seg.inv_duration = (1UL << 24) / segmentDuration(index);
+	seg.flags = 0;
+}
+
+static inline bool splineActive()
+{
+	return mem_config.interpolation == proto::IP_CUBIC
+		|| mem_config.interpolation == proto::IP_MIN_JERK;
+}
+
+static void compileScales()
+{
+	for(uint8_t j = 0; j < proto::NUM_AXES; ++j)
+	{
+		AxisScale* scale = &g_scales[j];
+
+		scale->max_speed = ((uint32_t)mem_config.enc_to_mot[j]) * 7000 / 256;
+
+		if(!mem_config.lookahead || !mem_config.enc_to_mot[j])
+		{
+			scale->vel_factor = 0;
+			scale->err_limit = 0;
+			continue;
+		}
+
+		uint64_t factor = 1000ULL * mem_config.enc_to_mot[j] * 256 / mem_config.lookahead;
+		if(factor > 0xFFFFFFFFULL)
+			factor = 0xFFFFFFFFULL;
+		scale->vel_factor = factor;
+
+		// Smallest error which gives max_speed, but make sure that
+		// err * vel_factor does not overflow.
+		uint64_t limit = (((uint64_t)scale->max_speed << 16) + factor - 1) / factor;
+		if(limit > 0xFFFFFFFFUL / factor)
+			limit = 0xFFFFFFFFUL / factor;
+		scale->err_limit = limit;
+	}
+}
+
+static void compileSequence()
+{
+	compileOrigin(0);
+	for(uint8_t i = 1; i < mem_config.num_keyframes; ++i)
+		compileSegment(i);
+
+	compileScales();
+}
+
+//! Number of keyframes buffered after the one we are coming from
+static inline uint8_t streamBuffered()
+{
+	return g_streamWrite - g_streamBase - 1;
+}
+
+uint8_t motion_streamFree()
+{
+	if(g_streamOrigin)
+		return proto::MAX_KEYFRAMES;
+
+	// The spline tangents and the fly-by blends need the keyframe before
+	// the one we are coming from
+	uint16_t used = g_streamWrite - g_streamBase + 1;
+
+	return (used < proto::MAX_KEYFRAMES) ? proto::MAX_KEYFRAMES - used : 0;
+}
+
+bool motion_streamKeyframe(const proto::StreamKeyframe& packet)
+{
+	// The ring buffer shares g_buffer with the normal playback and the
+	// EEPROM writer
+	if((g_isPlaying && !g_streaming) || mem_commitBusy())
+		return false;
+
+	if(packet.index == 0 && !g_isPlaying)
+	{
+		g_streamOrigin = true;
+		g_streamWrite = 0;
+		g_streamBase = 0;
+		g_streamEnd = false;
+		g_streamUnderrun = false;
+		g_streamLowWater = 0xFF;
+	}
+
+	if(packet.index != g_streamWrite || g_streamEnd || motion_streamFree() == 0)
+		return false;
+
+	keyframe(packet.index) = packet.keyframe;
+	if(g_streamOrigin)
+		compileOrigin(packet.index);
+	else
+		compileSegment(packet.index);
+
+	g_streamOrigin = false;
+	g_streamWrite++;
+
+	if(packet.flags & proto::SKF_LAST)
+		g_streamEnd = true;
+
+	return true;
+}
+
+void motion_streamStatus(proto::StreamStatus* status)
+{
+	status->next_index = g_streamWrite;
+	status->free = motion_streamFree();
+}
+
+void motion_streamFeedback(proto::Feedback* feedback)
+{
+	feedback->stream_free = motion_streamFree();
+	feedback->stream_low_water = 0xFF;
+
+	if(!g_streaming)
+		return;
+
+	feedback->flags |= proto::FF_STREAMING;
+	if(g_streamUnderrun)
+		feedback->flags |= proto::FF_STREAM_UNDERRUN;
+	feedback->stream_low_water = g_streamLowWater;
+
+	g_streamUnderrun = false;
+	g_streamLowWater = streamBuffered();
+}
+
+/**
+ * Lookahead cursor
+ *
+ * Tracks the segment which contains the lookahead time. Since the time only
+ * increases while a keyframe is played, the cursor only moves forward and
+ * finding the segment is O(1) amortized.
+ *
+ * With spline interpolation, the cursor also holds the tangents of the
+ * segment (see spline.h). With linear interpolation, it holds the
+ * parabolic blends of fly-by keyframes (proto::Keyframe::blend) at both
+ * ends of the segment.
+ *
+ * Whether the motion continues through the end keyframe is decided once
+ * when the segment is loaded first (SEG_SMOOTH_END), so reloading it gives
+ * the same trajectory. Otherwise the axes stop at the keyframe: at the
+ * start of the sequence, at the loop point, at the end and when the stream
+ * runs empty.
+ **/
+struct Cursor
+{
+	uint16_t segment;
+	uint32_t start;                     //!< Start time of the segment (ms)
+	bool hold;                          //!< Waiting at the end of the segment
+	int32_t from[proto::NUM_AXES];      //!< Start position (encoder ticks)
+	int32_t diff[proto::NUM_AXES];      //!< Position difference (encoder ticks)
+	int32_t velocity[proto::NUM_AXES];  //!< Velocity without adaption (ticks/s)
+	int32_t tangent0[proto::NUM_AXES];  //!< Spline tangent at the start (encoder ticks)
+	int32_t tangent1[proto::NUM_AXES];  //!< Spline tangent at the end (encoder ticks)
+	uint16_t blend0;                    //!< Half width of the blend at the start (ms)
+	uint16_t blend1;                    //!< Half width of the blend at the end (ms)
+	uint32_t scale0;                    //!< spline::cornerScale() of blend0
+	uint32_t scale1;                    //!< spline::cornerScale() of blend1
+	int32_t corner0[proto::NUM_AXES];   //!< Blend offset at the start (Q1 ticks), see spline::corner()
+	int32_t corner1[proto::NUM_AXES];   //!< Blend offset at the end (Q1 ticks)
+};
+
+//! Does the spline continue through the end keyframe of segment @a index?
+static bool smoothEnd(uint16_t index, bool force_loop)
+{
+	if(g_streaming)
+		return (int16_t)(g_streamWrite - (index + 1)) > 0;
+
+	// The last segment returns to the start position, the loop starts
+	// from rest. The loop decision of io_button() comes too late.
+	if(index == mem_config.num_keyframes-2)
+		return force_loop;
+
+	return index < mem_config.num_keyframes-2;
+}
+
+/**
+ * Half width (ms) of the blend at the end keyframe of segment @a index,
+ * see spline::corner()
+ **/
+static uint16_t blendWidth(uint16_t index)
+{
+	return spline::blendWidth(keyframe(index).blend, segmentDuration(index), segmentDuration(index+1));
+}
+
+static void cursorLoad(Cursor* cursor, const proto::Keyframe& from, bool force_loop)
+{
+	uint16_t index = cursor->segment;
+	const proto::Keyframe& to = keyframe(index);
+	uint16_t duration = segmentDuration(index);
+
+	for(uint8_t j = 0; j < mem_config.active_axes; ++j)
+	{
+		int32_t diff = ((int32_t)to.ticks[j]) - from.ticks[j];
+
+		cursor->from[j] = ((int32_t)from.ticks[j]) - proto::NT_POSITION_BIAS;
+		cursor->diff[j] = diff;
+		cursor->velocity[j] = 1000L * diff / duration;
+		cursor->tangent0[j] = 0;
+		cursor->tangent1[j] = 0;
+	}
+
+	cursor->blend0 = 0;
+	cursor->blend1 = 0;
+
+	Segment& seg = segment(index);
+	if(!(seg.flags & SEG_DECIDED))
+	{
+		seg.flags |= SEG_DECIDED;
+		if(smoothEnd(index, force_loop))
+			seg.flags |= SEG_SMOOTH_END;
+	}
+
+	// Never set for the start keyframe
+	bool smoothStart = segment(index-1).flags & SEG_SMOOTH_END;
+
+	if(!splineActive())
+	{
+		if(smoothStart)
+		{
+			cursor->blend0 = blendWidth(index-1);
+			if(cursor->blend0)
+			{
+				cursor->scale0 = spline::cornerScale(cursor->blend0);
+
+				const proto::Keyframe& before = keyframe(index-2);
+				uint16_t prev_duration = segmentDuration(index-1);
+
+				for(uint8_t j = 0; j < mem_config.active_axes; ++j)
+				{
+					int32_t prev_diff = ((int32_t)from.ticks[j]) - before.ticks[j];
+					cursor->corner0[j] = spline::cornerOffset(prev_diff, prev_duration, cursor->diff[j], duration, cursor->blend0);
+				}
+			}
+		}
+
+		if(seg.flags & SEG_SMOOTH_END)
+		{
+			cursor->blend1 = blendWidth(index);
+			if(cursor->blend1)
+			{
+				cursor->scale1 = spline::cornerScale(cursor->blend1);
+
+				const proto::Keyframe& after = keyframe(index+1);
+				uint16_t next_duration = segmentDuration(index+1);
+
+				for(uint8_t j = 0; j < mem_config.active_axes; ++j)
+				{
+					int32_t next_diff = ((int32_t)after.ticks[j]) - to.ticks[j];
+					cursor->corner1[j] = spline::cornerOffset(cursor->diff[j], duration, next_diff, next_duration, cursor->blend1);
+				}
+			}
+		}
+
+		return;
+	}
+
+	if(smoothStart)
+	{
+		const proto::Keyframe& before = keyframe(index-2);
+		uint16_t prev_duration = segmentDuration(index-1);
+
+		for(uint8_t j = 0; j < mem_config.active_axes; ++j)
+		{
+			int32_t prev_diff = ((int32_t)from.ticks[j]) - before.ticks[j];
+			cursor->tangent0[j] = spline::tangent(mem_config.interpolation, prev_diff, prev_duration, cursor->diff[j], duration, duration);
+		}
+	}
+
+	if(seg.flags & SEG_SMOOTH_END)
+	{
+		const proto::Keyframe& after = keyframe(index+1);
+		uint16_t next_duration = segmentDuration(index+1);
+
+		for(uint8_t j = 0; j < mem_config.active_axes; ++j)
+		{
+			int32_t next_diff = ((int32_t)after.ticks[j]) - to.ticks[j];
+			cursor->tangent1[j] = spline::tangent(mem_config.interpolation, cursor->diff[j], duration, next_diff, next_duration, duration);
+		}
+	}
+}
+
+static void cursorReset(Cursor* cursor, uint16_t segment, bool force_loop)
+{
+	cursor->segment = segment;
+	cursor->start = ::segment(segment).start;
+	cursor->hold = false;
+
+	cursorLoad(cursor, keyframe(segment-1), force_loop);
+}
+
+/**
+ * Can the cursor move on to the next segment?
+ *
+ * In streaming mode, this depends on whether the next keyframe was received.
+ * Otherwise playback continues with segment 1 after the last segment if
+ * looping. The loop decision is made as soon as the lookahead crosses the
+ * end of the second-to-last segment (the last segment returns to the start
+ * position and is only played when looping).
+ **/
+static bool cursorCanAdvance(const Cursor* cursor, bool force_loop, bool* loop)
+{
+	if(g_streaming)
+		return (int16_t)(g_streamWrite - (cursor->segment + 1)) > 0;
+
+	if(cursor->segment == mem_config.num_keyframes-2)
+	{
+		if(io_button() || force_loop)
+			*loop = true;
+		else
+			return false;
+	}
+
+	return true;
+}
+
+//! Move the cursor to the segment containing time @a t.
+static void cursorSeek(Cursor* cursor, uint32_t t, bool force_loop, bool* loop)
+{
+	while(t >= cursor->start + segmentDuration(cursor->segment))
+	{
+		if(!cursorCanAdvance(cursor, force_loop, loop))
+		{
+			if(!cursor->hold)
+			{
+				// Stay at the end of the segment
+				for(uint8_t j = 0; j < mem_config.active_axes; ++j)
+				{
+					cursor->from[j] += cursor->diff[j];
+					cursor->diff[j] = 0;
+					cursor->velocity[j] = 0;
+					cursor->tangent0[j] = 0;
+					cursor->tangent1[j] = 0;
+				}
+				cursor->blend0 = 0;
+				cursor->blend1 = 0;
+				cursor->hold = true;
+			}
+			break;
+		}
+
+		const proto::Keyframe& from = keyframe(cursor->segment);
+
+		cursor->start += segmentDuration(cursor->segment);
+
+		if(!g_streaming && cursor->segment == mem_config.num_keyframes-1)
+			cursor->segment = 1;
+		else
+			cursor->segment++;
+
+		cursor->hold = false;
+		cursorLoad(cursor, from, force_loop);
+	}
+}
+
+//! Setpoint for axis @a j at time @a t. cursorSeek() needs to be called first.
+static inline int32_t cursorPosition(const Cursor* cursor, uint8_t j, uint32_t t)
+{
+	if(cursor->hold)
+		return cursor->from[j];
+
+	// Fraction of the segment as Q24. Since t is inside the segment, this
+	// is < 2^24 and the product below fits into 32 bit.
+	uint32_t u = (t - cursor->start) * segment(cursor->segment).inv_duration;
+
+	if(!splineActive())
+	{
+		int32_t pos = cursor->from[j] + ((cursor->diff[j] * (int32_t)(u >> 9)) >> 15);
+
+		// Fly-by blends
+		uint32_t elapsed = t - cursor->start;
+		if(elapsed < cursor->blend0)
+		{
+			uint16_t w = cursor->blend0 - elapsed;
+			pos += spline::corner(cursor->corner0[j], cursor->scale0, w);
+		}
+
+		uint32_t remaining = segmentDuration(cursor->segment) - elapsed;
+		if(remaining < cursor->blend1)
+		{
+			uint16_t w = cursor->blend1 - remaining;
+			pos += spline::corner(cursor->corner1[j], cursor->scale1, w);
+		}
+
+		return pos;
+	}
+
+	spline::Basis<int32_t> b;
+	spline::basis(mem_config.interpolation, (int32_t)(u >> (24 - spline::SHIFT)), &b);
+
+	return spline::evaluate(b, cursor->from[j], cursor->diff[j], cursor->tangent0[j], cursor->tangent1[j]);
+}
+
+void motion_resetStats()
+{
+	memset(&g_stats, 0, sizeof(g_stats));
+	g_stats.cycle_min = 0xFFFF;
+
+	for(uint8_t j = 0; j < proto::NUM_AXES; ++j)
+		g_lastSampleValid[j] = false;
+
+	nt_resetBusStats();
+}
+
+void motion_getStats(proto::Stats* stats)
+{
+	*stats = g_stats;
+	stats->cycle_period = g_slotPeriod * mem_config.active_axes;
+
+	const NanotecBusStats& bus = nt_busStats();
+	stats->bus_transactions = bus.transactions;
+	stats->bus_timeouts = bus.timeouts;
+	stats->bus_errors = bus.errors;
+	stats->bus_latency_min = bus.latency_min;
+	stats->bus_latency_max = bus.latency_max;
+	stats->bus_latency_avg = bus.transactions ? bus.latency_sum / bus.transactions : 0;
+}
+
+static inline uint16_t saturate16(uint32_t value)
+{
+	return (value > 0xFFFF) ? 0xFFFF : value;
+}
+
+//! Record a new encoder sample of axis @a j taken at @a timestamp
+static void recordSample(uint8_t j, uint32_t timestamp)
+{
+	if(g_lastSampleValid[j])
+	{
+		uint16_t cycle = saturate16(timestamp - g_lastSample[j]);
+		uint16_t period = g_slotPeriod * mem_config.active_axes;
+
+		g_stats.cycles++;
+		if(cycle < g_stats.cycle_min)
+			g_stats.cycle_min = cycle;
+		if(cycle > g_stats.cycle_max)
+			g_stats.cycle_max = cycle;
+
+		uint16_t deviation = (cycle > period) ? (cycle - period) : (period - cycle);
+		uint8_t bin = 0;
+		while(bin < proto::STATS_HISTOGRAM_BINS-1 && deviation >= proto::STATS_HISTOGRAM_LIMITS[bin])
+			++bin;
+
+		if(g_stats.histogram[bin] != 0xFFFF)
+			g_stats.histogram[bin]++;
+	}
+
+	g_lastSample[j] = timestamp;
+	g_lastSampleValid[j] = true;
+}
+
+//! Reload the stored sequence into the keyframe buffer
+static void restoreSequence()
 {
-	mem_init();
 	for(uint16_t i = 0; i < mem_config.num_keyframes; ++i)
 		mem_readKeyframe(i, &g_buffer[i]);
+
+	mem_clearDirty();
+	compileSequence();
+}
+
+/**
+ * Leave stream playback. The stream has overwritten the keyframe buffer,
+ * so the stored sequence is restored. The (possibly uncommitted)
+ * configuration stays. A further stream play needs a new stream.
+ */
+static void endStream()
+{
+	g_streaming = false;
+	g_streamOrigin = true;
+	g_streamWrite = 0;
+	g_streamBase = 0;
+	g_streamEnd = false;
+
+	restoreSequence();
+}
+
+void motion_loadSequence()
+{
+	mem_init();
+	restoreSequence();
 }
 
 void motion_writeToBuffer(uint8_t index, const proto::Keyframe& kf)
@@ -111,13 +715,34 @@ void motion_writeToBuffer(uint8_t index, const proto::Keyframe& kf)
 		return;
 
 	g_buffer[index] = kf;
+	mem_markDirty(index);
+}
+
+void motion_sequenceCrc(proto::SequenceCrc* crc)
+{
+	crc->config = proto::crcUpdate(0xFFFF, &mem_config, sizeof(mem_config));
+
+	uint8_t num_keyframes = mem_config.num_keyframes;
+	if(num_keyframes > proto::MAX_KEYFRAMES)
+		num_keyframes = proto::MAX_KEYFRAMES;
+
+	for(uint8_t i = 0; i < proto::CRC_BLOCKS; ++i)
+	{
+		uint8_t start = i * proto::KEYFRAMES_PER_PACKET;
+		uint8_t count = 0;
+
+		if(start < num_keyframes)
+			count = num_keyframes - start;
+		if(count > proto::KEYFRAMES_PER_PACKET)
+			count = proto::KEYFRAMES_PER_PACKET;
+
+		crc->blocks[i] = proto::crcUpdate(0xFFFF, g_buffer + start, count * sizeof(proto::Keyframe));
+	}
 }
 
 void motion_commit()
 {
-	for(uint16_t i = 0; i < mem_config.num_keyframes; ++i)
-		mem_saveKeyframe(i, g_buffer[i]);
-	mem_saveConfig();
+	mem_commit(g_buffer);
 }
 
 static void executeOutputCommand(uint8_t cmd)
@@ -182,7 +807,8 @@ bool motion_doStartKeyframe()
 			nt_setDestination(j+1, start.ticks[j]);
 
 			// Get feedback for PC display
-			nt_encoderPosition(j+1, &g_encPos[j]);
+			if(nt_encoderPosition(j+1, &g_encPos[j]))
+				nt_lastEncoderPosition(j+1, &g_encPos[j], &g_encTime[j]);
 		}
 
 		if(motion_keyframeReached(start))
@@ -216,188 +842,305 @@ bool motion_doStartKeyframe()
 	return false;
 }
 
-void motion_runSequence(bool force_loop)
+//! Playback state
+struct Playback
 {
-	if(MOTION_PLOT)
-	{
-		printf("Playing sequence with %d keyframes on %d axes\n",
-			mem_config.num_keyframes, mem_config.active_axes
-		);
-		printf("enc_to_mot is %u\n", mem_config.enc_to_mot[0]);
-		printf("lookahead is %u\n", mem_config.lookahead);
-	}
+	bool force_loop;
+	bool loop;
+	Cursor cursor;
+	int32_t speeds[proto::NUM_AXES];
 
-	g_shouldStop = false;
-	g_isPlaying = true;
+	// Slot state, continues across keyframes
+	uint8_t axis;             //!< Axis of the current slot
+	bool sampling;            //!< Waiting for the encoder position
+	uint32_t sample_request;  //!< hal_micros() of the request
+};
 
-	if(!motion_isInStartPosition())
-		g_shouldStop = !motion_doStartKeyframe();
+static void handlePCInput()
+{
+	cmd_poll();
 
-	// If the user already aborted the operation, stop now
-	if(g_shouldStop)
+	while(com_buf_to_bot.available())
 	{
-		g_isPlaying = false;
-		return;
+		// Break as soon as a command was received. Otherwise
+		// the PC might be able to lock us in this loop.
+		if(cmd_input(com_buf_to_bot.get()))
+			break;
 	}
+}
 
-	executeOutputCommand(g_buffer[0].output_command);
-	startTimer();
-
-	int32_t speeds[proto::NUM_AXES];
+//! Play segment @a i (from keyframe i-1 to keyframe i)
+static void playSegment(Playback* play, uint16_t i)
+{
+	resetTimer(keyframe(i).duration);
+	cursorReset(&play->cursor, i, play->force_loop);
 
-	bool loop;
+	uint8_t& j = play->axis;
+	int32_t* speeds = play->speeds;
 
-	do
+	while(!g_reached && !g_shouldStop) // safe, byte access is atomic
 	{
-		loop = force_loop;
-
-		for(uint8_t i = 1; i < mem_config.num_keyframes; ++i)
-		{
-			const proto::Keyframe& old = g_buffer[i-1];
-			const proto::Keyframe& current = g_buffer[i];
-			const proto::Keyframe* next = &g_buffer[i+1];
-
-			if(i == mem_config.num_keyframes-1)
-				next = &g_buffer[1];
+		nt_process();
 
-			if(i == mem_config.num_keyframes-1 && !loop)
-				break;
+		bool update = false;
 
-			// Fallback speed is calculated just based on the keyframe duration.
-			// This is used when we cannot get encoder feedback.
-			for(uint8_t j = 0; j < mem_config.active_axes; ++j)
+		if(play->sampling)
+		{
+			// The queue is empty as soon as the read is finished
+			if(nt_queueFree() == NT_QUEUE_SIZE)
 			{
-				uint16_t diff = abs(current.ticks[j] - old.ticks[j]);
-				uint32_t enc_speed = 1000L * diff / current.duration;
-				speeds[j] = mem_config.enc_to_mot[j] * enc_speed / 256;
+				play->sampling = false;
+				update = true;
 			}
+		}
+		else
+		{
+			uint32_t now = hal_micros();
+			int32_t late = now - g_nextSlot;
 
-			resetTimer(current.duration);
-
-			while(!g_reached && !g_shouldStop) // safe, byte access is atomic
+			if(late >= 0)
 			{
-				if(MOTION_PLOT)
-					printf("%6lu ", getTicks());
+				uint32_t pending = 1 + late / g_slotPeriod;
+				uint32_t slotTime = g_nextSlot + (pending - 1) * g_slotPeriod;
+				g_nextSlot = slotTime + g_slotPeriod;
 
-				for(uint8_t j = 0; j < mem_config.active_axes; ++j)
+				// If we fell behind, skip the slots of the other axes
+				// instead of squeezing them in.
+				if(pending > 1)
 				{
-					int32_t delta = getDelta() + mem_config.lookahead;
-					if(g_reached)
-						break;
-
-					int16_t encPos;
-
-					int32_t from = ((int32_t)old.ticks[j]) - proto::NT_POSITION_BIAS;
-					int32_t to = ((int32_t)current.ticks[j]) - proto::NT_POSITION_BIAS;
-					int32_t duration = current.duration;
-
-					const proto::Keyframe* c = &current;
-					uint16_t k = i;
-					while(delta > c->duration)
-					{
-						if(k == mem_config.num_keyframes-2)
-						{
-							// Current keyframe is the last one.
-							// If we are looping, choose next keyframe as 'next'
-							// If not, just use current keyframe.
-
-							if(io_button() || force_loop)
-								loop = true;
-							else
-							{
-								from = to;
-								duration = 100;
-								break;
-							}
-						}
-
-						delta -= c->duration;
-
-						if(k == mem_config.num_keyframes-1)
-						{
-							k = 1;
-							c = &g_buffer[1];
-						}
-						else
-						{
-							++k;
-							++c;
-						}
-
-						from = to;
-
-						to = ((int32_t)c->ticks[j]) - proto::NT_POSITION_BIAS;
-						duration = c->duration;
-					}
-
-					int32_t orig_vel = 0;
-					int32_t dest = 0;
-					int32_t vel = 0;
-
-					// Velocity without adaption
-					orig_vel = 1000L * (to - from) / duration;
-
-					if(mem_config.lookahead && nt_encoderPosition(j+1, &encPos))
-					{
-						const int32_t maxSpeed = ((uint32_t)mem_config.enc_to_mot[j]) * 7000 / 256;
-
-						// Calculate dest position
-						dest = from + delta * orig_vel / 1000;
-
-						// I want to be at 'dest' in LOOKAHEAD ms. Calculate needed velocity.
-						vel = abs(1000L * (dest - encPos) / mem_config.lookahead);
-						vel = vel * mem_config.enc_to_mot[j] / 256;
-
-						speeds[j] = vel;
-
-						// Never stop completely
-						if(speeds[j] < 100)
-							speeds[j] = 100;
-						else if(speeds[j] > maxSpeed)
-							speeds[j] = maxSpeed;
-
-						nt_setDestination(j+1, dest+proto::NT_POSITION_BIAS);
-						nt_setVelocity(j+1, speeds[j]);
-
-						g_encPos[j] = encPos;
-					}
-					else if(mem_config.lookahead == 0)
-					{
-						// No velocity control wanted
-						nt_setDestination(j+1, to+proto::NT_POSITION_BIAS);
-						speeds[j] = abs(orig_vel);
-						nt_setVelocity(j+1, speeds[j]);
-					}
-
-					if(MOTION_PLOT && j == 2)
-						printf("%4ld %4lu %4d %4ld %4ld %4ld %4ld", to, speeds[j], encPos, from, dest, vel, duration);
+					g_stats.missed_slots += pending - 1;
+					j = (j + pending - 1) % mem_config.active_axes;
 				}
 
-				if(MOTION_PLOT)
-					printf("\n");
+				play->sample_request = now;
+
+				uint16_t delay = saturate16(play->sample_request - slotTime);
+				if(delay > g_stats.slot_delay_max)
+					g_stats.slot_delay_max = delay;
 
-				while(com_buf_to_bot.available())
+				if(mem_config.lookahead)
 				{
-					// Break as soon as a command was received. Otherwise
-					// the PC might be able to lock us in this loop.
-					if(cmd_input(com_buf_to_bot.get()))
-						break;
+					nt_queueEncoderPosition(j+1);
+					play->sampling = true;
 				}
+				else
+					update = true;
+			}
+		}
+
+		if(!update)
+			hal_idle();
+		else
+		{
+			uint32_t t = segment(i).start + getDelta() + mem_config.lookahead;
+
+			int16_t encPos = 0;
+			uint32_t sampleTime;
+			int32_t dest = 0;
+			int32_t vel = 0;
+
+			if(mem_config.lookahead
+				&& nt_lastEncoderPosition(j+1, &encPos, &sampleTime)
+				&& (int32_t)(sampleTime - play->sample_request) >= 0)
+			{
+				const AxisScale& scale = g_scales[j];
+
+				recordSample(j, sampleTime);
+
+				// Skew compensation: compare the position with the
+				// setpoint at the time the sample was taken, so the
+				// position in the slot does not matter. The cursor
+				// cannot move backwards, though.
+				uint16_t age = saturate16(hal_micros() - sampleTime);
+				if(age > g_stats.sample_age_max)
+					g_stats.sample_age_max = age;
+
+				uint32_t ts = t - age / 1000;
+				if(ts < play->cursor.start)
+					ts = play->cursor.start;
+
+				cursorSeek(&play->cursor, ts, play->force_loop, &play->loop);
+
+				dest = cursorPosition(&play->cursor, j, ts);
+
+				// I want to be at 'dest' in LOOKAHEAD ms. Calculate needed velocity.
+				uint32_t err = labs(dest - encPos);
+				if(err > scale.err_limit)
+					err = scale.err_limit;
+
+				vel = (err * scale.vel_factor) >> 16;
+
+				speeds[j] = vel;
+
+				// Never stop completely
+				if(speeds[j] < 100)
+					speeds[j] = 100;
+				else if(speeds[j] > scale.max_speed)
+					speeds[j] = scale.max_speed;
+
+				nt_queueDestination(j+1, dest+proto::NT_POSITION_BIAS);
+				nt_queueVelocity(j+1, speeds[j]);
+
+				g_encPos[j] = encPos;
+				g_encTime[j] = sampleTime;
 			}
+			else if(mem_config.lookahead == 0)
+			{
+				// No velocity control wanted
+				cursorSeek(&play->cursor, t, play->force_loop, &play->loop);
+
+				int32_t to = play->cursor.from[j] + play->cursor.diff[j];
+				nt_queueDestination(j+1, to+proto::NT_POSITION_BIAS);
+				speeds[j] = labs(play->cursor.velocity[j]);
+				nt_queueVelocity(j+1, speeds[j]);
+			}
+
+			if(MOTION_PLOT && j == 2)
+			{
+				printf("%6lu %4ld %4d %4lu %4ld %4ld\n",
+					(unsigned long)getTicks(), (long)speeds[j], encPos,
+					(unsigned long)t, (long)dest, (long)vel
+				);
+			}
+
+			if(++j == mem_config.active_axes)
+			{
+				j = 0;
+				updateSlotPeriod();
+			}
+		}
+
+		handlePCInput();
+	}
+}
+
+static void playSequence(Playback* play)
+{
+	do
+	{
+		play->loop = play->force_loop;
+
+		for(uint8_t i = 1; i < mem_config.num_keyframes; ++i)
+		{
+			if(i == mem_config.num_keyframes-1 && !play->loop)
+				break;
+
+			playSegment(play, i);
 
 			if(g_shouldStop)
 				break;
 
-			executeOutputCommand(current.output_command);
+			executeOutputCommand(g_buffer[i].output_command);
 		}
 
-		if(SYNCHRONIZE && loop && !force_loop) // do not wait if loop was commanded from PC
+		if(SYNCHRONIZE && play->loop && !play->force_loop) // do not wait if loop was commanded from PC
 		{
 			// We are done, wait for synchronization
 			io_synchronize();
 		}
 	}
-	while(loop && !g_shouldStop);
+	while(play->loop && !g_shouldStop);
+}
+
+static void playStream(Playback* play)
+{
+	for(uint16_t i = 1; !g_shouldStop; ++i)
+	{
+		g_streamBase = i - 1;
+		if(streamBuffered() < g_streamLowWater)
+			g_streamLowWater = streamBuffered();
+
+		// Wait for the next keyframe. The setpoints sent so far do not
+		// reach beyond the buffered keyframes, so the axes stop there.
+		while((int16_t)(g_streamWrite - i) <= 0)
+		{
+			if(g_streamEnd || g_shouldStop)
+				return;
+
+			g_streamUnderrun = true;
+
+			nt_process();
+			handlePCInput();
+			hal_idle();
+		}
+
+		playSegment(play, i);
+
+		if(g_shouldStop)
+			break;
+
+		executeOutputCommand(keyframe(i).output_command);
+	}
+}
+
+void motion_runSequence(bool force_loop, bool stream)
+{
+	if(MOTION_PLOT)
+	{
+		printf("Playing sequence with %d keyframes on %d axes\n",
+			mem_config.num_keyframes, mem_config.active_axes
+		);
+		printf("enc_to_mot is %u\n", mem_config.enc_to_mot[0]);
+		printf("lookahead is %u\n", mem_config.lookahead);
+	}
+
+	// Streaming needs at least the start keyframe
+	if(stream && g_streamOrigin)
+		return;
+
+	// The control slots cycle through the axes (see playSegment())
+	if(mem_config.active_axes == 0 || mem_config.active_axes > proto::NUM_AXES)
+		return;
+
+	g_shouldStop = false;
+	g_isPlaying = true;
+	g_streaming = stream;
+
+	bool inStartPosition = stream
+		? motion_keyframeReached(g_buffer[0])
+		: motion_isInStartPosition();
+
+	if(!inStartPosition)
+		g_shouldStop = !motion_doStartKeyframe();
+
+	// If the user already aborted the operation, stop now
+	if(g_shouldStop)
+	{
+		if(stream)
+			endStream();
+
+		g_isPlaying = false;
+		return;
+	}
+
+	executeOutputCommand(g_buffer[0].output_command);
+
+	// CMD_KEYFRAME and CMD_CONFIG may have changed buffer and configuration.
+	// Stream segments are compiled as they arrive.
+	if(stream)
+		compileScales();
+	else
+		compileSequence();
+
+	// The first cycle measures the bus
+	g_slotPeriod = SLOT_PERIOD_DEFAULT;
+
+	motion_resetStats();
+	startTimer();
+
+	Playback play;
+	play.force_loop = force_loop;
+	play.loop = force_loop;
+	play.axis = 0;
+	play.sampling = false;
+	play.sample_request = 0;
+	for(uint8_t j = 0; j < proto::NUM_AXES; ++j)
+		play.speeds[j] = 0;
+
+	if(stream)
+		playStream(&play);
+	else
+		playSequence(&play);
 
 	if(PLOT_STOP)
 	{
@@ -409,12 +1152,20 @@ void motion_runSequence(bool force_loop)
 			int16_t cmd;
 			nt_encoderPosition(4, &encPos);
 			nt_command(4, &cmd);
-			printf("%6lu %4d %4lu %4d %4d %4d %4ld\n", getTicks(), 0, speeds[3], encPos, cmd, 0, speeds[3]);
+			printf("%6lu %4d %4ld %4d %4d %4d %4ld\n",
+				(unsigned long)getTicks(), 0, (long)play.speeds[3], encPos, cmd, 0, (long)play.speeds[3]
+			);
 		}
 	}
 
+	// Do not leave transactions on the bus, passthrough mode follows
+	nt_flush();
+
 	stopTimer();
 
+	if(stream)
+		endStream();
+
 	g_isPlaying = false;
 }
 
@@ -428,18 +1179,26 @@ bool motion_isPlaying()
 	return g_isPlaying;
 }
 
-int16_t motion_feedback(uint8_t motor_index)
+int16_t motion_feedback(uint8_t motor_index, uint32_t* timestamp)
 {
+	*timestamp = hal_micros();
+
 	if(motor_index >= proto::NUM_AXES)
 		return 0;
 
 	if(g_isPlaying)
+	{
+		*timestamp = g_encTime[motor_index];
 		return g_encPos[motor_index];
+	}
 	else
 	{
 		int16_t ret = 0;
 		if(nt_encoderPosition(motor_index+1, &ret))
+		{
+			nt_lastEncoderPosition(motor_index+1, &ret, timestamp);
 			return ret;
+		}
 		else
 			return 0x7FFF;
 	}
@@ -12,17 +12,31 @@
  *
  * @param force_loop Loop even if io_button() is not pressed.
  *        This also disables the synchronization.
+ * @param stream Play the keyframes received with motion_streamKeyframe()
+ *        instead of the sequence. Playback ends after the keyframe marked
+ *        with proto::SKF_LAST. Afterwards, the keyframes are reloaded
+ *        from EEPROM.
  **/
-void motion_runSequence(bool force_loop = false);
+void motion_runSequence(bool force_loop = false, bool stream = false);
 
 void motion_loadSequence();
 
 void motion_writeToBuffer(uint8_t index, const proto::Keyframe& kf);
 void motion_commit();
 
+//! Checksums of the configuration and the keyframe buffer
+void motion_sequenceCrc(proto::SequenceCrc* crc);
+
 bool motion_isInStartPosition();
 
-int16_t motion_feedback(uint8_t motor_index);
+/**
+ * Encoder position for the feedback packet
+ *
+ * @param timestamp Receives the hal_micros() time at which the position
+ *        was read
+ * @return position, 0x7FFF on read error
+ **/
+int16_t motion_feedback(uint8_t motor_index, uint32_t* timestamp);
 
 /**
  * Move to the first keyframe.
@@ -33,6 +47,31 @@ void motion_stop();
 
 bool motion_isPlaying();
 
+/**
+ * Append a keyframe to the stream. Index 0 starts a new stream, which is
+ * only possible while not playing.
+ *
+ * @return false if the keyframe was not accepted (wrong index, buffer full)
+ **/
+bool motion_streamKeyframe(const proto::StreamKeyframe& keyframe);
+
+//! Number of keyframes which can be streamed right now
+uint8_t motion_streamFree();
+
+void motion_streamStatus(proto::StreamStatus* status);
+
+/**
+ * Fill in the stream fields of the feedback packet. This resets the
+ * low water mark and the underrun flag.
+ **/
+void motion_streamFeedback(proto::Feedback* feedback);
+
+/**
+ * Control loop and bus statistics of the last playback, see proto::Stats
+ **/
+void motion_getStats(proto::Stats* stats);
+void motion_resetStats();
+
 /**
  * Execute single motion with specified velocity
  **/
@@ -4,11 +4,9 @@
 #include "nanotec.h"
 
 #include "combuf.h"
-#include "uart.h"
+#include "hal.h"
 #include "protocol.h"
 
-#include <util/delay.h>
-
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -36,6 +34,108 @@ struct ControllerBuffer
 ControllerBuffer g_ctl_buffer[proto::NUM_AXES];
 #endif
 
+/**
+ * Transaction queue
+ *
+ * All bus traffic goes through a small FIFO of transactions, which is
+ * worked off by the bus interrupts without any CPU involvement:
+ *
+ *  1. Switch the RS485 transceiver to output, wait NT_GUARD_TIME (one-shot
+ *     bus timer)
+ *  2. Send the command from the UDRE interrupt
+ *  3. On TX complete, wait NT_HOLD_TIME, then switch back to input and arm
+ *     the response timeout
+ *  4. The RX interrupt copies the answer into com_buf_from_bot. As soon as
+ *     the terminating '\r' arrives, the next transaction is started.
+ *
+ * RS485 is half-duplex and the controllers only answer when asked, so there
+ * can be only one transaction on the wire. What we gain is that the next
+ * command starts right after the previous answer instead of after the
+ * main loop noticed it, and that the main loop can compute the next
+ * setpoints in the meantime.
+ *
+ * The answers are evaluated in main context by nt_process(). Each finished
+ * transaction owns exactly one '\r'-terminated line in com_buf_from_bot.
+ **/
+
+/**
+ * Time between enabling the RS485 transmitter and the first byte (us)
+ *
+ * Guard and hold time are the 200 us the blocking implementation waited.
+ * Neither the transceiver enable delay nor the turnaround time of the
+ * controllers is simulated, so shorter times are untested on hardware.
+ **/
+const uint16_t NT_GUARD_TIME = 200;
+
+//! Time between TX complete and disabling the RS485 transmitter (us)
+const uint16_t NT_HOLD_TIME = 200;
+
+//! Response timeout measured from the end of the hold time (us)
+const uint16_t NT_RESPONSE_TIMEOUT = 5000;
+
+enum TransactionType
+{
+	TT_WRITE,    //!< Answer is an echo of the command
+	TT_READ      //!< Answer is <id>Z<reg><value>
+};
+
+enum TransactionState
+{
+	TS_QUEUED,
+	TS_ACTIVE,
+	TS_ANSWERED,
+	TS_TIMEOUT
+};
+
+struct Transaction
+{
+	char command[12];        //!< Including '#' and '\r'
+	uint8_t id;
+	uint8_t type;
+	char reg;                //!< Register for TT_READ
+	volatile uint8_t state;
+
+	uint32_t start_time;     //!< hal_micros() when transmission started
+	uint32_t end_time;       //!< hal_micros() when the answer was complete
+
+	bool ok;                 //!< Result, valid after nt_process()
+	int16_t value;           //!< Read value, valid after nt_process()
+};
+
+static Transaction g_queue[NT_QUEUE_SIZE];
+
+// Indices into g_queue. g_head <= g_active <= g_tail (modulo queue size):
+//  [g_head, g_active) finished, waiting for nt_process()
+//  g_active           on the bus (if != g_tail)
+//  [g_active, g_tail) queued
+static uint8_t g_head;
+static volatile uint8_t g_active;
+static volatile uint8_t g_tail;
+static uint8_t g_count; //!< Number of used slots (main context only)
+
+enum BusState
+{
+	BS_IDLE,
+	BS_GUARD,
+	BS_TX,
+	BS_HOLD,
+	BS_WAIT
+};
+
+static volatile uint8_t g_busState;
+static uint8_t g_txIdx;
+
+static NanotecBusStats g_stats;
+
+struct EncoderCache
+{
+	int16_t value;
+	uint32_t timestamp;
+	bool valid;
+};
+
+static EncoderCache g_encoders[proto::NUM_AXES];
+
 void nt_init()
 {
 #if USE_BUFFER
@@ -46,125 +146,323 @@ void nt_init()
 		g_ctl_buffer[i].velocity = 0xFFFF;
 	}
 #endif
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		g_head = g_active = g_tail = g_count = 0;
+		g_busState = BS_IDLE;
+	}
+
+	com_buf_from_bot.flush();
+
+	for(uint8_t i = 0; i < proto::NUM_AXES; ++i)
+		g_encoders[i].valid = false;
+
+	nt_resetBusStats();
 }
 
-static void write(char c)
+static inline uint8_t nextIndex(uint8_t idx)
 {
-	uart_rob->put(c);
+	return (idx + 1) % NT_QUEUE_SIZE;
 }
 
-static void write(const char* c)
+// Interrupt side. All of these run with interrupts disabled.
+
+static void startNext()
 {
-	rs485_setDir(RS485_OUT);
-	_delay_us(200);
+	if(g_active == g_tail)
+	{
+		g_busState = BS_IDLE;
+		return;
+	}
 
-	while(*c)
-		uart_rob->put(*(c++));
+	g_queue[g_active].state = TS_ACTIVE;
+	g_txIdx = 0;
 
-	uart_rob->put('\r');
+	rs485_setDir(RS485_OUT);
+	g_busState = BS_GUARD;
+	hal_busArmTimer(NT_GUARD_TIME);
+}
 
-	// Wait till transmission is complete
-	while(!uart_rob->dataSent());
-	_delay_us(200);
+static void finishActive(uint8_t state)
+{
+	Transaction* t = &g_queue[g_active];
+	t->end_time = hal_micros();
+	t->state = state;
 
-	rs485_setDir(RS485_IN);
+	g_active = nextIndex(g_active);
+	startNext();
 }
 
-static uint8_t readResponse(char* dest, uint8_t max_len)
+void nt_busRxISR(uint8_t c)
 {
-	uint8_t cnt = 0;
-	dest[max_len-1] = '\0';
+	// Everything outside of the response window is noise or a late answer
+	// to a timed out transaction.
+	if(g_busState != BS_WAIT)
+		return;
 
-	while(1)
+	com_buf_from_bot.put(c);
+
+	if(c == '\r')
 	{
-		uint8_t timeout = 0;
-		while(!com_buf_from_bot.available())
-		{
-			_delay_us(30);
-			timeout++;
-			if(timeout == 255)
-				return 0; // timeout
-		}
+		hal_busCancelTimer();
+		finishActive(TS_ANSWERED);
+	}
+}
 
-		uint8_t c = com_buf_from_bot.get();
-		if(c == '\r')
-		{
-			if(dest && cnt < max_len-1)
-				dest[cnt] = '\0';
-			return cnt;
-		}
+int16_t nt_busTxISR()
+{
+	if(g_busState != BS_TX)
+		return -1;
 
-		if(dest && cnt < max_len-1)
-			dest[cnt] = c;
+	char c = g_queue[g_active].command[g_txIdx];
+	if(!c)
+		return -1;
 
-		cnt++;
-	}
+	g_txIdx++;
+	return (uint8_t)c;
 }
 
-static bool isResponse(const char* cmp)
+void nt_busTxCompleteISR()
 {
-	char respbuf[20];
-	uint8_t count = readResponse(respbuf, sizeof(respbuf));
-
-	if(count < strlen(cmp))
-		return false;
+	if(g_busState != BS_TX)
+		return;
 
-	if(strncmp(cmp, respbuf, strlen(cmp)) == 0)
-		return true;
-	else
-		return false;
+	g_busState = BS_HOLD;
+	hal_busArmTimer(NT_HOLD_TIME);
 }
 
-static bool chat(const char* command, const char* expected_answer)
+void nt_busTimerISR()
 {
-	write(command);
+	switch(g_busState)
+	{
+		case BS_GUARD:
+			g_queue[g_active].start_time = hal_micros();
+			g_busState = BS_TX;
+			hal_busStartTx();
+			break;
+		case BS_HOLD:
+			rs485_setDir(RS485_IN);
+			g_busState = BS_WAIT;
+			hal_busArmTimer(NT_RESPONSE_TIMEOUT);
+			break;
+		case BS_WAIT:
+			// Terminate a partial answer so that nt_process() stays in sync
+			com_buf_from_bot.put('\r');
+			finishActive(TS_TIMEOUT);
+			break;
+	}
+}
+
+// Main context
 
-	return isResponse(expected_answer);
+uint8_t nt_queueFree()
+{
+	return NT_QUEUE_SIZE - g_count;
 }
 
-bool nt_ping(uint8_t id)
+static int8_t enqueue(uint8_t id, uint8_t type, char reg, const char* fmt, uint16_t arg)
 {
-	char cmd_buf[20];
-	char answer_buf[20];
+	if(g_count == NT_QUEUE_SIZE)
+		return -1;
 
-	snprintf(cmd_buf, sizeof(cmd_buf), "#%dZP", id);
-	snprintf(answer_buf, sizeof(answer_buf), "%dZP+", id);
+	uint8_t idx = g_tail;
+	Transaction* t = &g_queue[idx];
+
+	uint8_t len = snprintf(t->command, sizeof(t->command) - 1, fmt, id, arg);
+	if(len > sizeof(t->command) - 2)
+		len = sizeof(t->command) - 2;
+	t->command[len] = '\r';
+	t->command[len+1] = '\0';
+
+	t->id = id;
+	t->type = type;
+	t->reg = reg;
+	t->state = TS_QUEUED;
+	t->ok = false;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		g_tail = nextIndex(idx);
+		g_count++;
+
+		if(g_busState == BS_IDLE)
+			startNext();
+	}
 
-	return chat(cmd_buf, answer_buf);
+	return idx;
 }
 
-static bool readRegister(uint8_t id, char reg, int16_t* ret)
+static uint8_t readLine(char* dest, uint8_t max_len)
 {
-	char cmd_buf[20];
-	char answer_buf[20];
+	uint8_t cnt = 0;
+
+	while(com_buf_from_bot.available())
+	{
+		uint8_t c = com_buf_from_bot.get();
+		if(c == '\r')
+			break;
 
-	snprintf(cmd_buf, sizeof(cmd_buf), "#%dZ%c", id, reg);
-	write(cmd_buf);
+		if(cnt < max_len-1)
+			dest[cnt++] = c;
+	}
 
-	uint8_t response_len = readResponse(answer_buf, sizeof(answer_buf));
+	dest[cnt] = '\0';
+	return cnt;
+}
 
-	if(response_len < 4)
-		return false;
+static bool parseAnswer(Transaction* t, const char* answer, uint8_t len)
+{
+	if(t->type == TT_WRITE)
+	{
+		// Answer is the command without '#' and '\r'. Some commands
+		// append a status character, which we return as value.
+		uint8_t cmd_len = strlen(t->command) - 2;
+		if(len < cmd_len || strncmp(t->command + 1, answer, cmd_len) != 0)
+			return false;
+
+		t->value = answer[cmd_len];
+		return true;
+	}
 
-	if(answer_buf[0] != '0' + id)
+	if(len < 4)
 		return false;
 
-	if(answer_buf[1] != 'Z' || answer_buf[2] != reg)
+	if(answer[0] != '0' + t->id)
 		return false;
 
-	if(answer_buf[3] == '\0')
+	if(answer[1] != 'Z' || answer[2] != t->reg)
 		return false;
 
 	char* endptr;
-	int16_t tmp = strtol(answer_buf + 3, &endptr, 10);
+	int16_t tmp = strtol(answer + 3, &endptr, 10);
 	if(*endptr != '\0')
 		return false;
 
-	*ret = tmp;
+	t->value = tmp;
+
+	return true;
+}
+
+void nt_process()
+{
+	while(g_head != g_active)
+	{
+		Transaction* t = &g_queue[g_head];
+
+		char answer[16];
+		uint8_t len = readLine(answer, sizeof(answer));
+
+		if(t->state == TS_TIMEOUT)
+		{
+			t->ok = false;
+			g_stats.timeouts++;
+		}
+		else
+		{
+			t->ok = parseAnswer(t, answer, len);
+			if(!t->ok)
+				g_stats.errors++;
+
+			uint32_t latency = t->end_time - t->start_time;
+			if(latency > 0xFFFF)
+				latency = 0xFFFF;
+
+			g_stats.transactions++;
+			g_stats.latency_sum += latency;
+			if(latency < g_stats.latency_min)
+				g_stats.latency_min = latency;
+			if(latency > g_stats.latency_max)
+				g_stats.latency_max = latency;
+		}
+
+		if(t->ok && t->type == TT_READ && t->reg == 'I' && t->id >= 1 && t->id <= proto::NUM_AXES)
+		{
+			EncoderCache* enc = &g_encoders[t->id-1];
+			enc->value = t->value;
+			enc->timestamp = t->end_time;
+			enc->valid = true;
+		}
+
+		g_head = nextIndex(g_head);
+		g_count--;
+	}
+}
+
+void nt_flush()
+{
+	while(1)
+	{
+		nt_process();
+
+		if(g_count == 0)
+			return;
+
+		hal_idle();
+	}
+}
+
+const NanotecBusStats& nt_busStats()
+{
+	return g_stats;
+}
+
+void nt_resetBusStats()
+{
+	memset(&g_stats, 0, sizeof(g_stats));
+	g_stats.latency_min = 0xFFFF;
+}
+
+uint16_t nt_transactionTime()
+{
+	if(!g_stats.transactions)
+		return 0;
+
+	// The latency is measured from the end of the guard time
+	return g_stats.latency_sum / g_stats.transactions + NT_GUARD_TIME;
+}
+
+// Blocking interface
+
+/**
+ * Queue a transaction and wait for it to finish. Since the slot is only
+ * reused by the next enqueue(), the result can be read afterwards.
+ **/
+static const Transaction* transact(uint8_t id, uint8_t type, char reg, const char* fmt, uint16_t arg = 0)
+{
+	int8_t idx;
+	while((idx = enqueue(id, type, reg, fmt, arg)) < 0)
+	{
+		nt_process();
+		hal_idle();
+	}
+
+	nt_flush();
+
+	return &g_queue[idx];
+}
+
+static bool readRegister(uint8_t id, char reg, int16_t* ret)
+{
+	const char fmt[] = {'#', '%', 'd', 'Z', reg, 0};
+
+	const Transaction* t = transact(id, TT_READ, reg, fmt);
+	if(!t->ok)
+		return false;
 
+	*ret = t->value;
 	return true;
 }
 
+bool nt_ping(uint8_t id)
+{
+	int16_t value;
+	if(!readRegister(id, 'P', &value))
+		return false;
+
+	return value >= 0;
+}
+
 int8_t nt_state(uint8_t id)
 {
 	int16_t value;
@@ -179,61 +477,75 @@ int8_t nt_state(uint8_t id)
 
 void nt_setState(uint8_t id, uint8_t state)
 {
-	char cmd_buf[20];
-
-	snprintf(cmd_buf, sizeof(cmd_buf), "#%dP%d", id, state);
-	write(cmd_buf);
-
-	readResponse(NULL, 0);
+	transact(id, TT_WRITE, 0, "#%dP%u", state);
 }
 
 bool nt_startJava(uint8_t id)
 {
-	char cmd_buf[20];
-	char answer_buf[20];
+	const Transaction* t = transact(id, TT_WRITE, 0, "#%d(JA");
+
+	return t->ok && t->value == '+';
+}
 
-	snprintf(cmd_buf, sizeof(cmd_buf), "#%d(JA", id);
-	snprintf(answer_buf, sizeof(answer_buf), "%d(JA+", id);
+bool nt_setCurrents(uint8_t id, uint8_t hold, uint8_t max)
+{
+	if(!transact(id, TT_WRITE, 0, "#%dr%u", hold)->ok)
+		return false;
 
-	return chat(cmd_buf, answer_buf);
+	return transact(id, TT_WRITE, 0, "#%di%u", max)->ok;
 }
 
-void nt_setDestination(uint8_t id, uint16_t dest)
+bool nt_queueDestination(uint8_t id, uint16_t dest)
 {
 #if USE_BUFFER
 	if(g_ctl_buffer[id-1].dest == dest)
-		return;
+		return true;
+	g_ctl_buffer[id-1].dest = dest;
 #endif
 
-	char cmd_buf[20];
-
-	snprintf(cmd_buf, sizeof(cmd_buf), "#%dn%u", id, dest);
-
-	if(chat(cmd_buf, cmd_buf + 1))
-#if USE_BUFFER
-		g_ctl_buffer[id-1].dest = dest;
-#else
-		;
-#endif
+	return enqueue(id, TT_WRITE, 0, "#%dn%u", dest) >= 0;
 }
 
-void nt_setVelocity(uint8_t id, uint16_t vel)
+bool nt_queueVelocity(uint8_t id, uint16_t vel)
 {
 #if USE_BUFFER
 	if(g_ctl_buffer[id-1].velocity == vel)
-		return;
+		return true;
+	g_ctl_buffer[id-1].velocity = vel;
 #endif
 
-	char cmd_buf[20];
+	return enqueue(id, TT_WRITE, 0, "#%do%u", vel) >= 0;
+}
+
+bool nt_queueEncoderPosition(uint8_t id)
+{
+	return enqueue(id, TT_READ, 'I', "#%dZI", 0) >= 0;
+}
 
-	snprintf(cmd_buf, sizeof(cmd_buf), "#%do%u", id, vel);
+bool nt_lastEncoderPosition(uint8_t id, int16_t* dest, uint32_t* timestamp)
+{
+	if(id < 1 || id > proto::NUM_AXES)
+		return false;
 
-	if(chat(cmd_buf, cmd_buf + 1))
-#if USE_BUFFER
-		g_ctl_buffer[id-1].velocity = vel;
-#else
-		;
-#endif
+	const EncoderCache& enc = g_encoders[id-1];
+	if(!enc.valid)
+		return false;
+
+	*dest = enc.value;
+	if(timestamp)
+		*timestamp = enc.timestamp;
+
+	return true;
+}
+
+void nt_setDestination(uint8_t id, uint16_t dest)
+{
+	transact(id, TT_WRITE, 0, "#%dn%u", dest);
+}
+
+void nt_setVelocity(uint8_t id, uint16_t vel)
+{
+	transact(id, TT_WRITE, 0, "#%do%u", vel);
 }
 
 bool nt_encoderPosition(uint8_t id, int16_t* value)
@@ -245,4 +557,3 @@ bool nt_command(uint8_t id, int16_t* value)
 {
 	return readRegister(id, 's', value);
 }
-
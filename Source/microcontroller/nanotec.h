@@ -16,18 +16,92 @@ enum NanotecState
 	NT_STATE_COUNT
 };
 
+struct NanotecBusStats
+{
+	uint32_t transactions;  //!< Completed transactions
+	uint16_t timeouts;      //!< Transactions without answer
+	uint16_t errors;        //!< Invalid answers
+	uint16_t latency_min;   //!< Minimum transaction latency (us)
+	uint16_t latency_max;   //!< Maximum transaction latency (us)
+	uint32_t latency_sum;   //!< Sum of all latencies (us), for average
+};
+
 void nt_init();
 
+// Blocking interface. These functions wait until all queued transactions
+// and their own transaction are finished.
+
 bool nt_ping(uint8_t id);
 int8_t nt_state(uint8_t id);
 void nt_setState(uint8_t id, uint8_t state);
 
 bool nt_startJava(uint8_t id);
 
+//! Set hold and maximum current (% of the rated current)
+bool nt_setCurrents(uint8_t id, uint8_t hold, uint8_t max);
+
 void nt_setDestination(uint8_t id, uint16_t dest);
 void nt_setVelocity(uint8_t id, uint16_t vel);
 
 bool nt_encoderPosition(uint8_t id, int16_t* dest);
 bool nt_command(uint8_t id, int16_t* dest);
 
+// Non-blocking interface. Transactions are queued and executed in order by
+// the bus interrupts. The queue functions return false if the queue is full.
+
+const uint8_t NT_QUEUE_SIZE = 8;
+
+//! Number of free transaction slots
+uint8_t nt_queueFree();
+
+bool nt_queueDestination(uint8_t id, uint16_t dest);
+bool nt_queueVelocity(uint8_t id, uint16_t vel);
+
+/**
+ * Queue an encoder position read. The result can be retrieved with
+ * nt_lastEncoderPosition() as soon as it was processed by nt_process().
+ **/
+bool nt_queueEncoderPosition(uint8_t id);
+
+/**
+ * Get the last successfully read encoder position.
+ *
+ * @param timestamp If not NULL, receives the hal_micros() time at which
+ *        the answer was received.
+ * @return false if there was no successful read yet
+ **/
+bool nt_lastEncoderPosition(uint8_t id, int16_t* dest, uint32_t* timestamp = 0);
+
+/**
+ * Evaluate answers of finished transactions. Needs to be called regularly
+ * while using the non-blocking interface.
+ **/
+void nt_process();
+
+//! Wait until all queued transactions are finished
+void nt_flush();
+
+const NanotecBusStats& nt_busStats();
+void nt_resetBusStats();
+
+/**
+ * Average bus time of a transaction (us): guard time, command, hold time
+ * and answer. 0 if no transaction was completed since nt_resetBusStats().
+ **/
+uint16_t nt_transactionTime();
+
+// Interrupt handlers, called by the HAL
+
+//! Byte received on the bus
+void nt_busRxISR(uint8_t c);
+
+//! Transmit buffer empty. Returns the next byte to send, -1 if done.
+int16_t nt_busTxISR();
+
+//! Last byte has left the shift register
+void nt_busTxCompleteISR();
+
+//! One-shot timer armed with hal_busArmTimer() expired
+void nt_busTimerISR();
+
 #endif
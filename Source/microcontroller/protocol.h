@@ -12,14 +12,24 @@ namespace proto
 // below. With this system old-style tools which want to talk directly
 // to the motor controllers can do so without modifications.
 
-const int VERSION = 10;
+// Increment VERSION with every change of a packet or of its meaning. Some
+// builds changed the protocol without doing so. PC and C software of
+// these builds may report the same VERSION and still not understand each
+// other:
+//  10: CMD_STATS was added, the builds with it only became 11
+//  12: CMD_SUBSCRIBE was added, the builds with it only became 13
+//  12: CMD_SAVE_KEYFRAMES and CMD_CRC were added, the builds with them
+//      only became 13
+//  12: CMD_COMMIT_STATUS was added and CMD_COMMIT answers before the
+//      write is finished, the builds with this only became 13
+const int VERSION = 22;
 const int NUM_AXES = 8;
 const int MAX_KEYFRAMES = 128;
 const int NT_POSITION_BIAS = 16384;
 
 enum Command
 {
-	CMD_INIT          =  0, //!< Enable extended protocol
+	CMD_INIT          =  0, //!< Enable extended protocol, answered with a Session
 	CMD_RESET         =  1, //!< Reset microcontroller (and enter bootloader)
 	CMD_CONFIG        =  2, //!< Read/save axis configuration
 	CMD_READ_KEYFRAME =  3, //!< Read keyframe
@@ -30,10 +40,21 @@ enum Command
 	CMD_STOP          =  8, //!< Stop
 	CMD_FEEDBACK      =  9, //!< Get position feedback
 	CMD_MOTION        = 10, //!< Execute single motion command
+	CMD_STATS         = 11, //!< Read/reset control loop statistics
+	CMD_STREAM        = 12, //!< Append keyframe to the playback stream
+	CMD_SUBSCRIBE     = 13, //!< Subscribe to periodic feedback packets
+	CMD_SAVE_KEYFRAMES = 14, //!< Save several keyframes at once
+	CMD_CRC           = 15, //!< Get checksums of configuration and keyframes
+	CMD_COMMIT_STATUS = 16, //!< Get progress of the EEPROM write started by CMD_COMMIT
+	CMD_AXES          = 17, //!< Query and change the state of several axes at once
+	CMD_COMPLIANCE    = 18, //!< Switch hardware compliance on/off
 
 	CMD_COUNT
 };
 
+// The PC may send several commands without waiting for the answers
+// (up to the size of the µC receive buffer). They are executed and answered
+// in order, and every answer carries the sequence number of its command.
 struct PacketHeader
 {
 	PacketHeader(uint8_t _command, uint8_t _payloadLength)
@@ -41,13 +62,15 @@ struct PacketHeader
 	 , version(VERSION)
 	 , command(_command)
 	 , length(_payloadLength)
+	 , sequence(0)
 	{
 	}
 
-	uint8_t start;   //!< Fixed 0xFF
-	uint8_t version; //!< Protocol version
-	uint8_t command; //!< Command code
-	uint8_t length;  //!< Payload length
+	uint8_t start;    //!< Fixed 0xFF
+	uint8_t version;  //!< Protocol version
+	uint8_t command;  //!< Command code
+	uint8_t length;   //!< Payload length
+	uint8_t sequence; //!< Chosen by the PC, echoed in the answer
 
 	// Payload + 1 byte checksum + 1 byte end (0x0D) follow
 } __attribute__((packed));
@@ -66,6 +89,14 @@ struct Keyframe
 	uint16_t duration;
 	uint16_t ticks[NUM_AXES];
 	uint8_t output_command;
+
+	/**
+	 * Fly-by: with linear interpolation, the corner at this keyframe is
+	 * rounded off instead of stopping there. The blend takes this
+	 * percentage of the shorter adjacent segment (max. 100, 0 = pass
+	 * through the keyframe exactly). Ignored with lookahead 0.
+	 **/
+	uint8_t blend;
 } __attribute__((packed));
 
 struct SaveKeyframe
@@ -74,34 +105,105 @@ struct SaveKeyframe
 	Keyframe keyframe;
 } __attribute__((packed));
 
+/**
+ * Bulk keyframe upload
+ *
+ * Writes keyframes index..index+count-1. The size of the packet is fixed,
+ * unused entries are ignored.
+ **/
+const uint8_t KEYFRAMES_PER_PACKET = 4;
+
+struct SaveKeyframes
+{
+	uint8_t index;
+	uint8_t count;
+	Keyframe keyframes[KEYFRAMES_PER_PACKET];
+} __attribute__((packed));
+
 struct ReadKeyframe
 {
 	uint8_t index;
 } __attribute__((packed));
 
+//! Trajectory between the keyframes, see spline.h
+enum Interpolation
+{
+	IP_LINEAR   = 0, //!< Constant velocity in each segment
+	IP_CUBIC    = 1, //!< Cubic spline, continuous velocity
+	IP_MIN_JERK = 2  //!< Minimum jerk (quintic) segments, continuous acceleration
+};
+
+/**
+ * Identifies the EEPROM layout, i.e. the sizes of Keyframe and Config (the
+ * configuration is stored behind MAX_KEYFRAMES keyframes). Change it with
+ * every change of either struct: after flashing such a firmware, mem_init()
+ * finds a different value and drops the stored sequence instead of reading
+ * it from the wrong address.
+ **/
+const uint16_t CONFIG_LAYOUT = 0x4C02;
+
 struct Config
 {
 	uint16_t num_keyframes;
 	uint16_t active_axes;
 	uint16_t enc_to_mot[NUM_AXES]; //!< encoder_velocity = mot_to_enc * motor_velocity
 	uint16_t lookahead;
+	uint8_t hold_current[NUM_AXES]; //!< Stiff hold current (% of rated current)
+	uint8_t max_current[NUM_AXES];  //!< Stiff maximum current (% of rated current)
+	uint8_t interpolation;          //!< Interpolation, unknown values and lookahead 0 mean IP_LINEAR
+	uint16_t layout;                //!< Always CONFIG_LAYOUT
+} __attribute__((packed));
+
+enum ConfigResult
+{
+	CR_OK      = 0,
+	CR_BUSY    = 1, //!< Playing or writing to EEPROM, try again later
+	CR_INVALID = 2  //!< active_axes, layout or keyframe index out of range
+};
+
+/**
+ * Answer to writing the Config with CMD_CONFIG. A CMD_CONFIG without
+ * payload reads the Config instead. CMD_SAVE_KEYFRAME,
+ * CMD_SAVE_KEYFRAMES and CMD_COMMIT are answered the same way.
+ **/
+struct ConfigStatus
+{
+	uint8_t result; //!< ConfigResult
 } __attribute__((packed));
 
 enum FeedbackFlags
 {
-	FF_PLAYING = 1
+	FF_PLAYING = 1,
+	FF_STREAMING = 2,        //!< Playing from the keyframe stream
+	FF_STREAM_UNDERRUN = 4   //!< Stream ran empty since the last feedback
 };
 
+//! Unit of Feedback::sample_age (µs)
+const uint8_t SAMPLE_AGE_UNIT = 100;
+
+/**
+ * Position feedback
+ *
+ * The positions were not all read at the same time (during playback, one
+ * axis is sampled per control slot). Subtracting sample_age from time gives
+ * the µC time at which each position was read, so the PC can measure
+ * velocities with the µC clock and extrapolate to the present.
+ **/
 struct Feedback
 {
 	uint8_t num_axes;
 	uint8_t flags;
     int16_t positions[NUM_AXES]; // 0x7FFF = read error
+	uint8_t stream_free;       //!< Free keyframe slots in the stream buffer
+	uint8_t stream_low_water;  //!< Minimum number of buffered keyframes since the last feedback
+	uint32_t time;             //!< hal_micros() when the feedback was filled
+	uint8_t sample_age[NUM_AXES]; //!< Age of the positions at time (SAMPLE_AGE_UNIT), 255 = older or unknown
 } __attribute__((packed));
 
 enum PlayFlags
 {
-	PF_LOOP = 1
+	PF_LOOP = 1,
+	PF_STREAM = 2  //!< Play keyframes sent with CMD_STREAM
 };
 
 struct Play
@@ -109,12 +211,213 @@ struct Play
 	uint8_t flags;
 } __attribute__((packed));
 
+/**
+ * Streaming playback
+ *
+ * Keyframes are sent one by one with increasing index, starting at 0
+ * (which resets the stream). The index wraps around after 65535, a 0
+ * during playback continues the stream. The µC buffers up to MAX_KEYFRAMES of them and
+ * answers every CMD_STREAM packet with a StreamStatus. A keyframe is only
+ * accepted if its index matches next_index and there is free space,
+ * otherwise it has to be sent again later.
+ **/
+enum StreamKeyframeFlags
+{
+	SKF_LAST = 1  //!< Last keyframe of the stream
+};
+
+struct StreamKeyframe
+{
+	uint16_t index;
+	uint8_t flags;
+	Keyframe keyframe;
+} __attribute__((packed));
+
+struct StreamStatus
+{
+	uint16_t next_index;  //!< Index the µC expects next
+	uint8_t free;         //!< Free keyframe slots
+} __attribute__((packed));
+
+/**
+ * Feedback subscription
+ *
+ * After CMD_SUBSCRIBE with a period != 0, the µC sends
+ * Packet<CMD_SUBSCRIBE, Feedback> packets on its own. Their sequence number
+ * is incremented for every packet, so the PC can detect lost packets.
+ * The subscription ends if it is not renewed within SUBSCRIBE_TIMEOUT ms.
+ **/
+const uint16_t SUBSCRIBE_TIMEOUT = 1000;
+
+/**
+ * Progress of the background EEPROM write. CMD_COMMIT only starts it.
+ * The counts include the configuration as one item.
+ **/
+struct CommitStatus
+{
+	uint8_t busy;       //!< Write still in progress
+	uint8_t total;      //!< Number of items (changed keyframes + config)
+	uint8_t remaining;  //!< Items not written yet
+} __attribute__((packed));
+
+/**
+ * Checksums of the (uncommitted) sequence in the µC RAM.
+ *
+ * The keyframe checksums cover blocks of KEYFRAMES_PER_PACKET keyframes
+ * and only keyframes < num_keyframes of the current configuration. This
+ * way the PC can find out which blocks need to be uploaded.
+ * All checksums are CRC-16-CCITT (see crcUpdate()) starting with 0xFFFF.
+ **/
+const uint8_t CRC_BLOCKS = MAX_KEYFRAMES / KEYFRAMES_PER_PACKET;
+
+struct SequenceCrc
+{
+	uint16_t config;              //!< CRC of the Config struct
+	uint16_t blocks[CRC_BLOCKS];  //!< CRC of the keyframe blocks
+} __attribute__((packed));
+
+//! CRC-16-CCITT update, same as _crc_ccitt_update() from avr-libc
+inline uint16_t crcUpdate(uint16_t crc, uint8_t data)
+{
+	data ^= crc & 0xFF;
+	data ^= data << 4;
+
+	return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3));
+}
+
+inline uint16_t crcUpdate(uint16_t crc, const void* data, uint16_t length)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	for(uint16_t i = 0; i < length; ++i)
+		crc = crcUpdate(crc, bytes[i]);
+
+	return crc;
+}
+
+/**
+ * Answer to CMD_INIT
+ *
+ * The id is chosen with the first CMD_INIT after a µC reset. If the PC
+ * finds the same id, checksums and initialized axes after a link drop, it
+ * can continue where it left off instead of connecting from scratch.
+ **/
+struct Session
+{
+	uint32_t id;
+	uint16_t config_crc;   //!< SequenceCrc::config
+	uint16_t sequence_crc; //!< CRC of SequenceCrc::blocks
+	uint8_t ready;         //!< Bit mask of the initialized axes (P2/P3), bit 0 = address 1
+	uint8_t flags;         //!< FeedbackFlags
+} __attribute__((packed));
+
+struct Subscribe
+{
+	uint16_t period; //!< Feedback period (ms), 0 = unsubscribe
+} __attribute__((packed));
+
+enum StatsFlags
+{
+	SF_RESET = 1  //!< Reset statistics after reading
+};
+
+struct StatsRequest
+{
+	uint8_t flags;
+} __attribute__((packed));
+
+const int STATS_HISTOGRAM_BINS = 8;
+
+//! Upper limits of the first histogram bins (us), the last bin is open
+const uint16_t STATS_HISTOGRAM_LIMITS[STATS_HISTOGRAM_BINS-1] = {
+	50, 100, 200, 500, 1000, 2000, 5000
+};
+
+/**
+ * Control loop statistics, collected during playback.
+ *
+ * The cycle time is the interval between two encoder samples of the same
+ * axis. The histogram counts the deviation from cycle_period.
+ **/
+struct Stats
+{
+	uint16_t cycle_period;      //!< Nominal control cycle period (us)
+	uint32_t cycles;            //!< Number of measured cycles
+	uint16_t cycle_min;         //!< Minimum cycle time (us)
+	uint16_t cycle_max;         //!< Maximum cycle time (us)
+	uint16_t histogram[STATS_HISTOGRAM_BINS]; //!< see STATS_HISTOGRAM_LIMITS
+	uint16_t missed_slots;      //!< Slots skipped because the CPU was busy
+	uint16_t slot_delay_max;    //!< Maximum delay slot start -> sample request (us)
+	uint16_t sample_age_max;    //!< Maximum age of a sample when used (us)
+
+	uint32_t bus_transactions;  //!< Nanotec bus transactions
+	uint16_t bus_timeouts;
+	uint16_t bus_errors;
+	uint16_t bus_latency_min;   //!< Transaction latency (us)
+	uint16_t bus_latency_avg;
+	uint16_t bus_latency_max;
+} __attribute__((packed));
+
 const uint8_t RESET_KEY[8] = {0x0A, 0x65, 0x38, 0x47, 0x82, 0xAB, 0xBF};
 struct Reset
 {
 	uint8_t key[8];
 } __attribute__((packed));
 
+/**
+ * Batched motor controller handling (CMD_AXES)
+ *
+ * For every axis in the mask, the µC reads the state and, if requested,
+ * sets a new one. Then it reads the state again and the encoder position.
+ * The answer is a Packet<CMD_AXES, AxisStatus>. This replaces one plain
+ * round trip per axis and register (#<a>P, #<a>ZP, #<a>I) during
+ * connection and initialization. During playback nothing is done, all
+ * axes are reported as AXIS_STATE_BUSY.
+ **/
+enum AxisState
+{
+	AXIS_STATE_RESET = 0,      //!< Not initialized (P0)
+	AXIS_STATE_SEARCH = 1,     //!< Center search running (P1)
+	AXIS_STATE_IDLE = 2,       //!< Initialized (P2)
+	AXIS_STATE_COMPLIANCE = 3, //!< Hardware compliance (P3)
+	AXIS_STATE_BUSY = -2,      //!< Playing, try again later (answer only)
+
+	AXIS_KEEP_STATE = 0xFF,    //!< set_state: only query
+	AXIS_ANY_STATE = 0xFF      //!< if_state: change axes in any state
+};
+
+struct AxisCommand
+{
+	uint8_t axes;      //!< Bit mask, bit 0 = address 1
+	uint8_t set_state; //!< AxisState to set or AXIS_KEEP_STATE
+	uint8_t if_state;  //!< Only change axes in this state (or AXIS_ANY_STATE)
+} __attribute__((packed));
+
+struct AxisStatus
+{
+	int8_t state[NUM_AXES];      //!< AxisState, -1 = not requested or no answer, -2 = busy
+	int16_t positions[NUM_AXES]; //!< Encoder positions, 0x7FFF = read error
+} __attribute__((packed));
+
+/**
+ * Hardware compliance (CMD_COMPLIANCE)
+ *
+ * Compliant sets the hold and maximum current of all active axes to zero,
+ * stiff restores the currents from the Config. The extended mode and the
+ * feedback subscription stay active. Not possible during playback, the
+ * answer then reports all axes as failed.
+ * The answer is a Packet<CMD_COMPLIANCE, ComplianceStatus>.
+ **/
+struct Compliance
+{
+	uint8_t compliant;
+} __attribute__((packed));
+
+struct ComplianceStatus
+{
+	uint8_t compliant;
+	uint8_t failed;    //!< Bit mask of axes which did not acknowledge, bit 0 = address 1
+} __attribute__((packed));
+
 struct Motion
 {
 	uint16_t ticks[NUM_AXES];
@@ -125,7 +428,7 @@ struct Motion
 
 inline uint8_t packetChecksum(const PacketHeader& header, const uint8_t* payload)
 {
-	uint8_t checksum = header.command + header.version + header.length;
+	uint8_t checksum = header.command + header.version + header.length + header.sequence;
 
     if(payload)
     {
@@ -0,0 +1,302 @@
+// Control loop benchmark on the simulated bus
+//
+// Plays a looped test sequence on the simulated controllers for a fixed
+// amount of virtual time and reports bus utilization, setpoint update rate
+// per axis, tracking error and the host CPU time needed for the simulation.
+// The setpoint range of each axis in the last second shows that the axes
+// still follow the sequence at the end.
+//
+// In stream mode, the sequence is not loaded into the keyframe buffer but
+// streamed with CMD_STREAM packets while playing, like the PC does for
+// sequences longer than MAX_KEYFRAMES.
+//
+// The interpolation between the keyframes can be selected with linear
+// (default), cubic or minjerk. With blend, the keyframes are flown by
+// (proto::Keyframe::blend, linear interpolation only).
+//
+// With short, the keyframes are only SHORT_DURATION to SHORT_DURATION+20 ms
+// apart, with smaller amplitudes and a lookahead of SHORT_DURATION. Streaming
+// for more than 2000 s then sends more than 65536 keyframes, so the 16 bit
+// stream index wraps around.
+//
+// Usage: igus_sim_bench [axes] [seconds] [stream] [linear|cubic|minjerk] [blend] [short]
+
+#include "sim.h"
+
+#include "../hal.h"
+#include "../motion.h"
+#include "../mem.h"
+#include "../nanotec.h"
+#include "../protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t g_stopTime;
+static uint32_t g_maxError;
+static uint8_t g_axes;
+static uint8_t g_blend;
+static bool g_short;
+static int16_t g_finalMin[proto::NUM_AXES + 1];
+static int16_t g_finalMax[proto::NUM_AXES + 1];
+
+// Stream mode
+static bool g_stream;
+static uint16_t g_streamIndex;       //!< Next keyframe to send
+static uint32_t g_streamCount;       //!< Keyframes sent (g_streamIndex wraps around)
+static bool g_streamLast;            //!< Last keyframe was sent
+static uint32_t g_streamUnderruns;   //!< Feedback intervals with underrun
+static uint8_t g_streamLowWater = 0xFF;
+
+//! Keep only a few keyframes buffered to exercise the refill path
+const uint8_t STREAM_AHEAD = 8;
+
+//! Shortest keyframe duration with the short option (ms)
+const uint16_t SHORT_DURATION = 20;
+
+/**
+ * Test sequence: every axis swings between two positions with
+ * different amplitudes. Keyframe 0 is the start position.
+ **/
+static proto::Keyframe testKeyframe(uint32_t k)
+{
+	proto::Keyframe kf;
+	kf.duration = (k == 0) ? 0 : 400 + 100 * (k % 4);
+	if(g_short && k != 0)
+		kf.duration = SHORT_DURATION + 10 * (k % 3);
+
+	kf.output_command = (k % 2) ? proto::OC_SET : proto::OC_RESET;
+	kf.blend = g_blend;
+
+	for(uint8_t j = 0; j < proto::NUM_AXES; ++j)
+	{
+		int16_t amplitude = 300 + 200 * j;
+		if(g_short)
+			amplitude /= 5;
+		int16_t pos = (k % 2) ? amplitude : -amplitude;
+		if(k == 0)
+			pos = 0;
+		kf.ticks[j] = pos + proto::NT_POSITION_BIAS;
+	}
+
+	return kf;
+}
+
+static void streamKeyframe()
+{
+	proto::Packet<proto::CMD_STREAM, proto::StreamKeyframe> packet;
+	packet.payload.index = g_streamIndex;
+	packet.payload.flags = 0;
+	packet.payload.keyframe = testKeyframe(g_streamCount);
+
+	if(sim_time() >= g_stopTime)
+	{
+		packet.payload.flags |= proto::SKF_LAST;
+		g_streamLast = true;
+	}
+
+	packet.updateChecksum();
+	sim_pcWrite(&packet, sizeof(packet));
+	g_streamIndex++;
+	g_streamCount++;
+}
+
+static void streamTick()
+{
+	// Discard the StreamStatus answers
+	uint8_t buf[64];
+	while(sim_pcRead(buf, sizeof(buf)));
+
+	static uint8_t ticks = 0;
+	if(++ticks != 10)
+		return;
+	ticks = 0;
+
+	proto::Feedback feedback;
+	memset(&feedback, 0, sizeof(feedback));
+	motion_streamFeedback(&feedback);
+
+	if(feedback.flags & proto::FF_STREAM_UNDERRUN)
+		g_streamUnderruns++;
+	if(feedback.stream_low_water < g_streamLowWater)
+		g_streamLowWater = feedback.stream_low_water;
+
+	// At most one keyframe per 10ms, the µC handles one command per
+	// control loop iteration.
+	if(!g_streamLast && motion_streamFree() > proto::MAX_KEYFRAMES - STREAM_AHEAD)
+		streamKeyframe();
+}
+
+static void tickHook()
+{
+	// Track deviation between setpoint and actual position
+	for(uint8_t i = 1; i <= g_axes; ++i)
+	{
+		const NanotecSim* ctrl = sim_controller(i);
+		uint32_t error = abs(ctrl->target() - ctrl->position());
+		if(error > g_maxError)
+			g_maxError = error;
+
+		if(sim_time() + 1000000ULL >= g_stopTime && sim_time() < g_stopTime)
+		{
+			if(ctrl->target() < g_finalMin[i])
+				g_finalMin[i] = ctrl->target();
+			if(ctrl->target() > g_finalMax[i])
+				g_finalMax[i] = ctrl->target();
+		}
+	}
+
+	if(g_stream)
+		streamTick();
+	else if(sim_time() >= g_stopTime)
+		motion_stop();
+}
+
+int main(int argc, char** argv)
+{
+	g_axes = (argc > 1) ? atoi(argv[1]) : 5;
+	uint32_t seconds = (argc > 2) ? atoi(argv[2]) : 20;
+
+	uint8_t interpolation = proto::IP_LINEAR;
+	for(int i = 3; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "stream") == 0)
+			g_stream = true;
+		else if(strcmp(argv[i], "linear") == 0)
+			interpolation = proto::IP_LINEAR;
+		else if(strcmp(argv[i], "cubic") == 0)
+			interpolation = proto::IP_CUBIC;
+		else if(strcmp(argv[i], "minjerk") == 0)
+			interpolation = proto::IP_MIN_JERK;
+		else if(strcmp(argv[i], "blend") == 0)
+			g_blend = 50;
+		else if(strcmp(argv[i], "short") == 0)
+			g_short = true;
+		else
+		{
+			fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if(g_axes < 1 || g_axes > proto::NUM_AXES)
+	{
+		fprintf(stderr, "Invalid number of axes\n");
+		return 1;
+	}
+
+	sim_init(g_axes);
+
+	mem_config.active_axes = g_axes;
+	mem_config.layout = proto::CONFIG_LAYOUT;
+	mem_config.lookahead = g_short ? SHORT_DURATION : 300;
+	mem_config.interpolation = interpolation;
+	for(uint8_t i = 0; i < proto::NUM_AXES; ++i)
+		mem_config.enc_to_mot[i] = 256;
+
+	const uint8_t NUM_KEYFRAMES = 8;
+	mem_config.num_keyframes = NUM_KEYFRAMES;
+
+	for(uint8_t k = 0; k < NUM_KEYFRAMES; ++k)
+	{
+		proto::Keyframe kf = testKeyframe(k);
+		motion_writeToBuffer(k, kf);
+	}
+
+	// The stream mode restores the sequence from EEPROM afterwards
+	motion_commit();
+	while(mem_commitBusy())
+		hal_idle();
+
+	if(g_stream)
+	{
+		// Prefill, the rest is sent while playing
+		for(g_streamIndex = 0; g_streamIndex < STREAM_AHEAD; ++g_streamIndex)
+		{
+			proto::StreamKeyframe packet;
+			packet.index = g_streamIndex;
+			packet.flags = 0;
+			packet.keyframe = testKeyframe(g_streamIndex);
+			motion_streamKeyframe(packet);
+		}
+		g_streamCount = g_streamIndex;
+	}
+
+	for(uint8_t i = 1; i <= g_axes; ++i)
+		sim_controller(i)->setInitialized(0);
+
+	for(uint8_t i = 1; i <= g_axes; ++i)
+	{
+		g_finalMin[i] = 0x7FFF;
+		g_finalMax[i] = -0x7FFF;
+	}
+
+	g_stopTime = 1000000ULL * seconds;
+	sim_setTickHook(tickHook);
+	sim_resetBusStats();
+
+	clock_t start = clock();
+	motion_runSequence(!g_stream, g_stream);
+	clock_t end = clock();
+
+	double sim_ms = sim_time() / 1000.0;
+	double cpu_ms = 1000.0 * (end - start) / CLOCKS_PER_SEC;
+	const SimBusStats& stats = sim_busStats();
+	const NanotecBusStats& nt = nt_busStats();
+
+	proto::Stats ctrl;
+	motion_getStats(&ctrl);
+
+	printf("axes:                 %u\n", g_axes);
+	printf("interpolation:        %u\n", interpolation);
+	printf("blend:                %u %%\n", g_blend);
+	printf("simulated time:       %.0f ms\n", sim_ms);
+	printf("host CPU time:        %.1f ms (%.1fx real time)\n", cpu_ms, sim_ms / cpu_ms);
+	printf("bus transactions:     %u (%.3f / ms)\n", stats.transactions, stats.transactions / sim_ms);
+	printf("bus utilization:      %.1f %%\n", 100.0 * stats.busy_time / (sim_ms * 1000.0));
+	printf("bus collisions:       %u\n", stats.collisions);
+	printf("rx overruns:          %u\n", stats.overruns);
+	printf("lost timer ticks:     %u\n", stats.lost_ticks);
+	printf("transaction latency:  min %u us, avg %.0f us, max %u us\n",
+		nt.latency_min, nt.transactions ? (double)nt.latency_sum / nt.transactions : 0.0, nt.latency_max
+	);
+	printf("timeouts / errors:    %u / %u\n", nt.timeouts, nt.errors);
+
+	printf("control cycle:        nominal %u us, min %u us, max %u us (%u cycles)\n",
+		ctrl.cycle_period, ctrl.cycle_min, ctrl.cycle_max, ctrl.cycles
+	);
+	printf("cycle jitter:        ");
+	for(uint8_t i = 0; i < proto::STATS_HISTOGRAM_BINS; ++i)
+	{
+		if(i < proto::STATS_HISTOGRAM_BINS-1)
+			printf(" <%u:%u", proto::STATS_HISTOGRAM_LIMITS[i], ctrl.histogram[i]);
+		else
+			printf(" more:%u", ctrl.histogram[i]);
+	}
+	printf("\n");
+	printf("missed slots:         %u\n", ctrl.missed_slots);
+	printf("max slot delay:       %u us\n", ctrl.slot_delay_max);
+	printf("max sample age:       %u us\n", ctrl.sample_age_max);
+
+	for(uint8_t i = 1; i <= g_axes; ++i)
+	{
+		const NanotecSim* sim = sim_controller(i);
+		printf("axis %u setpoint rate: %.1f Hz\n", i, sim->setpointCount() / (sim_ms / 1000.0));
+	}
+
+	for(uint8_t i = 1; i <= g_axes; ++i)
+		printf("axis %u final range:  %d ticks\n", i, g_finalMax[i] - g_finalMin[i]);
+
+	printf("max tracking error:   %u ticks\n", g_maxError);
+
+	if(g_stream)
+	{
+		printf("streamed keyframes:   %lu\n", (unsigned long)g_streamCount);
+		printf("stream underruns:     %u\n", g_streamUnderruns);
+		printf("stream low water:     %u keyframes\n", g_streamLowWater);
+	}
+
+	return 0;
+}
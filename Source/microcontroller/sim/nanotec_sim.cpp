@@ -0,0 +1,180 @@
+// Simulated Nanotec motor controller
+
+#include "nanotec_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+NanotecSim::NanotecSim()
+ : m_id(0)
+ , m_lineLength(0)
+ , m_lineValid(false)
+ , m_state(0)
+ , m_javaRunning(false)
+ , m_searchTime(0)
+ , m_position(0)
+ , m_maxSpeed2(NT_BIAS)
+ , m_maxSpeed(500)
+ , m_current(50)
+ , m_holdCurrent(20)
+ , m_commandCount(0)
+ , m_setpointCount(0)
+{
+}
+
+void NanotecSim::setInitialized(int16_t position)
+{
+	m_javaRunning = true;
+	m_state = 2;
+	m_position = ((int32_t)position) * POS_SCALE;
+	m_maxSpeed2 = position + NT_BIAS;
+}
+
+void NanotecSim::resetCounters()
+{
+	m_commandCount = 0;
+	m_setpointCount = 0;
+}
+
+uint8_t NanotecSim::input(char c, char* response, uint8_t max_len)
+{
+	if(c == '#')
+	{
+		m_lineLength = 0;
+		m_lineValid = true;
+		return 0;
+	}
+
+	if(!m_lineValid)
+		return 0;
+
+	if(c == '\r')
+	{
+		m_line[m_lineLength] = 0;
+		m_lineValid = false;
+		return handleCommand(response, max_len);
+	}
+
+	if(m_lineLength == sizeof(m_line)-1)
+	{
+		m_lineValid = false;
+		return 0;
+	}
+
+	m_line[m_lineLength++] = c;
+	return 0;
+}
+
+uint8_t NanotecSim::handleCommand(char* response, uint8_t max_len)
+{
+	char* cmd;
+	long id = strtol(m_line, &cmd, 10);
+
+	if(cmd == m_line || id != m_id)
+		return 0;
+
+	m_commandCount++;
+
+	int len;
+
+	if(cmd[0] == 'Z')
+	{
+		// Register read
+		int32_t value;
+		switch(cmd[1])
+		{
+			case 'P': value = m_state; break;
+			case 'I': value = position(); break;
+			case 's': value = target(); break;
+			case 'n': value = m_maxSpeed2; break;
+			case 'o': value = m_maxSpeed; break;
+			case 'r': value = m_holdCurrent; break;
+			case 'i': value = m_current; break;
+			default:
+				len = snprintf(response, max_len, "%d%s?\r", m_id, cmd);
+				return (len < max_len) ? len : 0;
+		}
+
+		len = snprintf(response, max_len, "%dZ%c%+ld\r", m_id, cmd[1], (long)value);
+		return (len < max_len) ? len : 0;
+	}
+
+	if(strcmp(cmd, "(JA") == 0)
+	{
+		m_javaRunning = true;
+		len = snprintf(response, max_len, "%d(JA+\r", m_id);
+		return (len < max_len) ? len : 0;
+	}
+
+	char* endptr;
+	long value = strtol(cmd + 1, &endptr, 10);
+	if(endptr == cmd + 1 || *endptr != 0)
+	{
+		len = snprintf(response, max_len, "%d%s?\r", m_id, cmd);
+		return (len < max_len) ? len : 0;
+	}
+
+	switch(cmd[0])
+	{
+		case 'P':
+			m_state = value;
+			if(m_state == 1)
+				m_searchTime = 0;
+			break;
+		case 'n':
+			m_maxSpeed2 = value;
+			m_setpointCount++;
+			break;
+		case 'o':
+			m_maxSpeed = value;
+			break;
+		case 'r':
+			m_holdCurrent = value;
+			break;
+		case 'i':
+			m_current = value;
+			break;
+		default:
+			len = snprintf(response, max_len, "%d%s?\r", m_id, cmd);
+			return (len < max_len) ? len : 0;
+	}
+
+	// Commands are acknowledged by echoing them without the '#'
+	len = snprintf(response, max_len, "%s\r", m_line);
+	return (len < max_len) ? len : 0;
+}
+
+void NanotecSim::update(uint32_t us)
+{
+	if(!m_javaRunning)
+		return;
+
+	switch(m_state)
+	{
+		case 1:
+			// Searching for the center position
+			m_searchTime += us;
+			if(m_searchTime >= SEARCH_TIME)
+			{
+				m_position = 0;
+				m_maxSpeed2 = NT_BIAS;
+				m_state = 2;
+			}
+			break;
+		case 2:
+		{
+			if(m_current == 0)
+				break;
+
+			int32_t target = (m_maxSpeed2 - NT_BIAS) * POS_SCALE;
+			int64_t step = ((int64_t)m_maxSpeed) * ENC_PER_MOT * us * POS_SCALE / 1000000LL;
+
+			if(m_position < target)
+				m_position = (target - m_position > step) ? m_position + step : target;
+			else
+				m_position = (m_position - target > step) ? m_position - step : target;
+		}
+			break;
+	}
+}
@@ -0,0 +1,96 @@
+// Simulated Nanotec motor controller
+//
+// Emulates a controller running NanoJMotorControl.java as far as it is
+// visible on the RS485 bus: the ASCII command protocol, the state machine in
+// the pause register and a simple position controller with velocity limit.
+
+#ifndef NANOTEC_SIM_H
+#define NANOTEC_SIM_H
+
+#include <stdint.h>
+
+class NanotecSim
+{
+public:
+	NanotecSim();
+
+	void setId(uint8_t id)
+	{ m_id = id; }
+
+	uint8_t id() const
+	{ return m_id; }
+
+	/**
+	 * Feed one character from the bus.
+	 *
+	 * @param response If the character completed a command addressed to us,
+	 *        the response (including the terminating '\r') is written here.
+	 * @param max_len Size of the response buffer
+	 * @return Length of the response, 0 if there is nothing to answer
+	 **/
+	uint8_t input(char c, char* response, uint8_t max_len);
+
+	/**
+	 * Advance the controller physics.
+	 *
+	 * @param us Elapsed time in microseconds
+	 **/
+	void update(uint32_t us);
+
+	//! Put the controller directly into normal mode (P2) at the given position
+	void setInitialized(int16_t position);
+
+	uint8_t state() const
+	{ return m_state; }
+
+	int16_t position() const
+	{ return m_position / POS_SCALE; }
+
+	int16_t target() const
+	{ return (int16_t)(m_maxSpeed2 - NT_BIAS); }
+
+	bool isCompliant() const
+	{ return m_current == 0; }
+
+	//! Number of complete commands addressed to this controller
+	uint32_t commandCount() const
+	{ return m_commandCount; }
+
+	//! Number of setpoint updates ("n" commands)
+	uint32_t setpointCount() const
+	{ return m_setpointCount; }
+
+	void resetCounters();
+
+	//! Duration of the center search (state P1) in microseconds
+	static const uint32_t SEARCH_TIME = 500000;
+
+	//! Encoder ticks per motor step
+	static const int32_t ENC_PER_MOT = 1;
+private:
+	static const int32_t NT_BIAS = 16384;
+	static const int32_t POS_SCALE = 1000;
+
+	uint8_t handleCommand(char* response, uint8_t max_len);
+
+	uint8_t m_id;
+
+	char m_line[24];
+	uint8_t m_lineLength;
+	bool m_lineValid;
+
+	uint8_t m_state;
+	bool m_javaRunning;
+	uint32_t m_searchTime;
+
+	int32_t m_position; //!< Encoder position * POS_SCALE
+	int32_t m_maxSpeed2; //!< Biased target position ("n" register)
+	int32_t m_maxSpeed;  //!< Velocity in motor steps/s ("o" register)
+	int32_t m_current;
+	int32_t m_holdCurrent;
+
+	uint32_t m_commandCount;
+	uint32_t m_setpointCount;
+};
+
+#endif
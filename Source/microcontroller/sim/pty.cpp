@@ -0,0 +1,190 @@
+// Simulated controller board on a pseudo terminal
+//
+// Runs the firmware command handling and the simulated bus in real time
+// and connects the PC link to a pty, so PC software can talk to it like to
+// the real board (e.g. the serial latency benchmark in Source/bench).
+//
+// Only the extended protocol is supported: bytes received outside of a
+// session are discarded until a CMD_INIT packet arrives. Bytes to the PC
+// are timed like on the 115200 baud line, bytes from the PC arrive
+// immediately.
+//
+// Usage: igus_sim_pty [axes] [link]
+//
+// Prints the name of the pty device. If link is given, a symlink with this
+// name pointing to the device is created as well.
+
+#include "sim.h"
+
+#include "../combuf.h"
+#include "../commands.h"
+#include "../hal.h"
+#include "../mem.h"
+#include "../protocol.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+static int g_master = -1;
+static uint64_t g_startTime;
+static uint32_t g_droppedBytes;
+static volatile sig_atomic_t g_quit = 0;
+
+static uint64_t wallMicros()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void sleepMicros(int64_t us)
+{
+	struct timespec ts;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, 0);
+}
+
+/**
+ * Advance hook: forward the µC output to the pty, hold the virtual clock
+ * back to real time and feed the PC input into the µC receive buffer.
+ **/
+static void pumpPC()
+{
+	uint8_t buf[256];
+	uint16_t len;
+
+	while((len = sim_pcRead(buf, sizeof(buf))) != 0)
+	{
+		// Nobody listening (EIO) or not reading (EAGAIN): data is lost,
+		// like on the real serial line.
+		if(write(g_master, buf, len) != len)
+			g_droppedBytes += len;
+	}
+
+	// Sleep until the wall clock has caught up, but wake up on input
+	int64_t ahead = (int64_t)sim_time() - (int64_t)(wallMicros() - g_startTime);
+	if(ahead > 0)
+	{
+		struct pollfd pfd;
+		pfd.fd = g_master;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		struct timespec ts;
+		ts.tv_sec = ahead / 1000000;
+		ts.tv_nsec = (ahead % 1000000) * 1000;
+
+		// Without an open slave, poll() reports POLLHUP immediately
+		if(ppoll(&pfd, 1, &ts, 0) > 0 && (pfd.revents & POLLHUP))
+			sleepMicros(ahead);
+	}
+
+	ssize_t ret;
+	while((ret = read(g_master, buf, sizeof(buf))) > 0)
+		sim_pcWrite(buf, ret);
+}
+
+static void handleSignal(int)
+{
+	g_quit = 1;
+}
+
+int main(int argc, char** argv)
+{
+	uint8_t axes = (argc > 1) ? atoi(argv[1]) : 5;
+	const char* link = (argc > 2) ? argv[2] : 0;
+
+	if(axes < 1 || axes > proto::NUM_AXES)
+	{
+		fprintf(stderr, "Invalid number of axes\n");
+		return 1;
+	}
+
+	g_master = posix_openpt(O_RDWR | O_NOCTTY);
+	if(g_master < 0 || grantpt(g_master) != 0 || unlockpt(g_master) != 0)
+	{
+		perror("Could not create pty");
+		return 1;
+	}
+
+	fcntl(g_master, F_SETFL, fcntl(g_master, F_GETFL) | O_NONBLOCK);
+
+	// Raw mode, in case the client does not set it up itself
+	struct termios tio;
+	tcgetattr(g_master, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(g_master, TCSANOW, &tio);
+
+	const char* device = ptsname(g_master);
+	if(link)
+	{
+		unlink(link);
+		if(symlink(device, link) != 0)
+		{
+			perror("Could not create link");
+			return 1;
+		}
+	}
+
+	printf("%s\n", device);
+	fflush(stdout);
+
+	signal(SIGINT, handleSignal);
+	signal(SIGTERM, handleSignal);
+
+	sim_init(axes);
+
+	mem_config.active_axes = axes;
+	mem_config.layout = proto::CONFIG_LAYOUT;
+	mem_config.lookahead = 300;
+	mem_config.num_keyframes = 0;
+	for(uint8_t i = 0; i < proto::NUM_AXES; ++i)
+		mem_config.enc_to_mot[i] = 256;
+
+	for(uint8_t i = 1; i <= axes; ++i)
+		sim_controller(i)->setInitialized(0);
+
+	g_startTime = wallMicros();
+	sim_setAdvanceHook(pumpPC);
+
+	// Like main.cpp: wait for CMD_INIT, then run the command loop until
+	// the PC leaves the extended mode or goes silent.
+	proto::SimplePacket<proto::CMD_INIT> initPacket;
+	uint8_t offset = 0;
+
+	while(!g_quit)
+	{
+		hal_delayMs(1);
+
+		while(com_buf_to_bot.available())
+		{
+			uint8_t c = com_buf_to_bot.get();
+			if(c == initPacket[offset])
+				offset++;
+			else
+				offset = (c == initPacket[0]) ? 1 : 0;
+
+			if(offset == sizeof(initPacket))
+			{
+				offset = 0;
+				handleCommand(proto::CMD_INIT, 0, 0);
+				handleCommands();
+			}
+		}
+	}
+
+	if(link)
+		unlink(link);
+
+	if(g_droppedBytes)
+		fprintf(stderr, "%u bytes to the PC were dropped\n", g_droppedBytes);
+
+	return 0;
+}
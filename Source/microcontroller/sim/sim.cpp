@@ -0,0 +1,593 @@
+// Host simulation of the controller board
+
+#include "sim.h"
+
+#include "../hal.h"
+#include "../combuf.h"
+#include "../io.h"
+#include "../mem.h"
+#include "../nanotec.h"
+
+#include <string.h>
+
+// Virtual clock
+static uint64_t g_now;
+
+// Interrupt state
+static uint8_t g_irqDisabled;
+static bool g_timerRunning;
+static bool g_timerPending;
+static uint64_t g_nextTick;
+static void (*g_tickHook)();
+static void (*g_advanceHook)();
+
+// RS485 bus
+static NanotecSim g_controllers[SIM_MAX_CONTROLLERS];
+static uint8_t g_numControllers;
+static RS485Direction g_busDir;
+static uint32_t g_responseDelay;
+static SimBusStats g_stats;
+
+struct BusByte
+{
+	uint64_t time;
+	uint8_t c;
+};
+
+const uint16_t RX_QUEUE_SIZE = 256;
+static BusByte g_rxQueue[RX_QUEUE_SIZE];
+static uint16_t g_rxRead;
+static uint16_t g_rxWrite;
+static uint64_t g_rxBusyUntil;
+
+// USART3 receive FIFO (used while interrupts are disabled)
+static uint8_t g_rxFifo[2];
+static uint8_t g_rxFifoCount;
+
+// USART3 transmitter. The UDRE interrupt is modelled without double
+// buffering: the next byte is requested when the previous one is done.
+static bool g_udreEnabled;
+static uint64_t g_udreTime;
+static bool g_txcPending;
+static uint64_t g_txBusyUntil;
+
+// One-shot bus timer (Timer3 compare B)
+static bool g_busTimerArmed;
+static uint64_t g_busTimerTime;
+
+// EEPROM write in progress and ready interrupt
+const uint32_t SIM_EEPROM_WRITE_TIME = 3400;
+static uint64_t g_eeBusyUntil;
+static bool g_eeReadyIRQ;
+
+//! Time consumed by one hal_idle() call
+const uint32_t SIM_IDLE_TIME = 10;
+
+// PC link
+const uint16_t PC_BUFSIZE = 4096;
+static uint8_t g_pcBuf[PC_BUFSIZE];
+static uint16_t g_pcRead;
+static uint16_t g_pcWrite;
+
+// Digital I/O
+static bool g_button;
+static bool g_output;
+static bool g_led;
+static bool g_resetRequested;
+
+void sim_init(uint8_t num_controllers)
+{
+	g_now = 0;
+	g_irqDisabled = 0;
+	g_timerRunning = false;
+	g_timerPending = false;
+	g_tickHook = 0;
+	g_advanceHook = 0;
+
+	if(num_controllers > SIM_MAX_CONTROLLERS)
+		num_controllers = SIM_MAX_CONTROLLERS;
+
+	g_numControllers = num_controllers;
+	for(uint8_t i = 0; i < SIM_MAX_CONTROLLERS; ++i)
+	{
+		g_controllers[i] = NanotecSim();
+		g_controllers[i].setId(i+1);
+	}
+
+	g_busDir = RS485_IN;
+	g_responseDelay = 300;
+	g_rxRead = g_rxWrite = 0;
+	g_rxBusyUntil = 0;
+	g_rxFifoCount = 0;
+	g_udreEnabled = false;
+	g_txcPending = false;
+	g_txBusyUntil = 0;
+	g_busTimerArmed = false;
+	g_eeBusyUntil = 0;
+	g_eeReadyIRQ = false;
+	sim_resetBusStats();
+
+	g_pcRead = g_pcWrite = 0;
+
+	g_button = false;
+	g_output = false;
+	g_led = false;
+	g_resetRequested = false;
+
+	com_buf_to_pc.flush();
+	com_buf_to_bot.flush();
+	com_buf_from_bot.flush();
+
+	nt_init();
+}
+
+uint64_t sim_time()
+{
+	return g_now;
+}
+
+void sim_setResponseDelay(uint32_t us)
+{
+	g_responseDelay = us;
+}
+
+void sim_setTickHook(void (*hook)())
+{
+	g_tickHook = hook;
+}
+
+void sim_setAdvanceHook(void (*hook)())
+{
+	g_advanceHook = hook;
+}
+
+NanotecSim* sim_controller(uint8_t id)
+{
+	if(id < 1 || id > g_numControllers)
+		return 0;
+
+	return &g_controllers[id-1];
+}
+
+const SimBusStats& sim_busStats()
+{
+	return g_stats;
+}
+
+void sim_resetBusStats()
+{
+	memset(&g_stats, 0, sizeof(g_stats));
+	for(uint8_t i = 0; i < SIM_MAX_CONTROLLERS; ++i)
+		g_controllers[i].resetCounters();
+}
+
+// Interrupt delivery
+
+static void rxInterrupt(uint8_t c)
+{
+	// See USART3_RX_vect in uart.cpp. The passthrough mode is handled by
+	// main(), which is not part of the simulation.
+	if(!c)
+		return;
+
+	// Interrupts are disabled inside the handler
+	g_irqDisabled++;
+	nt_busRxISR(c);
+	g_irqDisabled--;
+}
+
+static void timerInterrupt()
+{
+	g_irqDisabled++;
+	hal_timerISR();
+	g_irqDisabled--;
+
+	if(g_tickHook)
+		g_tickHook();
+}
+
+static void deliverBusByte(uint8_t c)
+{
+	g_stats.bytes_rx++;
+
+	if(g_irqDisabled)
+	{
+		// Bytes beyond the hardware FIFO are lost (data overrun)
+		if(g_rxFifoCount < sizeof(g_rxFifo))
+			g_rxFifo[g_rxFifoCount++] = c;
+		else
+			g_stats.overruns++;
+		return;
+	}
+
+	rxInterrupt(c);
+}
+
+static void transmitBusByte(uint8_t c)
+{
+	// The byte is on the wire from g_now to g_now + SIM_BYTE_TIME. The
+	// controllers see it complete at the end, but we feed it immediately,
+	// which only shifts their response by one byte time.
+	uint64_t start = g_now;
+	if(start < g_txBusyUntil)
+		start = g_txBusyUntil;
+	uint64_t end = start + SIM_BYTE_TIME;
+	g_txBusyUntil = end;
+
+	g_stats.bytes_tx++;
+	g_stats.busy_time += SIM_BYTE_TIME;
+
+	if(g_busDir != RS485_OUT)
+		return;
+
+	if(g_rxRead != g_rxWrite && g_rxQueue[g_rxRead].time < end)
+	{
+		// A controller is still talking. Both transmissions are garbled,
+		// drop the rest of the response.
+		g_stats.collisions++;
+		g_rxRead = g_rxWrite;
+	}
+
+	for(uint8_t i = 0; i < g_numControllers; ++i)
+	{
+		char response[32];
+		uint8_t len = g_controllers[i].input(c, response, sizeof(response));
+
+		if(!len)
+			continue;
+
+		g_stats.transactions++;
+
+		uint64_t t = end + g_responseDelay;
+		if(t < g_rxBusyUntil)
+			t = g_rxBusyUntil;
+
+		for(uint8_t j = 0; j < len; ++j)
+		{
+			t += SIM_BYTE_TIME;
+
+			uint16_t newidx = (g_rxWrite + 1) % RX_QUEUE_SIZE;
+			if(newidx == g_rxRead)
+				break;
+
+			g_rxQueue[g_rxWrite].time = t;
+			g_rxQueue[g_rxWrite].c = response[j];
+			g_rxWrite = newidx;
+		}
+
+		g_stats.busy_time += len * SIM_BYTE_TIME;
+		g_rxBusyUntil = t;
+	}
+}
+
+/**
+ * Run the level-triggered interrupts (UDRE, TX complete, bus timer) that
+ * are due. Like on the AVR, interrupts are disabled inside the handlers.
+ **/
+static void serviceInterrupts()
+{
+	if(g_irqDisabled)
+		return;
+
+	g_irqDisabled++;
+
+	while(1)
+	{
+		if(g_busTimerArmed && g_busTimerTime <= g_now)
+		{
+			g_busTimerArmed = false;
+			nt_busTimerISR();
+			continue;
+		}
+
+		if(g_udreEnabled && g_udreTime <= g_now)
+		{
+			int16_t c = nt_busTxISR();
+			if(c < 0)
+			{
+				g_udreEnabled = false;
+				g_txcPending = true;
+			}
+			else
+			{
+				transmitBusByte(c);
+				g_udreTime = g_txBusyUntil;
+			}
+			continue;
+		}
+
+		if(g_txcPending && g_txBusyUntil <= g_now)
+		{
+			g_txcPending = false;
+			nt_busTxCompleteISR();
+			continue;
+		}
+
+		if(g_eeReadyIRQ && g_eeBusyUntil <= g_now)
+		{
+			mem_eepromReadyISR();
+			continue;
+		}
+
+		break;
+	}
+
+	g_irqDisabled--;
+}
+
+void hal_irqDisable()
+{
+	g_irqDisabled++;
+}
+
+void hal_irqRestore()
+{
+	if(--g_irqDisabled != 0)
+		return;
+
+	if(g_rxFifoCount)
+	{
+		uint8_t count = g_rxFifoCount;
+		g_rxFifoCount = 0;
+		for(uint8_t i = 0; i < count; ++i)
+			rxInterrupt(g_rxFifo[i]);
+	}
+
+	if(g_timerPending)
+	{
+		g_timerPending = false;
+		timerInterrupt();
+	}
+
+	serviceInterrupts();
+}
+
+void sim_advance(uint32_t us)
+{
+	uint64_t end = g_now + us;
+
+	while(1)
+	{
+		serviceInterrupts();
+
+		uint64_t next = end;
+
+		if(g_timerRunning && g_nextTick < next)
+			next = g_nextTick;
+		if(g_rxRead != g_rxWrite && g_rxQueue[g_rxRead].time < next)
+			next = g_rxQueue[g_rxRead].time;
+
+		// Interrupts which are still due at this point are blocked by
+		// hal_irqDisable() and run in hal_irqRestore().
+		if(g_busTimerArmed && g_busTimerTime > g_now && g_busTimerTime < next)
+			next = g_busTimerTime;
+		if(g_udreEnabled && g_udreTime > g_now && g_udreTime < next)
+			next = g_udreTime;
+		if(g_txcPending && g_txBusyUntil > g_now && g_txBusyUntil < next)
+			next = g_txBusyUntil;
+		if(g_eeReadyIRQ && g_eeBusyUntil > g_now && g_eeBusyUntil < next)
+			next = g_eeBusyUntil;
+
+		for(uint8_t i = 0; i < g_numControllers; ++i)
+			g_controllers[i].update(next - g_now);
+
+		g_now = next;
+
+		while(g_rxRead != g_rxWrite && g_rxQueue[g_rxRead].time <= g_now)
+		{
+			uint8_t c = g_rxQueue[g_rxRead].c;
+			g_rxRead = (g_rxRead + 1) % RX_QUEUE_SIZE;
+			deliverBusByte(c);
+		}
+
+		if(g_timerRunning && g_nextTick <= g_now)
+		{
+			g_nextTick += 1000;
+
+			if(g_irqDisabled)
+			{
+				if(g_timerPending)
+					g_stats.lost_ticks++;
+				g_timerPending = true;
+			}
+			else
+				timerInterrupt();
+		}
+
+		serviceInterrupts();
+
+		if(g_now >= end)
+			break;
+	}
+
+	if(g_advanceHook)
+		g_advanceHook();
+}
+
+// HAL implementation
+
+void hal_init()
+{
+}
+
+uint32_t hal_micros()
+{
+	return g_now;
+}
+
+void hal_idle()
+{
+	sim_advance(SIM_IDLE_TIME);
+}
+
+void hal_delayUs(uint16_t us)
+{
+	sim_advance(us);
+}
+
+void hal_delayMs(uint16_t ms)
+{
+	sim_advance(1000L * ms);
+}
+
+void hal_timerStart()
+{
+	g_timerRunning = true;
+	g_timerPending = false;
+	g_nextTick = g_now + 1000;
+}
+
+void hal_timerStop()
+{
+	g_timerRunning = false;
+	g_timerPending = false;
+}
+
+void hal_setLed(bool on)
+{
+	g_led = on;
+}
+
+void hal_toggleLed()
+{
+	g_led = !g_led;
+}
+
+void hal_pcStartTransmitting()
+{
+	// The UDRE interrupt sends everything in com_buf_to_pc
+	while(com_buf_to_pc.available())
+	{
+		uint8_t c = com_buf_to_pc.get();
+
+		uint16_t newidx = (g_pcWrite + 1) % PC_BUFSIZE;
+		if(newidx != g_pcRead)
+		{
+			g_pcBuf[g_pcWrite] = c;
+			g_pcWrite = newidx;
+		}
+
+		g_stats.pc_bytes_tx++;
+		sim_advance(SIM_BYTE_TIME);
+	}
+}
+
+bool hal_pcDataSent()
+{
+	return true;
+}
+
+void rs485_setDir(RS485Direction dir)
+{
+	g_busDir = dir;
+}
+
+void hal_busStartTx()
+{
+	if(g_udreEnabled)
+		return;
+
+	g_udreEnabled = true;
+	g_udreTime = (g_txBusyUntil > g_now) ? g_txBusyUntil : g_now;
+}
+
+void hal_busArmTimer(uint16_t us)
+{
+	g_busTimerArmed = true;
+	g_busTimerTime = g_now + us;
+}
+
+void hal_busCancelTimer()
+{
+	g_busTimerArmed = false;
+}
+
+void hal_eepromRead(void* dest, const void* src, uint16_t size)
+{
+	memcpy(dest, src, size);
+}
+
+bool hal_eepromReady()
+{
+	return g_eeBusyUntil <= g_now;
+}
+
+uint8_t hal_eepromReadByte(const uint8_t* addr)
+{
+	return *addr;
+}
+
+void hal_eepromStartWrite(uint8_t* addr, uint8_t value)
+{
+	*addr = value;
+	g_eeBusyUntil = g_now + SIM_EEPROM_WRITE_TIME;
+}
+
+void hal_eepromSetReadyIRQ(bool enabled)
+{
+	g_eeReadyIRQ = enabled;
+}
+
+void hal_enterBootloader()
+{
+	g_resetRequested = true;
+}
+
+// PC link
+
+void sim_pcWrite(const void* data, uint16_t length)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	for(uint16_t i = 0; i < length; ++i)
+		com_buf_to_bot.put(bytes[i]);
+}
+
+uint16_t sim_pcRead(void* dest, uint16_t max_length)
+{
+	uint8_t* bytes = (uint8_t*)dest;
+	uint16_t count = 0;
+
+	while(count < max_length && g_pcRead != g_pcWrite)
+	{
+		bytes[count++] = g_pcBuf[g_pcRead];
+		g_pcRead = (g_pcRead + 1) % PC_BUFSIZE;
+	}
+
+	return count;
+}
+
+// Digital I/O (io.h)
+
+void io_init()
+{
+}
+
+bool io_button()
+{
+	return g_button;
+}
+
+void io_setOutput(bool active)
+{
+	g_output = active;
+}
+
+void io_synchronize()
+{
+	// There is only one controller in the simulation
+}
+
+void sim_setButton(bool pressed)
+{
+	g_button = pressed;
+}
+
+bool sim_output()
+{
+	return g_output;
+}
+
+bool sim_resetRequested()
+{
+	return g_resetRequested;
+}
@@ -0,0 +1,89 @@
+// Host simulation of the controller board
+//
+// Implements the hardware abstraction layer (hal.h) on top of a virtual
+// clock. Time only advances inside hal_delay*(), hal_idle() and the PC and
+// EEPROM functions, which is exactly where the firmware would wait for the
+// hardware. Interrupts (Timer1, USART3 RX/UDRE/TX complete, bus timer,
+// EEPROM ready) are delivered while the clock advances.
+//
+// The RS485 bus is modelled at byte level with 115200 baud timing and a
+// configurable number of simulated Nanotec controllers (addresses 1..n).
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+#include "nanotec_sim.h"
+
+const uint8_t SIM_MAX_CONTROLLERS = 8;
+
+//! Transmission time of one byte (10 bits) at 115200 baud
+const uint32_t SIM_BYTE_TIME = 87;
+
+struct SimBusStats
+{
+	uint32_t transactions;   //!< Complete commands answered by a controller
+	uint32_t bytes_tx;       //!< Bytes sent by the µC
+	uint32_t bytes_rx;       //!< Bytes sent by the controllers
+	uint32_t busy_time;      //!< Time the bus was occupied (us)
+	uint32_t collisions;     //!< µC transmitted while a controller was answering
+	uint32_t overruns;       //!< Received bytes lost with interrupts disabled
+	uint32_t lost_ticks;     //!< Timer interrupts lost with interrupts disabled
+	uint32_t pc_bytes_tx;    //!< Bytes sent to the PC
+};
+
+/**
+ * Reset the simulation.
+ *
+ * @param num_controllers Number of controllers on the bus (addresses 1..n)
+ **/
+void sim_init(uint8_t num_controllers);
+
+//! Virtual time in microseconds since sim_init()
+uint64_t sim_time();
+
+//! Advance virtual time, delivering all interrupts on the way
+void sim_advance(uint32_t us);
+
+/**
+ * Set the time a controller needs to start answering after the end of a
+ * command (default: 300us).
+ **/
+void sim_setResponseDelay(uint32_t us);
+
+/**
+ * Called from the simulated Timer1 interrupt (every 1ms while the timer is
+ * running). Can be used by a test driver to inject events, e.g. stop
+ * playback after a given amount of time.
+ **/
+void sim_setTickHook(void (*hook)());
+
+/**
+ * Called at the end of every sim_advance(). Can be used to pace the
+ * virtual clock to real time and to exchange PC data with the outside
+ * world (see pty.cpp).
+ **/
+void sim_setAdvanceHook(void (*hook)());
+
+NanotecSim* sim_controller(uint8_t id);
+
+const SimBusStats& sim_busStats();
+void sim_resetBusStats();
+
+//! Inject bytes from the PC (as received by the USART0 RX interrupt)
+void sim_pcWrite(const void* data, uint16_t length);
+
+//! Read bytes sent to the PC
+uint16_t sim_pcRead(void* dest, uint16_t max_length);
+
+//! Simulated start button
+void sim_setButton(bool pressed);
+
+//! State of the digital output
+bool sim_output();
+
+//! Was a reset into the bootloader requested?
+bool sim_resetRequested();
+
+#endif
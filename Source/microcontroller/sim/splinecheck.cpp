@@ -0,0 +1,327 @@
+// Spline interpolation check
+//
+// Evaluates random keyframe sequences with the fixed point spline code of
+// the µC and the floating point code of the PC preview (spline.h) and
+// reports the largest difference between both. Also checks that the
+// splines stay between the keyframes and that the velocity at a keyframe
+// is the same in both adjacent segments (up to the rounding of the integer
+// tangents).
+//
+// The fly-by blends of linear sequences (proto::Keyframe::blend) are checked
+// the same way against the floating point version of the PC preview. There
+// the position must not jump (from one millisecond to the next it changes by
+// at most the faster adjacent velocity), the blends at both ends of a segment
+// must not overlap and the setpoint stays within the adjacent keyframes.
+//
+// Returns nonzero if one of the checks fails.
+//
+// Usage: igus_sim_spline [sequences]
+
+#include "../spline.h"
+#include "../protocol.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+const int NUM_KEYFRAMES = 16;
+
+//! Allowed difference between fixed point and floating point (ticks)
+const double MAX_DEVIATION = 2.0;
+
+//! The same for blends, the linear setpoint and the blend term are rounded separately
+const double MAX_BLEND_DEVIATION = 2.5;
+
+struct Result
+{
+	double deviation;
+	double overshoot;
+	double velocityJump;
+};
+
+struct BlendResult
+{
+	double deviation;
+	double overshoot;
+	double jump;
+	int overlaps;
+};
+
+static const char* modeName(uint8_t mode)
+{
+	switch(mode)
+	{
+		case proto::IP_CUBIC:    return "cubic";
+		case proto::IP_MIN_JERK: return "minjerk";
+		default:                 return "linear";
+	}
+}
+
+static void randomSequence(int32_t* pos, uint16_t* duration, uint8_t* blend = 0)
+{
+	pos[0] = 0;
+	duration[0] = 0;
+
+	if(blend)
+	{
+		// Also values above the limit of 100
+		for(int k = 0; k < NUM_KEYFRAMES; ++k)
+			blend[k] = (rand() % 3 == 0) ? 0 : rand() % 121;
+	}
+
+	for(int k = 1; k < NUM_KEYFRAMES; ++k)
+	{
+		// Mix of turning points, monotonic runs and pauses
+		int r = rand() % 4;
+		if(r == 0)
+			pos[k] = pos[k-1];
+		else
+			pos[k] = pos[k-1] + (rand() % 4000) - (r == 1 ? 3000 : 1000);
+
+		if(pos[k] > 30000) pos[k] = 30000;
+		if(pos[k] < -30000) pos[k] = -30000;
+
+		duration[k] = 20 + rand() % 2000;
+	}
+}
+
+//! Start and end tangent of segment k (keyframe k-1 to k) as the µC computes them
+static void tangents(uint8_t mode, const int32_t* pos, const uint16_t* duration, int k, int32_t* m0, int32_t* m1)
+{
+	int32_t diff = pos[k] - pos[k-1];
+
+	*m0 = 0;
+	*m1 = 0;
+
+	if(k > 1)
+		*m0 = spline::tangent(mode, pos[k-1] - pos[k-2], duration[k-1], diff, duration[k], duration[k]);
+	if(k < NUM_KEYFRAMES-1)
+		*m1 = spline::tangent(mode, diff, duration[k], pos[k+1] - pos[k], duration[k+1], duration[k]);
+}
+
+static void checkSequence(uint8_t mode, Result* result)
+{
+	int32_t pos[NUM_KEYFRAMES];
+	uint16_t duration[NUM_KEYFRAMES];
+	randomSequence(pos, duration);
+
+	double endVelocity = 0;
+	uint16_t endDuration = 1;
+
+	for(int k = 1; k < NUM_KEYFRAMES; ++k)
+	{
+		int32_t m0, m1;
+		tangents(mode, pos, duration, k, &m0, &m1);
+
+		if(mode != proto::IP_LINEAR)
+		{
+			// The tangents are rounded to one tick
+			double jump = fabs((double)m0 / duration[k] - endVelocity)
+				- 1.0 / duration[k] - 1.0 / endDuration;
+			if(jump > result->velocityJump)
+				result->velocityJump = jump;
+		}
+
+		endVelocity = (double)m1 / duration[k];
+		endDuration = duration[k];
+
+		int32_t diff = pos[k] - pos[k-1];
+		int32_t lo = (diff < 0) ? pos[k] : pos[k-1];
+		int32_t hi = (diff < 0) ? pos[k-1] : pos[k];
+
+		for(uint16_t t = 1; t <= duration[k]; ++t)
+		{
+			// Same fraction as cursorPosition()
+			uint32_t inv_duration = 0xFFFFFFUL / duration[k];
+			uint32_t u = t * inv_duration;
+
+			spline::Basis<int32_t> bi;
+			spline::basis(mode, (int32_t)(u >> (24 - spline::SHIFT)), &bi);
+			int32_t fixed = spline::evaluate(bi, pos[k-1], diff, m0, m1);
+
+			spline::Basis<double> bd;
+			spline::basis(mode, (double)t / duration[k], &bd);
+			double exact = spline::evaluate(bd, pos[k-1], diff, m0, m1);
+
+			double deviation = fabs(fixed - exact);
+			if(deviation > result->deviation)
+				result->deviation = deviation;
+
+			double overshoot = 0;
+			if(exact > hi)
+				overshoot = exact - hi;
+			else if(exact < lo)
+				overshoot = lo - exact;
+			if(overshoot > result->overshoot)
+				result->overshoot = overshoot;
+		}
+	}
+}
+
+//! Half widths of the blends at both ends of segment k as the µC computes them
+static void blendWidths(const uint16_t* duration, const uint8_t* blend, int k, uint16_t* w0, uint16_t* w1)
+{
+	*w0 = 0;
+	*w1 = 0;
+
+	if(k > 1)
+		*w0 = spline::blendWidth(blend[k-1], duration[k-1], duration[k]);
+	if(k < NUM_KEYFRAMES-1)
+		*w1 = spline::blendWidth(blend[k], duration[k], duration[k+1]);
+}
+
+static void checkBlendSequence(BlendResult* result)
+{
+	int32_t pos[NUM_KEYFRAMES];
+	uint16_t duration[NUM_KEYFRAMES];
+	uint8_t blend[NUM_KEYFRAMES];
+	randomSequence(pos, duration, blend);
+
+	bool havePrevious = false;
+	int32_t previous = 0;
+
+	for(int k = 1; k < NUM_KEYFRAMES; ++k)
+	{
+		int32_t diff = pos[k] - pos[k-1];
+		int32_t prev_diff = (k > 1) ? pos[k-1] - pos[k-2] : 0;
+		int32_t next_diff = (k < NUM_KEYFRAMES-1) ? pos[k+1] - pos[k] : 0;
+
+		uint16_t w0, w1;
+		blendWidths(duration, blend, k, &w0, &w1);
+		if(w0 + w1 > duration[k])
+			result->overlaps++;
+
+		// Same as cursorLoad()
+		int32_t c0 = 0, c1 = 0;
+		uint32_t s0 = 0, s1 = 0;
+		if(w0)
+		{
+			c0 = spline::cornerOffset(prev_diff, duration[k-1], diff, duration[k], w0);
+			s0 = spline::cornerScale(w0);
+		}
+		if(w1)
+		{
+			c1 = spline::cornerOffset(diff, duration[k], next_diff, duration[k+1], w1);
+			s1 = spline::cornerScale(w1);
+		}
+
+		// Same as Timeline::sample()
+		double ta = (k > 1) ? duration[k-1] : 0;
+		double t = duration[k];
+		double tb = (k < NUM_KEYFRAMES-1) ? duration[k+1] : 0;
+
+		double wd0 = w0;
+		double wd1 = w1;
+		double cd0 = 0, cd1 = 0;
+		if(wd0 > 0)
+			cd0 = spline::cornerOffset((double)prev_diff, ta, (double)diff, t, wd0);
+		if(wd1 > 0)
+			cd1 = spline::cornerOffset((double)diff, t, (double)next_diff, tb, wd1);
+
+		// The blends stay between the velocities of the adjacent segments
+		double velocity = fabs((double)diff / duration[k]);
+		if(k > 1)
+			velocity = fmax(velocity, fabs((double)prev_diff / duration[k-1]));
+		if(k < NUM_KEYFRAMES-1)
+			velocity = fmax(velocity, fabs((double)next_diff / duration[k+1]));
+
+		int32_t lo = pos[k-1], hi = pos[k-1];
+		for(int i = k-2; i <= k+1; ++i)
+		{
+			if(i < 0 || i >= NUM_KEYFRAMES)
+				continue;
+			if(pos[i] < lo) lo = pos[i];
+			if(pos[i] > hi) hi = pos[i];
+		}
+
+		// Up to the end of the segment, i.e. the start of the next one
+		for(uint16_t t = 0; t <= duration[k]; ++t)
+		{
+			// Same as cursorPosition()
+			uint32_t inv_duration = 0xFFFFFFUL / duration[k];
+			uint32_t u = t * inv_duration;
+			int32_t fixed = pos[k-1] + ((diff * (int32_t)(u >> 9)) >> 15);
+
+			uint32_t remaining = duration[k] - t;
+			if(t < w0)
+				fixed += spline::corner(c0, s0, w0 - t);
+			if(remaining < w1)
+				fixed += spline::corner(c1, s1, w1 - remaining);
+
+			double exact = pos[k-1] + (double)diff * t / duration[k];
+			if(t < wd0)
+				exact += spline::corner(cd0, wd0, wd0 - t);
+			if(remaining < wd1)
+				exact += spline::corner(cd1, wd1, wd1 - remaining);
+
+			double deviation = fabs(fixed - exact);
+			if(deviation > result->deviation)
+				result->deviation = deviation;
+
+			double overshoot = 0;
+			if(exact > hi)
+				overshoot = exact - hi;
+			else if(exact < lo)
+				overshoot = lo - exact;
+			if(overshoot > result->overshoot)
+				result->overshoot = overshoot;
+
+			// t == 0 is the end of the previous segment again
+			if(havePrevious)
+			{
+				double jump = fabs((double)(fixed - previous)) - (t == 0 ? 0 : velocity);
+				if(jump > result->jump)
+					result->jump = jump;
+			}
+
+			previous = fixed;
+			havePrevious = true;
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	int sequences = (argc > 1) ? atoi(argv[1]) : 1000;
+	bool ok = true;
+
+	const uint8_t MODES[] = { proto::IP_LINEAR, proto::IP_CUBIC, proto::IP_MIN_JERK };
+
+	for(unsigned int i = 0; i < sizeof(MODES); ++i)
+	{
+		Result result = { 0, 0, 0 };
+
+		srand(1);
+		for(int s = 0; s < sequences; ++s)
+			checkSequence(MODES[i], &result);
+
+		bool modeOk = result.deviation <= MAX_DEVIATION
+			&& result.overshoot < 1e-6 && result.velocityJump < 1e-9;
+
+		printf("%-8s max deviation %.2f ticks, max overshoot %.2f ticks, max velocity jump %.3f ticks/ms: %s\n",
+			modeName(MODES[i]), result.deviation, result.overshoot, result.velocityJump,
+			modeOk ? "ok" : "FAILED"
+		);
+
+		ok = ok && modeOk;
+	}
+
+	BlendResult blend = { 0, 0, 0, 0 };
+
+	srand(1);
+	for(int s = 0; s < sequences; ++s)
+		checkBlendSequence(&blend);
+
+	// Two rounded samples in the jump
+	bool blendOk = blend.deviation <= MAX_BLEND_DEVIATION && blend.overshoot < 1e-6
+		&& blend.jump <= 2 * MAX_BLEND_DEVIATION && blend.overlaps == 0;
+
+	printf("%-8s max deviation %.2f ticks, max overshoot %.2f ticks, max jump %.2f ticks, %d overlaps: %s\n",
+		"blend", blend.deviation, blend.overshoot, blend.jump, blend.overlaps,
+		blendOk ? "ok" : "FAILED"
+	);
+
+	ok = ok && blendOk;
+
+	return ok ? 0 : 1;
+}
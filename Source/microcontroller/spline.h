@@ -0,0 +1,259 @@
+// Spline interpolation between keyframes
+
+#ifndef SPLINE_H
+#define SPLINE_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+/**
+ * Spline trajectories, shared by the µC (fixed point) and the PC preview
+ * (double).
+ *
+ * In a segment from keyframe a to keyframe b, each axis follows the
+ * Hermite spline
+ *
+ *   p(u) = p_a + diff * h01(u) + m0 * h10(u) + m1 * h11(u),   u = 0..1
+ *
+ * with diff = p_b - p_a. The tangents m0, m1 are the velocities at the
+ * keyframes multiplied with the segment duration. A keyframe has the same
+ * velocity in both adjacent segments (see tangent()), so the velocity is
+ * continuous. The minimum jerk segments additionally have zero
+ * acceleration at the keyframes, so the acceleration is continuous too.
+ *
+ * For proto::IP_LINEAR, h01(u) = u and the tangents are ignored. Instead,
+ * the corners at fly-by keyframes are rounded off (see corner()).
+ **/
+namespace spline
+{
+
+//! Fractional bits of u and of the fixed point basis functions
+const uint8_t SHIFT = 14;
+const int32_t ONE = 1L << SHIFT;
+
+template<class T>
+struct Basis
+{
+	T h01; //!< Weight of diff
+	T h10; //!< Weight of the start tangent
+	T h11; //!< Weight of the end tangent
+};
+
+//! Fixed point multiplication with rounding
+inline int32_t mul(int32_t a, int32_t b)
+{
+	return (a * b + (ONE >> 1)) >> SHIFT;
+}
+
+//! Fixed point basis functions for @a u in [0, ONE]
+inline void basis(uint8_t mode, int32_t u, Basis<int32_t>* b)
+{
+	int32_t u2 = mul(u, u);
+	int32_t u3 = mul(u2, u);
+
+	switch(mode)
+	{
+		case proto::IP_CUBIC:
+			b->h01 = 3 * u2 - 2 * u3;
+			b->h10 = u3 - 2 * u2 + u;
+			b->h11 = u3 - u2;
+			break;
+		case proto::IP_MIN_JERK:
+			// Factored as u^3 * (quadratic), so only one rounded power is
+			// multiplied with the large coefficients. The products are the
+			// basis values and thus fit into 32 bit.
+			b->h01 = mul(u3, 10 * ONE - 15 * u + 6 * u2);
+			b->h10 = u - mul(u3, 6 * ONE - 8 * u + 3 * u2);
+			b->h11 = -mul(u3, 4 * ONE - 7 * u + 3 * u2);
+			break;
+		default:
+			b->h01 = u;
+			b->h10 = 0;
+			b->h11 = 0;
+			break;
+	}
+}
+
+//! Basis functions for @a u in [0, 1]
+inline void basis(uint8_t mode, double u, Basis<double>* b)
+{
+	double u2 = u * u;
+	double u3 = u2 * u;
+
+	switch(mode)
+	{
+		case proto::IP_CUBIC:
+			b->h01 = 3 * u2 - 2 * u3;
+			b->h10 = u3 - 2 * u2 + u;
+			b->h11 = u3 - u2;
+			break;
+		case proto::IP_MIN_JERK:
+		{
+			double u4 = u3 * u;
+			double u5 = u4 * u;
+
+			b->h01 = 10 * u3 - 15 * u4 + 6 * u5;
+			b->h10 = u - 6 * u3 + 8 * u4 - 3 * u5;
+			b->h11 = -4 * u3 + 7 * u4 - 3 * u5;
+			break;
+		}
+		default:
+			b->h01 = u;
+			b->h10 = 0;
+			b->h11 = 0;
+			break;
+	}
+}
+
+/**
+ * Position in encoder ticks. The sum fits into 32 bit for 16 bit
+ * positions, since tangent() limits the tangents to three times the
+ * position difference of the segment.
+ **/
+inline int32_t evaluate(const Basis<int32_t>& b, int32_t from, int32_t diff, int32_t m0, int32_t m1)
+{
+	return from + ((diff * b.h01 + m0 * b.h10 + m1 * b.h11 + (ONE >> 1)) >> SHIFT);
+}
+
+inline double evaluate(const Basis<double>& b, double from, double diff, double m0, double m1)
+{
+	return from + diff * b.h01 + m0 * b.h10 + m1 * b.h11;
+}
+
+/**
+ * Largest tangent (as multiple of the position difference of the segment)
+ * which keeps the segment monotonic. 3 is the Fritsch-Carlson condition for
+ * cubic splines, the minimum jerk polynomial needs a tighter limit
+ * (numerically about 2.1).
+ **/
+inline uint8_t tangentLimit(uint8_t mode)
+{
+	return (mode == proto::IP_MIN_JERK) ? 2 : 3;
+}
+
+/**
+ * Tangent at the keyframe between segment a (position difference @a da,
+ * duration @a ta) and segment b, for a segment of duration @a t (the
+ * duration of a or b).
+ *
+ * The velocity is the average velocity of both segments, but at most
+ * tangentLimit() times the slower one, and zero if the keyframe is a
+ * turning point or one of the segments does not move (e.g. a pause). This
+ * way the spline does not overshoot the keyframes.
+ **/
+inline int32_t tangent(uint8_t mode, int32_t da, uint16_t ta, int32_t db, uint16_t tb, uint16_t t)
+{
+	if(da == 0 || db == 0 || (da < 0) != (db < 0) || ta == 0 || tb == 0)
+		return 0;
+
+	int64_t m = (int64_t)(da + db) * t / ((uint32_t)ta + tb);
+
+	uint8_t factor = tangentLimit(mode);
+	int64_t limit_a = (int64_t)factor * (da < 0 ? -da : da) * t / ta;
+	int64_t limit_b = (int64_t)factor * (db < 0 ? -db : db) * t / tb;
+	int64_t limit = (limit_a < limit_b) ? limit_a : limit_b;
+
+	if(m > limit)
+		m = limit;
+	else if(m < -limit)
+		m = -limit;
+
+	return m;
+}
+
+inline double tangent(uint8_t mode, double da, double ta, double db, double tb, double t)
+{
+	if(da == 0 || db == 0 || (da < 0) != (db < 0) || ta <= 0 || tb <= 0)
+		return 0;
+
+	double m = (da + db) * t / (ta + tb);
+
+	double factor = tangentLimit(mode);
+	double limit_a = factor * (da < 0 ? -da : da) * t / ta;
+	double limit_b = factor * (db < 0 ? -db : db) * t / tb;
+	double limit = (limit_a < limit_b) ? limit_a : limit_b;
+
+	if(m > limit)
+		m = limit;
+	else if(m < -limit)
+		m = -limit;
+
+	return m;
+}
+
+/**
+ * Half width (ms) of the fly-by blend (proto::Keyframe::blend, in percent)
+ * at the keyframe between segments of duration @a ta and @a tb (ms). It is
+ * at most half of the shorter segment, so the blends at both ends of a
+ * segment never overlap. The PC preview uses this version as well, so the
+ * widths are exactly the same.
+ **/
+inline uint16_t blendWidth(uint8_t blend, uint16_t ta, uint16_t tb)
+{
+	if(blend > 100)
+		blend = 100;
+
+	uint16_t shorter = (ta < tb) ? ta : tb;
+	return (uint32_t)shorter * blend / 200;
+}
+
+/**
+ * Fly-by blend at the keyframe between segment a (position difference da,
+ * duration ta) and segment b. In the window of +-width around the keyframe,
+ * the term
+ *
+ *   offset * (w / width)^2,   w = width - |t - t_keyframe|
+ *
+ * is added to the linear setpoint of either segment, with
+ * offset = (vb - va) * width / 4. Position and velocity stay continuous,
+ * the velocity changes with constant acceleration from va to vb. The
+ * keyframe itself is missed by offset.
+ *
+ * Since width is at most half of either segment, |vb - va| * width is at
+ * most (|da| + |db|) / 2, i.e. < 2^16 for 16 bit positions. This bounds
+ * all fixed point products below to 31 bit.
+ **/
+
+/**
+ * Offset of the blended setpoint from the keyframe as Q1 ticks, for
+ * @a width >= 1 ms. The velocities are calculated as Q14 ticks/ms.
+ **/
+inline int32_t cornerOffset(int32_t da, uint16_t ta, int32_t db, uint16_t tb, uint16_t width)
+{
+	int32_t va = da * (1L << 14) / ta;
+	int32_t vb = db * (1L << 14) / tb;
+
+	return ((vb - va) * (int32_t)width + (1L << 14)) >> 15;
+}
+
+inline double cornerOffset(double da, double ta, double db, double tb, double width)
+{
+	return (db / tb - da / ta) * width / 4;
+}
+
+//! 2^31 / @a width, precalculated for corner()
+inline uint32_t cornerScale(uint16_t width)
+{
+	return (1UL << 31) / width;
+}
+
+//! Blend term in ticks for 0 <= @a w <= width
+inline int32_t corner(int32_t offset, uint32_t scale, uint16_t w)
+{
+	// (w / width) and its square as Q15
+	uint32_t q = ((uint32_t)w * scale) >> 16;
+	int32_t q2 = (q * q) >> 15;
+
+	return (offset * q2 + (1L << 15)) >> 16;
+}
+
+inline double corner(double offset, double width, double w)
+{
+	double q = w / width;
+	return offset * q * q;
+}
+
+}
+
+#endif
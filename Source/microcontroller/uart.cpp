@@ -4,6 +4,7 @@
 #include "uart.h"
 
 #include "combuf.h"
+#include "nanotec.h"
 
 #include <avr/interrupt.h>
 #include <util/delay.h>
@@ -63,6 +64,28 @@ ISR(USART3_RX_vect)
 		UCSR0B |= (1 << UDRIE0);
 	}
 	else
-		com_buf_from_bot.put(c);
+		nt_busRxISR(c);
+}
+
+ISR(USART3_UDRE_vect)
+{
+	int16_t c = nt_busTxISR();
+	if(c < 0)
+	{
+		// Last byte is in the shift register, wait for TX complete
+		UCSR3B &= ~(1 << UDRIE3);
+		UCSR3B |= (1 << TXCIE3);
+	}
+	else
+	{
+		UCSR3A |= (1 << TXC3);
+		UDR3 = c;
+	}
+}
+
+ISR(USART3_TX_vect)
+{
+	UCSR3B &= ~(1 << TXCIE3);
+	nt_busTxCompleteISR();
 }
 
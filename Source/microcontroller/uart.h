@@ -59,20 +59,6 @@ template<long int baud> uint16_t BAUD_SETTING();
 template<>
 inline uint16_t BAUD_SETTING<115200>() { return 16; }
 
-enum RS485Direction
-{
-	RS485_IN,
-	RS485_OUT
-};
-
-inline void rs485_setDir(RS485Direction dir)
-{
-	if(dir == RS485_IN)
-		PORTJ &= ~(1 << 2);
-	else
-		PORTJ |= (1 << 2);
-}
-
 void uart_setPassthroughEnabled(bool enabled);
 
 #endif
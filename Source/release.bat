@@ -4,6 +4,7 @@ set IMAGE=IgusMotionEditor
 
 set BUILD_IME=..\build-IgusMotionEditor
 set BUILD_FLASHTOOL=..\build-flashtool
+set BUILD_TRACEDECODER=..\build-tracedecoder
 set OOWRITER="C:\Programme\LibreOffice 4.0\program\swriter.exe"
 
 
@@ -25,6 +26,7 @@ copy microcontroller\microcontroller.hex %IMAGE%\microcontroller\
 copy microcontroller\bootloader.hex %IMAGE%\microcontroller\
 
 copy %BUILD_FLASHTOOL%\release\flashtool.exe %IMAGE%\
+copy %BUILD_TRACEDECODER%\release\tracedecoder.exe %IMAGE%\
 
 REM Qt/System libraries
 
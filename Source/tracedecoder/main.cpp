@@ -0,0 +1,405 @@
+// Offline decoder for protocol traces (see ProtocolTrace)
+//
+// Prints every recorded frame and the answer latency per command. The
+// latency of an extended command is the time from sending it until its
+// answer (same command and sequence number) was parsed.
+//
+// Usage: tracedecoder [-s] <data.trace>
+//   -s  statistics only
+
+#include <QFile>
+#include <QHash>
+#include <QMap>
+#include <QVector>
+#include <QtAlgorithms>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../ProtocolTrace.h"
+#include "../microcontroller/protocol.h"
+
+static const char* COMMAND_NAMES[proto::CMD_COUNT] = {
+    "INIT", "RESET", "CONFIG", "READ_KEYFRAME", "SAVE_KEYFRAME", "EXIT",
+    "COMMIT", "PLAY", "STOP", "FEEDBACK", "MOTION", "STATS", "STREAM",
+    "SUBSCRIBE", "SAVE_KEYFRAMES", "CRC", "COMMIT_STATUS", "AXES",
+    "COMPLIANCE"
+};
+
+// Pseudo command for the latency of plain text commands
+static const int PLAIN = -1;
+
+struct Sent
+{
+    int command;
+    quint64 time;
+};
+
+struct Latency
+{
+    Latency() : lost(0) {}
+
+    QVector<quint64> samples; // ns
+    int lost;
+};
+
+static QString commandName(int command)
+{
+    if(command == PLAIN)
+        return "plain";
+    if(command >= 0 && command < proto::CMD_COUNT)
+        return COMMAND_NAMES[command];
+    return QString("cmd %1").arg(command);
+}
+
+static void printHex(const uint8_t* data, int length)
+{
+    const int MAX_BYTES = 16;
+
+    for(int i = 0; i < length && i < MAX_BYTES; ++i)
+        printf(" %02X", data[i]);
+    if(length > MAX_BYTES)
+        printf(" ...");
+}
+
+static void printPlain(const uint8_t* data, int length)
+{
+    putchar('\'');
+    for(int i = 0; i < length; ++i)
+    {
+        if(data[i] == '\r')
+            printf("\\r");
+        else if(data[i] >= 0x20 && data[i] < 0x7F)
+            putchar(data[i]);
+        else
+            printf("\\x%02X", data[i]);
+    }
+    putchar('\'');
+}
+
+/**
+ * Pretty-print the payload of an extended packet. The payload type follows
+ * from the command, the direction and the payload size.
+ */
+static void printPayload(bool tx, const proto::PacketHeader& header, const uint8_t* payload)
+{
+    if(header.length == 0)
+        return;
+
+    if(tx && header.command == proto::CMD_MOTION && header.length == sizeof(proto::Motion))
+    {
+        const proto::Motion* m = (const proto::Motion*)payload;
+        printf(" axes %d, output %d, ticks/vel", m->num_axes, m->output_command);
+        for(int i = 0; i < m->num_axes && i < proto::NUM_AXES; ++i)
+            printf(" %d/%d", m->ticks[i] - proto::NT_POSITION_BIAS, m->velocity[i]);
+        return;
+    }
+
+    if(!tx && header.length == sizeof(proto::Feedback)
+        && (header.command == proto::CMD_MOTION || header.command == proto::CMD_FEEDBACK || header.command == proto::CMD_SUBSCRIBE))
+    {
+        const proto::Feedback* f = (const proto::Feedback*)payload;
+        printf(" flags %02X, stream free %d (low %d), time %u us, positions/age",
+            f->flags, f->stream_free, f->stream_low_water, f->time);
+        for(int i = 0; i < f->num_axes && i < proto::NUM_AXES; ++i)
+        {
+            if(f->positions[i] == 0x7FFF)
+                printf(" err");
+            else
+                printf(" %d/%d", f->positions[i], f->sample_age[i] * proto::SAMPLE_AGE_UNIT);
+        }
+        return;
+    }
+
+    if(tx && header.command == proto::CMD_SUBSCRIBE && header.length == sizeof(proto::Subscribe))
+    {
+        printf(" period %d ms", ((const proto::Subscribe*)payload)->period);
+        return;
+    }
+
+    if(!tx && header.command == proto::CMD_STATS && header.length == sizeof(proto::Stats))
+    {
+        const proto::Stats* s = (const proto::Stats*)payload;
+        printf(" cycle %d us (min %d, max %d), %d missed slots, bus latency %d/%d/%d us",
+            s->cycle_period, s->cycle_min, s->cycle_max, s->missed_slots,
+            s->bus_latency_min, s->bus_latency_avg, s->bus_latency_max);
+        return;
+    }
+
+    if(tx && header.command == proto::CMD_AXES && header.length == sizeof(proto::AxisCommand))
+    {
+        const proto::AxisCommand* a = (const proto::AxisCommand*)payload;
+        printf(" axes %02X, set state %d if %d", a->axes, a->set_state, a->if_state);
+        return;
+    }
+
+    if(!tx && header.command == proto::CMD_AXES && header.length == sizeof(proto::AxisStatus))
+    {
+        const proto::AxisStatus* a = (const proto::AxisStatus*)payload;
+        printf(" state/position");
+        for(int i = 0; i < proto::NUM_AXES; ++i)
+        {
+            if(a->state[i] >= 0)
+                printf(" %d:P%d/%d", i+1, a->state[i], a->positions[i]);
+            else if(a->state[i] == proto::AXIS_STATE_BUSY)
+                printf(" %d:busy", i+1);
+        }
+        return;
+    }
+
+    if(!tx && header.command == proto::CMD_COMPLIANCE && header.length == sizeof(proto::ComplianceStatus))
+    {
+        const proto::ComplianceStatus* c = (const proto::ComplianceStatus*)payload;
+        printf(" compliant %d, failed axes %02X", c->compliant, c->failed);
+        return;
+    }
+
+    if(!tx && header.length == sizeof(proto::ConfigStatus)
+        && (header.command == proto::CMD_CONFIG
+            || header.command == proto::CMD_SAVE_KEYFRAME
+            || header.command == proto::CMD_SAVE_KEYFRAMES
+            || header.command == proto::CMD_COMMIT))
+    {
+        static const char* const RESULTS[] = {"ok", "busy", "invalid"};
+        uint8_t result = ((const proto::ConfigStatus*)payload)->result;
+        if(result <= proto::CR_INVALID)
+            printf(" %s", RESULTS[result]);
+        else
+            printf(" result %d", result);
+        return;
+    }
+
+    if(!tx && header.command == proto::CMD_INIT && header.length == sizeof(proto::Session))
+    {
+        const proto::Session* s = (const proto::Session*)payload;
+        printf(" session %08X, crc %04X/%04X, ready %02X, flags %02X",
+            s->id, s->config_crc, s->sequence_crc, s->ready, s->flags);
+        return;
+    }
+
+    if(!tx && header.command == proto::CMD_COMMIT_STATUS && header.length == sizeof(proto::CommitStatus))
+    {
+        const proto::CommitStatus* c = (const proto::CommitStatus*)payload;
+        printf(" busy %d, %d of %d remaining", c->busy, c->remaining, c->total);
+        return;
+    }
+
+    printHex(payload, header.length);
+}
+
+static void printStats(const QMap<int, Latency>& latencies)
+{
+    printf("\n%-15s %7s %5s %9s %9s %9s %9s %9s\n",
+        "command", "count", "lost", "min", "avg", "p50", "p99", "max");
+
+    QMapIterator<int, Latency> it(latencies);
+    while(it.hasNext())
+    {
+        it.next();
+
+        QVector<quint64> s = it.value().samples;
+        qSort(s);
+
+        int n = s.size();
+        if(n == 0)
+        {
+            printf("%-15s %7d %5d\n", qPrintable(commandName(it.key())), 0, it.value().lost);
+            continue;
+        }
+
+        quint64 sum = 0;
+        foreach(quint64 t, s)
+            sum += t;
+
+        printf("%-15s %7d %5d %9.3f %9.3f %9.3f %9.3f %9.3f ms\n",
+            qPrintable(commandName(it.key())), n, it.value().lost,
+            s.first() / 1e6, (double)sum / n / 1e6, s[n / 2] / 1e6,
+            s[qMin(n - 1, (n * 99) / 100)] / 1e6, s.last() / 1e6);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    bool statsOnly = false;
+    const char* fileName = 0;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "-s") == 0)
+            statsOnly = true;
+        else
+            fileName = argv[i];
+    }
+
+    if(!fileName)
+    {
+        fprintf(stderr, "Usage: tracedecoder [-s] <data.trace>\n");
+        return 1;
+    }
+
+    QFile file(fileName);
+    if(!file.open(QFile::ReadOnly))
+    {
+        fprintf(stderr, "Could not open %s\n", fileName);
+        return 1;
+    }
+
+    QByteArray data = file.readAll();
+
+    trace::FileHeader fileHeader;
+    if(data.size() < (int)sizeof(fileHeader))
+    {
+        fprintf(stderr, "%s: file too short\n", fileName);
+        return 1;
+    }
+
+    memcpy(&fileHeader, data.constData(), sizeof(fileHeader));
+    if(memcmp(fileHeader.magic, "IGTRACE", sizeof(fileHeader.magic)) != 0 || fileHeader.version != trace::VERSION)
+    {
+        fprintf(stderr, "%s: not a trace file (version %d)\n", fileName, trace::VERSION);
+        return 1;
+    }
+
+    if(fileHeader.proto_version != (uint32_t)proto::VERSION)
+    {
+        fprintf(stderr, "Warning: recorded with protocol version %d, decoding version %d\n",
+            fileHeader.proto_version, proto::VERSION);
+    }
+
+    QHash<int, Sent> pending; // by sequence number
+    QMap<int, Latency> latencies;
+    Sent plainSent;
+    bool plainPending = false;
+    quint32 dropped = 0;
+    int records = 0;
+
+    int pos = sizeof(fileHeader);
+    while(pos + (int)sizeof(trace::RecordHeader) <= data.size())
+    {
+        trace::RecordHeader rec;
+        memcpy(&rec, data.constData() + pos, sizeof(rec));
+        pos += sizeof(rec);
+
+        if(pos + rec.length > data.size())
+        {
+            fprintf(stderr, "Warning: last record truncated\n");
+            break;
+        }
+
+        const uint8_t* payload = (const uint8_t*)data.constData() + pos;
+        pos += rec.length;
+        records++;
+
+        if(!statsOnly)
+            printf("%14.6f ", rec.time / 1e6);
+
+        switch(rec.type)
+        {
+            case trace::REC_OPEN:
+            {
+                // New session, sequence numbers start over
+                foreach(const Sent& s, pending)
+                    latencies[s.command].lost++;
+                pending.clear();
+                plainPending = false;
+
+                if(!statsOnly)
+                    printf("OPEN %.*s\n", rec.length, (const char*)payload);
+                break;
+            }
+            case trace::REC_TX_EXT:
+            case trace::REC_RX_EXT:
+            {
+                bool tx = (rec.type == trace::REC_TX_EXT);
+                proto::PacketHeader header(0, 0);
+
+                if(rec.length < sizeof(header) + 2)
+                {
+                    if(!statsOnly)
+                        printf("%s short packet\n", tx ? "TX" : "RX");
+                    break;
+                }
+
+                memcpy(&header, payload, sizeof(header));
+
+                if(tx)
+                {
+                    if(pending.contains(header.sequence))
+                        latencies[pending[header.sequence].command].lost++;
+
+                    Sent s;
+                    s.command = header.command;
+                    s.time = rec.time;
+                    pending.insert(header.sequence, s);
+                }
+                else
+                {
+                    QHash<int, Sent>::iterator it = pending.find(header.sequence);
+                    if(it != pending.end() && it->command == header.command)
+                    {
+                        latencies[header.command].samples.append(rec.time - it->time);
+                        pending.erase(it);
+                    }
+                }
+
+                if(!statsOnly)
+                {
+                    printf("%s %-14s seq %3d len %3d", tx ? "TX" : "RX",
+                        qPrintable(commandName(header.command)), header.sequence, header.length);
+                    if(rec.length >= sizeof(header) + header.length)
+                        printPayload(tx, header, payload + sizeof(header));
+                    putchar('\n');
+                }
+                break;
+            }
+            case trace::REC_TX_PLAIN:
+            case trace::REC_RX_PLAIN:
+            {
+                bool tx = (rec.type == trace::REC_TX_PLAIN);
+
+                if(tx)
+                {
+                    if(plainPending)
+                        latencies[PLAIN].lost++;
+
+                    plainSent.command = PLAIN;
+                    plainSent.time = rec.time;
+                    plainPending = true;
+                }
+                else if(plainPending)
+                {
+                    latencies[PLAIN].samples.append(rec.time - plainSent.time);
+                    plainPending = false;
+                }
+
+                if(!statsOnly)
+                {
+                    printf("%s plain ", tx ? "TX" : "RX");
+                    printPlain(payload, rec.length);
+                    putchar('\n');
+                }
+                break;
+            }
+            case trace::REC_DROPPED:
+            {
+                quint32 count = 0;
+                if(rec.length >= sizeof(count))
+                    memcpy(&count, payload, sizeof(count));
+                dropped += count;
+
+                if(!statsOnly)
+                    printf("DROPPED %u records\n", count);
+                break;
+            }
+            default:
+                if(!statsOnly)
+                    printf("unknown record type %d\n", rec.type);
+                break;
+        }
+    }
+
+    printf("\n%d records, %u dropped while recording\n", records, dropped);
+    printStats(latencies);
+
+    return 0;
+}
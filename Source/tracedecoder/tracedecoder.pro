@@ -0,0 +1,7 @@
+TEMPLATE = app
+TARGET = tracedecoder
+QT += core
+QT -= gui
+HEADERS += ../ProtocolTrace.h
+SOURCES += main.cpp
+CONFIG += console